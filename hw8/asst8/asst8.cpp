@@ -11,6 +11,12 @@
 #include <string>
 #include <memory>
 #include <stdexcept>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <thread>
 
 // OpenGL + GLEW/GLUT
 #include <GL/glew.h>
@@ -28,6 +34,8 @@
 #include "rigtform.h"
 #include "geometry.h"
 #include "mesh.h"
+#include "meshutils.h"
+#include "tessellator.h"
 
 // UI & Interaction
 #include "arcball.h"
@@ -39,8 +47,21 @@
 // Scene Graph & Visitor Pattern
 #include "asstcommon.h"
 #include "scenegraph.h"
+#include "nodearena.h"
 #include "drawer.h"
+#include "flatscene.h"
+#include "scenebvh.h"
+#include "raypicker.h"
+#include "renderqueue.h"
+#include "softrenderer.h"
 #include "picker.h"
+#include "sceneio.h"
+#include "profiler.h"
+#ifdef OFFSCREEN
+#include "offscreen.h"
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
 
 // Animation, Frame & Script Support
 #include "keyframes.h"
@@ -92,17 +113,42 @@ static double g_arcballScale;
 static Cvec3 g_arcUnitVec;
 bool drawArc = false;
 bool g_pickMode = false;
+bool g_rayPicking = true; // pick by casting a ray on the CPU instead of rendering object IDs
+bool g_asyncPicking = true; // read GPU pick IDs back a frame or two later instead of waiting for them
+bool g_boxSelectMode = false; // the next left drag selects the objects in a rectangle
 bool g_nothingPicked = true;
 bool g_is_mesh_smooth = false;
 bool g_shading_toggle_pending = false;
 bool g_subdivision_pending = false;
+bool g_adaptive_tessellation = false;
 
 static RigTForm auxilaryFrame, auxilaryT, auxilaryR, eyeRbt;
 
+static shared_ptr<NodeArena> g_nodeArena(new NodeArena()); // the scene nodes built in code, contiguous in creation order
 static shared_ptr<SgRootNode> g_world;
 static shared_ptr<SgRbtNode> g_skyNode, g_light1Node, g_light2Node, g_groundNode, g_robot1Node, g_robot2Node;
 static shared_ptr<SgRbtNode> g_currentPickedRbtNode; // used later when you do picking
+static vector<shared_ptr<SgRbtNode> > g_selectedRbtNodes; // result of the last box selection
+static int g_boxSelectX, g_boxSelectY;                   // corner where the box selection drag started
 static shared_ptr<SgRbtNode> g_animation_cube;
+static RenderQueue g_renderQueue; // draws of a frame, submitted sorted by material and geometry
+static bool g_printRenderStats = false; // print the state changes of the next frame
+static FlatScene g_flatScene; // flattened copy of g_world used for drawing, rebuilt if the graph structure changes
+static SceneBvh g_sceneBvh;   // world-space BVH over the shapes of g_flatScene, refitted every frame
+static shared_ptr<SgTransformNode> g_crowdRoot; // robot crowd for the instancing demo, built on first use or loaded from a scene file
+static FlatScene g_crowdScene;
+static bool g_showCrowd = false; // draw g_crowdScene too, toggled with x
+static bool g_frustumCulling = true; // skip shapes and subtrees outside the view frustum
+static SceneResources g_sceneResources; // names of the geometries and materials in scene files
+static shared_ptr<WorkStealingPool> g_scenePool; // threads for updating world frames and filling the render queue, see getScenePool
+static bool g_parallelTraversal = true;
+static Profiler g_profiler; // CPU and GPU times of the passes of the last frames, recorded while toggled on with 'O' and written to trace.json with 'o'
+static long long g_bytesUploadedBefore = 0; // g_bufferBytesUploaded at the end of the last frame
+static bool g_offscreen = false; // rendering to an OffscreenFramebuffer without a window, see renderOffscreen
+static shared_ptr<SoftRenderer> g_softRenderer; // draws the offscreen frames on the CPU instead of through GL, with -soft
+#ifdef OFFSCREEN
+static shared_ptr<OffscreenContext> g_offscreenContext; // outlives the statics declared after it; those before it are released by releaseGlObjects
+#endif
 
 // --------- Materials
 static shared_ptr<Material> g_redDiffuseMat,
@@ -110,11 +156,15 @@ static shared_ptr<Material> g_redDiffuseMat,
     g_bumpFloorMat,
     g_arcballMat,
     g_pickingMat,
+    g_idPickingMat,
     g_lightMat,
     g_specMat;
 
 shared_ptr<Material> g_overridingMaterial;
 
+static shared_ptr<PickBuffer> g_pickBuffer; // integer ID target of GPU picking, GL3 only
+static PickReadback g_pickReadback;          // GPU picks in flight, resolved by display()
+
 static shared_ptr<Script> g_script;
 static const std::string SCRIPT_FILE = "animation.txt";
 
@@ -132,7 +182,7 @@ static shared_ptr<Geometry> g_ground, g_cube, g_sphere; // Vertex buffer and ind
 
 static shared_ptr<Mesh> g_mesh = make_shared<Mesh>();
 static shared_ptr<Mesh> g_subdivided_mesh = make_shared<Mesh>();
-static std::shared_ptr<SimpleGeometryPN> g_mesh_geom_pn;
+static std::shared_ptr<SimpleStreamingGeometryPN> g_mesh_geom_pn;
 static int g_mesh_resolution_lv = 0;
 
 // ============================================================================
@@ -184,198 +234,33 @@ static void initSphere()
 
 static void initMeshCube()
 {
-  g_mesh_geom_pn = std::make_shared<SimpleGeometryPN>();
+  g_mesh_geom_pn = std::make_shared<SimpleStreamingGeometryPN>();
   // Load the mesh from file
   g_mesh->load("data/cube.mesh");
 
   vector<VertexPN> vtx;
-
-  for (int i = 0; i < g_mesh->getNumFaces(); ++i)
-  {
-    Mesh::Face f = g_mesh->getFace(i);
-    std::vector<Cvec3> pos;
-    for (int j = 0; j < f.getNumVertices(); ++j)
-      pos.push_back(f.getVertex(j).getPosition());
-
-    // from quad to triangle1
-    vtx.push_back(VertexPN(pos[0], f.getNormal())); // face normal for flat shading
-    vtx.push_back(VertexPN(pos[1], f.getNormal())); // face normal for flat shading
-    vtx.push_back(VertexPN(pos[2], f.getNormal())); // face normal for flat shading
-
-    // from quad to triangle2
-    vtx.push_back(VertexPN(pos[2], f.getNormal())); // face normal for flat shading
-    vtx.push_back(VertexPN(pos[3], f.getNormal())); // face normal for flat shading
-    vtx.push_back(VertexPN(pos[0], f.getNormal())); // face normal for flat shading
-  }
+  build_mesh_vertices(*g_mesh, false, vtx); // face normal for flat shading
 
   g_mesh_geom_pn->upload(&vtx[0], vtx.size());
   // cout << "size: " << vtx.size() << endl;
 }
 
-shared_ptr<Mesh> catmull_clark_subdivision_mesh(shared_ptr<Mesh> m)
-{
-  shared_ptr<Mesh> result_mesh = make_shared<Mesh>(*m);
-
-  // FaceVertex iteration
-  for (int f = 0; f < result_mesh->getNumFaces(); ++f)
-  {
-    Mesh::Face f_temp = result_mesh->getFace(f);
-    Cvec3 pos(0);
-    for (int v = 0; v < f_temp.getNumVertices(); ++v)
-    {
-      Mesh::Vertex v_temp = f_temp.getVertex(v);
-      pos += v_temp.getPosition();
-    }
-    pos /= f_temp.getNumVertices();
-    result_mesh->setNewFaceVertex(f_temp, pos);
-  }
-
-  // EdgeVertex iteration
-  for (int e = 0; e < result_mesh->getNumEdges(); ++e)
-  {
-    Mesh::Edge e_temp = result_mesh->getEdge(e);
-    Cvec3 pos(0);
-    pos += e_temp.getVertex(0).getPosition();
-    pos += e_temp.getVertex(1).getPosition();
-    pos += result_mesh->getNewFaceVertex(e_temp.getFace(0));
-    pos += result_mesh->getNewFaceVertex(e_temp.getFace(1));
-    pos /= 4.0;
-    result_mesh->setNewEdgeVertex(e_temp, pos);
-  }
-
-  // VertexVertex iteration
-  for (int v = 0; v < result_mesh->getNumVertices(); ++v)
-  {
-    Mesh::Vertex v_temp = result_mesh->getVertex(v);
-    Cvec3 F(0), V(0);
-    int n = 0;
-
-    Mesh::VertexIterator iter(v_temp.getIterator()), it0(iter);
-    do
-    {
-      F += result_mesh->getNewFaceVertex(iter.getFace());
-      V += iter.getVertex().getPosition();
-      ++n;
-    } while (++iter != it0);
-    Cvec3 pos = v_temp.getPosition() * (((double)n - 2.0) / (double)n) + V * (1.0 / (double)pow(n, 2)) + F * (1.0 / (double)pow(n, 2));
-    result_mesh->setNewVertexVertex(v_temp, pos);
-  }
-
-  // Apply cached new vertices to subdivision
-  result_mesh->subdivide();
-
-  // vertex normal 초기화: flat shading용 normal로 대충 박기
-  for (int i = 0; i < result_mesh->getNumFaces(); ++i)
-  {
-    Mesh::Face f = result_mesh->getFace(i);
-    for (int j = 0; j < f.getNumVertices(); ++j)
-    {
-      f.getVertex(j).setNormal(f.getNormal());
-    }
-  }
-
-  return result_mesh;
-}
-
 static void toggle_mesh_shading(shared_ptr<Mesh> mesh, bool smooth)
 {
-  shared_ptr<Mesh> temp_mesh = mesh;
-  bool subdivided_mesh_selected = false;
-  if (g_mesh_resolution_lv != 0)
-  {
-    subdivided_mesh_selected = true;
-  }
-  // cout << "# of divided mesh: " << temp_mesh->getNumVertices() << endl;
-
   vector<VertexPN> vtx;
-  if (smooth)
-  {
-    // first reset all vertices normals to zero
-    for (int i = 0; i < temp_mesh->getNumFaces(); ++i)
-    {
-      Mesh::Face f = temp_mesh->getFace(i);
-      for (int j = 0; j < f.getNumVertices(); ++j)
-      {
-        f.getVertex(j).setNormal(Cvec3(0, 0, 0));
-      }
-    }
-
-    // and then accumulate
-    for (int i = 0; i < temp_mesh->getNumFaces(); ++i)
-    {
-      Mesh::Face f = temp_mesh->getFace(i);
-      for (int j = 0; j < f.getNumVertices(); ++j)
-      {
-        f.getVertex(j).setNormal(f.getVertex(j).getNormal() + f.getNormal());
-      }
-    }
-
-    // lastely divide them with valance of a vertex
-    for (int i = 0; i < temp_mesh->getNumVertices(); ++i)
-    {
-      const Mesh::Vertex v = temp_mesh->getVertex(i);
-
-      int count = 0;
-      Mesh::VertexIterator it(v.getIterator()), it0(it);
-      do
-      {
-        ++count;
-      } while (++it != it0); // go around once the 1ring
-
-      v.setNormal(v.getNormal() / count);
-    }
+  build_mesh_vertices(*mesh, smooth, vtx);
 
-    for (int i = 0; i < temp_mesh->getNumFaces(); ++i)
-    {
-      Mesh::Face f = temp_mesh->getFace(i);
-      std::vector<Cvec3> pos;
-      for (int j = 0; j < f.getNumVertices(); ++j)
-        pos.push_back(f.getVertex(j).getPosition());
-
-      // from quad to triangle1
-      vtx.push_back(VertexPN(pos[0], f.getVertex(0).getNormal()));
-      vtx.push_back(VertexPN(pos[1], f.getVertex(1).getNormal()));
-      vtx.push_back(VertexPN(pos[2], f.getVertex(2).getNormal()));
-
-      // from quad to triangle2
-      vtx.push_back(VertexPN(pos[2], f.getVertex(2).getNormal()));
-      vtx.push_back(VertexPN(pos[3], f.getVertex(3).getNormal()));
-      vtx.push_back(VertexPN(pos[0], f.getVertex(0).getNormal()));
-    }
-  }
-  else
+  g_mesh_geom_pn->upload(&vtx[0], vtx.size(), get_mesh_bounds(*mesh));
+  if (g_animation_cube)
   {
-    for (int i = 0; i < temp_mesh->getNumFaces(); ++i)
-    {
-      Mesh::Face f = temp_mesh->getFace(i);
-      std::vector<Cvec3> pos;
-      for (int j = 0; j < f.getNumVertices(); ++j)
-        pos.push_back(f.getVertex(j).getPosition());
-
-      // from quad to triangle1
-      vtx.push_back(VertexPN(pos[0], f.getNormal())); // face normal for flat shading
-      vtx.push_back(VertexPN(pos[1], f.getNormal())); // face normal for flat shading
-      vtx.push_back(VertexPN(pos[2], f.getNormal())); // face normal for flat shading
-
-      // from quad to triangle2
-      vtx.push_back(VertexPN(pos[2], f.getNormal())); // face normal for flat shading
-      vtx.push_back(VertexPN(pos[3], f.getNormal())); // face normal for flat shading
-      vtx.push_back(VertexPN(pos[0], f.getNormal())); // face normal for flat shading
-    }
+    g_animation_cube->invalidateBounds();
+    g_sceneBvh.markSubtreeChanged(g_flatScene.findNode(*g_animation_cube));
   }
-
-  g_mesh_geom_pn->upload(&vtx[0], vtx.size());
 }
 
 shared_ptr<Mesh> subdivide_nth_catmullclark(shared_ptr<Mesh> mesh, int n)
 {
-  shared_ptr<Mesh> temp = make_shared<Mesh>(*mesh);
-  for (int i = 0; i < n; ++i)
-  {
-    temp = catmull_clark_subdivision_mesh(temp);
-  }
-
-  g_subdivided_mesh = temp;
+  g_subdivided_mesh = subdivide_mesh(mesh, n);
 
   return g_subdivided_mesh;
 }
@@ -399,6 +284,49 @@ shared_ptr<Mesh> meshPointsRescale(float time)
   return temp;
 }
 
+static Matrix4 makeProjectionMatrix();
+static WorkStealingPool &getScenePool();
+static void initCrowd();
+static void saveCrowdScene();
+
+// Alternative to subdivide_nth_catmullclark: tessellates the faces of the mesh
+// as bicubic patches, with more triangles where the mesh is large on screen
+static void tessellate_mesh_adaptive(shared_ptr<Mesh> mesh)
+{
+  const RigTForm meshRbt = inv(eyeRbt) * getPathAccumRbt(g_world, g_animation_cube);
+
+  vector<VertexPN> vtx;
+  tessellateMeshAdaptive(*mesh, rigTFormToMatrix(meshRbt), makeProjectionMatrix(),
+                         g_windowWidth, g_windowHeight, vtx,
+                         g_parallelTraversal ? &getScenePool() : NULL);
+  // the patches may bulge out of the control mesh, so bound the vertices
+  g_mesh_geom_pn->upload(vtx.empty() ? NULL : &vtx[0], vtx.size());
+  g_animation_cube->invalidateBounds();
+  g_sceneBvh.markSubtreeChanged(g_flatScene.findNode(*g_animation_cube));
+}
+
+// Shapes the animated mesh as it is 'elapsed_sec' seconds into its animation
+static void updateAnimatedMesh(float elapsed_sec)
+{
+  ProfileScope scope(g_profiler, "meshAnimation");
+
+  shared_ptr<Mesh> temp = make_shared<Mesh>();
+  temp = meshPointsRescale(elapsed_sec);
+
+  if (g_adaptive_tessellation)
+  {
+    tessellate_mesh_adaptive(temp);
+  }
+  else
+  {
+    if (g_subdivision_pending)
+    {
+      temp = subdivide_nth_catmullclark(temp, g_mesh_resolution_lv);
+    }
+    toggle_mesh_shading(temp, g_is_mesh_smooth);
+  }
+}
+
 void animateMeshTimerCallback(int)
 {
   // if (g_shading_toggle_pending)
@@ -410,15 +338,7 @@ void animateMeshTimerCallback(int)
   if (g_start_time_ms == -1)
     g_start_time_ms = glutGet(GLUT_ELAPSED_TIME);
 
-  float elapsed_sec = (glutGet(GLUT_ELAPSED_TIME) - g_start_time_ms) / 1000.0f;
-  shared_ptr<Mesh> temp = make_shared<Mesh>();
-  temp = meshPointsRescale(elapsed_sec);
-
-  if (g_subdivision_pending)
-  {
-    temp = subdivide_nth_catmullclark(temp, g_mesh_resolution_lv);
-  }
-  toggle_mesh_shading(temp, g_is_mesh_smooth);
+  updateAnimatedMesh((glutGet(GLUT_ELAPSED_TIME) - g_start_time_ms) / 1000.0f);
 
   glutTimerFunc(1000 / 60, animateMeshTimerCallback, 0);
   glutPostRedisplay();
@@ -450,6 +370,76 @@ static Matrix4 makeProjectionMatrix()
       g_frustNear, g_frustFar);
 }
 
+static void setPickedRbtNode(const shared_ptr<SgRbtNode>& node)
+{
+  g_currentPickedRbtNode = node;
+  g_nothingPicked = false;
+  if (g_currentPickedRbtNode == g_groundNode)
+    g_currentPickedRbtNode = shared_ptr<SgRbtNode>(); // set to NULL
+  if (g_currentPickedRbtNode == NULL)
+    g_nothingPicked = true;
+}
+
+// Called by g_pickReadback once an asynchronous GPU pick has been read back
+static void onPickResolved(shared_ptr<SgRbtNode> node)
+{
+  setPickedRbtNode(node);
+  cout << g_currentPickedRbtNode << endl;
+  glutPostRedisplay();
+}
+
+// Starts the threads on first use rather than at startup, so the batch
+// renderer can fork its worker processes while there is only one thread
+static WorkStealingPool &getScenePool()
+{
+  if (!g_scenePool)
+    g_scenePool.reset(new WorkStealingPool());
+  return *g_scenePool;
+}
+
+// Drops the scene, geometries, materials and profiler queries while the GL
+// context is still current. Statics are destroyed in reverse order of
+// declaration, and the scene nodes, resources and profiler are declared before
+// g_offscreenContext, so their GL objects would otherwise be deleted after the
+// context is gone.
+static void releaseGlObjects()
+{
+  g_renderQueue.release();
+  g_flatScene.clear();
+  g_crowdScene.clear();
+  g_sceneBvh = SceneBvh();
+  g_script.reset();
+  g_world.reset();
+  g_skyNode.reset();
+  g_light1Node.reset();
+  g_light2Node.reset();
+  g_groundNode.reset();
+  g_robot1Node.reset();
+  g_robot2Node.reset();
+  g_currentPickedRbtNode.reset();
+  g_selectedRbtNodes.clear();
+  g_animation_cube.reset();
+  g_crowdRoot.reset();
+  g_sceneResources = SceneResources();
+
+  g_redDiffuseMat.reset();
+  g_blueDiffuseMat.reset();
+  g_bumpFloorMat.reset();
+  g_arcballMat.reset();
+  g_pickingMat.reset();
+  g_idPickingMat.reset();
+  g_lightMat.reset();
+  g_specMat.reset();
+  g_overridingMaterial.reset();
+  g_pickBuffer.reset();
+  g_ground.reset();
+  g_cube.reset();
+  g_sphere.reset();
+  g_mesh_geom_pn.reset();
+  g_softRenderer.reset();
+  g_profiler.release();
+}
+
 static void drawStuff(bool picking)
 {
   Uniforms uniforms;
@@ -512,8 +502,68 @@ static void drawStuff(bool picking)
 
   if (!picking)
   {
-    Drawer drawer(invEyeRbt, uniforms);
-    g_world->accept(drawer);
+    // only the subtrees whose frames changed since the last frame are recomputed
+    // with a pool, the worker threads compute the frames and fill draw lists
+    // of their own, merged in order before this thread submits them to GL
+    WorkStealingPool *const pool = g_parallelTraversal ? &getScenePool() : NULL;
+    int framesUpdated;
+    {
+      ProfileScope scope(g_profiler, "updateFrames");
+      g_flatScene.pullLocalRbts();
+      framesUpdated = g_flatScene.update(pool);
+      g_sceneBvh.update();
+    }
+    CullStats cullStats, crowdCullStats;
+    {
+      ProfileScope scope(g_profiler, "cullAndEnqueue");
+      const Frustum frustum(projmat * rigTFormToMatrix(invEyeRbt)); // in world coordinates
+      if (g_frustumCulling)
+        g_flatScene.enqueue(invEyeRbt, g_renderQueue, frustum, &cullStats, pool);
+      else
+        g_flatScene.enqueue(invEyeRbt, g_renderQueue, pool);
+      if (g_showCrowd)
+      {
+        if (g_frustumCulling)
+          g_crowdScene.enqueue(invEyeRbt, g_renderQueue, frustum, &crowdCullStats, pool);
+        else
+          g_crowdScene.enqueue(invEyeRbt, g_renderQueue, pool);
+      }
+    }
+    {
+      ProfileScope scope(g_profiler, "submit", true);
+      if (g_softRenderer)
+        g_renderQueue.submit(uniforms, *g_softRenderer);
+      else
+        g_renderQueue.submit(uniforms);
+    }
+
+    if (g_profiler.isEnabled())
+    {
+      const RenderQueue::Stats &stats = g_renderQueue.getStats();
+      // without culling every node is visited
+      const int nodesVisited = g_frustumCulling ? cullStats.nodesVisited + crowdCullStats.nodesVisited
+                                                : g_flatScene.getNumNodes() + (g_showCrowd ? g_crowdScene.getNumNodes() : 0);
+      g_profiler.addCounter("worldFramesUpdated", framesUpdated);
+      g_profiler.addCounter("nodesVisited", nodesVisited);
+      g_profiler.addCounter("draws", stats.draws);
+      g_profiler.addCounter("stateChanges", stats.programChanges + stats.renderStateChanges + stats.materialBinds + stats.textureBinds);
+    }
+    if (g_printRenderStats)
+    {
+      const RenderQueue::Stats &stats = g_renderQueue.getStats();
+      cout << "draws: " << stats.draws << " (" << stats.instancedDraws << " instanced, covering " << stats.instances << " shapes)"
+           << ", program changes: " << stats.programChanges
+           << ", render state changes: " << stats.renderStateChanges << ", material binds: " << stats.materialBinds
+           << ", texture binds: " << stats.textureBinds << endl;
+      if (g_frustumCulling)
+      {
+        cout << "culling: " << cullStats.shapesDrawn + crowdCullStats.shapesDrawn << " shapes drawn, "
+             << cullStats.shapesCulled + crowdCullStats.shapesCulled << " culled; "
+             << cullStats.nodesVisited + crowdCullStats.nodesVisited << " nodes visited, "
+             << cullStats.nodesCulled + crowdCullStats.nodesCulled << " skipped with their subtree" << endl;
+      }
+      g_printRenderStats = false;
+    }
 
     // draw Arcball
     if (g_nothingPicked && viewpoint == 's')
@@ -525,7 +575,8 @@ static void drawStuff(bool picking)
       g_arcballRbt = getPathAccumRbt(g_world, g_currentPickedRbtNode);
     }
 
-    if (drawArc)
+    // the arcball is an aid for interaction, not part of offscreen renders
+    if (drawArc && !g_offscreen)
     {
       if (!(g_mouseMClickButton || (g_mouseLClickButton && g_mouseRClickButton)))
       {
@@ -540,50 +591,137 @@ static void drawStuff(bool picking)
   }
   else
   {
-    Picker picker(invEyeRbt, uniforms);
-    g_overridingMaterial = g_pickingMat; // set overiding material to our picking material
-    g_world->accept(picker);
-    g_overridingMaterial.reset(); // unset the overriding material
-    glFlush();
-    g_currentPickedRbtNode = picker.getRbtNodeAtXY(g_mouseClickX, g_mouseClickY);
-    g_nothingPicked = false;
-    if (g_currentPickedRbtNode == g_groundNode)
-      g_currentPickedRbtNode = shared_ptr<SgRbtNode>(); // set to NULL
-    if (g_currentPickedRbtNode == NULL)
-      g_nothingPicked = true;
+    if (g_rayPicking)
+    {
+      // against the frames of the last frame drawn, i.e. what is on screen
+      const RayPicker picker(g_flatScene, g_sceneBvh);
+      setPickedRbtNode(picker.getRbtNodeAtXY(eyeRbt, projmat, g_mouseClickX, g_mouseClickY, g_windowWidth, g_windowHeight));
+    }
+    else
+    {
+      // GL3 draws the full 32 bit IDs to g_pickBuffer, GL2 encodes them in the colors
+      Picker picker(invEyeRbt, uniforms, !g_Gl2Compatible);
+      g_overridingMaterial = g_Gl2Compatible ? g_pickingMat : g_idPickingMat; // set overiding material to our picking material
+      traverse(*g_world, picker);
+      g_overridingMaterial.reset(); // unset the overriding material
+      if (g_asyncPicking)
+        picker.getRbtNodeAtXYAsync(g_mouseClickX, g_mouseClickY, g_pickReadback, onPickResolved);
+      else
+      {
+        glFlush();
+        setPickedRbtNode(picker.getRbtNodeAtXY(g_mouseClickX, g_mouseClickY));
+      }
+    }
   }
 }
 
-static void pick()
+static GLdouble g_savedClearColor[4];
+
+// Prepares the framebuffer the GPU picking pass draws IDs into
+static void beginPickPass()
 {
+  // with GL3 the IDs go to an offscreen integer buffer, which is cleared on bind
+  if (!g_Gl2Compatible)
+  {
+    g_pickBuffer->bind(g_windowWidth, g_windowHeight);
+    return;
+  }
+
   // We need to set the clear color to black, for pick rendering.
   // so let's save the clear color
-  GLdouble clearColor[4];
-  glGetDoublev(GL_COLOR_CLEAR_VALUE, clearColor);
+  glGetDoublev(GL_COLOR_CLEAR_VALUE, g_savedClearColor);
 
   glClearColor(0, 0, 0, 0);
 
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+}
+
+static void endPickPass()
+{
+  if (!g_Gl2Compatible)
+    g_pickBuffer->unbind();
+  else
+  {
+    // Uncomment below and comment out the glutPostRedisplay in mouse(...) call back
+    // to see result of the pick rendering pass
+    // glutSwapBuffers();
+
+    // Now set back the clear color
+    glClearColor(g_savedClearColor[0], g_savedClearColor[1], g_savedClearColor[2], g_savedClearColor[3]);
+  }
+  checkGlErrors();
+}
+
+static void pick()
+{
+  ProfileScope scope(g_profiler, "pick", !g_rayPicking);
 
+  // a ray pick draws nothing, so the framebuffer is left alone
+  if (g_rayPicking)
+  {
+    drawStuff(true);
+    return;
+  }
+
+  beginPickPass();
   drawStuff(true); // no more curSS
+  endPickPass();
+}
 
-  // Uncomment below and comment out the glutPostRedisplay in mouse(...) call back
-  // to see result of the pick rendering pass
-  // glutSwapBuffers();
+// Selects the objects in the rectangle between two window corners, as seen
+// from the eye of the last frame drawn
+static void boxSelect(int x0, int y0, int x1, int y1)
+{
+  const int x = min(x0, x1), y = min(y0, y1);
+  const int width = abs(x1 - x0) + 1, height = abs(y1 - y0) + 1;
 
-  // Now set back the clear color
-  glClearColor(clearColor[0], clearColor[1], clearColor[2], clearColor[3]);
+  if (g_rayPicking)
+  {
+    // selects through, including objects hidden behind others
+    const RayPicker picker(g_flatScene, g_sceneBvh);
+    g_selectedRbtNodes = picker.getRbtNodesInRect(eyeRbt, makeProjectionMatrix(), x, y, width, height, g_windowWidth, g_windowHeight);
+  }
+  else
+  {
+    // selects what is visible in the rectangle
+    Uniforms uniforms;
+    sendProjectionMatrix(uniforms, makeProjectionMatrix());
+    beginPickPass();
+    Picker picker(inv(eyeRbt), uniforms, !g_Gl2Compatible);
+    g_overridingMaterial = g_Gl2Compatible ? g_pickingMat : g_idPickingMat;
+    traverse(*g_world, picker);
+    g_overridingMaterial.reset();
+    g_selectedRbtNodes = picker.getRbtNodesInRect(x, y, width, height);
+    endPickPass();
+  }
 
-  checkGlErrors();
+  g_selectedRbtNodes.erase(remove(g_selectedRbtNodes.begin(), g_selectedRbtNodes.end(), g_groundNode), g_selectedRbtNodes.end());
+  cout << "Selected " << g_selectedRbtNodes.size() << " objects" << endl;
 }
 
 static void display()
 {
+  // resolve the GPU picks that have been read back by now, and keep drawing
+  // frames until the rest are
+  g_pickReadback.poll();
+  if (g_pickReadback.hasPending())
+    glutPostRedisplay();
+
+  g_profiler.beginFrame();
+  ProfileScope scope(g_profiler, "frame", true);
+
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
   drawStuff(false); // no more curSS
 
-  glutSwapBuffers();
+  {
+    ProfileScope swapScope(g_profiler, "swapBuffers");
+    glutSwapBuffers();
+  }
+
+  // including what the mesh animation uploaded since the last frame
+  g_profiler.addCounter("bytesUploaded", double(g_bufferBytesUploaded - g_bytesUploadedBefore));
+  g_bytesUploadedBefore = g_bufferBytesUploaded;
 
   checkGlErrors();
 }
@@ -648,6 +786,10 @@ static double makeArcZ(int x, int y, Cvec2 arcCenter)
 
 static void motion(const int x, const int y)
 {
+  // a box selection drag moves nothing
+  if (g_boxSelectMode)
+    return;
+
   const double dx = x - g_mouseClickX; // 지금 마우스 위치 - 이전 프레임 위치 저장해둔거
   const double dy = g_windowHeight - y - 1 - g_mouseClickY;
   makeAuxFrame();
@@ -740,28 +882,52 @@ static void mouse(const int button, const int state, const int x, const int y)
   g_mouseMClickButton &= !(button == GLUT_MIDDLE_BUTTON && state == GLUT_UP);
 
   g_mouseClickDown = g_mouseLClickButton || g_mouseRClickButton || g_mouseMClickButton;
-  if (g_pickMode && g_mouseLClickButton)
+  if (g_boxSelectMode && button == GLUT_LEFT_BUTTON)
+  {
+    if (state == GLUT_DOWN)
+    {
+      g_boxSelectX = g_mouseClickX;
+      g_boxSelectY = g_mouseClickY;
+    }
+    else
+    {
+      boxSelect(g_boxSelectX, g_boxSelectY, g_mouseClickX, g_mouseClickY);
+      g_boxSelectMode = false;
+    }
+  }
+  else if (g_pickMode && g_mouseLClickButton)
   {
     pick();
-    cout << g_currentPickedRbtNode << endl;
+    if (!g_pickReadback.hasPending())
+      cout << g_currentPickedRbtNode << endl;
     cout << "Picking mode if off" << endl;
     g_pickMode = false;
   }
   glutPostRedisplay();
 }
 
-static bool interpolateAndDisplay(float t)
+// Poses the scene 't' keyframes into the script, between keyframes floor(t)
+// and floor(t) + 1. Returns false, and leaves the scene alone, if t is past the
+// second to last keyframe.
+static bool pasteScriptFrame(double t)
 {
   int i = floor(t);
   float a = t - i;
 
   if (g_script->get_script_size() < 2 || t > g_script->get_script_size() - 2) // n-1까지만
-    return true;
+    return false;
 
   Frame f0 = g_script->get_frame_at(i);
   Frame f1 = g_script->get_frame_at(i + 1);
   Frame fa = get_frame_interpolation(f0, f1, a);
   fa.paste_to_scene(g_world);
+  return true;
+}
+
+static bool interpolateAndDisplay(float t)
+{
+  if (!pasteScriptFrame(t))
+    return true;
   glutPostRedisplay();
   return false;
 }
@@ -788,6 +954,7 @@ static void keyboard(const unsigned char key, const int x, const int y)
   switch (key)
   {
   case 27:
+    releaseGlObjects(); // while the window's context is still current
     exit(0); // ESC
   case 'h':
     cout << " ============== H E L P ==============\n\n"
@@ -797,6 +964,18 @@ static void keyboard(const unsigned char key, const int x, const int y)
          << "v\t\tCycle view\n"
          << "m\t\tSwitching between world-sky and sky-sky frames for sky motion\n"
          << "p\t\tEnter picking mode to select object\n"
+         << "t\t\tToggle screen-adaptive CPU tessellation of the mesh\n"
+         << "c\t\tPrint the GL state changes and culling stats of the next frame\n"
+         << "x\t\tToggle a crowd of robots\n"
+         << "z\t\tToggle instanced drawing\n"
+         << "k\t\tToggle view-frustum culling\n"
+         << "j\t\tToggle multithreaded world frame update, draw list building and tessellation\n"
+         << "e\t\tSave the robot crowd to crowd.scene (text) and crowd.sgb (binary)\n"
+         << "g\t\tToggle between CPU ray picking and GPU ID picking\n"
+         << "a\t\tToggle asynchronous readback of GPU picks\n"
+         << "b\t\tSelect the objects in a rectangle dragged with the left mouse button\n"
+         << "O\t\tToggle recording of pass timings and frame counters (off by default)\n"
+         << "o\t\tWrite the timings and counters of the last frames to trace.json (Chrome trace)\n"
          << "drag left mouse to rotate\n"
          << endl;
     break;
@@ -933,6 +1112,74 @@ static void keyboard(const unsigned char key, const int x, const int y)
     g_shading_toggle_pending = true;
     cout << "toggle smooth shading: " << (g_is_mesh_smooth ? "true" : "false") << endl;
     break;
+  case 'c':
+    g_printRenderStats = true;
+    break;
+  case 'x':
+    g_showCrowd = !g_showCrowd;
+    if (g_showCrowd && !g_crowdRoot)
+      initCrowd();
+    cout << "Robot crowd: " << (g_showCrowd ? "on" : "off") << endl;
+    break;
+  case 'z':
+    g_renderQueue.setInstancing(!g_renderQueue.getInstancing());
+    cout << "Instanced drawing: " << (g_renderQueue.getInstancing() ? "on" : "off")
+         << (isInstancingSupported() ? "" : " (not supported by this GL context)") << endl;
+    break;
+  case 'g':
+    g_rayPicking = !g_rayPicking;
+    cout << "Picking: " << (g_rayPicking ? "CPU ray cast" : "GPU IDs") << endl;
+    break;
+  case 'b':
+    g_boxSelectMode = true;
+    cout << "Box selection: drag a rectangle with the left mouse button" << endl;
+    break;
+  case 'a':
+    g_asyncPicking = !g_asyncPicking;
+    cout << "GPU pick readback: " << (g_asyncPicking ? "asynchronous" : "synchronous") << endl;
+    break;
+  case 'k':
+    g_frustumCulling = !g_frustumCulling;
+    cout << "Frustum culling: " << (g_frustumCulling ? "on" : "off") << endl;
+    break;
+  case 'e':
+    if (!g_crowdRoot)
+      initCrowd();
+    // a file that cannot be written should not end the session
+    try
+    {
+      saveCrowdScene();
+    }
+    catch (const runtime_error &e)
+    {
+      cout << e.what() << endl;
+    }
+    break;
+  case 'O':
+    g_profiler.setEnabled(!g_profiler.isEnabled());
+    g_profiler.setGpuTiming(g_profiler.isEnabled()); // if the context has timer queries
+    cout << "Profiling: " << (g_profiler.isEnabled() ? "on" : "off") << endl;
+    break;
+  case 'o':
+    try
+    {
+      g_profiler.writeChromeTrace("trace.json");
+      cout << "Wrote " << g_profiler.getNumEvents() << " profiler events to trace.json" << endl;
+    }
+    catch (const runtime_error &e)
+    {
+      cout << e.what() << endl;
+    }
+    break;
+  case 'j':
+    g_parallelTraversal = !g_parallelTraversal;
+    cout << "Parallel scene traversal: " << (g_parallelTraversal ? "on, " : "off, ")
+         << getScenePool().getNumThreads() << " worker threads" << endl;
+    break;
+  case 't':
+    g_adaptive_tessellation = !g_adaptive_tessellation;
+    cout << "Adaptive tessellation: " << (g_adaptive_tessellation ? "on" : "off") << endl;
+    break;
   case '0':
     if (g_mesh_resolution_lv < 7)
     {
@@ -985,7 +1232,7 @@ static void keyboard(const unsigned char key, const int x, const int y)
   }
 }
 
-static void initGlutState(int argc, char *argv[])
+static void initGlutState(int &argc, char *argv[])
 {
   glutInit(&argc, argv);                                     // initialize Glut based on cmd-line args
   glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH); //  RGBA pixel channels and double buffering
@@ -1009,7 +1256,8 @@ static void initGLState()
   glEnable(GL_CULL_FACE);
   glEnable(GL_DEPTH_TEST);
   glDepthFunc(GL_GREATER);
-  glReadBuffer(GL_BACK);
+  if (!g_offscreen)
+    glReadBuffer(GL_BACK); // an OffscreenFramebuffer reads its own color buffer
   if (!g_Gl2Compatible)
     glEnable(GL_FRAMEBUFFER_SRGB);
 }
@@ -1046,6 +1294,11 @@ static void initMaterials()
 
   // pick shader
   g_pickingMat.reset(new Material("./shaders/basic-gl3.vshader", "./shaders/pick-gl3.fshader"));
+  if (!g_Gl2Compatible)
+  {
+    g_idPickingMat.reset(new Material("./shaders/basic-gl3.vshader", "./shaders/pick-id-gl3.fshader"));
+    g_pickBuffer.reset(new PickBuffer());
+  }
 
   // Mesh specualr material
   g_specMat.reset(new Material(specular));
@@ -1121,45 +1374,200 @@ static void constructRobot(shared_ptr<SgTransformNode> base, shared_ptr<Material
       jointNodes[i] = base;
     else
     {
-      jointNodes[i].reset(new SgRbtNode(RigTForm(Cvec3(jointDesc[i].x, jointDesc[i].y, jointDesc[i].z))));
+      jointNodes[i] = makeArenaShared<SgRbtNode>(g_nodeArena, RigTForm(Cvec3(jointDesc[i].x, jointDesc[i].y, jointDesc[i].z)));
       jointNodes[jointDesc[i].parent]->addChild(jointNodes[i]);
     }
   }
   for (int i = 0; i < NUM_SHAPES; ++i)
   {
-    shared_ptr<MyShapeNode> shape(
-        new MyShapeNode(shapeDesc[i].geometry,
-                        material,
-                        Cvec3(shapeDesc[i].x, shapeDesc[i].y, shapeDesc[i].z),
-                        Cvec3(0, 0, 0),
-                        Cvec3(shapeDesc[i].sx, shapeDesc[i].sy, shapeDesc[i].sz)));
+    shared_ptr<MyShapeNode> shape = makeArenaShared<MyShapeNode>(
+        g_nodeArena,
+        shapeDesc[i].geometry,
+        material,
+        Cvec3(shapeDesc[i].x, shapeDesc[i].y, shapeDesc[i].z),
+        Cvec3(0, 0, 0),
+        Cvec3(shapeDesc[i].sx, shapeDesc[i].sy, shapeDesc[i].sz));
     jointNodes[shapeDesc[i].parentJointId]->addChild(shape);
   }
 }
 
+// A grid of robots sharing the robot materials and geometries. Kept out of
+// g_world so it is neither picked nor part of the keyframe script.
+static void initCrowd()
+{
+  const int CROWD_SIDE = 32;
+  const double SPACING = 2.5;
+
+  g_crowdRoot = makeArenaShared<SgRootNode>(g_nodeArena);
+  for (int i = 0; i < CROWD_SIDE; ++i)
+  {
+    for (int j = 0; j < CROWD_SIDE; ++j)
+    {
+      const Cvec3 pos((i - CROWD_SIDE / 2) * SPACING, 0, -(j + 2) * SPACING);
+      shared_ptr<SgRbtNode> robot = makeArenaShared<SgRbtNode>(g_nodeArena, RigTForm(pos));
+      constructRobot(robot, (i + j) % 2 ? g_redDiffuseMat : g_blueDiffuseMat);
+      g_crowdRoot->addChild(robot);
+    }
+  }
+  g_crowdScene.build(g_crowdRoot);
+}
+
+static double millisecondsSince(chrono::steady_clock::time_point start)
+{
+  return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+// Replaces the robot crowd with the scene in 'filename', in either scene file
+// format (see sceneio.h)
+static void loadCrowdScene(const char *filename)
+{
+  const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  g_crowdRoot = loadScene(filename, g_sceneResources);
+  const double loadMs = millisecondsSince(start);
+  g_crowdScene.build(g_crowdRoot);
+  g_showCrowd = true;
+  cout << "Loaded " << filename << ": " << g_crowdScene.getNumNodes() << " transform nodes, "
+       << g_crowdScene.getNumShapes() << " shapes in " << loadMs << " ms" << endl;
+}
+
+#ifdef OFFSCREEN
+// Last frame of the keyframe script played at 'fps' frames per second, with
+// g_msBetweenKeyFrames between keyframes
+static int getLastScriptFrame(double fps)
+{
+  const double keyFramesPerFrame = 1000 / (fps * g_msBetweenKeyFrames);
+  return (int)floor((g_script->get_script_size() - 2) / keyFramesPerFrame + 1e-6);
+}
+
+// Draws the given frames into an offscreen framebuffer and writes frame k to
+// <outPrefix>k.ppm, k padded to 4 digits, or nowhere if 'outPrefix' is NULL.
+// Frame k shows the scene k / fps seconds into the animation: the animated mesh
+// and, with 'playScript', the keyframe script are evaluated at that time, not
+// at the time the frame is drawn. Prints the frame throughput.
+//
+// With g_softRenderer set, the frames are drawn by it instead of GL, which is
+// still needed for creating the geometries and materials.
+static void renderOffscreen(const vector<int> &frames, double fps, bool playScript, const char *outPrefix)
+{
+  if (frames.empty())
+    return;
+
+  OffscreenFramebuffer target(g_windowWidth, g_windowHeight, !g_Gl2Compatible);
+  target.bind();
+  glViewport(0, 0, g_windowWidth, g_windowHeight);
+  updateFrustFovY();
+  if (g_softRenderer)
+    g_softRenderer->setClearColor(Cvec3f(128. / 255., 200. / 255., 255. / 255.)); // as initGLState
+
+  const int numFrames = frames.size();
+  const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  for (int n = 0; n < numFrames; ++n)
+  {
+    const int frame = frames[n];
+    updateAnimatedMesh(frame / fps);
+    if (playScript)
+    {
+      // the last frame may end a little before the last keyframe, not after it
+      const double t = frame * 1000 / (fps * g_msBetweenKeyFrames);
+      pasteScriptFrame(min(t, g_script->get_script_size() - 2.0));
+    }
+
+    g_profiler.beginFrame();
+    ProfileScope scope(g_profiler, "frame", true);
+    if (g_softRenderer)
+    {
+      g_softRenderer->clear();
+      drawStuff(false);
+      ProfileScope rasterizeScope(g_profiler, "rasterize");
+      g_softRenderer->finish(g_parallelTraversal ? &getScenePool() : NULL);
+    }
+    else
+    {
+      glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+      drawStuff(false);
+    }
+    if (outPrefix)
+    {
+      ProfileScope readScope(g_profiler, "writeFrame");
+      char number[16];
+      snprintf(number, sizeof(number), "%04d", frame);
+      const string filename = string(outPrefix) + number + ".ppm";
+      if (g_softRenderer)
+        g_softRenderer->writePpm(filename.c_str());
+      else
+        writePpmScreenshot(g_windowWidth, g_windowHeight, filename.c_str());
+    }
+    else if (!g_softRenderer)
+      glFinish(); // so the time covers the rendering and not only its submission
+    checkGlErrors();
+  }
+  const double ms = millisecondsSince(start);
+  cout << "Rendered " << numFrames << " frames of " << g_windowWidth << "x" << g_windowHeight << " in " << ms
+       << " ms: " << ms / numFrames << " ms per frame, " << numFrames * 1000 / ms << " frames per second" << endl;
+}
+
+// Splits this process into 'numWorkers' worker processes. Returns the index of
+// the worker in each of them, and -1 in this process once they have all
+// exited. Throws runtime_error if a worker cannot be started or fails.
+//
+// Call before creating the GL context or any thread, neither of which a
+// forked process inherits.
+static int runWorkerProcesses(int numWorkers)
+{
+  cout.flush(); // or every worker would print it again
+  vector<pid_t> workers;
+  for (int i = 0; i < numWorkers; ++i)
+  {
+    const pid_t pid = fork();
+    if (pid == 0)
+      return i;
+    if (pid < 0)
+      break;
+    workers.push_back(pid);
+  }
+
+  int numFailed = numWorkers - workers.size();
+  for (size_t i = 0; i < workers.size(); ++i)
+  {
+    int status;
+    if (waitpid(workers[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      ++numFailed;
+  }
+  if (numFailed > 0)
+    throw runtime_error("Error: " + to_string(numFailed) + " of " + to_string(numWorkers) + " worker processes failed");
+  return -1;
+}
+#endif
+
+static void saveCrowdScene()
+{
+  saveScene(*g_crowdRoot, g_sceneResources, "crowd.scene");
+  saveSceneBinary(*g_crowdRoot, g_sceneResources, "crowd.sgb");
+  cout << "Saved the robot crowd to crowd.scene and crowd.sgb" << endl;
+}
+
 static void initScene()
 {
-  g_world.reset(new SgRootNode());
+  g_world = makeArenaShared<SgRootNode>(g_nodeArena);
 
-  g_skyNode.reset(new SgRbtNode(RigTForm(Cvec3(0.0, 0.25, 4.0))));
+  g_skyNode = makeArenaShared<SgRbtNode>(g_nodeArena, RigTForm(Cvec3(0.0, 0.25, 4.0)));
 
-  g_light1Node.reset(new SgRbtNode(RigTForm(Cvec3(4.0, 3.0, 5.0))));
-  g_light1Node->addChild(shared_ptr<MyShapeNode>(new MyShapeNode(g_sphere, g_lightMat, Cvec3(0, 0, 0), Cvec3(0, 0, 0), Cvec3(0.5, 0.5, 0.5))));
-  g_light2Node.reset(new SgRbtNode(RigTForm(Cvec3(-4, 1.0, -5.0))));
-  g_light2Node->addChild(shared_ptr<MyShapeNode>(new MyShapeNode(g_sphere, g_lightMat, Cvec3(0, 0, 0), Cvec3(0, 0, 0), Cvec3(0.5, 0.5, 0.5))));
+  g_light1Node = makeArenaShared<SgRbtNode>(g_nodeArena, RigTForm(Cvec3(4.0, 3.0, 5.0)));
+  g_light1Node->addChild(makeArenaShared<MyShapeNode>(g_nodeArena, g_sphere, g_lightMat, Cvec3(0, 0, 0), Cvec3(0, 0, 0), Cvec3(0.5, 0.5, 0.5)));
+  g_light2Node = makeArenaShared<SgRbtNode>(g_nodeArena, RigTForm(Cvec3(-4, 1.0, -5.0)));
+  g_light2Node->addChild(makeArenaShared<MyShapeNode>(g_nodeArena, g_sphere, g_lightMat, Cvec3(0, 0, 0), Cvec3(0, 0, 0), Cvec3(0.5, 0.5, 0.5)));
 
-  g_groundNode.reset(new SgRbtNode());
-  g_groundNode->addChild(shared_ptr<MyShapeNode>(
-      new MyShapeNode(g_ground, g_bumpFloorMat, Cvec3(0, g_groundY, 0))));
+  g_groundNode = makeArenaShared<SgRbtNode>(g_nodeArena);
+  g_groundNode->addChild(makeArenaShared<MyShapeNode>(g_nodeArena, g_ground, g_bumpFloorMat, Cvec3(0, g_groundY, 0)));
 
-  g_robot1Node.reset(new SgRbtNode(RigTForm(Cvec3(-2, 1, 0))));
-  g_robot2Node.reset(new SgRbtNode(RigTForm(Cvec3(2, 1, 0))));
+  g_robot1Node = makeArenaShared<SgRbtNode>(g_nodeArena, RigTForm(Cvec3(-2, 1, 0)));
+  g_robot2Node = makeArenaShared<SgRbtNode>(g_nodeArena, RigTForm(Cvec3(2, 1, 0)));
 
   constructRobot(g_robot1Node, g_redDiffuseMat);  // a Red robot
   constructRobot(g_robot2Node, g_blueDiffuseMat); // a Blue robot
 
-  g_animation_cube.reset(new SgRbtNode(RigTForm(Cvec3(0.0, 0.5, 0.0))));
-  g_animation_cube->addChild(shared_ptr<MyShapeNode>(new MyShapeNode(g_mesh_geom_pn, g_specMat, Cvec3(0, 0, 0), Cvec3(0, 0, 0))));
+  g_animation_cube = makeArenaShared<SgRbtNode>(g_nodeArena, RigTForm(Cvec3(0.0, 0.5, 0.0)));
+  g_animation_cube->addChild(makeArenaShared<MyShapeNode>(g_nodeArena, g_mesh_geom_pn, g_specMat, Cvec3(0, 0, 0), Cvec3(0, 0, 0)));
 
   g_world->addChild(g_skyNode);
   g_world->addChild(g_light1Node);
@@ -1169,7 +1577,24 @@ static void initScene()
   g_world->addChild(g_robot2Node);
   g_world->addChild(g_animation_cube);
 
-  animateMeshTimerCallback(0);
+  g_flatScene.build(g_world);
+  g_sceneBvh.build(g_flatScene);
+
+  updateAnimatedMesh(0);
+}
+
+// Names under which scene files refer to the geometries and materials
+static void initSceneResources()
+{
+  g_sceneResources.addGeometry("ground", g_ground);
+  g_sceneResources.addGeometry("cube", g_cube);
+  g_sceneResources.addGeometry("sphere", g_sphere);
+  g_sceneResources.addGeometry("mesh", g_mesh_geom_pn);
+  g_sceneResources.addMaterial("red", g_redDiffuseMat);
+  g_sceneResources.addMaterial("blue", g_blueDiffuseMat);
+  g_sceneResources.addMaterial("floor", g_bumpFloorMat);
+  g_sceneResources.addMaterial("light", g_lightMat);
+  g_sceneResources.addMaterial("specular", g_specMat);
 }
 
 static void initScript()
@@ -1177,11 +1602,113 @@ static void initScript()
   g_script = make_shared<Script>(g_world);
 }
 
+static void usage()
+{
+  throw runtime_error("Usage: asst8 [-offscreen frames | -script file [-frames FIRST-LAST] [-fps F] [-workers N]]\n"
+                      "             [-size WIDTHxHEIGHT] [-soft] [-o prefix] [scene file]");
+}
+
 int main(int argc, char *argv[])
 {
   try
   {
-    initGlutState(argc, argv);
+    // glutInit needs a display, so the offscreen mode is picked before it
+    for (int i = 1; i < argc; ++i)
+      g_offscreen = g_offscreen || !strcmp(argv[i], "-offscreen") || !strcmp(argv[i], "-script");
+#ifndef OFFSCREEN
+    if (g_offscreen)
+      throw runtime_error("Error: asst8 was built without offscreen rendering, build it with make OFFSCREEN=1");
+#endif
+    if (!g_offscreen)
+      initGlutState(argc, argv); // removes the GLUT options from argv
+
+    // frames first to last are rendered offscreen: by default, all of the
+    // script, or the number given to -offscreen
+    int numFrames = 0, firstFrame = 0, lastFrame = -1, numWorkers = 1;
+    bool frameRangeSet = false;
+    double fps = 60;
+    const char *sceneFile = NULL, *scriptFile = NULL;
+#ifdef OFFSCREEN
+    bool softRendering = false;
+    const char *outPrefix = NULL;
+#endif
+    for (int i = 1; i < argc; ++i)
+    {
+      const bool hasValue = i + 1 < argc;
+      if (!strcmp(argv[i], "-offscreen") && hasValue && !scriptFile)
+      {
+        numFrames = atoi(argv[++i]);
+        if (numFrames <= 0)
+          usage();
+      }
+      else if (!strcmp(argv[i], "-script") && hasValue && numFrames == 0)
+        scriptFile = argv[++i];
+      else if (!strcmp(argv[i], "-frames") && hasValue && g_offscreen)
+      {
+        if (sscanf(argv[++i], "%d-%d", &firstFrame, &lastFrame) != 2 || firstFrame < 0 || lastFrame < firstFrame)
+          usage();
+        frameRangeSet = true;
+      }
+      else if (!strcmp(argv[i], "-fps") && hasValue && g_offscreen)
+      {
+        fps = atof(argv[++i]);
+        if (!(fps > 0))
+          usage();
+      }
+      else if (!strcmp(argv[i], "-workers") && hasValue && g_offscreen)
+      {
+        // 0 for one per hardware thread
+        numWorkers = atoi(argv[++i]);
+        if (numWorkers == 0)
+          numWorkers = max(1u, thread::hardware_concurrency());
+        if (numWorkers < 0)
+          usage();
+      }
+      else if (!strcmp(argv[i], "-size") && hasValue && g_offscreen)
+      {
+        if (sscanf(argv[++i], "%dx%d", &g_windowWidth, &g_windowHeight) != 2 || g_windowWidth <= 0 || g_windowHeight <= 0)
+          usage();
+      }
+#ifdef OFFSCREEN
+      else if (!strcmp(argv[i], "-soft") && g_offscreen)
+        softRendering = true;
+      else if (!strcmp(argv[i], "-o") && hasValue && g_offscreen)
+        outPrefix = argv[++i];
+#endif
+      else if (argv[i][0] != '-' && !sceneFile)
+        sceneFile = argv[i];
+      else
+        usage();
+    }
+    if (!frameRangeSet)
+      lastFrame = numFrames - 1;
+
+#ifdef OFFSCREEN
+    int worker = 0;
+    if (g_offscreen)
+    {
+      if (numWorkers > 1)
+      {
+        // each worker renders every numWorkers-th frame, which evens out the
+        // parts of the animation that are slower to draw
+        const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        worker = runWorkerProcesses(numWorkers);
+        if (worker < 0)
+        {
+          cout << numWorkers << " worker processes finished in " << millisecondsSince(start) << " ms" << endl;
+          return 0;
+        }
+        // the processes share the cores rather than each starting a thread per
+        // core, as the scene pool and Mesa's llvmpipe rasterizer would
+        g_parallelTraversal = false;
+        const int threadsPerWorker = max(1, (int)thread::hardware_concurrency() / numWorkers);
+        setenv("LP_NUM_THREADS", to_string(threadsPerWorker).c_str(), 0);
+      }
+      g_offscreenContext.reset(new OffscreenContext());
+      if (softRendering)
+        g_softRenderer.reset(new SoftRenderer(g_windowWidth, g_windowHeight));
+    }
+#endif
 
     glewInit(); // load the OpenGL extensions
 
@@ -1196,13 +1723,40 @@ int main(int argc, char *argv[])
     initGeometry();
     initScene();
     initScript();
+    initSceneResources();
+
+    // an optional scene file replaces the robot crowd
+    if (sceneFile)
+      loadCrowdScene(sceneFile);
+
+#ifdef OFFSCREEN
+    if (g_offscreen)
+    {
+      if (scriptFile)
+      {
+        g_script->set_script(scriptFile);
+        if (g_script->get_script_size() < 2)
+          throw runtime_error(string("Error: the script ") + scriptFile + " needs at least 2 keyframes");
+        if (!frameRangeSet)
+          lastFrame = getLastScriptFrame(fps);
+      }
+      vector<int> frames;
+      for (int frame = firstFrame + worker; frame <= lastFrame; frame += numWorkers)
+        frames.push_back(frame);
+      renderOffscreen(frames, fps, scriptFile != NULL, outPrefix);
+      releaseGlObjects();
+      return 0;
+    }
+#endif
 
+    animateMeshTimerCallback(0); // keeps itself going with glutTimerFunc
     glutMainLoop();
     return 0;
   }
   catch (const runtime_error &e)
   {
     cout << "Exception caught: " << e.what() << endl;
+    releaseGlObjects();
     return -1;
   }
 }
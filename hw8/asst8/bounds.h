@@ -0,0 +1,171 @@
+#ifndef BOUNDS_H
+#define BOUNDS_H
+
+#include <cmath>
+#include <algorithm>
+
+#include "cvec.h"
+#include "matrix4.h"
+#include "rigtform.h"
+
+//--------------------------------------------------------------------------------
+// Bounding volumes and view-frustum tests
+//--------------------------------------------------------------------------------
+
+// Axis aligned bounding box. A default constructed box is empty; adding points
+// or boxes grows it. infinite() stands for an unknown extent: it stays infinite
+// under transforms and unions, and is never culled.
+struct Aabb {
+  Cvec3 lo, hi;
+
+  Aabb() : lo(HUGE_VAL), hi(-HUGE_VAL) {}
+
+  Aabb(const Cvec3& _lo, const Cvec3& _hi) : lo(_lo), hi(_hi) {}
+
+  static Aabb infinite() {
+    return Aabb(Cvec3(-HUGE_VAL), Cvec3(HUGE_VAL));
+  }
+
+  bool isEmpty() const {
+    return lo[0] > hi[0] || lo[1] > hi[1] || lo[2] > hi[2];
+  }
+
+  bool isInfinite() const {
+    return lo[0] == -HUGE_VAL || lo[1] == -HUGE_VAL || lo[2] == -HUGE_VAL ||
+           hi[0] == HUGE_VAL || hi[1] == HUGE_VAL || hi[2] == HUGE_VAL;
+  }
+
+  Aabb& add(const Cvec3& p) {
+    for (int i = 0; i < 3; ++i) {
+      lo[i] = std::min(lo[i], p[i]);
+      hi[i] = std::max(hi[i], p[i]);
+    }
+    return *this;
+  }
+
+  Aabb& add(const Aabb& b) {
+    for (int i = 0; i < 3; ++i) {
+      lo[i] = std::min(lo[i], b.lo[i]);
+      hi[i] = std::max(hi[i], b.hi[i]);
+    }
+    return *this;
+  }
+
+  Cvec3 getCenter() const {
+    return (lo + hi) * 0.5;
+  }
+
+  // Half the size along each axis
+  Cvec3 getHalfExtent() const {
+    return (hi - lo) * 0.5;
+  }
+
+  // Radius of the bounding sphere centered at getCenter()
+  double getRadius() const {
+    return norm(getHalfExtent());
+  }
+};
+
+// Box around the image of 'b' under the affine matrix 'm'
+inline Aabb transformBounds(const Matrix4& m, const Aabb& b) {
+  if (b.isEmpty() || b.isInfinite())
+    return b;
+  const Cvec3 c = b.getCenter(), e = b.getHalfExtent();
+  Cvec3 center, extent;
+  for (int i = 0; i < 3; ++i) {
+    center[i] = m(i, 3);
+    extent[i] = 0;
+    for (int j = 0; j < 3; ++j) {
+      center[i] += m(i, j) * c[j];
+      extent[i] += std::abs(m(i, j)) * e[j];
+    }
+  }
+  return Aabb(center - extent, center + extent);
+}
+
+inline Aabb transformBounds(const RigTForm& rbt, const Aabb& b) {
+  return transformBounds(rigTFormToMatrix(rbt), b);
+}
+
+// The six clip planes of a projection (or projection times view) matrix. With
+// the projection alone the planes are in eye space; multiplied by a view
+// matrix, they are in the frame that matrix maps from.
+class Frustum {
+public:
+  enum Result { OUTSIDE, INTERSECTING, INSIDE };
+
+  explicit Frustum(const Matrix4& clipMatrix) {
+    // -w <= x, y, z <= w, with each row of the matrix giving one coordinate
+    for (int i = 0; i < 3; ++i) {
+      for (int j = 0; j < 4; ++j) {
+        planes_[2 * i][j] = clipMatrix(3, j) + clipMatrix(i, j);
+        planes_[2 * i + 1][j] = clipMatrix(3, j) - clipMatrix(i, j);
+      }
+    }
+    // normalized, so plane distances of sphere centers compare to radii
+    for (int i = 0; i < 6; ++i) {
+      const double len = norm(Cvec3(planes_[i]));
+      if (len > 0)
+        planes_[i] /= len;
+    }
+  }
+
+  Result classify(const Aabb& b) const {
+    if (b.isEmpty())
+      return OUTSIDE;
+    if (b.isInfinite())
+      return INTERSECTING;
+    const Cvec3 c = b.getCenter(), e = b.getHalfExtent();
+    Result r = INSIDE;
+    for (int i = 0; i < 6; ++i) {
+      const Cvec4& p = planes_[i];
+      const double d = p[0] * c[0] + p[1] * c[1] + p[2] * c[2] + p[3];
+      const double extent = std::abs(p[0]) * e[0] + std::abs(p[1]) * e[1] + std::abs(p[2]) * e[2];
+      if (d + extent < 0)
+        return OUTSIDE;
+      if (d - extent < 0)
+        r = INTERSECTING;
+    }
+    return r;
+  }
+
+  Result classify(const Cvec3& center, double radius) const {
+    Result r = INSIDE;
+    for (int i = 0; i < 6; ++i) {
+      const Cvec4& p = planes_[i];
+      const double d = p[0] * center[0] + p[1] * center[1] + p[2] * center[2] + p[3];
+      if (d < -radius)
+        return OUTSIDE;
+      if (d < radius)
+        r = INTERSECTING;
+    }
+    return r;
+  }
+
+  // Sphere test of a box given in the frame 'rbt' maps from. Rigid transforms
+  // keep spheres spheres, so this is cheaper than transforming the box, at
+  // the price of a looser fit.
+  Result classify(const RigTForm& rbt, const Aabb& b) const {
+    if (b.isEmpty())
+      return OUTSIDE;
+    if (b.isInfinite())
+      return INTERSECTING;
+    const Cvec3 center = rbt.getTranslation() + Cvec3(rbt.getRotation() * Cvec4(b.getCenter(), 0));
+    return classify(center, b.getRadius());
+  }
+
+private:
+  Cvec4 planes_[6]; // (a, b, c, d) with ax + by + cz + d >= 0 inside
+};
+
+// What a culling pass did
+struct CullStats {
+  int nodesCulled;  // transform nodes skipped along with an outside subtree
+  int nodesVisited; // transform nodes whose shapes were considered
+  int shapesCulled;
+  int shapesDrawn;
+
+  CullStats() : nodesCulled(0), nodesVisited(0), shapesCulled(0), shapesDrawn(0) {}
+};
+
+#endif
@@ -0,0 +1,275 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "bvh.h"
+
+using namespace std;
+
+// Number of bins along each axis evaluated for a split, and the most items
+// a leaf gets
+static const int SAH_BINS = 12;
+static const int MAX_LEAF_SIZE = 4;
+
+// Relative cost of descending into a node versus testing one item
+static const double TRAVERSAL_COST = 1;
+static const double ITEM_COST = 1;
+
+static double surfaceArea(const Aabb& b) {
+  if (b.isEmpty())
+    return 0;
+  const Cvec3 d = b.hi - b.lo;
+  return 2 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+}
+
+static bool overlaps(const Aabb& a, const Aabb& b) {
+  return a.lo[0] <= b.hi[0] && b.lo[0] <= a.hi[0] &&
+         a.lo[1] <= b.hi[1] && b.lo[1] <= a.hi[1] &&
+         a.lo[2] <= b.hi[2] && b.lo[2] <= a.hi[2];
+}
+
+// Weight of a node in the SAH cost
+static double nodeCost(int count) {
+  return count > 0 ? ITEM_COST * count : TRAVERSAL_COST;
+}
+
+void Bvh::clear() {
+  nodes_.clear();
+  bounds_.clear();
+  items_.clear();
+  leafOf_.clear();
+  unbounded_.clear();
+  weightedArea_ = 0;
+}
+
+void Bvh::build(const vector<Aabb>& bounds) {
+  clear();
+  bounds_ = bounds;
+  leafOf_.assign(bounds.size(), -1);
+
+  // empty boxes are left out, infinite ones are kept aside
+  vector<Cvec3> centers(bounds.size());
+  for (int i = 0, n = bounds.size(); i < n; ++i) {
+    if (bounds[i].isInfinite())
+      unbounded_.push_back(i);
+    else if (!bounds[i].isEmpty()) {
+      items_.push_back(i);
+      centers[i] = bounds[i].getCenter();
+    }
+  }
+
+  if (!items_.empty()) {
+    nodes_.reserve(2 * items_.size());
+    nodes_.push_back(Node());
+    nodes_[0].parent = -1;
+    buildNode(centers, 0, 0, items_.size());
+  }
+
+  for (size_t n = 0; n < nodes_.size(); ++n)
+    weightedArea_ += surfaceArea(nodes_[n].bounds) * nodeCost(nodes_[n].count);
+}
+
+void Bvh::buildNode(const vector<Cvec3>& centers, int n, int begin, int end) {
+  Aabb box, centerBox;
+  for (int k = begin; k < end; ++k) {
+    box.add(bounds_[items_[k]]);
+    centerBox.add(centers[items_[k]]);
+  }
+  nodes_[n].bounds = box;
+
+  const int count = end - begin;
+  int bestAxis = -1, bestSplit = 0;
+  double bestCost = count * ITEM_COST;
+
+  if (count > MAX_LEAF_SIZE) {
+    const double parentArea = surfaceArea(box);
+    for (int axis = 0; axis < 3; ++axis) {
+      const double lo = centerBox.lo[axis], extent = centerBox.hi[axis] - lo;
+      if (extent <= 0)
+        continue;
+
+      Aabb binBox[SAH_BINS];
+      int binCount[SAH_BINS] = {0};
+      for (int k = begin; k < end; ++k) {
+        const int b = min(SAH_BINS - 1, int(SAH_BINS * (centers[items_[k]][axis] - lo) / extent));
+        binBox[b].add(bounds_[items_[k]]);
+        ++binCount[b];
+      }
+
+      // sweep from the right to get the cost of the right side of each split
+      double rightArea[SAH_BINS];
+      int rightCount[SAH_BINS];
+      Aabb acc;
+      int accCount = 0;
+      for (int b = SAH_BINS - 1; b > 0; --b) {
+        acc.add(binBox[b]);
+        accCount += binCount[b];
+        rightArea[b] = surfaceArea(acc);
+        rightCount[b] = accCount;
+      }
+
+      acc = Aabb();
+      accCount = 0;
+      for (int b = 1; b < SAH_BINS; ++b) {
+        acc.add(binBox[b - 1]);
+        accCount += binCount[b - 1];
+        if (accCount == 0 || rightCount[b] == 0)
+          continue;
+        const double cost = TRAVERSAL_COST +
+                            ITEM_COST * (surfaceArea(acc) * accCount + rightArea[b] * rightCount[b]) / parentArea;
+        if (cost < bestCost) {
+          bestCost = cost;
+          bestAxis = axis;
+          bestSplit = b;
+        }
+      }
+    }
+  }
+
+  if (bestAxis < 0 && count > MAX_LEAF_SIZE * 4) {
+    // no split beats a leaf, typically because all the centers coincide; a
+    // leaf this large would make every query linear in it, so halve it
+    bestAxis = -2;
+  }
+
+  if (bestAxis == -1) {
+    nodes_[n].first = begin;
+    nodes_[n].count = count;
+    for (int k = begin; k < end; ++k)
+      leafOf_[items_[k]] = n;
+    return;
+  }
+
+  int mid;
+  if (bestAxis >= 0) {
+    const double lo = centerBox.lo[bestAxis], extent = centerBox.hi[bestAxis] - lo;
+    mid = partition(items_.begin() + begin, items_.begin() + end, [&](int i) {
+      return min(SAH_BINS - 1, int(SAH_BINS * (centers[i][bestAxis] - lo) / extent)) < bestSplit;
+    }) - items_.begin();
+  }
+  else
+    mid = (begin + end) / 2;
+
+  // the two children are adjacent, so both are allocated before recursing
+  const int first = nodes_.size();
+  nodes_[n].first = first;
+  nodes_[n].count = 0;
+  nodes_.resize(first + 2);
+  nodes_[first].parent = nodes_[first + 1].parent = n;
+  buildNode(centers, first, begin, mid);
+  buildNode(centers, first + 1, mid, end);
+}
+
+void Bvh::refitNode(int n) {
+  Node& node = nodes_[n];
+  weightedArea_ -= surfaceArea(node.bounds) * nodeCost(node.count);
+  if (node.count > 0) {
+    node.bounds = Aabb();
+    for (int k = node.first; k < node.first + node.count; ++k)
+      node.bounds.add(bounds_[items_[k]]);
+  }
+  else
+    node.bounds = Aabb(nodes_[node.first].bounds).add(nodes_[node.first + 1].bounds);
+  weightedArea_ += surfaceArea(node.bounds) * nodeCost(node.count);
+}
+
+void Bvh::refit(const vector<Aabb>& bounds) {
+  if (bounds.size() != bounds_.size())
+    throw runtime_error("Bvh::refit: the number of items changed, build again");
+  bounds_ = bounds;
+
+  // children always come after their parent
+  for (int n = nodes_.size() - 1; n >= 0; --n)
+    refitNode(n);
+}
+
+void Bvh::refit(const vector<Aabb>& bounds, const vector<int>& changed) {
+  if (bounds.size() != bounds_.size())
+    throw runtime_error("Bvh::refit: the number of items changed, build again");
+
+  // mark the paths to the root, stopping where an earlier path was marked
+  vector<int> stale;
+  stale_.resize(nodes_.size(), 0);
+  for (size_t k = 0; k < changed.size(); ++k) {
+    const int i = changed[k];
+    bounds_[i] = bounds[i];
+    for (int n = leafOf_[i]; n >= 0 && !stale_[n]; n = nodes_[n].parent) {
+      stale_[n] = 1;
+      stale.push_back(n);
+    }
+  }
+
+  sort(stale.begin(), stale.end());
+  for (int k = stale.size() - 1; k >= 0; --k) {
+    refitNode(stale[k]);
+    stale_[stale[k]] = 0;
+  }
+}
+
+double Bvh::getSahCost() const {
+  const double rootArea = nodes_.empty() ? 0 : surfaceArea(nodes_[0].bounds);
+  return rootArea > 0 ? weightedArea_ / rootArea : 0;
+}
+
+void Bvh::queryBox(const Aabb& box, vector<int>& items) const {
+  items.insert(items.end(), unbounded_.begin(), unbounded_.end());
+  if (nodes_.empty() || box.isEmpty())
+    return;
+
+  vector<int> stack(1, 0);
+  while (!stack.empty()) {
+    const Node& node = nodes_[stack.back()];
+    stack.pop_back();
+    if (!overlaps(node.bounds, box))
+      continue;
+    if (node.count > 0) {
+      for (int k = node.first; k < node.first + node.count; ++k) {
+        if (overlaps(bounds_[items_[k]], box))
+          items.push_back(items_[k]);
+      }
+    }
+    else {
+      stack.push_back(node.first + 1);
+      stack.push_back(node.first);
+    }
+  }
+}
+
+// Appends all items below node n
+void Bvh::collect(int n, vector<int>& items) const {
+  const Node& node = nodes_[n];
+  if (node.count > 0)
+    items.insert(items.end(), items_.begin() + node.first, items_.begin() + node.first + node.count);
+  else {
+    collect(node.first, items);
+    collect(node.first + 1, items);
+  }
+}
+
+void Bvh::queryFrustum(const Frustum& frustum, vector<int>& items) const {
+  items.insert(items.end(), unbounded_.begin(), unbounded_.end());
+  if (nodes_.empty())
+    return;
+
+  vector<int> stack(1, 0);
+  while (!stack.empty()) {
+    const int n = stack.back();
+    const Node& node = nodes_[n];
+    stack.pop_back();
+
+    const Frustum::Result r = frustum.classify(node.bounds);
+    if (r == Frustum::OUTSIDE)
+      continue;
+    if (r == Frustum::INSIDE)
+      collect(n, items);
+    else if (node.count > 0) {
+      for (int k = node.first; k < node.first + node.count; ++k) {
+        if (frustum.classify(bounds_[items_[k]]) != Frustum::OUTSIDE)
+          items.push_back(items_[k]);
+      }
+    }
+    else {
+      stack.push_back(node.first + 1);
+      stack.push_back(node.first);
+    }
+  }
+}
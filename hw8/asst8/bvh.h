@@ -0,0 +1,165 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+#include "cvec.h"
+#include "bounds.h"
+
+//--------------------------------------------------------------------------------
+// Bounding volume hierarchy over a set of boxes
+//
+// The items are the indices into the vector of boxes given to build(). The
+// tree is built top down with the surface area heuristic, evaluated over a
+// fixed number of bins of the box centers along each axis.
+//
+// When boxes move, refit() recomputes the node bounds bottom up without
+// changing the tree. Refitting only the changed items touches the nodes on
+// their paths to the root and nothing else. A refitted tree stays correct but
+// gets looser the further the items move from where they were at build time;
+// getSahCost() can be compared with its value after build() to decide when to
+// build again.
+//
+// Queries report items whose box overlaps a box, a frustum or a ray. The tree
+// does not know what the items are; callers test the items themselves when
+// they need more than a box test. No GL dependency.
+//--------------------------------------------------------------------------------
+
+class Bvh {
+public:
+  Bvh() : weightedArea_(0) {}
+
+  // Builds the tree over 'bounds', replacing any previous one. Items with an
+  // empty box are never reported by queries, items with an infinite box by
+  // all of them. Which items are empty or infinite is fixed until the next
+  // build.
+  void build(const std::vector<Aabb>& bounds);
+
+  void clear();
+
+  int getNumItems() const {
+    return bounds_.size();
+  }
+
+  int getNumNodes() const {
+    return nodes_.size();
+  }
+
+  // Box around all items
+  Aabb getBounds() const {
+    return nodes_.empty() ? Aabb() : nodes_[0].bounds;
+  }
+
+  // Recomputes every node box from 'bounds', which must have as many entries
+  // as at build time. Throws runtime_error otherwise.
+  void refit(const std::vector<Aabb>& bounds);
+
+  // Same, but only along the paths from the items in 'changed' to the root
+  void refit(const std::vector<Aabb>& bounds, const std::vector<int>& changed);
+
+  // Expected cost of a ray query relative to testing one box, under the
+  // surface area heuristic. Kept up to date by refit, so this is O(1).
+  double getSahCost() const;
+
+  // Appends the items whose box overlaps 'box' to 'items'
+  void queryBox(const Aabb& box, std::vector<int>& items) const;
+
+  // Appends the items whose box may intersect 'frustum' to 'items'. Subtrees
+  // inside the frustum are taken whole.
+  void queryFrustum(const Frustum& frustum, std::vector<int>& items) const;
+
+  // Calls hit(item, tEnter) for the items whose box is hit by the ray
+  // origin + t * dir with t in [0, tMax], nearer subtrees first. hit returns
+  // the new tMax: a closest-hit query returns the distance of the hit it
+  // found, so farther boxes are skipped; returning the tMax it was given
+  // visits every box on the ray.
+  // Items with an infinite box are reported first, with tEnter 0.
+  template<typename Hit>
+  void intersectRay(const Cvec3& origin, const Cvec3& dir, double tMax, Hit hit) const;
+
+  // Entry distance of the ray into 'box' if it enters before tMax, else -1
+  static double intersectRayBox(const Cvec3& origin, const Cvec3& invDir, double tMax, const Aabb& box) {
+    double t0 = 0, t1 = tMax;
+    for (int i = 0; i < 3; ++i) {
+      double near = (box.lo[i] - origin[i]) * invDir[i];
+      double far = (box.hi[i] - origin[i]) * invDir[i];
+      if (near > far)
+        std::swap(near, far);
+      t0 = near > t0 ? near : t0; // also skips NaN from 0 * inf
+      t1 = far < t1 ? far : t1;
+      if (t0 > t1)
+        return -1;
+    }
+    return t0;
+  }
+
+private:
+  struct Node {
+    Aabb bounds;
+    int parent;
+    int first;  // first child (the second one follows it), or first item of a leaf
+    int count;  // number of items for a leaf, 0 for an inner node
+  };
+
+  std::vector<Node> nodes_;
+  std::vector<Aabb> bounds_; // of the items, as of the last build or refit
+  std::vector<int> items_;  // item indices, the items of a leaf are contiguous
+  std::vector<int> leafOf_; // leaf node of each item, -1 if not in the tree
+  std::vector<int> unbounded_; // items with infinite boxes, reported by every query
+  std::vector<char> stale_; // scratch for partial refits
+  double weightedArea_;     // sum of node surface areas times their cost
+
+  void buildNode(const std::vector<Cvec3>& centers, int n, int begin, int end);
+  void refitNode(int n);
+  void collect(int n, std::vector<int>& items) const;
+};
+
+template<typename Hit>
+void Bvh::intersectRay(const Cvec3& origin, const Cvec3& dir, double tMax, Hit hit) const {
+  for (size_t k = 0; k < unbounded_.size(); ++k)
+    tMax = std::min(tMax, hit(unbounded_[k], 0.0));
+  if (nodes_.empty())
+    return;
+
+  const Cvec3 invDir(1 / dir[0], 1 / dir[1], 1 / dir[2]);
+  if (intersectRayBox(origin, invDir, tMax, nodes_[0].bounds) < 0)
+    return;
+
+  // nodes whose box the ray enters, with the entry distance
+  std::vector<std::pair<int, double> > stack(1, std::make_pair(0, 0.0));
+  while (!stack.empty()) {
+    const int n = stack.back().first;
+    const double tEnter = stack.back().second;
+    stack.pop_back();
+    if (tEnter > tMax)
+      continue;
+
+    const Node& node = nodes_[n];
+    if (node.count > 0) {
+      for (int k = node.first; k < node.first + node.count; ++k) {
+        const double t = intersectRayBox(origin, invDir, tMax, bounds_[items_[k]]);
+        if (t >= 0)
+          tMax = std::min(tMax, hit(items_[k], t));
+      }
+      continue;
+    }
+
+    const double t0 = intersectRayBox(origin, invDir, tMax, nodes_[node.first].bounds);
+    const double t1 = intersectRayBox(origin, invDir, tMax, nodes_[node.first + 1].bounds);
+    // push the farther child first so the nearer one is visited first
+    if (t0 >= 0 && t1 >= 0) {
+      const bool firstNearer = t0 <= t1;
+      stack.push_back(std::make_pair(node.first + (firstNearer ? 1 : 0), firstNearer ? t1 : t0));
+      stack.push_back(std::make_pair(node.first + (firstNearer ? 0 : 1), firstNearer ? t0 : t1));
+    }
+    else if (t0 >= 0)
+      stack.push_back(std::make_pair(node.first, t0));
+    else if (t1 >= 0)
+      stack.push_back(std::make_pair(node.first + 1, t1));
+  }
+}
+
+#endif
@@ -5,6 +5,7 @@
 
 #include "uniforms.h"
 #include "scenegraph.h"
+#include "renderqueue.h"
 #include "asstcommon.h"
 
 class Drawer : public SgNodeVisitor {
@@ -42,6 +43,34 @@ public:
   }
 };
 
+// Like Drawer, but collects the shapes into a RenderQueue to be submitted later
+class QueueDrawer : public SgNodeVisitor {
+protected:
+  std::vector<RigTForm> rbtStack_;
+  RenderQueue& queue_;
+public:
+  QueueDrawer(const RigTForm& initialRbt, RenderQueue& queue)
+    : rbtStack_(1, initialRbt)
+    , queue_(queue) {}
+
+  using SgNodeVisitor::postVisit;
+
+  virtual bool visit(SgTransformNode& node) {
+    rbtStack_.push_back(rbtStack_.back() * node.getRbt());
+    return true;
+  }
+
+  virtual bool postVisit(SgTransformNode& node) {
+    rbtStack_.pop_back();
+    return true;
+  }
+
+  virtual bool visit(SgShapeNode& shapeNode) {
+    shapeNode.enqueue(queue_, rigTFormToMatrix(rbtStack_.back()) * shapeNode.getAffineMatrix());
+    return true;
+  }
+};
+
 #endif
 
 
@@ -0,0 +1,275 @@
+#include <algorithm>
+
+#include "flatscene.h"
+
+using namespace std;
+
+// Parallel update() hands subtrees of more nodes than this to their own task
+static const int UPDATE_GRAIN = 2048;
+
+// update() marks the dirty nodes in a pass over all of them, instead of
+// sorting them, once more than 1 in this many are dirty
+static const int DENSE_DIRTY_RATIO = 16;
+
+// Parallel enqueue() gives each task at least this many shapes
+static const int ENQUEUE_GRAIN = 256;
+
+// Appends the nodes of a scene graph to a FlatScene in the order they are visited
+class FlatScene::Builder : public SgNodeVisitor {
+  FlatScene& scene_;
+  vector<int> indexStack_;
+public:
+  Builder(FlatScene& scene)
+    : scene_(scene) {}
+
+  using SgNodeVisitor::postVisit;
+
+  virtual bool visit(SgTransformNode& node) {
+    const int i = scene_.addNode(indexStack_.empty() ? -1 : indexStack_.back(), node.getRbt());
+    scene_.sources_.push_back(&node);
+    node.setRbtChangeLog(scene_.changeLog_, i);
+    scene_.indexOf_[&node] = i;
+    indexStack_.push_back(i);
+    return true;
+  }
+
+  virtual bool postVisit(SgTransformNode& node) {
+    indexStack_.pop_back();
+    return true;
+  }
+
+  virtual bool visit(SgShapeNode& node) {
+    if (indexStack_.empty())
+      throw runtime_error("FlatScene needs a transform node above every shape node");
+    ShapeEntry e;
+    e.transform = indexStack_.back();
+    e.node = static_pointer_cast<SgShapeNode>(node.shared_from_this());
+    scene_.shapes_.push_back(e);
+    return true;
+  }
+};
+
+void FlatScene::build(shared_ptr<SgNode> root) {
+  clear();
+  changeLog_.reset(new SgRbtChangeLog());
+  Builder builder(*this);
+  traverse(*root, builder);
+
+  stable_sort(shapes_.begin(), shapes_.end(), [](const ShapeEntry& a, const ShapeEntry& b) {
+    return a.transform < b.transform;
+  });
+  shapeStart_.assign(getNumNodes() + 1, 0);
+  for (size_t k = 0; k < shapes_.size(); ++k)
+    ++shapeStart_[shapes_[k].transform + 1];
+  for (int i = 0; i < getNumNodes(); ++i)
+    shapeStart_[i + 1] += shapeStart_[i];
+
+  update();
+}
+
+void FlatScene::clear() {
+  parent_.clear();
+  subtreeEnd_.clear();
+  local_.clear();
+  world_.clear();
+  dirtyRoots_.clear();
+  lastUpdatedRoots_.clear();
+  sources_.clear();
+  closeChangeLog();
+  shapes_.clear();
+  indexOf_.clear();
+  shapeStart_.assign(1, 0);
+}
+
+int FlatScene::addNode(int parent, const RigTForm& localRbt) {
+  const int i = parent_.size();
+
+  // every ancestor of the new node must be on the path to the last added one
+  if (parent >= 0) {
+    int a = i - 1;
+    while (a >= 0 && a != parent)
+      a = parent_[a];
+    if (a < 0)
+      throw runtime_error("FlatScene::addNode: parent is not on the current path");
+  }
+
+  parent_.push_back(parent);
+  subtreeEnd_.push_back(i + 1);
+  local_.push_back(localRbt);
+  world_.push_back(parent >= 0 ? world_[parent] * localRbt : localRbt);
+
+  for (int a = parent; a >= 0; a = parent_[a])
+    subtreeEnd_[a] = i + 1;
+  shapeStart_.push_back(shapes_.size());
+  return i;
+}
+
+int FlatScene::update(WorkStealingPool* pool) {
+  lastUpdatedRoots_.clear();
+  if (dirtyRoots_.empty())
+    return 0;
+
+  // after sorting, a dirty node inside an already recomputed range is skipped
+  const int n = getNumNodes();
+  if (int(dirtyRoots_.size()) > n / DENSE_DIRTY_RATIO) {
+    // as when every node of an animated scene was set, which takes longer to
+    // sort than the frames take to compute; the marks give the same order
+    // without the nested roots
+    dirtyMarks_.assign(n, 0);
+    for (size_t k = 0; k < dirtyRoots_.size(); ++k)
+      dirtyMarks_[dirtyRoots_[k]] = 1;
+    dirtyRoots_.clear();
+    for (int i = 0; i < n;) {
+      if (dirtyMarks_[i]) {
+        dirtyRoots_.push_back(i);
+        i = subtreeEnd_[i];
+      }
+      else
+        ++i;
+    }
+  }
+  else
+    sort(dirtyRoots_.begin(), dirtyRoots_.end());
+
+  int numUpdated = 0, done = 0;
+  for (size_t k = 0; k < dirtyRoots_.size(); ++k) {
+    const int r = dirtyRoots_[k];
+    if (r < done)
+      continue;
+    const int end = subtreeEnd_[r];
+    if (pool && end - r > UPDATE_GRAIN) {
+      // the dirty subtrees are disjoint, so each can go to a task
+      pool->submit([this, r, pool]() {
+        updateSubtree(r, *pool);
+      });
+    }
+    else {
+      for (int i = r; i < end; ++i) {
+        const int p = parent_[i];
+        world_[i] = p >= 0 ? world_[p] * local_[i] : local_[i];
+      }
+    }
+    numUpdated += end - r;
+    done = end;
+    lastUpdatedRoots_.push_back(r);
+  }
+  dirtyRoots_.clear();
+  if (pool)
+    pool->wait();
+  return numUpdated;
+}
+
+void FlatScene::updateSubtree(int r, WorkStealingPool& pool) {
+  const int end = subtreeEnd_[r];
+  for (int i = r; i < end;) {
+    // A large subtree gets its own task once its parent's frame is done, unless
+    // it is most of what is left, as in a long chain, where the task would
+    // only hand the work on
+    const int size = subtreeEnd_[i] - i;
+    if (i != r && size > UPDATE_GRAIN && size < end - i - UPDATE_GRAIN) {
+      pool.submit([this, i, &pool]() {
+        updateSubtree(i, pool);
+      });
+      i += size;
+      continue;
+    }
+    const int p = parent_[i];
+    world_[i] = p >= 0 ? world_[p] * local_[i] : local_[i];
+    ++i;
+  }
+}
+
+int FlatScene::findNode(const SgTransformNode& node) const {
+  unordered_map<const SgNode*, int>::const_iterator it = indexOf_.find(&node);
+  return it == indexOf_.end() ? -1 : it->second;
+}
+
+void FlatScene::closeChangeLog() {
+  // the nodes may be gone already, so they are not told one by one
+  if (changeLog_) {
+    changeLog_->open = false;
+    changeLog_.reset();
+  }
+}
+
+int FlatScene::pullLocalRbts() {
+  if (!changeLog_)
+    return 0;
+  const vector<SgRbtChangeLog::Entry>& entries = changeLog_->entries;
+  const int numChanged = entries.size();
+  for (int k = 0; k < numChanged; ++k)
+    setLocalRbt(entries[k].index, entries[k].rbt);
+  changeLog_->clear();
+  return numChanged;
+}
+
+void FlatScene::cull(const Frustum& frustum, vector<int>& visibleShapes, CullStats* stats) {
+  visibleShapes.clear();
+  CullStats s;
+  const bool haveBounds = sources_.size() == parent_.size();
+
+  for (int i = 0, n = getNumNodes(); i < n;) {
+    const int end = subtreeEnd_[i];
+    const Frustum::Result r = haveBounds ? frustum.classify(world_[i], sources_[i]->getBounds()) : Frustum::INTERSECTING;
+
+    if (r == Frustum::OUTSIDE) {
+      s.nodesCulled += end - i;
+      s.shapesCulled += shapeStart_[end] - shapeStart_[i];
+      i = end;
+    }
+    else if (r == Frustum::INSIDE) {
+      s.nodesVisited += end - i;
+      for (int k = shapeStart_[i]; k < shapeStart_[end]; ++k)
+        visibleShapes.push_back(k);
+      i = end;
+    }
+    else {
+      // only the shapes of this node; the children get their own test
+      ++s.nodesVisited;
+      for (int k = shapeStart_[i]; k < shapeStart_[i + 1]; ++k) {
+        if (frustum.classify(world_[i], shapes_[k].node->getBounds()) == Frustum::OUTSIDE)
+          ++s.shapesCulled;
+        else
+          visibleShapes.push_back(k);
+      }
+      ++i;
+    }
+  }
+
+  s.shapesDrawn = visibleShapes.size();
+  if (stats)
+    *stats = s;
+}
+
+void FlatScene::enqueueShapes(const RigTForm& invEyeRbt, RenderQueue& queue, const int* shapes, int begin, int end) const {
+  for (int k = begin; k < end; ++k) {
+    const ShapeEntry& e = shapes_[shapes ? shapes[k] : k];
+    e.node->enqueue(queue, rigTFormToMatrix(invEyeRbt * world_[e.transform]) * e.node->getAffineMatrix());
+  }
+}
+
+void FlatScene::enqueueShapes(const RigTForm& invEyeRbt, RenderQueue& queue, const int* shapes, int count, WorkStealingPool* pool) {
+  // a few chunks per thread, so threads that finish early can steal the rest
+  const int numChunks = pool ? min(count / ENQUEUE_GRAIN, 4 * (pool->getNumThreads() + 1)) : 1;
+  if (numChunks <= 1) {
+    enqueueShapes(invEyeRbt, queue, shapes, 0, count);
+    return;
+  }
+
+  if (int(chunkQueues_.size()) < numChunks)
+    chunkQueues_.resize(numChunks);
+  for (int c = 0; c < numChunks; ++c) {
+    const int begin = int((long long)count * c / numChunks);
+    const int end = int((long long)count * (c + 1) / numChunks);
+    RenderQueue& chunk = chunkQueues_[c];
+    pool->submit([this, &invEyeRbt, &chunk, shapes, begin, end]() {
+      enqueueShapes(invEyeRbt, chunk, shapes, begin, end);
+    });
+  }
+  pool->wait();
+
+  for (int c = 0; c < numChunks; ++c) {
+    queue.append(chunkQueues_[c]);
+    chunkQueues_[c].clear();
+  }
+}
@@ -0,0 +1,238 @@
+#ifndef FLATSCENE_H
+#define FLATSCENE_H
+
+#include <vector>
+#include <memory>
+#include <unordered_map>
+
+#include "rigtform.h"
+#include "bounds.h"
+#include "uniforms.h"
+#include "scenegraph.h"
+#include "renderqueue.h"
+#include "threadpool.h"
+#include "asstcommon.h"
+
+//--------------------------------------------------------------------------------
+// Flattened copy of the transform hierarchy of a scene graph
+//
+// Transform nodes are stored in depth-first order, so every node comes after
+// its parent and a subtree is the contiguous index range [i, getSubtreeEnd(i)).
+// Local and world frames live in two contiguous RigTForm arrays, and world[i] is
+// world[parent(i)] * local[i].
+//
+// Changing a local frame only marks the node dirty. update() then recomputes
+// the world frames of the dirty subtrees, each with one linear pass over its
+// range, and leaves the rest of the scene untouched.
+//
+// A FlatScene can be filled by hand with addNode, or built from a scene graph.
+// In the latter case it keeps pointers to the scene graph nodes it was built
+// from, so draw() can render the shape nodes, and the transform nodes report
+// their frame changes (SgRbtNode::setRbt) to its SgRbtChangeLog, from which
+// pullLocalRbts() marks just the changed nodes dirty. A node reports to the
+// last FlatScene built from it. The FlatScene does not follow structural
+// changes of the graph and does not keep its transform nodes alive; build it
+// again after adding or removing nodes.
+//
+// What this saves is the work on nodes that keep their frames. When every node
+// changes every frame, logging the frames and pulling them in costs about what
+// update() saves over the recursive walk, so the two are on par; scenebench
+// measures both cases.
+//
+// Shapes are kept sorted by the transform node they hang from, so the shapes
+// of a subtree are a contiguous range as well. cull() uses that together with
+// the subtree bounds cached by the scene graph (SgNode::getBounds) to skip
+// whole subtrees that are outside the view frustum.
+//
+// update() and enqueue() optionally run on a WorkStealingPool. update() then
+// hands large subtrees to tasks, which split off their own large subtrees in
+// turn, and enqueue() fills one RenderQueue per chunk of shapes in parallel
+// and appends them to the destination queue in order, so the result is the
+// same as without a pool. Both wait for the pool, so they must not be called
+// from one of its tasks. cull() always runs on the calling thread, since it
+// fills the bounds cache of the scene graph.
+//--------------------------------------------------------------------------------
+
+class FlatScene : Noncopyable {
+public:
+  FlatScene() : shapeStart_(1, 0) {}
+
+  // Builds from the transform and shape nodes below 'root', replacing any
+  // previous content
+  explicit FlatScene(std::shared_ptr<SgNode> root) {
+    build(root);
+  }
+
+  ~FlatScene() {
+    closeChangeLog();
+  }
+
+  void build(std::shared_ptr<SgNode> root);
+  void clear();
+
+  // Appends a node with the given parent (-1 for a root) and returns its index.
+  // To keep the depth-first order, 'parent' must be the last added node or one
+  // of its ancestors.
+  int addNode(int parent, const RigTForm& localRbt);
+
+  int getNumNodes() const {
+    return parent_.size();
+  }
+
+  int getParent(int i) const {
+    return parent_[i];
+  }
+
+  // One past the last index of the subtree rooted at i
+  int getSubtreeEnd(int i) const {
+    return subtreeEnd_[i];
+  }
+
+  const RigTForm& getLocalRbt(int i) const {
+    return local_[i];
+  }
+
+  void setLocalRbt(int i, const RigTForm& rbt) {
+    local_[i] = rbt;
+    dirtyRoots_.push_back(i);
+  }
+
+  // World frame as of the last update()
+  const RigTForm& getWorldRbt(int i) const {
+    return world_[i];
+  }
+
+  bool needsUpdate() const {
+    return !dirtyRoots_.empty();
+  }
+
+  // Recomputes the world frames of all dirty subtrees, in parallel on 'pool'
+  // if given. Returns the number of nodes recomputed.
+  int update(WorkStealingPool* pool = NULL);
+
+  // Roots of the subtrees recomputed by the last update(), in increasing
+  // order and without nesting
+  const std::vector<int>& getLastUpdatedRoots() const {
+    return lastUpdatedRoots_;
+  }
+
+  // Scene graph node that node i was built from, or NULL if it was added with
+  // addNode
+  std::shared_ptr<SgTransformNode> getSourceNode(int i) const {
+    SgTransformNode* node = getSourceNodePtr(i);
+    return node ? std::static_pointer_cast<SgTransformNode>(node->shared_from_this()) : std::shared_ptr<SgTransformNode>();
+  }
+
+  // Same without taking a reference, for walks over many nodes
+  SgTransformNode* getSourceNodePtr(int i) const {
+    return i < int(sources_.size()) ? sources_[i] : NULL;
+  }
+
+  // Index of the node built from 'node', or -1 if there is none
+  int findNode(const SgTransformNode& node) const;
+
+  int getNumShapes() const {
+    return shapes_.size();
+  }
+
+  std::shared_ptr<SgShapeNode> getShapeNode(int k) const {
+    return shapes_[k].node;
+  }
+
+  // Index of the transform node shape k hangs from
+  int getShapeTransform(int k) const {
+    return shapes_[k].transform;
+  }
+
+  // Box around shape k in world coordinates, as of the last update()
+  Aabb getShapeWorldBounds(int k) const {
+    return transformBounds(world_[shapes_[k].transform], shapes_[k].node->getBounds());
+  }
+
+  // The shapes of the subtree rooted at node i are [getSubtreeShapesBegin(i),
+  // getSubtreeShapesEnd(i))
+  int getSubtreeShapesBegin(int i) const {
+    return shapeStart_[i];
+  }
+
+  int getSubtreeShapesEnd(int i) const {
+    return shapeStart_[subtreeEnd_[i]];
+  }
+
+  // Takes the frames the scene graph nodes this was built from reported since
+  // the last call and marks their nodes dirty, in O(number of nodes changed).
+  // Returns that number; a node set twice counts once.
+  int pullLocalRbts();
+
+  // Adds all shape nodes to 'queue' with the world frames as of the last
+  // update(), the same way QueueDrawer does. The shapes' enqueue() and
+  // getAffineMatrix() are called from the threads of 'pool' if given.
+  void enqueue(const RigTForm& invEyeRbt, RenderQueue& queue, WorkStealingPool* pool = NULL) {
+    enqueueShapes(invEyeRbt, queue, NULL, shapes_.size(), pool);
+  }
+
+  // Collects the indices of the shapes whose bounds may intersect 'frustum',
+  // given in world coordinates, and optionally what was culled. A subtree
+  // whose bounding sphere is outside is skipped without looking at the nodes
+  // in it; one that is inside has all its shapes collected without further
+  // tests. Needs a FlatScene built from a scene graph; nodes added with
+  // addNode are never culled.
+  void cull(const Frustum& frustum, std::vector<int>& visibleShapes, CullStats* stats = NULL);
+
+  // Same as enqueue above, but only with the shapes cull() lets through
+  void enqueue(const RigTForm& invEyeRbt, RenderQueue& queue, const Frustum& frustum, CullStats* stats = NULL,
+               WorkStealingPool* pool = NULL) {
+    cull(frustum, visibleShapes_, stats);
+    enqueueShapes(invEyeRbt, queue, visibleShapes_.data(), visibleShapes_.size(), pool);
+  }
+
+  // Draws all shape nodes with the world frames as of the last update(), the
+  // same way Drawer does
+  void draw(const RigTForm& invEyeRbt, Uniforms& uniforms) {
+    for (size_t k = 0; k < shapes_.size(); ++k) {
+      SgShapeNode& shapeNode = *shapes_[k].node;
+      const Matrix4 MVM = rigTFormToMatrix(invEyeRbt * world_[shapes_[k].transform]) * shapeNode.getAffineMatrix();
+      sendModelViewNormalMatrix(uniforms, MVM, normalMatrix(MVM));
+      shapeNode.draw(uniforms);
+    }
+  }
+
+private:
+  struct ShapeEntry {
+    int transform; // index of the transform node the shape hangs from
+    std::shared_ptr<SgShapeNode> node;
+  };
+
+  class Builder;
+
+  // Tells the nodes still writing to changeLog_ to stop, and lets go of it
+  void closeChangeLog();
+
+  // World frames of the subtree rooted at r, whose parent's frame is up to
+  // date. Large subtrees below r are submitted to 'pool' as tasks of their own.
+  void updateSubtree(int r, WorkStealingPool& pool);
+
+  // Enqueues shapes_[shapes[k]], or shapes_[k] if 'shapes' is NULL, for k in
+  // [begin, end)
+  void enqueueShapes(const RigTForm& invEyeRbt, RenderQueue& queue, const int* shapes, int begin, int end) const;
+  void enqueueShapes(const RigTForm& invEyeRbt, RenderQueue& queue, const int* shapes, int count, WorkStealingPool* pool);
+
+  std::vector<int> parent_, subtreeEnd_;
+  std::vector<RigTForm> local_, world_;
+  std::vector<int> dirtyRoots_;
+  std::vector<char> dirtyMarks_; // scratch for update with many dirty nodes
+  std::vector<int> lastUpdatedRoots_;
+
+  // only filled when built from a scene graph
+  std::vector<SgTransformNode*> sources_;
+  std::shared_ptr<SgRbtChangeLog> changeLog_;
+  std::vector<ShapeEntry> shapes_;
+  std::unordered_map<const SgNode*, int> indexOf_;
+
+  // the shapes of node i are shapes_[shapeStart_[i] .. shapeStart_[i + 1])
+  std::vector<int> shapeStart_;
+  std::vector<int> visibleShapes_; // scratch for enqueue with culling
+  std::vector<RenderQueue> chunkQueues_; // per chunk draws of a parallel enqueue, kept for their capacity
+};
+
+#endif
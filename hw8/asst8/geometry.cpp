@@ -6,6 +6,8 @@
 
 using namespace std;
 
+long long g_bufferBytesUploaded = 0;
+
 const VertexFormat VertexPN::FORMAT = VertexFormat(sizeof(VertexPN))
                                       .put("aPosition", 3, GL_FLOAT, GL_FALSE, offsetof(VertexPN, p))
                                       .put("aNormal", 3, GL_FLOAT, GL_FALSE, offsetof(VertexPN, n));
@@ -80,11 +82,10 @@ const vector<string>& BufferObjectGeometry::getVertexAttribNames() {
   return vertexAttribNames_;
 }
 
-void BufferObjectGeometry::draw(int attribIndices[]) {
+unsigned int BufferObjectGeometry::bindVertexBuffers(int attribIndices[]) {
   if (wiringChanged_)
     processWiring();
 
-  const unsigned int UNDEFINED_VB_LEN = 0xFFFFFFFF;
   unsigned int vboLen = UNDEFINED_VB_LEN;
 
   // bind the vertex buffer and set vertex attribute pointers
@@ -99,9 +100,14 @@ void BufferObjectGeometry::draw(int attribIndices[]) {
     for (size_t j = 0; j < pvw.vb2GeoIdx.size(); ++j) {
       int loc = attribIndices[pvw.vb2GeoIdx[j].second];
       if (loc >= 0)
-        vfd.setGlVertexAttribPointer(pvw.vb2GeoIdx[j].first, loc);
+        vfd.setGlVertexAttribPointer(pvw.vb2GeoIdx[j].first, loc, pvw.vb->getByteOffset());
     }
   }
+  return vboLen;
+}
+
+void BufferObjectGeometry::draw(int attribIndices[]) {
+  const unsigned int vboLen = bindVertexBuffers(attribIndices);
 
   if (isIndexed()) {
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, *ib_);
@@ -112,6 +118,25 @@ void BufferObjectGeometry::draw(int attribIndices[]) {
   }
 }
 
+void BufferObjectGeometry::drawInstanced(int attribIndices[], int instanceCount) {
+  const unsigned int vboLen = bindVertexBuffers(attribIndices);
+  const bool core = GLEW_VERSION_3_1;
+
+  if (isIndexed()) {
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, *ib_);
+    if (core)
+      glDrawElementsInstanced(primitiveType_, ib_->length(), ib_->getIndexFormat(), 0, instanceCount);
+    else
+      glDrawElementsInstancedARB(primitiveType_, ib_->length(), ib_->getIndexFormat(), 0, instanceCount);
+  }
+  else if (vboLen != UNDEFINED_VB_LEN) {
+    if (core)
+      glDrawArraysInstanced(primitiveType_, 0, vboLen, instanceCount);
+    else
+      glDrawArraysInstancedARB(primitiveType_, 0, vboLen, instanceCount);
+  }
+}
+
 void BufferObjectGeometry::processWiring() {
   perVbWirings_.clear();
   vertexAttribNames_.clear();
@@ -143,3 +168,230 @@ void BufferObjectGeometry::processWiring() {
   }
   wiringChanged_ = false;
 }
+
+StreamingVbo::StreamingVbo(const VertexFormat& formatDesc, int numRegions, Mode mode)
+  : FormattedVbo(formatDesc)
+  , mode_(UNINITIALIZED)
+  , requestedMode_(mode)
+  , useFences_(false)
+  , numRegions_(max(numRegions, 2))
+  , capacity_(0)
+  , head_(0)
+  , writeOffset_(0)
+  , writeSize_(0)
+  , mapped_(NULL) {}
+
+StreamingVbo::~StreamingVbo() {
+  // the mapping (if any) goes away together with the buffer object
+  releaseFences();
+}
+
+bool StreamingVbo::isSupported(Mode mode) {
+  const bool hasFences = GLEW_VERSION_3_2 || GLEW_ARB_sync;
+  switch (mode) {
+  case PERSISTENT_MAPPED:
+    // without fences we could not tell when a region may be written again
+    return hasFences && (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage);
+  case MAPPED_RANGE:
+    return GLEW_VERSION_3_0 || GLEW_ARB_map_buffer_range;
+  case BUFFER_SUB_DATA:
+    return true;
+  default:
+    return false;
+  }
+}
+
+void StreamingVbo::chooseMode() {
+  useFences_ = GLEW_VERSION_3_2 || GLEW_ARB_sync;
+  if (requestedMode_ != UNINITIALIZED) {
+    if (!isSupported(requestedMode_))
+      throw runtime_error("StreamingVbo: the requested upload mode is not supported by the GL context");
+    mode_ = requestedMode_;
+  }
+  else if (isSupported(PERSISTENT_MAPPED))
+    mode_ = PERSISTENT_MAPPED;
+  else if (isSupported(MAPPED_RANGE))
+    mode_ = MAPPED_RANGE;
+  else
+    mode_ = BUFFER_SUB_DATA;
+}
+
+void StreamingVbo::reserve(int capacity) {
+  // Whatever is in flight keeps referencing the old store, which GL frees once
+  // it is no longer used. Our fences only guard regions of the old store.
+  releaseFences();
+  capacity_ = capacity;
+  head_ = 0;
+  writeSize_ = 0;
+
+  if (mode_ == PERSISTENT_MAPPED) {
+    // buffer storage is immutable, so growing requires a new buffer object
+    glDeleteBuffers(1, &handle_);
+    glGenBuffers(1, &handle_);
+    glBindBuffer(GL_ARRAY_BUFFER, handle_);
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glBufferStorage(GL_ARRAY_BUFFER, capacity_, NULL, flags);
+    mapped_ = glMapBufferRange(GL_ARRAY_BUFFER, 0, capacity_, flags);
+    if (mapped_ == NULL)
+      throw runtime_error("StreamingVbo: cannot persistently map the buffer store");
+  }
+  else {
+    glBindBuffer(GL_ARRAY_BUFFER, handle_);
+    glBufferData(GL_ARRAY_BUFFER, capacity_, NULL, GL_STREAM_DRAW);
+  }
+  checkGlErrors();
+}
+
+void StreamingVbo::fenceLastWrite() {
+  // Every draw that reads the previous region has been submitted by now (the
+  // region stays current until this upload), so a fence placed here retires it
+  if (useFences_ && writeSize_ > 0) {
+    Fence f = { writeOffset_, writeOffset_ + writeSize_, glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0) };
+    fences_.push_back(f);
+  }
+}
+
+void StreamingVbo::waitForRange(int begin, int end) {
+  // Fences signal in submission order, so waiting for the newest fence that
+  // guards [begin, end) also retires every older one
+  int last = -1;
+  for (int i = 0, n = fences_.size(); i < n; ++i) {
+    if (fences_[i].begin < end && begin < fences_[i].end)
+      last = i;
+  }
+  if (last < 0)
+    return;
+
+  static const GLuint64 ONE_SECOND = 1000000000;
+  GLenum r;
+  do {
+    r = glClientWaitSync(fences_[last].sync, GL_SYNC_FLUSH_COMMANDS_BIT, ONE_SECOND);
+  } while (r == GL_TIMEOUT_EXPIRED);
+  if (r == GL_WAIT_FAILED)
+    throw runtime_error("StreamingVbo: glClientWaitSync failed");
+
+  for (int i = 0; i <= last; ++i) {
+    glDeleteSync(fences_.front().sync);
+    fences_.pop_front();
+  }
+}
+
+void StreamingVbo::releaseFences() {
+  for (size_t i = 0; i < fences_.size(); ++i)
+    glDeleteSync(fences_[i].sync);
+  fences_.clear();
+}
+
+void* StreamingVbo::beginWrite(int size) {
+  if (mode_ == UNINITIALIZED)
+    chooseMode();
+
+  if (size > capacity_)
+    reserve(max(size * numRegions_, capacity_ * 2));
+  else
+    fenceLastWrite();
+
+  int offset = head_;
+  if (offset + size > capacity_) {
+    offset = 0;
+    if (!useFences_) {
+      // we cannot tell when the GPU is done with the old regions, so hand the
+      // whole store back to the driver and start from a fresh one
+      glBindBuffer(GL_ARRAY_BUFFER, handle_);
+      glBufferData(GL_ARRAY_BUFFER, capacity_, NULL, GL_STREAM_DRAW);
+    }
+  }
+  if (useFences_)
+    waitForRange(offset, offset + size);
+
+  writeOffset_ = offset;
+  writeSize_ = size;
+
+  switch (mode_) {
+  case PERSISTENT_MAPPED:
+    return static_cast<char*>(mapped_) + offset;
+  case MAPPED_RANGE:
+    {
+      if (size == 0)
+        return NULL;
+      glBindBuffer(GL_ARRAY_BUFFER, handle_);
+      void* p = glMapBufferRange(GL_ARRAY_BUFFER, offset, size,
+                                 GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+      if (p == NULL)
+        throw runtime_error("StreamingVbo: glMapBufferRange failed");
+      return p;
+    }
+  default:
+    staging_.resize(size);
+    return staging_.empty() ? NULL : &staging_[0];
+  }
+}
+
+void StreamingVbo::endWrite(int length) {
+  if (writeSize_ > 0) {
+    if (mode_ == MAPPED_RANGE) {
+      glBindBuffer(GL_ARRAY_BUFFER, handle_);
+      glUnmapBuffer(GL_ARRAY_BUFFER);
+    }
+    else if (mode_ == BUFFER_SUB_DATA) {
+      glBindBuffer(GL_ARRAY_BUFFER, handle_);
+      glBufferSubData(GL_ARRAY_BUFFER, writeOffset_, writeSize_, &staging_[0]);
+    }
+  }
+  head_ = writeOffset_ + writeSize_;
+  setRange(writeOffset_, length);
+  g_bufferBytesUploaded += writeSize_;
+#ifndef NDEBUG
+  checkGlErrors();
+#endif
+}
+
+bool isInstancingSupported() {
+  return GLEW_VERSION_3_3 || ((GLEW_VERSION_3_1 || GLEW_ARB_draw_instanced) && GLEW_ARB_instanced_arrays);
+}
+
+static void setVertexAttribDivisor(GLuint index, GLuint divisor) {
+  if (GLEW_VERSION_3_3)
+    glVertexAttribDivisor(index, divisor);
+  else
+    glVertexAttribDivisorARB(index, divisor);
+}
+
+void InstanceVbo::upload(const InstanceMatrices* instances, int length) {
+  glBindBuffer(GL_ARRAY_BUFFER, handle_);
+  glBufferData(GL_ARRAY_BUFFER, length * sizeof(InstanceMatrices), NULL, GL_STREAM_DRAW);
+  glBufferSubData(GL_ARRAY_BUFFER, 0, length * sizeof(InstanceMatrices), instances);
+  length_ = length;
+  g_bufferBytesUploaded += length * sizeof(InstanceMatrices);
+  checkGlErrors();
+}
+
+void InstanceVbo::enableAttribs(int modelViewLocation, int normalLocation) const {
+  glBindBuffer(GL_ARRAY_BUFFER, handle_);
+  const int locations[2] = {modelViewLocation, normalLocation};
+  const size_t offsets[2] = {offsetof(InstanceMatrices, modelView), offsetof(InstanceMatrices, normal)};
+  for (int m = 0; m < 2; ++m) {
+    if (locations[m] < 0)
+      continue;
+    // a mat4 attribute takes four consecutive locations, one per column
+    for (int col = 0; col < 4; ++col) {
+      const GLuint loc = locations[m] + col;
+      glEnableVertexAttribArray(loc);
+      glVertexAttribPointer(loc, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceMatrices),
+                            reinterpret_cast<const GLvoid*>(offsets[m] + col * 4 * sizeof(GLfloat)));
+      setVertexAttribDivisor(loc, 1);
+    }
+  }
+}
+
+void InstanceVbo::disableAttribs(int modelViewLocation, int normalLocation) const {
+  const int locations[2] = {modelViewLocation, normalLocation};
+  for (int m = 0; m < 2; ++m) {
+    if (locations[m] < 0)
+      continue;
+    for (int col = 0; col < 4; ++col) {
+      setVertexAttribDivisor(locations[m] + col, 0);
+      glDisableVertexAttribArray(locations[m] + col);
+    }
+  }
+}
@@ -2,17 +2,25 @@
 #define GEOMETRY_H
 
 #include <vector>
+#include <deque>
 #include <cassert>
+#include <cstring>
 #include <map>
 #include <cmath>
 #include <string>
 #include <stdexcept>
 #include <memory>
+#include <functional>
 
 #include "cvec.h"
+#include "matrix4.h"
+#include "bounds.h"
+#include "raycast.h"
 #include "glsupport.h"
 #include "geometrymaker.h"
 
+class CpuVertexArray;
+
 // An abstract class that encapsulates geometry data that provides vertex attributes and
 // know how to draw itself.
 class Geometry {
@@ -26,7 +34,93 @@ public:
   // not used. The caller is responsible for enable/disable vertex attribute arrays.
   virtual void draw(int attribIndices[]) = 0;
 
+  // Whether drawInstanced is implemented
+  virtual bool supportsInstancing() {
+    return false;
+  }
+
+  // Same as draw, but draws 'instanceCount' instances in one call. Per-instance
+  // attributes are set up by the caller.
+  virtual void drawInstanced(int attribIndices[], int instanceCount) {
+    throw std::runtime_error("Geometry::drawInstanced: not supported by this geometry");
+  }
+
+  // Box around the vertex positions, Aabb::infinite() if unknown. The Simple*
+  // geometries below update it on every upload.
+  const Aabb& getBounds() const {
+    return bounds_;
+  }
+
+  void setBounds(const Aabb& bounds) {
+    bounds_ = bounds;
+  }
+
+  // CPU copy of the triangles for ray queries, or NULL if the geometry keeps
+  // none. The Simple* geometries below make theirs on the first call after an
+  // upload; all but the streaming one read it back from their buffers, so the
+  // GL context must be current.
+  virtual RayMesh* getRayMesh() {
+    return NULL;
+  }
+
+  // CPU copy of the vertices for drawing without GL, or NULL if the geometry
+  // keeps none. Made the same way as the ray mesh, so only SoftRenderer users
+  // pay for it.
+  virtual const CpuVertexArray* getCpuVertexArray() {
+    return NULL;
+  }
+
   virtual ~Geometry() {}
+
+protected:
+  Geometry() : bounds_(Aabb::infinite()) {}
+
+private:
+  Aabb bounds_;
+};
+
+// Bytes handed to GL by the uploads of the buffer classes below so far, for
+// the frame statistics of the profiler
+extern long long g_bufferBytesUploaded;
+
+// Whether the GL context can draw instanced with per-instance attributes
+// (GL 3.3, or the ARB_draw_instanced and ARB_instanced_arrays extensions)
+bool isInstancingSupported();
+
+// Per-instance model view and normal matrices, stored column-major as read by
+// the aModelViewMatrix and aNormalMatrix attributes of the *-instanced shaders
+struct InstanceMatrices {
+  GLfloat modelView[16];
+  GLfloat normal[16];
+
+  InstanceMatrices() {}
+
+  InstanceMatrices(const Matrix4& MVM, const Matrix4& NMVM) {
+    MVM.writeToColumnMajorMatrix(modelView);
+    NMVM.writeToColumnMajorMatrix(normal);
+  }
+};
+
+// Buffer of InstanceMatrices, refilled every frame
+class InstanceVbo : public GlBufferObject {
+  int length_;
+
+public:
+  InstanceVbo() : length_(0) {}
+
+  int length() const {
+    return length_;
+  }
+
+  // Replaces the content, orphaning the previous storage
+  void upload(const InstanceMatrices* instances, int length);
+
+  // Points the four column attributes of each matrix at this buffer, advancing
+  // once per instance, and enables them. A location of -1 is skipped.
+  void enableAttribs(int modelViewLocation, int normalLocation) const;
+
+  // Undoes enableAttribs
+  void disableAttribs(int modelViewLocation, int normalLocation) const;
 };
 
 
@@ -98,11 +192,12 @@ public:
 
   // Calls glVertexAttribPointer with appropirate arguments to bind the attribute
   // indexed by 'attribIndex' within this VertexFormat to vertex attribute location
-  // specified by 'glAttribLocation'
-  void setGlVertexAttribPointer(int attribIndex, int glAttribLocation) const {
+  // specified by 'glAttribLocation'. 'byteOffset' is the position of the first
+  // vertex within the currently bound buffer.
+  void setGlVertexAttribPointer(int attribIndex, int glAttribLocation, int byteOffset = 0) const {
     assert(glAttribLocation >= 0);
     const AttribDesc &ad = attribDescs_[attribIndex];
-    glVertexAttribPointer(glAttribLocation, ad.size, ad.type, ad.normalized, vertexSize_, reinterpret_cast<const GLvoid*>(ad.offset));
+    glVertexAttribPointer(glAttribLocation, ad.size, ad.type, ad.normalized, vertexSize_, reinterpret_cast<const GLvoid*>(byteOffset + ad.offset));
   }
 
 private:
@@ -111,17 +206,76 @@ private:
   std::map<std::string, int> name2Idx_;
 };
 
+// CPU copy of a triangle list in a VertexFormat, read by the software renderer
+// (softrenderer.h) in place of the vertex and index buffers
+class CpuVertexArray {
+public:
+  // The format is stored by reference, as by FormattedVbo
+  CpuVertexArray(const VertexFormat& format) : format_(format), numVertices_(0) {}
+
+  // Every three vertices make a triangle
+  template<typename Vertex>
+  void setTriangles(const Vertex* vertices, int numVertices) {
+    setVertices(vertices, numVertices);
+    indices_.clear();
+  }
+
+  template<typename Vertex, typename Index>
+  void setTriangles(const Vertex* vertices, const Index* indices, int numVertices, int numIndices) {
+    setVertices(vertices, numVertices);
+    indices_.assign(indices, indices + numIndices - numIndices % 3);
+  }
+
+  const VertexFormat& getVertexFormat() const {
+    return format_;
+  }
+
+  int getNumVertices() const {
+    return numVertices_;
+  }
+
+  // Vertex i starts getVertexFormat().getVertexSize() * i bytes in
+  const char* getVertexData() const {
+    return data_.empty() ? NULL : &data_[0];
+  }
+
+  // Three per triangle, or empty if every three vertices make a triangle
+  const std::vector<int>& getIndices() const {
+    return indices_;
+  }
+
+  int getNumTriangles() const {
+    return (indices_.empty() ? numVertices_ : int(indices_.size())) / 3;
+  }
+
+private:
+  const VertexFormat& format_;
+  int numVertices_;
+  std::vector<char> data_;
+  std::vector<int> indices_;
+
+  template<typename Vertex>
+  void setVertices(const Vertex* vertices, int numVertices) {
+    assert(sizeof(Vertex) == format_.getVertexSize());
+    numVertices_ = numVertices;
+    data_.resize(sizeof(Vertex) * numVertices);
+    if (numVertices > 0)
+      std::memcpy(&data_[0], vertices, sizeof(Vertex) * numVertices);
+  }
+};
+
 // Light wrapper for a GL buffer object storing vertices, together with format for its vertices.
 class FormattedVbo : public GlBufferObject {
   const VertexFormat& format_;
   int length_;
+  int byteOffset_;
 
 public:
   // The passed in formatDesc_ is stored by reference. Hence the caller
   // should either pass in a static global variable, or ensure its lifespan
   // encompasses the lifespan of the FormmatedVbo
   FormattedVbo(const VertexFormat& formatDesc)
-    : format_(formatDesc), length_(0) {}
+    : format_(formatDesc), length_(0), byteOffset_(0) {}
 
   const VertexFormat& getVertexFormat() const {
     return format_;
@@ -132,6 +286,12 @@ public:
     return length_;
   }
 
+  // Position in bytes of the first vertex within the buffer. Always 0 unless
+  // the buffer is sub-allocated, as StreamingVbo does
+  int getByteOffset() const {
+    return byteOffset_;
+  }
+
   // Upload vertex data to the vbo. Specify dynamicUsage = true if you intend
   // to upload different data multiple times
   template<typename Vertex>
@@ -139,8 +299,10 @@ public:
     assert(sizeof(Vertex) == format_.getVertexSize());
     glBindBuffer(GL_ARRAY_BUFFER, *this);
     length_ = length;
+    byteOffset_ = 0;
 
     const int size = sizeof(Vertex) * length;
+    g_bufferBytesUploaded += size;
     if (dynamicUsage) {
       // We always call glBufferData with a NULL ptr here, so that OpenGL knows that
       // we're done with old data, and that if the old vbo is in use, it can  allocate
@@ -155,6 +317,104 @@ public:
     checkGlErrors();
 #endif
   }
+
+  // Reads the current vertices back from the buffer, for CPU copies that are
+  // only needed now and then
+  template<typename Vertex>
+  void download(std::vector<Vertex>& vertices) const {
+    assert(sizeof(Vertex) == format_.getVertexSize());
+    vertices.resize(length_);
+    if (length_ > 0) {
+      glBindBuffer(GL_ARRAY_BUFFER, *this);
+      glGetBufferSubData(GL_ARRAY_BUFFER, byteOffset_, sizeof(Vertex) * length_, &vertices[0]);
+    }
+  }
+
+protected:
+  // Lets subclasses that manage the buffer storage themselves describe where
+  // the current vertices live
+  void setRange(int byteOffset, int length) {
+    byteOffset_ = byteOffset;
+    length_ = length;
+  }
+};
+
+// A FormattedVbo for vertices that get replaced every frame, such as an animated
+// subdivision mesh. Instead of re-specifying the buffer store on each upload,
+// it keeps one buffer that is carved into consecutive regions, used as a ring.
+// Each upload writes into a fresh region, so the GPU can keep reading the regions
+// of previous frames while we write.
+//
+// Depending on what the driver offers, the buffer is either
+//   - persistently mapped (GL_ARB_buffer_storage), written with a plain memcpy,
+//   - mapped per upload with glMapBufferRange using the UNSYNCHRONIZED and
+//     INVALIDATE_RANGE flags, or
+//   - written with glBufferSubData.
+// When fences are available (GL_ARB_sync), a region is only reused once the GPU
+// has signaled that it finished the draws that read it. Without fences, the whole
+// store gets orphaned with glBufferData(NULL) each time the ring wraps around.
+//
+// The store is sized to hold 'numRegions' uploads of the largest size seen so
+// far, and is only reallocated when an upload no longer fits.
+class StreamingVbo : public FormattedVbo {
+public:
+  enum Mode { UNINITIALIZED, PERSISTENT_MAPPED, MAPPED_RANGE, BUFFER_SUB_DATA };
+
+  // With 'mode' other than UNINITIALIZED, uploads take that path instead of
+  // the best one the context offers, e.g. to test each of them. The first
+  // upload throws runtime_error if the context does not support it.
+  StreamingVbo(const VertexFormat& formatDesc, int numRegions = 3, Mode mode = UNINITIALIZED);
+  ~StreamingVbo();
+
+  template<typename Vertex>
+  void upload(const Vertex* vertices, int length) {
+    assert(sizeof(Vertex) == getVertexFormat().getVertexSize());
+    const int size = sizeof(Vertex) * length;
+    void* dst = beginWrite(size);
+    if (size > 0)
+      std::memcpy(dst, vertices, size);
+    endWrite(length);
+  }
+
+  // Returns the upload path that was picked for the current GL context. Stays
+  // UNINITIALIZED until the first upload
+  Mode getMode() const {
+    return mode_;
+  }
+
+  // Size in bytes of the underlying buffer store
+  int capacity() const {
+    return capacity_;
+  }
+
+  // Whether the current GL context can upload the 'mode' way
+  static bool isSupported(Mode mode);
+
+private:
+  struct Fence {
+    int begin, end;
+    GLsync sync;
+  };
+
+  Mode mode_;
+  const Mode requestedMode_;
+  bool useFences_;
+  const int numRegions_;
+  int capacity_;
+  int head_;                // where the next region starts
+  int writeOffset_, writeSize_; // region of the most recent upload
+  void* mapped_;            // persistent mapping of the whole store, if any
+  std::vector<char> staging_;
+  std::deque<Fence> fences_; // in submission order, hence also in completion order
+
+  void chooseMode();
+  void reserve(int capacity);
+  void fenceLastWrite();
+  void waitForRange(int begin, int end);
+  void releaseFences();
+
+  void* beginWrite(int size);
+  void endWrite(int length);
 };
 
 // Light wrapper for a GL buffer object storing indices, together with format for its
@@ -185,6 +445,7 @@ public:
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, *this);
     length_ = length;
     const int size = sizeof(Index) * length;
+    g_bufferBytesUploaded += size;
     if (dynamicUsage) {
       glBufferData(GL_ELEMENT_ARRAY_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
       glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, size, indices);
@@ -197,6 +458,15 @@ public:
 #endif
   }
 
+  // Reads the indices back from the buffer, as FormattedVbo::download
+  template<typename Index>
+  void download(std::vector<Index>& indices) const {
+    indices.resize(length_);
+    if (length_ > 0) {
+      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, *this);
+      glGetBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, sizeof(Index) * length_, &indices[0]);
+    }
+  }
 };
 
 // A flexible light weight Geometry implementation allowing drawing using multiple vertex buffers,
@@ -252,6 +522,10 @@ public:
   // Methods declared by Geometry
   virtual const std::vector<std::string>& getVertexAttribNames();
   virtual void draw(int attribIndices[]);
+  virtual bool supportsInstancing() {
+    return true;
+  }
+  virtual void drawInstanced(int attribIndices[], int instanceCount);
 
 private:
   typedef std::map<std::string, std::pair<std::shared_ptr<FormattedVbo>, std::string> > Wiring;
@@ -280,6 +554,14 @@ private:
   // Setups up perVbWiring_ and vertexAttribNames_. Gets called whenever wiringChanged_ is true
   // and we need to draw or return list of vertex attributes.
   void processWiring();
+
+  // What bindVertexBuffers returns if there is no vertex buffer
+  static const unsigned int UNDEFINED_VB_LEN = 0xFFFFFFFF;
+
+  // Binds the vertex buffers and sets the attribute pointers. Returns the
+  // number of vertices for non-indexed drawing, or UNDEFINED_VB_LEN if there
+  // is no vertex buffer.
+  unsigned int bindVertexBuffers(int attribIndices[]);
 };
 
 
@@ -403,18 +685,79 @@ struct VertexPNTBX : public VertexPNX {
   }
 };
 
-// Simple unindex geometry implementation based on BufferObjectGeometry
+// Box around the positions of 'numVertices' vertices of one of the formats above
+template<typename Vertex>
+inline Aabb getVertexBounds(const Vertex* vertices, int numVertices) {
+  Aabb bounds;
+  for (int i = 0; i < numVertices; ++i)
+    bounds.add(Cvec3(vertices[i].p[0], vertices[i].p[1], vertices[i].p[2]));
+  return bounds;
+}
+
+// The ray mesh and CPU vertex array of one of the Simple* geometries below,
+// made on the first request after an upload. 'read(vertices, indices)' fills
+// in the geometry's current vertices, and its indices if it is indexed.
+template<typename Vertex, typename Index>
+class GeometryCpuCopies {
+  RayMesh rayMesh_;
+  CpuVertexArray cpuVertices_;
+  bool indexed_;
+  bool rayMeshStale_, cpuVerticesStale_; // uploaded since the copy was last made
+
+public:
+  explicit GeometryCpuCopies(bool indexed)
+    : cpuVertices_(Vertex::FORMAT), indexed_(indexed), rayMeshStale_(false), cpuVerticesStale_(false) {}
+
+  void invalidate() {
+    rayMeshStale_ = cpuVerticesStale_ = true;
+  }
+
+  template<typename Read>
+  RayMesh* getRayMesh(Read read) {
+    if (rayMeshStale_) {
+      update(rayMesh_, read);
+      rayMeshStale_ = false;
+    }
+    return &rayMesh_;
+  }
+
+  template<typename Read>
+  const CpuVertexArray* getCpuVertexArray(Read read) {
+    if (cpuVerticesStale_) {
+      update(cpuVertices_, read);
+      cpuVerticesStale_ = false;
+    }
+    return &cpuVertices_;
+  }
+
+private:
+  template<typename Copy, typename Read>
+  void update(Copy& copy, Read read) {
+    std::vector<Vertex> vertices;
+    std::vector<Index> indices;
+    read(vertices, indices);
+    const Vertex* v = vertices.empty() ? NULL : &vertices[0];
+    if (indexed_)
+      copy.setTriangles(v, indices.empty() ? NULL : &indices[0], vertices.size(), indices.size());
+    else
+      copy.setTriangles(v, vertices.size());
+  }
+};
+
+// Simple unindex geometry implementation based on BufferObjectGeometry. Its
+// CPU copies are read back from the buffer, so the GL context must be current.
 template<typename Vertex>
 class SimpleUnindexedGeometry : public BufferObjectGeometry {
   std::shared_ptr<FormattedVbo> vbo;
+  GeometryCpuCopies<Vertex, unsigned short> cpuCopies;
 public:
-  SimpleUnindexedGeometry() : vbo(new FormattedVbo(Vertex::FORMAT)) {
+  SimpleUnindexedGeometry() : vbo(new FormattedVbo(Vertex::FORMAT)), cpuCopies(false) {
     wire(vbo);
     primitiveType(GL_TRIANGLES);
   }
 
   SimpleUnindexedGeometry(const Vertex* vertices, int numVertices)
-    : vbo(new FormattedVbo(Vertex::FORMAT)) {
+    : vbo(new FormattedVbo(Vertex::FORMAT)), cpuCopies(false) {
     wire(vbo);
     primitiveType(GL_TRIANGLES);
     upload(vertices, numVertices);
@@ -422,25 +765,44 @@ public:
 
   void upload(const Vertex* vertices, int numVertices) {
     vbo->upload(vertices, numVertices, true);
+    setBounds(getVertexBounds(vertices, numVertices));
+    cpuCopies.invalidate();
+  }
+
+  virtual RayMesh* getRayMesh() {
+    return cpuCopies.getRayMesh(readBack());
+  }
+
+  virtual const CpuVertexArray* getCpuVertexArray() {
+    return cpuCopies.getCpuVertexArray(readBack());
+  }
+
+private:
+  std::function<void (std::vector<Vertex>&, std::vector<unsigned short>&)> readBack() {
+    return [this](std::vector<Vertex>& vertices, std::vector<unsigned short>&) {
+      vbo->download(vertices);
+    };
   }
 };
 
 
-// Simple Index geometry implementation based on BufferObjectGeometry
+// Simple Index geometry implementation based on BufferObjectGeometry. Its CPU
+// copies are read back from the buffers, as with SimpleUnindexedGeometry.
 template<typename Vertex, typename Index>
 class SimpleIndexedGeometry : public BufferObjectGeometry {
   std::shared_ptr<FormattedVbo> vbo;
   std::shared_ptr<FormattedIbo> ibo;
+  GeometryCpuCopies<Vertex, Index> cpuCopies;
 public:
   SimpleIndexedGeometry()
-    : vbo(new FormattedVbo(Vertex::FORMAT)), ibo(new FormattedIbo(size2IboFmt(sizeof(Index)))) {
+    : vbo(new FormattedVbo(Vertex::FORMAT)), ibo(new FormattedIbo(size2IboFmt(sizeof(Index)))), cpuCopies(true) {
     wire(vbo);
     indexedBy(ibo);
     primitiveType(GL_TRIANGLES);
   }
 
   SimpleIndexedGeometry(const Vertex* vertices,  const Index* indices, int numVertices, int numIndices)
-    : vbo(new FormattedVbo(Vertex::FORMAT)), ibo(new FormattedIbo(size2IboFmt(sizeof(Index)))) {
+    : vbo(new FormattedVbo(Vertex::FORMAT)), ibo(new FormattedIbo(size2IboFmt(sizeof(Index)))), cpuCopies(true) {
     wire(vbo);
     indexedBy(ibo);
     primitiveType(GL_TRIANGLES);
@@ -450,9 +812,26 @@ public:
   void upload(const Vertex* vertices, const Index* indices, int numVertices, int numIndices) {
     vbo->upload(vertices, numVertices, true);
     ibo->upload(indices, numIndices, true);
+    setBounds(getVertexBounds(vertices, numVertices));
+    cpuCopies.invalidate();
+  }
+
+  virtual RayMesh* getRayMesh() {
+    return cpuCopies.getRayMesh(readBack());
+  }
+
+  virtual const CpuVertexArray* getCpuVertexArray() {
+    return cpuCopies.getCpuVertexArray(readBack());
   }
 
 private:
+  std::function<void (std::vector<Vertex>&, std::vector<Index>&)> readBack() {
+    return [this](std::vector<Vertex>& vertices, std::vector<Index>& indices) {
+      vbo->download(vertices);
+      ibo->download(indices);
+    };
+  }
+
   GLenum size2IboFmt(int size) {
     if (size == 1)
       return GL_UNSIGNED_BYTE;
@@ -467,10 +846,57 @@ private:
 
 
 
+// Unindexed geometry whose vertices are expected to change every frame. Uploads go
+// through a StreamingVbo instead of reallocating the buffer each time. The last
+// upload is also kept on the CPU, as reading it back would wait for the GPU
+// on every pick of an animated mesh; its CPU copies are made from that.
+template<typename Vertex>
+class SimpleStreamingGeometry : public BufferObjectGeometry {
+  std::shared_ptr<StreamingVbo> vbo;
+  std::vector<Vertex> uploaded;
+  GeometryCpuCopies<Vertex, unsigned short> cpuCopies;
+public:
+  SimpleStreamingGeometry() : vbo(new StreamingVbo(Vertex::FORMAT)), cpuCopies(false) {
+    wire(vbo);
+    primitiveType(GL_TRIANGLES);
+  }
+
+  void upload(const Vertex* vertices, int numVertices) {
+    upload(vertices, numVertices, getVertexBounds(vertices, numVertices));
+  }
+
+  // Same, with bounds the caller already knows, which saves going over the
+  // vertices a second time
+  void upload(const Vertex* vertices, int numVertices, const Aabb& bounds) {
+    vbo->upload(vertices, numVertices);
+    uploaded.assign(vertices, vertices + numVertices);
+    setBounds(bounds);
+    cpuCopies.invalidate();
+  }
+
+  virtual RayMesh* getRayMesh() {
+    return cpuCopies.getRayMesh(copyUploaded());
+  }
+
+  virtual const CpuVertexArray* getCpuVertexArray() {
+    return cpuCopies.getCpuVertexArray(copyUploaded());
+  }
+
+private:
+  std::function<void (std::vector<Vertex>&, std::vector<unsigned short>&)> copyUploaded() {
+    return [this](std::vector<Vertex>& vertices, std::vector<unsigned short>&) {
+      vertices = uploaded;
+    };
+  }
+};
+
+
 typedef SimpleUnindexedGeometry<VertexPN> SimpleGeometryPN;
 typedef SimpleUnindexedGeometry<VertexPNX> SimpleGeometryPNX;
 typedef SimpleUnindexedGeometry<VertexPNTBX> SimpleGeometryPNTBX;
 
+typedef SimpleStreamingGeometry<VertexPN> SimpleStreamingGeometryPN;
+
 typedef SimpleIndexedGeometry<VertexPN, unsigned short> SimpleIndexedGeometryPN;
 typedef SimpleIndexedGeometry<VertexPNX, unsigned short> SimpleIndexedGeometryPNX;
 typedef SimpleIndexedGeometry<VertexPNTBX, unsigned short> SimpleIndexedGeometryPNTBX;
@@ -131,6 +131,50 @@ public:
   }
 };
 
+// Light wrapper around a GL framebuffer object handle that automatically
+// allocates and deallocates. Can be casted to a GLuint.
+class GlFramebufferObject : Noncopyable {
+protected:
+  GLuint handle_;
+
+public:
+  GlFramebufferObject() {
+    glGenFramebuffers(1, &handle_);
+    checkGlErrors();
+  }
+
+  ~GlFramebufferObject() {
+    glDeleteFramebuffers(1, &handle_);
+  }
+
+  // Casts to GLuint so can be used directly by glBindFramebuffer and so on
+  operator GLuint() const {
+    return handle_;
+  }
+};
+
+// Light wrapper around a GL renderbuffer object handle that automatically
+// allocates and deallocates. Can be casted to a GLuint.
+class GlRenderbufferObject : Noncopyable {
+protected:
+  GLuint handle_;
+
+public:
+  GlRenderbufferObject() {
+    glGenRenderbuffers(1, &handle_);
+    checkGlErrors();
+  }
+
+  ~GlRenderbufferObject() {
+    glDeleteRenderbuffers(1, &handle_);
+  }
+
+  // Casts to GLuint so can be used directly by glBindRenderbuffer and so on
+  operator GLuint() const {
+    return handle_;
+  }
+};
+
 
 // Safe versions of various functions that handle GLSL shader attributes
 // and variables: These mainly issue a warning when specified attributes
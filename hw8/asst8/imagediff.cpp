@@ -0,0 +1,86 @@
+////////////////////////////////////////////////////////////////////////
+//
+//   imagediff: compares two PPM images of the same size
+//
+//   Prints, over the RGB channels of all pixels:
+//     - the largest and the mean absolute difference
+//     - the percentage of pixels with a channel that differs by more
+//       than the threshold
+//   and exits with 1 if the mean or the percentage is above its
+//   tolerance. softcheck in the Makefile runs it on the frames asst8
+//   draws through GL and with -soft. Their edges are rasterized alike,
+//   but where two surfaces are at almost the same depth, as the boxes
+//   standing on the floor are, each may pick the other one, and a
+//   minified texture may blend different texels. Such pixels differ by
+//   up to 255, so the tolerances bound how many of them there are
+//   rather than how large the differences get. The defaults, a mean of
+//   1 and 1% of the pixels off by more than 8, leave room over the
+//   largest measured for softcheck's frames, 0.55 and 0.16%.
+//
+//   Usage: imagediff [-mean M] [-pixels P] [-threshold T] a.ppm b.ppm
+//
+////////////////////////////////////////////////////////////////////////
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <iostream>
+
+#include "ppm.h"
+
+using namespace std;
+
+int main(int argc, char* argv[]) {
+  double maxMean = 1, maxPixels = 1;
+  int threshold = 8;
+  vector<const char*> files;
+
+  for (int i = 1; i < argc; ++i) {
+    const bool hasValue = i + 1 < argc;
+    if (!strcmp(argv[i], "-mean") && hasValue)
+      maxMean = atof(argv[++i]);
+    else if (!strcmp(argv[i], "-pixels") && hasValue)
+      maxPixels = atof(argv[++i]);
+    else if (!strcmp(argv[i], "-threshold") && hasValue)
+      threshold = atoi(argv[++i]);
+    else
+      files.push_back(argv[i]);
+  }
+  if (files.size() != 2) {
+    cerr << "Usage: " << argv[0] << " [-mean M] [-pixels P] [-threshold T] a.ppm b.ppm" << endl;
+    return 1;
+  }
+
+  try {
+    int width[2], height[2];
+    vector<PackedPixel> pixels[2];
+    for (int k = 0; k < 2; ++k)
+      ppmRead(files[k], width[k], height[k], pixels[k]);
+    if (width[0] != width[1] || height[0] != height[1])
+      throw runtime_error(string(files[0]) + " and " + files[1] + " differ in size");
+
+    int maxDiff = 0, numOff = 0;
+    double sum = 0;
+    for (size_t i = 0; i < pixels[0].size(); ++i) {
+      const PackedPixel &a = pixels[0][i], &b = pixels[1][i];
+      const int diff = max(max(abs(a.r - b.r), abs(a.g - b.g)), abs(a.b - b.b));
+      sum += abs(a.r - b.r) + abs(a.g - b.g) + abs(a.b - b.b);
+      maxDiff = max(maxDiff, diff);
+      numOff += diff > threshold;
+    }
+    const double n = max<double>(1, pixels[0].size());
+    const double mean = sum / (3 * n), percentOff = 100 * numOff / n;
+    const bool ok = mean <= maxMean && percentOff <= maxPixels;
+
+    printf("%s %s: max %d, mean %.3f, %.3f%% of pixels off by more than %d %s\n",
+           files[0], files[1], maxDiff, mean, percentOff, threshold, ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+  }
+  catch (const runtime_error& e) {
+    cerr << "Exception caught: " << e.what() << endl;
+    return 1;
+  }
+}
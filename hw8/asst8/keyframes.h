@@ -15,17 +15,20 @@
 struct Paster : public SgNodeVisitor
 {
 private:
-    std::vector<RigTForm> frame_;
+    const std::vector<RigTForm> &frame_;
     int paste_node_counter;
 
 public:
     // root부터가 아니라 임의의 노드부터 씬에 붙여넣기를 하는 확장을 대비한 offset적용. 지금은 무조건 0이어야 함
     Paster(std::vector<RigTForm> &frame, int offset = 0) : frame_(frame), paste_node_counter(offset) {};
 
+    using SgNodeVisitor::visit;
+
     virtual bool visit(SgTransformNode &node)
     {
-        std::shared_ptr<SgRbtNode> node_ = std::dynamic_pointer_cast<SgRbtNode>(node.shared_from_this());
-        if (node_)
+        SgRbtNode *node_ = asRbtNode(&node);
+        // nodes added to the scene after the script was written keep their rbt
+        if (node_ && paste_node_counter < int(frame_.size()))
         {
             node_->setRbt(frame_[paste_node_counter]);
             paste_node_counter += 1;
@@ -42,8 +45,8 @@ public:
 
     void capture_scene(std::shared_ptr<SgNode> root)
     {
-        std::vector<std::shared_ptr<SgRbtNode>> dump;
-        dumpSgRbtNodes(root, dump);
+        std::vector<SgRbtNode *> dump;
+        dumpSgRbtNodes(*root, dump);
         for (const auto &p : dump)
         {
             frame_.push_back(p->getRbt());
@@ -53,7 +56,7 @@ public:
     bool paste_to_scene(std::shared_ptr<SgNode> root)
     {
         Paster paster(frame_);
-        if (root->accept(paster))
+        if (traverse(*root, paster))
         {
             return true;
         }
@@ -3,6 +3,7 @@
 #include <string>
 #include <vector>
 #include <sstream>
+#include <fstream>
 
 #include "glsupport.h"
 #include "asstcommon.h"
@@ -98,8 +99,13 @@ public:
     }
   }
 
+  // Whether the shader file exists, after the same renaming getShader does
+  bool hasShader(const string& filename) {
+    return ifstream(getShaderFilename(filename).c_str()).good();
+  }
+
 protected:
-  shared_ptr<GlShader> getShader(const string& filename, GLenum shaderType) {
+  static string getShaderFilename(const string& filename) {
     string f = filename;
     if (g_Gl2Compatible) { // optionally change -gl3 to -gl3 in the end of the filename
       size_t pos = f.rfind("-gl3");
@@ -107,6 +113,11 @@ protected:
         f[pos+3] = '2';
       }
     }
+    return f;
+  }
+
+  shared_ptr<GlShader> getShader(const string& filename, GLenum shaderType) {
+    const string f = getShaderFilename(filename);
 
     GlShaderMap::key_type key(f, shaderType);
     GlShaderMap::iterator i = shaderMap.find(key);
@@ -124,8 +135,29 @@ protected:
 
 Material::Material(const string& vsFilename, const string& fsFilename)
   : programDesc_(GlProgramLibrary::getSingleton().getProgramDesc(vsFilename, fsFilename))
+  , vsFilename_(vsFilename)
+  , fsFilename_(fsFilename)
+  , instancedChecked_(false)
+  , boundProgramDesc_(NULL)
+  , materialTextureUnits_(0)
 {}
 
+bool Material::hasInstancedProgram() {
+  if (!instancedChecked_) {
+    instancedChecked_ = true;
+
+    // ./shaders/basic-gl3.vshader -> ./shaders/basic-instanced-gl3.vshader
+    const size_t pos = vsFilename_.rfind("-gl3");
+    if (pos != string::npos) {
+      const string vs = vsFilename_.substr(0, pos) + "-instanced" + vsFilename_.substr(pos);
+      GlProgramLibrary& library = GlProgramLibrary::getSingleton();
+      if (library.hasShader(vs))
+        instancedProgramDesc_ = library.getProgramDesc(vs, fsFilename_);
+    }
+  }
+  return instancedProgramDesc_ ? true : false;
+}
+
 static const char * getGlConstantName(GLenum c) {
   struct ValueNamePair {
     GLenum value;
@@ -167,7 +199,7 @@ static const char * getGlConstantName(GLenum c) {
   return "Unkonwn";
 }
 
-void Material::draw(Geometry& geometry, const Uniforms& extraUniforms) {
+static GLint getMaxTextureImageUnits() {
   static GLint maxTextureImageUnits = 0;
 
   // Initialize maxTextureImageUnits if this is called for the first time
@@ -175,75 +207,135 @@ void Material::draw(Geometry& geometry, const Uniforms& extraUniforms) {
     glGetIntegerv(GL_MAX_COMBINED_TEXTURE_IMAGE_UNITS, &maxTextureImageUnits);
     assert(maxTextureImageUnits > 0); // GL spec says this has to be at least 2
   }
+  return maxTextureImageUnits;
+}
 
-  glUseProgram(programDesc_->program);
+const Uniforms::Value* Material::findUniform(const Uniforms& uniforms, int i) const {
+  const GlProgramDesc::UniformDesc& ud = boundProgramDesc_->uniforms[i];
+  const Uniforms::Value* u = uniforms.get(ud.name);
 
-  renderStates_.apply();  // transit to current states
+  // if the name looks like blah[0], and the uniform is not found, we also try stripping the '[0]'
+  if (u == NULL && ud.name.length() >= 3 && ud.name.compare(ud.name.length() - 3, 3, "[0]") == 0)
+    u = uniforms.get(ud.name.substr(0, ud.name.length() - 3));
+  return u;
+}
 
-  // Step 1:
-  // set the uniforms and bind the textures
-  int textureUnit = 0;
-  for (int i = 0, n = programDesc_->uniforms.size(); i < n; ++i) {
-    const GlProgramDesc::UniformDesc& ud = programDesc_->uniforms[i];
-
-    const Uniforms* uniformsList[] = {&uniforms_, &extraUniforms};
-    int j = 0;
-    for (; j < 2; ++j) {
-      const Uniforms::Value* u = uniformsList[j]->get(ud.name);
-
-      // if the name looks like blah[0], and the uniform is not found, we also try stripping the '[0]'
-      if (u == NULL && ud.name.length() >= 3 && ud.name.compare(ud.name.length() - 3, 3, "[0]") == 0)
-        u = uniformsList[j]->get(ud.name.substr(0, ud.name.length() - 3));
-
-      if (u) {
-        if (u->type == ud.type && u->size >= ud.size) {
-          switch (u->type) {
-          case GL_SAMPLER_1D:
-          case GL_SAMPLER_2D:
-          case GL_SAMPLER_CUBE:
-          case GL_SAMPLER_1D_SHADOW:
-          case GL_SAMPLER_2D_SHADOW:
-            {
-              const shared_ptr<Texture> *tex = u->getTextures();
-
-              // If this assert hits, the Uniform::Value is incorrectly implemented
-              assert(tex != NULL);
-              static const int MAX_TEX_UNITS = 1024;
-              GLint texUnits[MAX_TEX_UNITS];
-              int count = 0;
-              for (; count < ud.size; ++count) {
-                if (textureUnit == maxTextureImageUnits) {
-                  stringstream s;
-                  s << "System allows a maximum of " << maxTextureImageUnits << ". The current shader is trying to use more than that.";
-                  throw runtime_error(s.str());
-                }
-
-                glActiveTexture(GL_TEXTURE0 + textureUnit);
-                tex[count]->bind();
-                texUnits[count] = textureUnit++;
-              }
-              u->apply(ud.location, ud.size, texUnits);
-            }
-            break;
-          default:
-            u->apply(ud.location, ud.size, NULL);
-          }
-        }
-        else {
+int Material::applyUniform(int i, const Uniforms::Value* u, int textureUnit) const {
+  const GlProgramDesc::UniformDesc& ud = boundProgramDesc_->uniforms[i];
+  if (u->type != ud.type || u->size < ud.size) {
+    stringstream s;
+    s << "Uniform variable " << ud.name << ": supplied value and declared variable do not match in type and/or size."
+      << "\nSupplied value: type = " << getGlConstantName(u->type) << ", size = " << u->size
+      << "\nDeclared in shader: type = " << getGlConstantName(ud.type) << ", size = " << ud.size;
+    throw runtime_error(s.str());
+  }
+
+  switch (u->type) {
+  case GL_SAMPLER_1D:
+  case GL_SAMPLER_2D:
+  case GL_SAMPLER_CUBE:
+  case GL_SAMPLER_1D_SHADOW:
+  case GL_SAMPLER_2D_SHADOW:
+    {
+      const shared_ptr<Texture> *tex = u->getTextures();
+
+      // If this assert hits, the Uniform::Value is incorrectly implemented
+      assert(tex != NULL);
+      static const int MAX_TEX_UNITS = 1024;
+      GLint texUnits[MAX_TEX_UNITS];
+      const GLint maxTextureImageUnits = getMaxTextureImageUnits();
+      int count = 0;
+      for (; count < ud.size; ++count) {
+        if (textureUnit == maxTextureImageUnits) {
           stringstream s;
-          s << "Uniform variable " << ud.name << ": supplied value and declared variable do not match in type and/or size."
-            << "\nSupplied value: type = " << getGlConstantName(u->type) << ", size = " << u->size
-            << "\nDeclared in shader: type = " << getGlConstantName(ud.type) << ", size = " << ud.size;
+          s << "System allows a maximum of " << maxTextureImageUnits << ". The current shader is trying to use more than that.";
           throw runtime_error(s.str());
         }
-        break;
+
+        glActiveTexture(GL_TEXTURE0 + textureUnit);
+        tex[count]->bind();
+        texUnits[count] = textureUnit++;
       }
+      u->apply(ud.location, ud.size, texUnits);
+      return count;
+    }
+  default:
+    u->apply(ud.location, ud.size, NULL);
+    return 0;
+  }
+}
+
+void Material::draw(Geometry& geometry, const Uniforms& extraUniforms) {
+  bind(NULL);
+  drawBound(geometry, extraUniforms);
+}
+
+void Material::bind(const Material* previous, MaterialBindStats* stats, bool instanced) {
+  if (instanced && !hasInstancedProgram())
+    throw runtime_error("Material::bind: no instanced variant of " + vsFilename_);
+  GlProgramDesc* desc = instanced ? instancedProgramDesc_.get() : programDesc_.get();
+
+  if (previous == this && boundProgramDesc_ == desc)
+    return;
+
+  if (!previous || previous->boundProgramDesc_ != desc) {
+    glUseProgram(desc->program);
+    if (stats)
+      ++stats->programChanges;
+  }
+
+  if (!previous || previous->renderStates_ != renderStates_) {
+    renderStates_.apply();  // transit to current states
+    if (stats)
+      ++stats->renderStateChanges;
+  }
+  boundProgramDesc_ = desc;
+
+  // Step 1:
+  // set the uniforms supplied by the material and bind its textures. The rest
+  // come from the extra uniforms passed to each drawBound.
+  materialTextureUnits_ = 0;
+  fromMaterial_.assign(desc->uniforms.size(), 0);
+  for (int i = 0, n = desc->uniforms.size(); i < n; ++i) {
+    const Uniforms::Value* u = findUniform(uniforms_, i);
+    if (u) {
+      const int numTextures = applyUniform(i, u, materialTextureUnits_);
+      materialTextureUnits_ += numTextures;
+      fromMaterial_[i] = 1;
+      if (stats)
+        stats->textureBinds += numTextures;
     }
-    if (j == 2) {
+  }
+  if (stats)
+    ++stats->materialBinds;
+}
+
+void Material::drawBound(Geometry& geometry, const Uniforms& extraUniforms) {
+  drawBound(geometry, extraUniforms, NULL, 0);
+}
+
+void Material::drawBoundInstanced(Geometry& geometry, const Uniforms& extraUniforms, const InstanceVbo& instances) {
+  drawBound(geometry, extraUniforms, &instances, instances.length());
+}
+
+void Material::drawBound(Geometry& geometry, const Uniforms& extraUniforms, const InstanceVbo* instances, int instanceCount) {
+  const GlProgramDesc& desc = *boundProgramDesc_;
+
+  // Step 1 (continued):
+  // set the remaining uniforms from the extra uniforms
+  int textureUnit = materialTextureUnits_;
+  for (int i = 0, n = desc.uniforms.size(); i < n; ++i) {
+    if (fromMaterial_[i])
+      continue;
+
+    const Uniforms::Value* u = findUniform(extraUniforms, i);
+    if (!u) {
+      const GlProgramDesc::UniformDesc& ud = desc.uniforms[i];
       stringstream s;
       s << "Uniform variable " << ud.name << ": used in the shader codes, but not supplied. Type = " << getGlConstantName(ud.type) << ", Size = " << ud.size;
       throw runtime_error(s.str());
     }
+    textureUnit += applyUniform(i, u, textureUnit);
   }
 
   // Step 2:
@@ -262,9 +354,12 @@ void Material::draw(Geometry& geometry, const Uniforms& extraUniforms) {
     attribIndices[i] = -1;
   }
 
+  // per-instance matrices, for the instanced shaders
+  int modelViewLocation = -1, normalLocation = -1;
+
   // simple and stupid O(n^2) wiring, should use a hashtable to reduce to O(n)
-  for (int i = 0, n = programDesc_->attribs.size(); i < n; ++i) {
-    const GlProgramDesc::AttribDesc& ad = programDesc_->attribs[i];
+  for (int i = 0, n = desc.attribs.size(); i < n; ++i) {
+    const GlProgramDesc::AttribDesc& ad = desc.attribs[i];
 
     size_t j = 0;
     for (; j < numAttribs; ++j) {
@@ -273,7 +368,14 @@ void Material::draw(Geometry& geometry, const Uniforms& extraUniforms) {
         break;
       }
     }
-    if (j == numAttribs) {
+    if (j < numAttribs)
+      continue;
+
+    if (instances && ad.name == "aModelViewMatrix")
+      modelViewLocation = ad.location;
+    else if (instances && ad.name == "aNormalMatrix")
+      normalLocation = ad.location;
+    else {
       throw runtime_error(string("Vertex attribute ") + ad.name
                           + ": used in the shader codes, but not supplied.");
     }
@@ -285,7 +387,13 @@ void Material::draw(Geometry& geometry, const Uniforms& extraUniforms) {
   }
 
   // Now let the geometry draw its self
-  geometry.draw(attribIndices);
+  if (instances) {
+    instances->enableAttribs(modelViewLocation, normalLocation);
+    geometry.drawInstanced(attribIndices, instanceCount);
+    instances->disableAttribs(modelViewLocation, normalLocation);
+  }
+  else
+    geometry.draw(attribIndices);
 
   for (size_t i = 0; i < numAttribs; ++i) {
     if (attribIndices[i] >= 0)
@@ -17,24 +17,84 @@
 
 struct GlProgramDesc;
 
+// Counts of the GL state changes made by Material::bind, to see how well
+// draws sharing state were grouped
+struct MaterialBindStats {
+  int programChanges;     // glUseProgram calls
+  int renderStateChanges; // RenderStates::apply calls
+  int materialBinds;      // material uniform uploads
+  int textureBinds;       // textures bound for material uniforms
+
+  MaterialBindStats() : programChanges(0), renderStateChanges(0), materialBinds(0), textureBinds(0) {}
+};
+
 class Material {
 public:
   Material(const std::string& vsFilename, const std::string& fsFilename);
 
+  // Same as bind(NULL) followed by drawBound
   void draw(Geometry& geometry, const Uniforms& extraUniforms);
 
+  // Makes this material current: program, render states, and the uniforms and
+  // textures it supplies itself. 'previous' is the material bound last, or
+  // NULL if unknown; state that 'previous' already set is not set again.
+  // Changes are counted in 'stats' if given. With 'instanced', the instanced
+  // variant of the program is bound, see hasInstancedProgram.
+  void bind(const Material* previous, MaterialBindStats* stats = NULL, bool instanced = false);
+
+  // Draws with this material, which must be the one bound last. Uniforms used
+  // by the shaders but not supplied by the material come from 'extraUniforms'.
+  void drawBound(Geometry& geometry, const Uniforms& extraUniforms);
+
+  // Draws one instance of 'geometry' per entry of 'instances', which supply
+  // the model view and normal matrices. Must be bound with 'instanced'.
+  void drawBoundInstanced(Geometry& geometry, const Uniforms& extraUniforms, const InstanceVbo& instances);
+
+  // Whether there is an instanced variant of the vertex shader: for
+  // foo-gl3.vshader, a foo-instanced-gl3.vshader taking the matrices as the
+  // per-instance attributes aModelViewMatrix and aNormalMatrix. It is loaded
+  // the first time this is called.
+  bool hasInstancedProgram();
+
+  // Materials with the same program descriptor share the GL program
+  const GlProgramDesc* getProgramDesc() const { return programDesc_.get(); }
+
   Uniforms& getUniforms() { return uniforms_; }
   const Uniforms& getUniforms() const { return uniforms_; }
 
   RenderStates& getRenderStates() { return renderStates_; }
   const RenderStates& getRenderStates() const { return renderStates_; }
 
+  const std::string& getVertexShaderFilename() const { return vsFilename_; }
+  const std::string& getFragmentShaderFilename() const { return fsFilename_; }
+
 protected:
   std::shared_ptr<GlProgramDesc> programDesc_;
 
   Uniforms uniforms_;
 
   RenderStates renderStates_;
+
+  std::string vsFilename_, fsFilename_;
+  std::shared_ptr<GlProgramDesc> instancedProgramDesc_;
+  bool instancedChecked_;
+
+  // program set by the last bind
+  GlProgramDesc* boundProgramDesc_;
+
+  void drawBound(Geometry& geometry, const Uniforms& extraUniforms, const InstanceVbo* instances, int instanceCount);
+
+  // Value for the i-th uniform of the bound program in 'uniforms', or NULL
+  const Uniforms::Value* findUniform(const Uniforms& uniforms, int i) const;
+
+  // Sends 'u' to the i-th uniform of the bound program, binding textures starting at
+  // 'textureUnit'. Returns the number of texture units used.
+  int applyUniform(int i, const Uniforms::Value* u, int textureUnit) const;
+
+  // set by bind: texture units taken by material uniforms, and which of the
+  // program's uniforms the material supplied
+  int materialTextureUnits_;
+  std::vector<char> fromMaterial_;
 };
 
 
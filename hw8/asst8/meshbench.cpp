@@ -0,0 +1,224 @@
+////////////////////////////////////////////////////////////////////////
+//
+//   meshbench: standalone timing of the mesh pipeline used by asst8
+//
+//   Loads each mesh, subdivides it level by level, and for every level
+//   times subdivision, smooth normals and building the triangle vertex
+//   stream. Results go to stdout as JSON. Needs no GL context.
+//
+//   Usage: meshbench [-l maxLevel] [-r repeats] [mesh ...]
+//
+////////////////////////////////////////////////////////////////////////
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+#include <iostream>
+
+#include <sys/resource.h>
+
+#include "cvec.h"
+#include "mesh.h"
+#include "meshutils.h"
+
+using namespace std;
+
+// Global allocation counters. operator new is replaced below so every heap
+// allocation made by the pipeline (Mesh internals, vectors, shared_ptrs) is
+// counted.
+static atomic<long long> g_numAllocs(0), g_allocBytes(0);
+
+// The replacements forward to these two, kept out of line: once GCC inlines
+// malloc() or free() into code that also sees the matching new or delete
+// expression, it takes them for a mismatch with the library's operators
+// (-Wmismatched-new-delete).
+__attribute__((noinline)) static void* countedAlloc(size_t size) {
+  g_numAllocs.fetch_add(1, memory_order_relaxed);
+  g_allocBytes.fetch_add(size, memory_order_relaxed);
+  if (void* p = malloc(size ? size : 1))
+    return p;
+  throw bad_alloc();
+}
+
+__attribute__((noinline)) static void countedFree(void* p) {
+  free(p);
+}
+
+void* operator new(size_t size) { return countedAlloc(size); }
+void* operator new[](size_t size) { return countedAlloc(size); }
+void operator delete(void* p) noexcept { countedFree(p); }
+void operator delete[](void* p) noexcept { countedFree(p); }
+void operator delete(void* p, size_t) noexcept { countedFree(p); }
+void operator delete[](void* p, size_t) noexcept { countedFree(p); }
+
+// Same layout as VertexPN in geometry.h, which cannot be included without GL
+struct BenchVertexPN {
+  Cvec3f p, n;
+
+  BenchVertexPN(const Cvec3& pos, const Cvec3& normal)
+    : p(pos[0], pos[1], pos[2]), n(normal[0], normal[1], normal[2]) {}
+};
+
+// Peak resident set size of the process so far, in kilobytes
+static long getPeakRssKb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __MAC__
+  return usage.ru_maxrss / 1024; // bytes on macOS
+#else
+  return usage.ru_maxrss;
+#endif
+}
+
+// Time and allocations spent in one phase. With several repeats the fastest
+// run is kept; allocation counts are the same for every run.
+struct PhaseStats {
+  double seconds;
+  long long allocs, bytes;
+
+  PhaseStats() : seconds(1e300), allocs(0), bytes(0) {}
+};
+
+class PhaseTimer {
+  PhaseStats& stats_;
+  chrono::steady_clock::time_point start_;
+  long long allocs0_, bytes0_;
+
+public:
+  PhaseTimer(PhaseStats& stats)
+    : stats_(stats), start_(chrono::steady_clock::now()),
+      allocs0_(g_numAllocs.load()), bytes0_(g_allocBytes.load()) {}
+
+  ~PhaseTimer() {
+    const double s = chrono::duration<double>(chrono::steady_clock::now() - start_).count();
+    stats_.seconds = min(stats_.seconds, s);
+    stats_.allocs = g_numAllocs.load() - allocs0_;
+    stats_.bytes = g_allocBytes.load() - bytes0_;
+  }
+};
+
+// File names come from the command line, so quotes, backslashes and control
+// characters are escaped
+static void printJsonString(const char* s) {
+  putchar('"');
+  for (; *s; ++s) {
+    if (*s == '"' || *s == '\\')
+      printf("\\%c", *s);
+    else if ((unsigned char)*s < 0x20)
+      printf("\\u%04x", (unsigned char)*s);
+    else
+      putchar(*s);
+  }
+  putchar('"');
+}
+
+static void printPhase(const char* name, const PhaseStats& s, bool last) {
+  printf("          \"%s\": {\"seconds\": %.9f, \"allocs\": %lld, \"bytes\": %lld}%s\n",
+         name, s.seconds, s.allocs, s.bytes, last ? "" : ",");
+}
+
+static void benchMesh(const string& filename, int maxLevel, int repeats, bool last) {
+  shared_ptr<Mesh> base = make_shared<Mesh>();
+  base->load(filename.c_str());
+
+  printf("    {\n");
+  printf("      \"mesh\": ");
+  printJsonString(filename.c_str());
+  printf(",\n");
+  printf("      \"levels\": [\n");
+
+  shared_ptr<Mesh> prev = base;
+  for (int level = 0; level <= maxLevel; ++level) {
+    // copy + new vertex computation + topology + flat normals is exactly
+    // catmull_clark_subdivision_mesh, split up so each step is timed
+    PhaseStats copy, compute, topology, flat, normals, stream;
+    shared_ptr<Mesh> m;
+    vector<BenchVertexPN> vtx;
+
+    for (int r = 0; r < repeats; ++r) {
+      if (level == 0) {
+        m = make_shared<Mesh>(*base);
+      }
+      else {
+        { PhaseTimer t(copy); m = make_shared<Mesh>(*prev); }
+        { PhaseTimer t(compute); compute_catmull_clark_vertices(*m); }
+        { PhaseTimer t(topology); m->subdivide(); }
+        { PhaseTimer t(flat); set_flat_vertex_normals(*m); }
+      }
+      { PhaseTimer t(normals); compute_smooth_vertex_normals(*m); }
+      vector<BenchVertexPN>().swap(vtx);
+      { PhaseTimer t(stream); build_mesh_vertices(*m, false, vtx); }
+    }
+
+    const double subdivSeconds = level == 0 ? 0 : copy.seconds + compute.seconds + topology.seconds + flat.seconds;
+    const int numFaces = m->getNumFaces();
+
+    printf("        {\n");
+    printf("          \"level\": %d,\n", level);
+    printf("          \"faces\": %d, \"edges\": %d, \"vertices\": %d, \"streamVertices\": %d,\n",
+           numFaces, m->getNumEdges(), m->getNumVertices(), int(vtx.size()));
+    if (level > 0) {
+      printf("          \"subdivideFacesPerSecond\": %.1f,\n", numFaces / subdivSeconds);
+      printPhase("copy", copy, false);
+      printPhase("computeVertices", compute, false);
+      printPhase("subdivide", topology, false);
+      printPhase("flatNormals", flat, false);
+    }
+    printf("          \"normalsFacesPerSecond\": %.1f,\n", numFaces / normals.seconds);
+    printf("          \"streamFacesPerSecond\": %.1f,\n", numFaces / stream.seconds);
+    printPhase("smoothNormals", normals, false);
+    printPhase("buildStream", stream, false);
+    printf("          \"peakRssKb\": %ld\n", getPeakRssKb());
+    printf("        }%s\n", level == maxLevel ? "" : ",");
+    fflush(stdout);
+
+    prev = m;
+  }
+
+  printf("      ]\n");
+  printf("    }%s\n", last ? "" : ",");
+}
+
+int main(int argc, char* argv[]) {
+  int maxLevel = 6, repeats = 1;
+  vector<string> files;
+
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-l") && i + 1 < argc)
+      maxLevel = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-r") && i + 1 < argc)
+      repeats = max(1, atoi(argv[++i]));
+    else if (argv[i][0] == '-') {
+      cerr << "Usage: " << argv[0] << " [-l maxLevel] [-r repeats] [mesh ...]" << endl;
+      return 1;
+    }
+    else
+      files.push_back(argv[i]);
+  }
+  if (files.empty())
+    files.push_back("data/cube.mesh");
+
+  try {
+    printf("{\n");
+    printf("  \"maxLevel\": %d,\n", maxLevel);
+    printf("  \"repeats\": %d,\n", repeats);
+    printf("  \"meshes\": [\n");
+    for (size_t i = 0; i < files.size(); ++i)
+      benchMesh(files[i], maxLevel, repeats, i + 1 == files.size());
+    printf("  ]\n");
+    printf("}\n");
+  }
+  catch (const runtime_error& e) {
+    cerr << "Exception caught: " << e.what() << endl;
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,228 @@
+////////////////////////////////////////////////////////////////////////
+//
+//   meshtool: batch processing of .mesh files without a display
+//
+//   Every input file is loaded, subdivided, optionally given smooth
+//   normals, and written out as .mesh or OBJ. Files are processed
+//   concurrently on a work-stealing pool, and the time spent on each
+//   file is reported as it finishes. Output files are named after the
+//   input files without their directories, so two inputs of the same name
+//   are refused before any file is processed.
+//
+//   Usage: meshtool [options] file ...
+//     -s N       apply N levels of Catmull-Clark subdivision (default 0)
+//     -n         compute smooth vertex normals (OBJ output includes them)
+//     -f FORMAT  output format, mesh or obj (default mesh)
+//     -o DIR     output directory (default .)
+//     -l LIST    also read input file names from LIST, one per line
+//     -j N       number of worker threads (default: hardware threads)
+//
+////////////////////////////////////////////////////////////////////////
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <fstream>
+#include <stdexcept>
+#include <iostream>
+
+#include "mesh.h"
+#include "meshutils.h"
+#include "threadpool.h"
+
+using namespace std;
+
+struct Options {
+  int levels;
+  bool smooth;
+  string format;
+  string outDir;
+  int numThreads;
+
+  Options() : levels(0), smooth(false), format("mesh"), outDir("."), numThreads(0) {}
+};
+
+static double secondsSince(chrono::steady_clock::time_point start) {
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// outDir/<input name without directory and extension>.<format>
+static string getOutputName(const string& input, const Options& options) {
+  string name = input.substr(input.find_last_of('/') + 1);
+  const size_t dot = name.find_last_of('.');
+  if (dot != string::npos && dot > 0)
+    name = name.substr(0, dot);
+  return options.outDir + "/" + name + "." + options.format;
+}
+
+// Absolute path without ".", ".." or symbolic links. A file that does not
+// exist yet, such as an output, is named through its canonical directory;
+// a path whose directory does not exist either is returned unchanged.
+static string getCanonicalName(const string& path) {
+  if (char* resolved = realpath(path.c_str(), NULL)) {
+    const string name = resolved;
+    free(resolved);
+    return name;
+  }
+  const size_t slash = path.find_last_of('/');
+  const string dir = slash == string::npos ? "." : path.substr(0, max(slash, size_t(1)));
+  char* resolved = realpath(dir.c_str(), NULL);
+  if (!resolved)
+    return path;
+  const string name = string(resolved) + (resolved[1] ? "/" : "") + path.substr(slash + 1);
+  free(resolved);
+  return name;
+}
+
+static void usage(const char* prog) {
+  cerr << "Usage: " << prog << " [-s levels] [-n] [-f mesh|obj] [-o outdir] [-l listfile] [-j threads] file ..." << endl;
+}
+
+static void readList(const char* listFile, vector<string>& files) {
+  ifstream f(listFile);
+  if (!f)
+    throw runtime_error(string("Cannot open file ") + listFile);
+  for (string line; getline(f, line);) {
+    if (!line.empty())
+      files.push_back(line);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  Options options;
+  vector<string> files;
+
+  try {
+    for (int i = 1; i < argc; ++i) {
+      const bool hasValue = i + 1 < argc;
+      if (!strcmp(argv[i], "-s") && hasValue)
+        options.levels = max(0, atoi(argv[++i]));
+      else if (!strcmp(argv[i], "-n"))
+        options.smooth = true;
+      else if (!strcmp(argv[i], "-f") && hasValue)
+        options.format = argv[++i];
+      else if (!strcmp(argv[i], "-o") && hasValue)
+        options.outDir = argv[++i];
+      else if (!strcmp(argv[i], "-l") && hasValue)
+        readList(argv[++i], files);
+      else if (!strcmp(argv[i], "-j") && hasValue)
+        options.numThreads = atoi(argv[++i]);
+      else if (argv[i][0] == '-') {
+        usage(argv[0]);
+        return 1;
+      }
+      else
+        files.push_back(argv[i]);
+    }
+  }
+  catch (const runtime_error& e) {
+    cerr << "Exception caught: " << e.what() << endl;
+    return -1;
+  }
+
+  if (files.empty() || (options.format != "mesh" && options.format != "obj")) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  // the workers would overwrite each other's output. Names are compared in
+  // canonical form, as "./x.mesh" and "a/../x.mesh" are the same file.
+  // An output that is one of the inputs is refused when its file comes up.
+  set<string> canonicalInputs;
+  for (size_t i = 0; i < files.size(); ++i)
+    canonicalInputs.insert(getCanonicalName(files[i]));
+  vector<string> outputs(files.size());
+  vector<bool> overwritesInput(files.size());
+  map<string, string> inputOfOutput;
+  int numCollisions = 0;
+  for (size_t i = 0; i < files.size(); ++i) {
+    outputs[i] = getOutputName(files[i], options);
+    const string canonicalOutput = getCanonicalName(outputs[i]);
+    overwritesInput[i] = canonicalInputs.count(canonicalOutput) > 0;
+    const map<string, string>::iterator j = inputOfOutput.find(canonicalOutput);
+    if (j != inputOfOutput.end()) {
+      cerr << files[i] << ": same output file " << outputs[i] << " as " << j->second << endl;
+      ++numCollisions;
+    }
+    else
+      inputOfOutput[canonicalOutput] = files[i];
+  }
+  if (numCollisions > 0)
+    return 1;
+
+  const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  mutex outputMutex;
+  int numFailed = 0;
+  long long totalFaces = 0;
+  int numThreads = 0;
+
+  {
+    WorkStealingPool pool(options.numThreads);
+    numThreads = pool.getNumThreads();
+    cout << "# file\tfaces\tload_ms\tprocess_ms\twrite_ms\ttotal_ms" << endl;
+
+    for (size_t i = 0; i < files.size(); ++i) {
+      const string input = files[i], output = outputs[i];
+      const bool refused = overwritesInput[i];
+      pool.submit([&, input, output, refused]() {
+        const chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        double loadSeconds = 0, processSeconds = 0, writeSeconds = 0;
+        int numFaces = 0;
+        string error;
+
+        try {
+          if (refused)
+            throw runtime_error("Refusing to overwrite input file " + output);
+
+          chrono::steady_clock::time_point t = chrono::steady_clock::now();
+          shared_ptr<Mesh> mesh = make_shared<Mesh>();
+          mesh->load(input.c_str());
+          loadSeconds = secondsSince(t);
+
+          t = chrono::steady_clock::now();
+          mesh = subdivide_mesh(mesh, options.levels);
+          if (options.smooth)
+            compute_smooth_vertex_normals(*mesh);
+          numFaces = mesh->getNumFaces();
+          processSeconds = secondsSince(t);
+
+          t = chrono::steady_clock::now();
+          if (options.format == "obj")
+            export_obj_mesh(*mesh, output.c_str(), options.smooth);
+          else
+            save_mesh(*mesh, output.c_str());
+          writeSeconds = secondsSince(t);
+        }
+        catch (const exception& e) {
+          error = e.what();
+        }
+
+        const double totalSeconds = secondsSince(t0);
+        lock_guard<mutex> lock(outputMutex);
+        if (!error.empty()) {
+          ++numFailed;
+          cerr << input << ": " << error << endl;
+          return;
+        }
+        totalFaces += numFaces;
+        printf("%s\t%d\t%.3f\t%.3f\t%.3f\t%.3f\n", input.c_str(), numFaces,
+               loadSeconds * 1000, processSeconds * 1000, writeSeconds * 1000, totalSeconds * 1000);
+        fflush(stdout);
+      });
+    }
+    pool.wait();
+  }
+
+  const double seconds = secondsSince(start);
+  printf("# %d files, %d failed, %lld faces written in %.3f s (%.1f files/s) on %d worker threads\n",
+         int(files.size()), numFailed, totalFaces, seconds, files.size() / seconds,
+         numThreads);
+  return numFailed == 0 ? 0 : 1;
+}
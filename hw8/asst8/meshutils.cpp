@@ -0,0 +1,229 @@
+#include <cmath>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+#include "meshutils.h"
+
+using namespace std;
+
+void compute_catmull_clark_vertices(Mesh& m)
+{
+  // FaceVertex iteration
+  for (int f = 0; f < m.getNumFaces(); ++f)
+  {
+    Mesh::Face f_temp = m.getFace(f);
+    Cvec3 pos(0);
+    for (int v = 0; v < f_temp.getNumVertices(); ++v)
+    {
+      Mesh::Vertex v_temp = f_temp.getVertex(v);
+      pos += v_temp.getPosition();
+    }
+    pos /= f_temp.getNumVertices();
+    m.setNewFaceVertex(f_temp, pos);
+  }
+
+  // EdgeVertex iteration
+  for (int e = 0; e < m.getNumEdges(); ++e)
+  {
+    Mesh::Edge e_temp = m.getEdge(e);
+    Cvec3 pos(0);
+    pos += e_temp.getVertex(0).getPosition();
+    pos += e_temp.getVertex(1).getPosition();
+    pos += m.getNewFaceVertex(e_temp.getFace(0));
+    pos += m.getNewFaceVertex(e_temp.getFace(1));
+    pos /= 4.0;
+    m.setNewEdgeVertex(e_temp, pos);
+  }
+
+  // VertexVertex iteration
+  for (int v = 0; v < m.getNumVertices(); ++v)
+  {
+    Mesh::Vertex v_temp = m.getVertex(v);
+    Cvec3 F(0), V(0);
+    int n = 0;
+
+    Mesh::VertexIterator iter(v_temp.getIterator()), it0(iter);
+    do
+    {
+      F += m.getNewFaceVertex(iter.getFace());
+      V += iter.getVertex().getPosition();
+      ++n;
+    } while (++iter != it0);
+    Cvec3 pos = v_temp.getPosition() * (((double)n - 2.0) / (double)n) + V * (1.0 / (double)pow(n, 2)) + F * (1.0 / (double)pow(n, 2));
+    m.setNewVertexVertex(v_temp, pos);
+  }
+}
+
+void set_flat_vertex_normals(Mesh& m)
+{
+  for (int i = 0; i < m.getNumFaces(); ++i)
+  {
+    Mesh::Face f = m.getFace(i);
+    for (int j = 0; j < f.getNumVertices(); ++j)
+    {
+      f.getVertex(j).setNormal(f.getNormal());
+    }
+  }
+}
+
+void compute_smooth_vertex_normals(Mesh& m)
+{
+  // first reset all vertices normals to zero
+  for (int i = 0; i < m.getNumVertices(); ++i)
+  {
+    m.getVertex(i).setNormal(Cvec3(0, 0, 0));
+  }
+
+  // and then accumulate
+  for (int i = 0; i < m.getNumFaces(); ++i)
+  {
+    Mesh::Face f = m.getFace(i);
+    const Cvec3 n = f.getNormal();
+    for (int j = 0; j < f.getNumVertices(); ++j)
+    {
+      f.getVertex(j).setNormal(f.getVertex(j).getNormal() + n);
+    }
+  }
+
+  // lastely divide them with valance of a vertex
+  for (int i = 0; i < m.getNumVertices(); ++i)
+  {
+    const Mesh::Vertex v = m.getVertex(i);
+
+    int count = 0;
+    Mesh::VertexIterator it(v.getIterator()), it0(it);
+    do
+    {
+      ++count;
+    } while (++it != it0); // go around once the 1ring
+
+    v.setNormal(v.getNormal() / count);
+  }
+}
+
+shared_ptr<Mesh> catmull_clark_subdivision_mesh(shared_ptr<Mesh> m)
+{
+  shared_ptr<Mesh> result_mesh = make_shared<Mesh>(*m);
+
+  compute_catmull_clark_vertices(*result_mesh);
+
+  // Apply cached new vertices to subdivision
+  result_mesh->subdivide();
+
+  set_flat_vertex_normals(*result_mesh);
+
+  return result_mesh;
+}
+
+shared_ptr<Mesh> subdivide_mesh(shared_ptr<Mesh> m, int n)
+{
+  shared_ptr<Mesh> temp = make_shared<Mesh>(*m);
+  for (int i = 0; i < n; ++i)
+  {
+    temp = catmull_clark_subdivision_mesh(temp);
+  }
+  return temp;
+}
+
+Aabb get_mesh_bounds(Mesh& m)
+{
+  Aabb bounds;
+  for (int i = 0; i < m.getNumVertices(); ++i)
+  {
+    bounds.add(m.getVertex(i).getPosition());
+  }
+  return bounds;
+}
+
+int get_mesh_vertices_len(Mesh& m)
+{
+  int len = 0;
+  for (int i = 0; i < m.getNumFaces(); ++i)
+  {
+    len += m.getFace(i).getNumVertices() == 4 ? 6 : 3;
+  }
+  return len;
+}
+
+// Opens 'filename' for writing with IO errors reported as exceptions
+static void open_for_write(ofstream& f, const char filename[])
+{
+  f.open(filename);
+  if (!f)
+  {
+    throw runtime_error(string("Cannot write file ") + filename);
+  }
+  f.exceptions(ios::failbit | ios::badbit);
+  f.precision(17);
+}
+
+void save_mesh(Mesh& m, const char filename[])
+{
+  ofstream f;
+  open_for_write(f, filename);
+
+  int nt = 0, nq = 0;
+  for (int i = 0; i < m.getNumFaces(); ++i)
+  {
+    if (m.getFace(i).getNumVertices() == 3)
+      ++nt;
+    else
+      ++nq;
+  }
+
+  f << m.getNumVertices() << ' ' << nt << ' ' << nq << '\n';
+  for (int i = 0; i < m.getNumVertices(); ++i)
+  {
+    const Cvec3 p = m.getVertex(i).getPosition();
+    f << p[0] << ' ' << p[1] << ' ' << p[2] << '\n';
+  }
+
+  // Mesh::load expects all the triangles before the quads
+  for (int pass = 3; pass <= 4; ++pass)
+  {
+    for (int i = 0; i < m.getNumFaces(); ++i)
+    {
+      const Mesh::Face face = m.getFace(i);
+      if (face.getNumVertices() != pass)
+        continue;
+      for (int j = 0; j < pass; ++j)
+        f << face.getVertex(j).getIndex() << (j + 1 < pass ? ' ' : '\n');
+    }
+  }
+}
+
+void export_obj_mesh(Mesh& m, const char filename[], bool withNormals)
+{
+  ofstream f;
+  open_for_write(f, filename);
+
+  for (int i = 0; i < m.getNumVertices(); ++i)
+  {
+    const Cvec3 p = m.getVertex(i).getPosition();
+    f << "v " << p[0] << ' ' << p[1] << ' ' << p[2] << '\n';
+  }
+  if (withNormals)
+  {
+    for (int i = 0; i < m.getNumVertices(); ++i)
+    {
+      const Cvec3 n = m.getVertex(i).getNormal();
+      f << "vn " << n[0] << ' ' << n[1] << ' ' << n[2] << '\n';
+    }
+  }
+
+  // OBJ indices are 1-based; with normals, vertex i uses normal i
+  for (int i = 0; i < m.getNumFaces(); ++i)
+  {
+    const Mesh::Face face = m.getFace(i);
+    f << 'f';
+    for (int j = 0; j < face.getNumVertices(); ++j)
+    {
+      const int k = face.getVertex(j).getIndex() + 1;
+      f << ' ' << k;
+      if (withNormals)
+        f << "//" << k;
+    }
+    f << '\n';
+  }
+}
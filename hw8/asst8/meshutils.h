@@ -0,0 +1,78 @@
+#ifndef MESHUTILS_H
+#define MESHUTILS_H
+
+#include <vector>
+#include <memory>
+
+#include "cvec.h"
+#include "bounds.h"
+#include "mesh.h"
+
+//--------------------------------------------------------------------------------
+// Catmull-Clark subdivision, vertex normals, conversion of a Mesh into a
+// triangle vertex stream, and mesh export. None of this depends on OpenGL; it
+// is built into libmeshcore.a (see the Makefile) together with mesh.h, so
+// batch tools can link it without a display.
+//--------------------------------------------------------------------------------
+
+// Computes the new face, edge and vertex points of one Catmull-Clark step and
+// stores them in 'm' (see Mesh::setNewFaceVertex and friends). Mesh::subdivide()
+// then builds the refined mesh out of them.
+void compute_catmull_clark_vertices(Mesh& m);
+
+// Sets every vertex normal of 'm' to the normal of one of its faces. Good enough
+// for flat shading, which only uses face normals anyway.
+void set_flat_vertex_normals(Mesh& m);
+
+// Sets every vertex normal of 'm' to the average of its adjacent face normals
+void compute_smooth_vertex_normals(Mesh& m);
+
+// Returns a new mesh that is one Catmull-Clark subdivision of 'm', with flat
+// vertex normals
+std::shared_ptr<Mesh> catmull_clark_subdivision_mesh(std::shared_ptr<Mesh> m);
+
+// Applies 'n' levels of Catmull-Clark subdivision to a copy of 'm'
+std::shared_ptr<Mesh> subdivide_mesh(std::shared_ptr<Mesh> m, int n);
+
+// Writes 'm' in the .mesh format read by Mesh::load: triangles first, then
+// quads. Note that Mesh::load recenters and rescales the positions it reads.
+// Throws runtime_error if the file cannot be written.
+void save_mesh(Mesh& m, const char filename[]);
+
+// Writes 'm' as a Wavefront OBJ file, with per-vertex normals if 'withNormals'.
+// Throws runtime_error if the file cannot be written.
+void export_obj_mesh(Mesh& m, const char filename[], bool withNormals);
+
+// Box around the vertex positions of 'm'. Catmull-Clark surfaces stay inside
+// the convex hull of their control mesh, so this also bounds every subdivision
+// level of 'm'.
+Aabb get_mesh_bounds(Mesh& m);
+
+// Number of vertices build_mesh_vertices produces for 'm'
+int get_mesh_vertices_len(Mesh& m);
+
+// Triangulates 'm' into an unindexed triangle list. With 'smooth', the
+// vertex normals of 'm' are recomputed and used; otherwise the face normals are.
+// Vertex must be constructible from a (position, normal) pair of Cvec3.
+template<typename Vertex>
+void build_mesh_vertices(Mesh& m, bool smooth, std::vector<Vertex>& vtx) {
+  if (smooth)
+    compute_smooth_vertex_normals(m);
+
+  vtx.clear();
+  vtx.reserve(get_mesh_vertices_len(m));
+  for (int i = 0; i < m.getNumFaces(); ++i) {
+    const Mesh::Face f = m.getFace(i);
+    const Cvec3 faceNormal = smooth ? Cvec3() : f.getNormal();
+    const int n = f.getNumVertices();
+
+    // fan triangulation: (0, 1, 2) and, for quads, (2, 3, 0)
+    static const int order[6] = {0, 1, 2, 2, 3, 0};
+    for (int k = 0; k < (n == 4 ? 6 : 3); ++k) {
+      const Mesh::Vertex v = f.getVertex(order[k]);
+      vtx.push_back(Vertex(v.getPosition(), smooth ? v.getNormal() : faceNormal));
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,178 @@
+#ifndef NODEARENA_H
+#define NODEARENA_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <vector>
+#include <memory>
+#include <new>
+#include <algorithm>
+#include <utility>
+
+#include "glsupport.h" // for Noncopyable
+
+//--------------------------------------------------------------------------------
+// Pool allocator for scene graph nodes
+//
+// Memory comes from large chunks and is handed out in allocation order, so
+// nodes created one after the other sit next to each other. A freed block goes
+// on a free list and is reused by the next allocation of the same size, i.e.
+// the next node of the same type; chunks go back to the system only when the
+// arena itself goes away. reserve() sizes the next chunk up front, e.g. from
+// the node counts in a scene file, so a whole scene fits in one.
+//
+// Nodes are made with makeArenaShared, which is allocate_shared with an
+// ArenaAllocator: the result is an ordinary shared_ptr (shared_from_this
+// works), and every node holds a reference to the arena, which therefore
+// lives as long as the last of its nodes.
+//
+// An arena is not thread-safe: nodes of one arena must be created and
+// destroyed on one thread at a time.
+//--------------------------------------------------------------------------------
+
+class NodeArena : Noncopyable {
+public:
+  // 'chunkSize' is the size of the chunks allocated once the reserve is used up
+  explicit NodeArena(size_t chunkSize = 64 * 1024)
+    : next_(NULL), end_(NULL), chunkSize_(chunkSize), bytesUsed_(0) {}
+
+  ~NodeArena() {
+    for (size_t i = 0; i < chunks_.size(); ++i)
+      std::free(chunks_[i]);
+  }
+
+  // Makes sure the next 'bytes' bytes of allocations need no new chunk
+  void reserve(size_t bytes) {
+    if (size_t(end_ - next_) < bytes)
+      addChunk(bytes);
+  }
+
+  void* allocate(size_t bytes, size_t alignment) {
+    for (size_t i = 0; i < freeLists_.size(); ++i) {
+      FreeList& list = freeLists_[i];
+      if (list.bytes == bytes && list.alignment == alignment && list.head) {
+        FreeBlock* block = list.head;
+        list.head = block->next;
+        bytesUsed_ += bytes;
+        return block;
+      }
+    }
+
+    char* p = align(next_, alignment);
+    if (!p || p + bytes > end_) {
+      addChunk(std::max(chunkSize_, bytes + alignment));
+      p = align(next_, alignment);
+    }
+    next_ = p + bytes;
+    bytesUsed_ += bytes;
+    return p;
+  }
+
+  // Gives back a block from allocate(bytes, alignment) for reuse
+  void deallocate(void* p, size_t bytes, size_t alignment) {
+    FreeBlock* block = static_cast<FreeBlock*>(p);
+    bytesUsed_ -= bytes;
+    for (size_t i = 0; i < freeLists_.size(); ++i) {
+      FreeList& list = freeLists_[i];
+      if (list.bytes == bytes && list.alignment == alignment) {
+        block->next = list.head;
+        list.head = block;
+        return;
+      }
+    }
+    // blocks too small to hold the link are not reused
+    if (bytes < sizeof(FreeBlock))
+      return;
+    FreeList list = {bytes, alignment, block};
+    block->next = NULL;
+    freeLists_.push_back(list);
+  }
+
+  // Total size of the live allocations, without padding
+  size_t getBytesUsed() const {
+    return bytesUsed_;
+  }
+
+  int getNumChunks() const {
+    return chunks_.size();
+  }
+
+private:
+  struct FreeBlock {
+    FreeBlock* next;
+  };
+
+  // freed blocks of one size; there are as many lists as node types
+  struct FreeList {
+    size_t bytes, alignment;
+    FreeBlock* head;
+  };
+
+  std::vector<char*> chunks_;
+  std::vector<FreeList> freeLists_;
+  char* next_;
+  char* end_;
+  size_t chunkSize_;
+  size_t bytesUsed_;
+
+  static char* align(char* p, size_t alignment) {
+    return p ? reinterpret_cast<char*>((reinterpret_cast<size_t>(p) + alignment - 1) & ~(alignment - 1)) : NULL;
+  }
+
+  void addChunk(size_t bytes) {
+    // malloc returns memory aligned for any type
+    char* chunk = static_cast<char*>(std::malloc(bytes));
+    if (!chunk)
+      throw std::bad_alloc();
+    chunks_.push_back(chunk);
+    next_ = chunk;
+    end_ = chunk + bytes;
+  }
+};
+
+// Standard allocator over a NodeArena, for allocate_shared
+template<typename T>
+class ArenaAllocator {
+public:
+  typedef T value_type;
+
+  explicit ArenaAllocator(const std::shared_ptr<NodeArena>& arena)
+    : arena_(arena) {}
+
+  template<typename U>
+  ArenaAllocator(const ArenaAllocator<U>& other)
+    : arena_(other.getArena()) {}
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(arena_->allocate(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T* p, size_t n) {
+    arena_->deallocate(p, n * sizeof(T), alignof(T));
+  }
+
+  const std::shared_ptr<NodeArena>& getArena() const {
+    return arena_;
+  }
+
+  template<typename U>
+  bool operator == (const ArenaAllocator<U>& other) const {
+    return arena_ == other.getArena();
+  }
+
+  template<typename U>
+  bool operator != (const ArenaAllocator<U>& other) const {
+    return arena_ != other.getArena();
+  }
+
+private:
+  std::shared_ptr<NodeArena> arena_;
+};
+
+// make_shared<T>(args...) with the node and its reference count in 'arena'
+template<typename T, typename... Args>
+std::shared_ptr<T> makeArenaShared(const std::shared_ptr<NodeArena>& arena, Args&&... args) {
+  return std::allocate_shared<T>(ArenaAllocator<T>(arena), std::forward<Args>(args)...);
+}
+
+#endif
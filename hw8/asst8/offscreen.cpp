@@ -0,0 +1,112 @@
+#include <cstring>
+#include <stdexcept>
+
+#include <GL/glew.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include "offscreen.h"
+
+using namespace std;
+
+static bool hasExtension(const char* extensions, const char* name) {
+  if (!extensions)
+    return false;
+  const size_t n = strlen(name);
+  for (const char* p = strstr(extensions, name); p; p = strstr(p + n, name)) {
+    if ((p == extensions || p[-1] == ' ') && (p[n] == ' ' || p[n] == '\0'))
+      return true;
+  }
+  return false;
+}
+
+static EGLDisplay openDisplay() {
+  // client extensions are queried without a display
+  const char* clientExtensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+  if (hasExtension(clientExtensions, "EGL_MESA_platform_surfaceless") &&
+      hasExtension(clientExtensions, "EGL_EXT_platform_base")) {
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+      (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay) {
+      EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+      if (display != EGL_NO_DISPLAY)
+        return display;
+    }
+  }
+  return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+
+OffscreenContext::OffscreenContext()
+  : display_(openDisplay()), surface_(EGL_NO_SURFACE), context_(EGL_NO_CONTEXT) {
+  EGLint major, minor;
+  if (display_ == EGL_NO_DISPLAY || !eglInitialize(display_, &major, &minor))
+    throw runtime_error("OffscreenContext: cannot initialize an EGL display");
+  if (!eglBindAPI(EGL_OPENGL_API)) {
+    eglTerminate(display_);
+    throw runtime_error("OffscreenContext: the EGL display has no desktop OpenGL");
+  }
+
+  const char* extensions = eglQueryString(display_, EGL_EXTENSIONS);
+  const bool surfaceless = hasExtension(extensions, "EGL_KHR_surfaceless_context");
+  const EGLint configAttribs[] = {
+    EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+    EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+    EGL_NONE
+  };
+  EGLConfig config = NULL;
+  EGLint numConfigs = 0;
+  eglChooseConfig(display_, configAttribs, &config, 1, &numConfigs);
+
+  if (numConfigs > 0)
+    context_ = eglCreateContext(display_, config, EGL_NO_CONTEXT, NULL);
+  else if (surfaceless && hasExtension(extensions, "EGL_KHR_no_config_context"))
+    context_ = eglCreateContext(display_, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, NULL);
+  if (context_ == EGL_NO_CONTEXT) {
+    eglTerminate(display_);
+    throw runtime_error("OffscreenContext: cannot create an OpenGL context");
+  }
+
+  if (!surfaceless && numConfigs > 0) {
+    const EGLint pbufferAttribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+    surface_ = eglCreatePbufferSurface(display_, config, pbufferAttribs);
+  }
+  if ((!surfaceless && surface_ == EGL_NO_SURFACE) || !eglMakeCurrent(display_, surface_, surface_, context_)) {
+    if (surface_ != EGL_NO_SURFACE)
+      eglDestroySurface(display_, surface_);
+    eglDestroyContext(display_, context_);
+    eglTerminate(display_);
+    throw runtime_error("OffscreenContext: cannot make the OpenGL context current");
+  }
+}
+
+OffscreenContext::~OffscreenContext() {
+  eglMakeCurrent(display_, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  if (surface_ != EGL_NO_SURFACE)
+    eglDestroySurface(display_, surface_);
+  eglDestroyContext(display_, context_);
+  eglTerminate(display_);
+}
+
+OffscreenFramebuffer::OffscreenFramebuffer(int width, int height, bool srgb)
+  : width_(width), height_(height) {
+  glBindRenderbuffer(GL_RENDERBUFFER, color_);
+  glRenderbufferStorage(GL_RENDERBUFFER, srgb ? GL_SRGB8_ALPHA8 : GL_RGBA8, width, height);
+  glBindRenderbuffer(GL_RENDERBUFFER, depth_);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+  glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo_);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color_);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth_);
+  const bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  if (!complete)
+    throw runtime_error("OffscreenFramebuffer: the framebuffer is incomplete");
+  checkGlErrors();
+}
+
+void OffscreenFramebuffer::bind() {
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo_);
+  glDrawBuffer(GL_COLOR_ATTACHMENT0);
+  glReadBuffer(GL_COLOR_ATTACHMENT0);
+}
@@ -0,0 +1,58 @@
+#ifndef OFFSCREEN_H
+#define OFFSCREEN_H
+
+#include <EGL/egl.h>
+
+#include "glsupport.h"
+
+//--------------------------------------------------------------------------------
+// Rendering without a window or a display, for batch rendering on servers
+//
+// OffscreenContext creates a GL context through EGL, on Mesa's surfaceless
+// platform when the EGL library has it (no X server needed, and llvmpipe
+// renders on the CPU if there is no GPU), on the default display otherwise.
+// The context has no window to draw to: frames go to an OffscreenFramebuffer.
+//
+// Only built with OFFSCREEN=1, which links libEGL.
+//--------------------------------------------------------------------------------
+
+class OffscreenContext : Noncopyable {
+public:
+  // Creates a context with the default attributes, which gives a
+  // compatibility profile context on Mesa, and makes it current. Throws
+  // runtime_error if there is no usable EGL display or context.
+  OffscreenContext();
+  ~OffscreenContext();
+
+private:
+  EGLDisplay display_;
+  EGLSurface surface_; // a 1x1 pbuffer if the display cannot go without a surface
+  EGLContext context_;
+};
+
+// Color and depth renderbuffers that stand in for the window
+class OffscreenFramebuffer : Noncopyable {
+  GlFramebufferObject fbo_;
+  GlRenderbufferObject color_, depth_;
+  int width_, height_;
+
+public:
+  // With 'srgb', the color buffer is sRGB encoded, as the window of a GL3
+  // context with GL_FRAMEBUFFER_SRGB enabled. Throws runtime_error if the
+  // framebuffer cannot be completed.
+  OffscreenFramebuffer(int width, int height, bool srgb);
+
+  // Makes this the draw and read framebuffer, so the frame can be read back
+  // with glReadPixels, e.g. by writePpmScreenshot
+  void bind();
+
+  int getWidth() const {
+    return width_;
+  }
+
+  int getHeight() const {
+    return height_;
+  }
+};
+
+#endif
@@ -0,0 +1,201 @@
+////////////////////////////////////////////////////////////////////////
+//
+//   pickbench: CPU ray picking on a scene of many shapes
+//
+//   Builds a grid of spheres, each under its own SgRbtNode and sharing
+//   one triangle mesh, as a crowd of instances does. Casts rays through
+//   random pixels of a view of the whole grid and compares, per pick:
+//     - RayPicker::pickShape, which visits the shapes in the order the
+//       SceneBvh hands them out and stops at the nearest hit
+//     - testing the ray against every shape of the FlatScene and keeping
+//       the nearest hit
+//   Both go through the same RayMesh, whose BVH is built before timing.
+//   Results go to stdout as JSON. No GL calls are made.
+//
+//   Usage: pickbench [-n shapes] [-s slices] [-p picks]
+//
+////////////////////////////////////////////////////////////////////////
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+#include <vector>
+#include <memory>
+#include <random>
+#include <algorithm>
+#include <iterator>
+#include <iostream>
+
+#include "rigtform.h"
+#include "scenegraph.h"
+#include "flatscene.h"
+#include "scenebvh.h"
+#include "raycast.h"
+#include "raypicker.h"
+#include "geometrymaker.h"
+
+using namespace std;
+
+static const double RADIUS = 1, SPACING = 3;
+
+// What RayMesh reads from a vertex
+struct Position {
+  Cvec3f p;
+};
+
+// Sphere that can only be picked, with the triangles shared by all of them
+class SphereShapeNode : public SgShapeNode {
+  shared_ptr<RayMesh> mesh_;
+public:
+  explicit SphereShapeNode(const shared_ptr<RayMesh>& mesh) : mesh_(mesh) {}
+
+  virtual Matrix4 getAffineMatrix() {
+    return Matrix4();
+  }
+
+  virtual void draw(const Uniforms& uniforms) {}
+
+  virtual Aabb getBounds() {
+    return Aabb(Cvec3(-RADIUS), Cvec3(RADIUS));
+  }
+
+  virtual bool intersectRay(const Cvec3& origin, const Cvec3& dir, double tMax, double& t) {
+    return mesh_->intersectRay(origin, dir, tMax, t);
+  }
+};
+
+static shared_ptr<RayMesh> makeSphereMesh(int slices) {
+  const int stacks = max(2, slices / 2);
+  int vbLen, ibLen;
+  getSphereVbIbLen(slices, stacks, vbLen, ibLen);
+  vector<GenericVertex> vtx;
+  vector<unsigned short> idx;
+  vtx.reserve(vbLen);
+  idx.reserve(ibLen);
+  makeSphere(RADIUS, slices, stacks, back_inserter(vtx), back_inserter(idx));
+
+  vector<Position> positions(vbLen);
+  for (int i = 0; i < vbLen; ++i)
+    positions[i].p = vtx[i].pos;
+  shared_ptr<RayMesh> mesh(new RayMesh());
+  mesh->setTriangles(&positions[0], &idx[0], vbLen, ibLen);
+  return mesh;
+}
+
+static Cvec3 rotate(const Quat& q, const Cvec3& v) {
+  return Cvec3(q * Cvec4(v, 0));
+}
+
+// The same search as RayPicker::pickShape without the SceneBvh
+static int pickShapeBruteForce(const FlatScene& scene, const Cvec3& origin, const Cvec3& dir, double tMax, double& t) {
+  int nearest = -1;
+  for (int k = 0, n = scene.getNumShapes(); k < n; ++k) {
+    const RigTForm invWorld = inv(scene.getWorldRbt(scene.getShapeTransform(k)));
+    const Cvec3 o = invWorld.getTranslation() + rotate(invWorld.getRotation(), origin);
+    const Cvec3 d = rotate(invWorld.getRotation(), dir);
+
+    double hit;
+    if (scene.getShapeNode(k)->intersectRay(o, d, tMax, hit)) {
+      tMax = hit;
+      t = hit;
+      nearest = k;
+    }
+  }
+  return nearest;
+}
+
+template<typename F>
+static double timePicks(int picks, F pick) {
+  const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  for (int p = 0; p < picks; ++p)
+    pick(p);
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count() * 1e6 / picks;
+}
+
+int main(int argc, char* argv[]) {
+  int numShapes = 7200, slices = 16, picks = 1000;
+
+  for (int i = 1; i < argc; ++i) {
+    const bool hasValue = i + 1 < argc;
+    if (!strcmp(argv[i], "-n") && hasValue)
+      numShapes = max(1, atoi(argv[++i]));
+    else if (!strcmp(argv[i], "-s") && hasValue)
+      slices = max(3, atoi(argv[++i]));
+    else if (!strcmp(argv[i], "-p") && hasValue)
+      picks = max(1, atoi(argv[++i]));
+    else {
+      cerr << "Usage: " << argv[0] << " [-n shapes] [-s slices] [-p picks]" << endl;
+      return 1;
+    }
+  }
+
+  try {
+    // a cube of spheres, slightly jittered so the rays do not line up with it
+    mt19937 rng(175);
+    uniform_real_distribution<double> jitter(-0.5, 0.5);
+    const int side = int(ceil(cbrt(double(numShapes))));
+    shared_ptr<RayMesh> mesh = makeSphereMesh(slices);
+    shared_ptr<SgRootNode> root = make_shared<SgRootNode>();
+    for (int k = 0; k < numShapes; ++k) {
+      const Cvec3 cell(k % side, k / side % side, k / (side * side));
+      const Cvec3 p = (cell - Cvec3((side - 1) * 0.5)) * SPACING + Cvec3(jitter(rng), jitter(rng), jitter(rng));
+      shared_ptr<SgRbtNode> node = make_shared<SgRbtNode>(RigTForm(p));
+      node->addChild(make_shared<SphereShapeNode>(mesh));
+      root->addChild(node);
+    }
+
+    FlatScene flat(root);
+    flat.update();
+    SceneBvh sceneBvh;
+    sceneBvh.build(flat);
+    const RayPicker picker(flat, sceneBvh);
+
+    // the grid fills a 60 degree view from in front of it
+    const double extent = side * SPACING;
+    const RigTForm eyeRbt(Cvec3(0, 0, extent * 1.5));
+    const Matrix4 projMatrix = Matrix4::makeProjection(60, 1, -0.1, -extent * 4);
+    const int size = 1024;
+    uniform_int_distribution<int> pixel(0, size - 1);
+    vector<Cvec3> origins(picks), dirs(picks);
+    for (int p = 0; p < picks; ++p)
+      RayPicker::getPixelRay(eyeRbt, projMatrix, pixel(rng), pixel(rng), size, size, origins[p], dirs[p]);
+
+    // builds the BVH of the mesh, which a first click in asst8 also pays for
+    double t;
+    mesh->intersectRay(origins[0], dirs[0], 1, t);
+
+    vector<int> bvhShapes(picks), allShapes(picks);
+    vector<double> bvhT(picks, -1), allT(picks, -1);
+    const double bvhUs = timePicks(picks, [&](int p) {
+      bvhShapes[p] = picker.pickShape(origins[p], dirs[p], 1, bvhT[p]);
+    });
+    const double allUs = timePicks(picks, [&](int p) {
+      allShapes[p] = pickShapeBruteForce(flat, origins[p], dirs[p], 1, allT[p]);
+    });
+
+    int hits = 0;
+    bool match = true;
+    for (int p = 0; p < picks; ++p) {
+      hits += bvhShapes[p] >= 0;
+      // on a tie the two may pick different shapes at the same distance
+      match = match && (bvhShapes[p] == allShapes[p] || fabs(bvhT[p] - allT[p]) < 1e-12);
+    }
+
+    printf("{\n");
+    printf("  \"shapes\": %d, \"trianglesPerShape\": %d, \"picks\": %d, \"hits\": %d,\n",
+           numShapes, mesh->getNumTriangles(), picks, hits);
+    printf("  \"results\": {\n");
+    printf("    \"sceneBvh\": {\"usPerPick\": %.3f},\n", bvhUs);
+    printf("    \"everyShape\": {\"usPerPick\": %.3f}\n", allUs);
+    printf("  },\n");
+    printf("  \"bvhMatchesEveryShape\": %s\n", match ? "true" : "false");
+    printf("}\n");
+    return match ? 0 : 1;
+  }
+  catch (const runtime_error& e) {
+    cerr << "Exception caught: " << e.what() << endl;
+    return 1;
+  }
+}
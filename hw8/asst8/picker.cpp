@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <cmath>
+
 #include <GL/glew.h>
 
 #include "uniforms.h"
@@ -5,36 +8,88 @@
 
 using namespace std;
 
-Picker::Picker(const RigTForm& initialRbt, Uniforms& uniforms)
-  : drawer_(initialRbt, uniforms)
-  , idCounter_(0)
-  , srgbFrameBuffer_(!g_Gl2Compatible) {}
+// encode 2^8 = 256 IDs in each of R, G, B channel, for a total of 2^24 - 1
+// objects besides the background
+static const int NBITS = 8, N = 1 << NBITS, MASK = N-1;
+
+static Cvec3 idToColor(int id) {
+  if (id >= N * N * N)
+    throw runtime_error("Picker: too many shapes for color IDs, use integer IDs");
+  // each channel value k in [0, 255] is sent as k / 255, which the framebuffer
+  // stores back exactly as k
+  return Cvec3(id & MASK, (id >> NBITS) & MASK, (id >> (NBITS+NBITS)) & MASK) / MASK;
+}
+
+static int colorToId(const PackedPixel& p) {
+  return p.r | (p.g << NBITS) | (p.b << (NBITS+NBITS));
+}
+
+static shared_ptr<SgRbtNode> toShared(SgRbtNode* node) {
+  return node ? static_pointer_cast<SgRbtNode>(node->shared_from_this()) : shared_ptr<SgRbtNode>();
+}
+
+template<typename Node>
+static Node find(const vector<Node>& idToRbtNode, unsigned id) {
+  if (id < idToRbtNode.size())
+    return idToRbtNode[id];
+  else
+    return Node(); // set to null
+}
+
+void PickBuffer::bind(int width, int height) {
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo_);
+  if (width != width_ || height != height_) {
+    glBindRenderbuffer(GL_RENDERBUFFER, color_);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_R32UI, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, depth_);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color_);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth_);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+      glBindFramebuffer(GL_FRAMEBUFFER, 0);
+      throw runtime_error("PickBuffer: the ID framebuffer is incomplete");
+    }
+    width_ = width;
+    height_ = height;
+  }
+
+  // integer color buffers are cleared with glClearBufferuiv, not glClear
+  const GLuint background[4] = {0, 0, 0, 0};
+  glClearBufferuiv(GL_COLOR, 0, background);
+  glClear(GL_DEPTH_BUFFER_BIT);
+  checkGlErrors();
+}
+
+void PickBuffer::unbind() {
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+Picker::Picker(const RigTForm& initialRbt, Uniforms& uniforms, bool integerIds)
+  : rbtNodeStack_(1)
+  , idToRbtNode_(1)
+  , integerIds_(integerIds)
+  , drawer_(initialRbt, uniforms) {}
 
 bool Picker::visit(SgTransformNode& node) {
-  nodeStack_.push_back(node.shared_from_this());
+  rbtNodeStack_.push_back(node.getType() == SgNode::RBT ? static_cast<SgRbtNode*>(&node) : rbtNodeStack_.back());
   return drawer_.visit(node);
 }
 
 bool Picker::postVisit(SgTransformNode& node) {
-  nodeStack_.pop_back();
+  rbtNodeStack_.pop_back();
   return drawer_.postVisit(node);
 }
 
 bool Picker::visit(SgShapeNode& node) {
-  idCounter_++;
-  for (int i = nodeStack_.size() - 1; i >= 0; --i) {
-    shared_ptr<SgRbtNode> asRbtNode = dynamic_pointer_cast<SgRbtNode>(nodeStack_[i]);
-    if (asRbtNode) {
-      addToMap(idCounter_, asRbtNode);
-      break;
-    }
-  }
-  const Cvec3 idColor = idToColor(idCounter_);
-
-  // DEBUG OUTPUT
-  cerr << idCounter_ << " => " << idColor[0] << ' ' << idColor[1] << ' ' << idColor[2] << endl;
-
-  drawer_.getUniforms().put("uIdColor", idColor);
+  const int id = idToRbtNode_.size();
+  idToRbtNode_.push_back(rbtNodeStack_.back());
+  if (integerIds_)
+    drawer_.getUniforms().put("uId", id);
+  else
+    drawer_.getUniforms().put("uIdColor", idToColor(id));
   return drawer_.visit(node);
 }
 
@@ -43,56 +98,214 @@ bool Picker::postVisit(SgShapeNode& node) {
 }
 
 shared_ptr<SgRbtNode> Picker::getRbtNodeAtXY(int x, int y) {
+  if (integerIds_) {
+    GLuint id = 0;
+    glReadPixels(x, y, 1, 1, GL_RED_INTEGER, GL_UNSIGNED_INT, &id);
+    return toShared(find(idToRbtNode_, id));
+  }
   PackedPixel query;
   glReadPixels(x, y, 1, 1, GL_RGB, GL_UNSIGNED_BYTE, &query);
-  const int id = colorToId(query);
+  return toShared(find(idToRbtNode_, colorToId(query)));
+}
 
-  // DEBUG OUTPUT
-  cerr << int(query.r) << ' ' << int(query.g) << ' ' << int(query.b) << " => " << id << endl;
+void Picker::getRbtNodeAtXYAsync(int x, int y, PickReadback& readback, const PickReadback::Callback& done) {
+  PickReadback::IdTable ids(idToRbtNode_.size());
+  for (size_t i = 0; i < ids.size(); ++i)
+    ids[i] = toShared(idToRbtNode_[i]);
+  readback.request(x, y, integerIds_, ids, done);
+}
 
-  return find(id);
+// Reads the IDs of a rectangle of the current read framebuffer, row by row
+// from the bottom
+void Picker::readIds(int x, int y, int width, int height, vector<GLuint>& ids) {
+  ids.resize(width * height);
+  if (ids.empty())
+    return;
+  if (integerIds_) {
+    glReadPixels(x, y, width, height, GL_RED_INTEGER, GL_UNSIGNED_INT, &ids[0]);
+    return;
+  }
+  vector<PackedPixel> pixels(ids.size());
+  glReadPixels(x, y, width, height, GL_RGB, GL_UNSIGNED_BYTE, &pixels[0]);
+  for (size_t i = 0; i < pixels.size(); ++i)
+    ids[i] = colorToId(pixels[i]);
 }
 
-//------------------
-// Helper functions
-//------------------
-//
-void Picker::addToMap(int id, shared_ptr<SgRbtNode> node) {
-  idToRbtNode_[id] = node;
+vector<shared_ptr<SgRbtNode> > Picker::getRbtNodesOfIds(const vector<GLuint>& ids) {
+  // a pixel count's worth of IDs usually repeats few shapes many times, so
+  // mark the shapes first and look their nodes up once
+  vector<char> seen(idToRbtNode_.size(), 0);
+  for (size_t i = 0; i < ids.size(); ++i) {
+    if (ids[i] < seen.size())
+      seen[ids[i]] = 1;
+  }
+
+  // several shapes may hang from the same node
+  vector<SgRbtNode*> found;
+  for (size_t id = 1; id < seen.size(); ++id) {
+    if (seen[id] && idToRbtNode_[id])
+      found.push_back(idToRbtNode_[id]);
+  }
+  sort(found.begin(), found.end());
+  found.erase(unique(found.begin(), found.end()), found.end());
+
+  vector<shared_ptr<SgRbtNode> > nodes(found.size());
+  for (size_t i = 0; i < found.size(); ++i)
+    nodes[i] = toShared(found[i]);
+  return nodes;
 }
 
-shared_ptr<SgRbtNode> Picker::find(int id) {
-  IdToRbtNodeMap::iterator it = idToRbtNode_.find(id);
-  if (it != idToRbtNode_.end())
-    return it->second;
-  else
-    return shared_ptr<SgRbtNode>(); // set to null
+// Clips the rectangle to the viewport, returns false if nothing is left
+static bool clipToViewport(int& x, int& y, int& width, int& height) {
+  GLint viewport[4];
+  glGetIntegerv(GL_VIEWPORT, viewport);
+  const int x1 = min(x + width, viewport[0] + viewport[2]), y1 = min(y + height, viewport[1] + viewport[3]);
+  x = max(x, int(viewport[0]));
+  y = max(y, int(viewport[1]));
+  width = x1 - x;
+  height = y1 - y;
+  return width > 0 && height > 0;
 }
 
-// encode 2^4 = 16 IDs in each of R, G, B channel, for a total of 16^3 number of objects
-static const int NBITS = 4, N = 1 << NBITS, MASK = N-1;
+vector<shared_ptr<SgRbtNode> > Picker::getRbtNodesInRect(int x, int y, int width, int height) {
+  vector<GLuint> ids;
+  if (clipToViewport(x, y, width, height))
+    readIds(x, y, width, height, ids);
+  return getRbtNodesOfIds(ids);
+}
 
-Cvec3 Picker::idToColor(int id) {
-  assert(id > 0 && id < N * N * N);
-  Cvec3 framebufferColor = Cvec3(id & MASK, (id >> NBITS) & MASK, (id >> (NBITS+NBITS)) & MASK);
-  framebufferColor = framebufferColor / N + Cvec3(0.5/N);
+vector<shared_ptr<SgRbtNode> > Picker::getRbtNodesInLasso(const vector<Cvec2>& lasso) {
+  if (lasso.size() < 3)
+    return vector<shared_ptr<SgRbtNode> >();
 
-  if (!srgbFrameBuffer_)
-    return framebufferColor;
-  else {
-    // if GL3 is used, the framebuffer will be in SRGB format, and the color we supply needs to be in linear space
-    Cvec3 linearColor;
-    for (int i = 0; i < 3; ++i) {
-      linearColor[i] = framebufferColor[i] <= 0.04045 ? framebufferColor[i]/12.92 : pow((framebufferColor[i] + 0.055)/1.055, 2.4);
+  double minX = lasso[0][0], maxX = minX, minY = lasso[0][1], maxY = minY;
+  for (size_t i = 1; i < lasso.size(); ++i) {
+    minX = min(minX, lasso[i][0]);
+    maxX = max(maxX, lasso[i][0]);
+    minY = min(minY, lasso[i][1]);
+    maxY = max(maxY, lasso[i][1]);
+  }
+  int x = int(floor(minX)), y = int(floor(minY));
+  int width = int(ceil(maxX)) - x + 1, height = int(ceil(maxY)) - y + 1;
+  if (!clipToViewport(x, y, width, height))
+    return vector<shared_ptr<SgRbtNode> >();
+
+  vector<GLuint> ids;
+  readIds(x, y, width, height, ids);
+
+  // scan each row: the pixels between the 1st and 2nd crossing of the row
+  // center with the polygon are inside, and so on
+  vector<double> crossings;
+  for (int row = 0; row < height; ++row) {
+    const double cy = y + row + 0.5;
+    crossings.clear();
+    for (size_t i = 0, n = lasso.size(); i < n; ++i) {
+      const Cvec2& a = lasso[i];
+      const Cvec2& b = lasso[(i + 1) % n];
+      if ((a[1] <= cy) != (b[1] <= cy))
+        crossings.push_back(a[0] + (cy - a[1]) * (b[0] - a[0]) / (b[1] - a[1]));
+    }
+    sort(crossings.begin(), crossings.end());
+
+    GLuint* rowIds = &ids[row * width];
+    int col = 0;
+    for (size_t k = 0; k + 1 < crossings.size(); k += 2) {
+      // pixel centers x + col + 0.5 in [crossings[k], crossings[k + 1])
+      const int begin = max(0, int(ceil(crossings[k] - x - 0.5)));
+      const int end = min(width, int(ceil(crossings[k + 1] - x - 0.5)));
+      for (; col < begin; ++col)
+        rowIds[col] = 0;
+      col = max(col, end);
     }
-    return linearColor;
+    for (; col < width; ++col)
+      rowIds[col] = 0;
+  }
+  return getRbtNodesOfIds(ids);
+}
+
+//--------------
+// PickReadback
+//--------------
+//
+PickReadback::~PickReadback() {
+  for (size_t i = 0; i < pending_.size(); ++i) {
+    if (pending_[i].sync)
+      glDeleteSync(pending_[i].sync);
   }
 }
 
-int Picker::colorToId(const PackedPixel& p) {
-  const int UNUSED_BITS = 8 - NBITS;
-  int id = p.r >> UNUSED_BITS;
-  id |= ((p.g >> UNUSED_BITS) << NBITS);
-  id |= ((p.b >> UNUSED_BITS) << (NBITS+NBITS));
-  return id;
+void PickReadback::request(int x, int y, bool integerIds, IdTable& ids, const Callback& done) {
+  Request r;
+  if (freePbos_.empty()) {
+    r.pbo.reset(new GlBufferObject());
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, *r.pbo);
+    glBufferData(GL_PIXEL_PACK_BUFFER, sizeof(GLuint), NULL, GL_STREAM_READ);
+  }
+  else {
+    r.pbo = freePbos_.back();
+    freePbos_.pop_back();
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, *r.pbo);
+  }
+
+  // with a pack buffer bound, the last argument is an offset into it and the
+  // call returns without waiting for the pixel
+  if (integerIds)
+    glReadPixels(x, y, 1, 1, GL_RED_INTEGER, GL_UNSIGNED_INT, 0);
+  else
+    glReadPixels(x, y, 1, 1, GL_RGB, GL_UNSIGNED_BYTE, 0);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+  r.sync = (GLEW_VERSION_3_2 || GLEW_ARB_sync) ? glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0) : NULL;
+  r.polls = 0;
+  r.integerIds = integerIds;
+  r.ids.swap(ids);
+  r.done = done;
+  pending_.push_back(r);
+  checkGlErrors();
+}
+
+bool PickReadback::isFinished(Request& r, bool wait) {
+  if (r.sync == NULL)
+    return wait || r.polls >= 2;
+
+  static const GLuint64 ONE_SECOND = 1000000000;
+  GLenum status;
+  do {
+    // the flush makes sure the fence reaches the GPU even if nothing else is drawn
+    status = glClientWaitSync(r.sync, GL_SYNC_FLUSH_COMMANDS_BIT, wait ? ONE_SECOND : 0);
+  } while (wait && status == GL_TIMEOUT_EXPIRED);
+  if (status == GL_WAIT_FAILED)
+    throw runtime_error("PickReadback: glClientWaitSync failed");
+  return status != GL_TIMEOUT_EXPIRED;
+}
+
+void PickReadback::poll(bool wait) {
+  for (size_t i = 0; i < pending_.size(); ++i)
+    ++pending_[i].polls;
+
+  // Reads finish in request order, so stop at the first unfinished one. The
+  // request is taken off the queue before its callback runs, which may well
+  // request another pick.
+  while (!pending_.empty() && isFinished(pending_.front(), wait)) {
+    Request r = pending_.front();
+    pending_.pop_front();
+    if (r.sync)
+      glDeleteSync(r.sync);
+
+    GLuint id = 0;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, *r.pbo);
+    const void* p = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+    if (p == NULL)
+      throw runtime_error("PickReadback: glMapBuffer failed");
+    if (r.integerIds)
+      id = *static_cast<const GLuint*>(p);
+    else
+      id = colorToId(*static_cast<const PackedPixel*>(p));
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    checkGlErrors();
+
+    freePbos_.push_back(r.pbo);
+    r.done(find(r.ids, id));
+  }
 }
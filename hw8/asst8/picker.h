@@ -2,35 +2,105 @@
 #define PICKER_H
 
 #include <vector>
-#include <map>
+#include <deque>
 #include <memory>
+#include <functional>
 #include <stdexcept>
 
 #include "cvec.h"
+#include "glsupport.h"
 #include "scenegraph.h"
 #include "asstcommon.h"
 #include "ppm.h"
 #include "drawer.h"
 
+// Offscreen framebuffer with an unsigned 32 bit integer color buffer and a
+// depth buffer, for the ID pass of the Picker. Needs GL 3.0.
+class PickBuffer : Noncopyable {
+  GlFramebufferObject fbo_;
+  GlRenderbufferObject color_, depth_;
+  int width_, height_;
+
+public:
+  PickBuffer() : width_(0), height_(0) {}
+
+  // Makes this the draw and read framebuffer, sized width x height, and
+  // clears it to ID 0 and the current clear depth. Throws runtime_error if
+  // the framebuffer cannot be completed.
+  void bind(int width, int height);
+
+  // Goes back to drawing to the window
+  void unbind();
+};
+
+// Reads picked IDs back without stalling: request() queues the copy of one
+// pixel into a pixel buffer object and fences it, and poll(), called once a
+// frame, maps the buffers the GPU has finished with and calls the callbacks.
+// A pick therefore resolves one or two frames after the click.
+//
+// Without fences (GL_ARB_sync), a read is mapped two polls after its request,
+// by which time the driver has normally finished it; mapping blocks otherwise.
+class PickReadback : Noncopyable {
+public:
+  typedef std::function<void(std::shared_ptr<SgRbtNode>)> Callback;
+  typedef std::vector<std::shared_ptr<SgRbtNode> > IdTable;
+
+  ~PickReadback();
+
+  // Starts the copy of pixel (x, y) of the current read framebuffer. 'ids'
+  // maps the ID there to the node passed to 'done', see Picker.
+  void request(int x, int y, bool integerIds, IdTable& ids, const Callback& done);
+
+  // Calls the callbacks of the finished reads, in request order. With wait,
+  // blocks until every read is finished.
+  void poll(bool wait = false);
+
+  bool hasPending() const {
+    return !pending_.empty();
+  }
+
+private:
+  struct Request {
+    std::shared_ptr<GlBufferObject> pbo;
+    GLsync sync; // NULL without fences
+    int polls;   // number of polls since the request
+    bool integerIds;
+    IdTable ids;
+    Callback done;
+  };
+
+  std::deque<Request> pending_; // in request order, hence also in completion order
+  std::vector<std::shared_ptr<GlBufferObject> > freePbos_;
+
+  bool isFinished(Request& r, bool wait);
+};
+
+// Draws every shape with its own ID, to be read back at the clicked pixel.
+//
+// With integerIds the IDs are written as is, and the current framebuffer must
+// be a PickBuffer. Otherwise they are encoded in the 8 bits of each of R, G
+// and B, which needs a framebuffer with 8 bits per channel and no sRGB
+// conversion, and allows 2^24 - 1 shapes.
 class Picker : public SgNodeVisitor {
-  std::vector<std::shared_ptr<SgNode> > nodeStack_;
+  // Plain pointers: the graph owns the nodes while it is traversed, and the
+  // results are turned into shared pointers only when handed out.
 
-  typedef std::map<int, std::shared_ptr<SgRbtNode> > IdToRbtNodeMap;
-  IdToRbtNodeMap idToRbtNode_;
+  // innermost SgRbtNode above each transform node on the current path, may be
+  // null
+  std::vector<SgRbtNode*> rbtNodeStack_;
 
-  int idCounter_;
-  bool srgbFrameBuffer_;
+  // SgRbtNode of each shape ID. ID 0 is the background and maps to null.
+  std::vector<SgRbtNode*> idToRbtNode_;
 
-  Drawer drawer_;
+  bool integerIds_;
 
-  void addToMap(int id, std::shared_ptr<SgRbtNode> node);
-  std::shared_ptr<SgRbtNode> find(int id);
+  Drawer drawer_;
 
-  Cvec3 idToColor(int id);
-  int colorToId(const PackedPixel& p);
+  void readIds(int x, int y, int width, int height, std::vector<GLuint>& ids);
+  std::vector<std::shared_ptr<SgRbtNode> > getRbtNodesOfIds(const std::vector<GLuint>& ids);
 
 public:
-  Picker(const RigTForm& initialRbt, Uniforms& uniforms);
+  Picker(const RigTForm& initialRbt, Uniforms& uniforms, bool integerIds);
 
   virtual bool visit(SgTransformNode& node);
   virtual bool postVisit(SgTransformNode& node);
@@ -38,7 +108,21 @@ public:
   virtual bool postVisit(SgShapeNode& node);
 
   std::shared_ptr<SgRbtNode> getRbtNodeAtXY(int x, int y);
+
+  // Like getRbtNodeAtXY, but the result is passed to 'done' by a later
+  // readback.poll(). The ID table goes to 'readback' as shared pointers, so
+  // nodes removed from the graph in between stay valid.
+  void getRbtNodeAtXYAsync(int x, int y, PickReadback& readback, const PickReadback::Callback& done);
+
+  // Distinct SgRbtNodes of the shapes seen in the width x height pixels with
+  // lower left corner (x, y), clipped to the viewport. Shapes hidden behind
+  // others are not seen.
+  std::vector<std::shared_ptr<SgRbtNode> > getRbtNodesInRect(int x, int y, int width, int height);
+
+  // Same for the pixels whose center is inside the polygon 'lasso', given in
+  // window coordinates, by the even-odd rule
+  std::vector<std::shared_ptr<SgRbtNode> > getRbtNodesInLasso(const std::vector<Cvec2>& lasso);
 };
 
 
-#endif
\ No newline at end of file
+#endif
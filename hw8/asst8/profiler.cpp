@@ -0,0 +1,163 @@
+#include <cstdio>
+#include <algorithm>
+#include <string>
+#include <stdexcept>
+
+#include "profiler.h"
+
+using namespace std;
+
+// Queries created at most, i.e. twice the GPU scopes in flight. Beyond that
+// new GPU scopes are timed on the CPU only until the GPU catches up.
+static const int MAX_QUERIES = 1024;
+
+bool isGpuTimingSupported() {
+  // glGetInteger64v comes with GL 3.2 or ARB_sync
+  return GLEW_VERSION_3_3 || (GLEW_ARB_timer_query && (GLEW_VERSION_3_2 || GLEW_ARB_sync));
+}
+
+Profiler::Profiler(int capacity)
+  : start_(chrono::steady_clock::now()), enabled_(false), gpuTiming_(false)
+  , events_(max(capacity, 1)), head_(0), numEvents_(0)
+  , numQueries_(0), numOpenGpuScopes_(0), gpuToCpuUs_(0) {}
+
+void Profiler::release() {
+  for (size_t i = 0; i < pendingGpuScopes_.size(); ++i) {
+    glDeleteQueries(1, &pendingGpuScopes_[i].begin);
+    glDeleteQueries(1, &pendingGpuScopes_[i].end);
+  }
+  if (!freeQueries_.empty())
+    glDeleteQueries(freeQueries_.size(), &freeQueries_[0]);
+  pendingGpuScopes_.clear();
+  freeQueries_.clear();
+  numQueries_ = 0;
+  gpuTiming_ = false;
+}
+
+void Profiler::setGpuTiming(bool enabled) {
+  gpuTiming_ = enabled && isGpuTimingSupported();
+}
+
+void Profiler::beginFrame() {
+  if (pendingGpuScopes_.empty() && !gpuTiming_)
+    return;
+
+  GLint64 gpuNow;
+  glGetInteger64v(GL_TIMESTAMP, &gpuNow);
+  gpuToCpuUs_ = now() - gpuNow / 1000.0;
+
+  while (!pendingGpuScopes_.empty()) {
+    const GpuScope& s = pendingGpuScopes_.front();
+    GLuint available = 0;
+    glGetQueryObjectuiv(s.end, GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available)
+      break;
+    // the begin query was issued before the end query, so it is done too
+    GLuint64 begin, end;
+    glGetQueryObjectui64v(s.begin, GL_QUERY_RESULT, &begin);
+    glGetQueryObjectui64v(s.end, GL_QUERY_RESULT, &end);
+    if (enabled_)
+      record(s.name, begin / 1000.0 + gpuToCpuUs_, (end - begin) / 1000.0, GPU_SCOPE);
+    freeQueries_.push_back(s.begin);
+    freeQueries_.push_back(s.end);
+    pendingGpuScopes_.pop_front();
+  }
+  checkGlErrors();
+}
+
+void Profiler::addScope(const char* name, double beginUs, double endUs) {
+  if (enabled_)
+    record(name, beginUs, endUs - beginUs, CPU_SCOPE);
+}
+
+void Profiler::addCounter(const char* name, double value) {
+  if (enabled_)
+    record(name, now(), value, COUNTER);
+}
+
+GLuint Profiler::getQuery() {
+  if (freeQueries_.empty()) {
+    if (numQueries_ >= MAX_QUERIES)
+      return 0;
+    GLuint q;
+    glGenQueries(1, &q);
+    ++numQueries_;
+    return q;
+  }
+  const GLuint q = freeQueries_.back();
+  freeQueries_.pop_back();
+  return q;
+}
+
+GLuint Profiler::beginGpuScope() {
+  // keep a query for the end of this scope and of every open one around it
+  const int available = freeQueries_.size() + MAX_QUERIES - numQueries_;
+  if (!gpuTiming_ || available < 2 + numOpenGpuScopes_)
+    return 0;
+  const GLuint q = getQuery();
+  glQueryCounter(q, GL_TIMESTAMP);
+  ++numOpenGpuScopes_;
+  return q;
+}
+
+void Profiler::endGpuScope(GLuint beginQuery, const char* name) {
+  --numOpenGpuScopes_;
+  GpuScope s;
+  s.begin = beginQuery;
+  s.end = getQuery();
+  s.name = name;
+  glQueryCounter(s.end, GL_TIMESTAMP);
+  pendingGpuScopes_.push_back(s);
+}
+
+void Profiler::record(const char* name, double ts, double durOrValue, Kind kind) {
+  Event& e = events_[head_];
+  e.name = name;
+  e.ts = ts;
+  e.durOrValue = durOrValue;
+  e.kind = kind;
+  head_ = (head_ + 1) % events_.size();
+  numEvents_ = min(numEvents_ + 1, getCapacity());
+}
+
+static void writeJsonString(FILE* f, const char* s) {
+  fputc('"', f);
+  for (; *s; ++s) {
+    if (*s == '"' || *s == '\\')
+      fputc('\\', f);
+    fputc(*s, f);
+  }
+  fputc('"', f);
+}
+
+void Profiler::writeChromeTrace(const char filename[]) const {
+  FILE* f = fopen(filename, "w");
+  if (!f)
+    throw runtime_error(string("Cannot write file ") + filename);
+
+  // tid 1 holds the CPU scopes and counters, tid 2 the GPU scopes
+  fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  fprintf(f, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 1, \"args\": {\"name\": \"CPU\"}},\n");
+  fprintf(f, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 2, \"args\": {\"name\": \"GPU\"}}");
+
+  const int capacity = getCapacity();
+  for (int k = 0; k < numEvents_; ++k) {
+    const Event& e = events_[(head_ - numEvents_ + k + capacity) % capacity];
+    fprintf(f, ",\n{\"name\": ");
+    writeJsonString(f, e.name);
+    if (e.kind == COUNTER) {
+      fprintf(f, ", \"ph\": \"C\", \"pid\": 1, \"tid\": 1, \"ts\": %.3f, \"args\": {", e.ts);
+      writeJsonString(f, e.name);
+      fprintf(f, ": %.17g}}", e.durOrValue);
+    }
+    else {
+      fprintf(f, ", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+              e.kind == GPU_SCOPE ? 2 : 1, e.ts, e.durOrValue);
+    }
+  }
+  fprintf(f, "\n]}\n");
+
+  const bool failed = ferror(f) != 0;
+  if (fclose(f) != 0 || failed)
+    throw runtime_error(string("Cannot write file ") + filename);
+}
@@ -0,0 +1,164 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <vector>
+#include <deque>
+#include <chrono>
+
+#include <GL/glew.h>
+
+#include "glsupport.h"
+
+//--------------------------------------------------------------------------------
+// Frame profiler: scoped CPU timers, GL timer queries and per-frame counters,
+// recorded into a ring buffer and written out as a Chrome trace
+//
+// A ProfileScope times the code between its construction and destruction with
+// the CPU clock and, if asked to and the context has timer queries (GL 3.3 or
+// ARB_timer_query), on the GPU with a pair of timestamp queries. Timestamps
+// rather than GL_TIME_ELAPSED, so GPU scopes can nest. The query results are
+// collected by a later beginFrame(), once the GPU has got that far, so timing
+// never waits for the GPU. GPU times are moved onto the CPU clock with the GL
+// timestamp read in beginFrame().
+//
+// Events go into a ring buffer of fixed size, so recording allocates nothing
+// and the buffer holds the last getCapacity() events. writeChromeTrace() writes
+// them in the Trace Event format read by chrome://tracing and Perfetto, with
+// CPU scopes on one track, GPU scopes on another and one track per counter.
+//
+// A profiler starts disabled, so a frame pays for no clock reads, timestamp
+// queries or GL timestamp reads until it is turned on.
+//
+// Names are kept as pointers, so they must be string literals or otherwise
+// outlive the profiler. A profiler is used from the thread that owns the GL
+// context only, and release() must be called while that context is current.
+//--------------------------------------------------------------------------------
+
+class Profiler : Noncopyable {
+public:
+  explicit Profiler(int capacity = 1 << 16);
+
+  // Deletes the timer queries, dropping the GPU scopes still in flight, and
+  // turns GPU timing off. Call before the GL context is destroyed; the
+  // destructor makes no GL calls.
+  void release();
+
+  // A disabled profiler records nothing, and its scopes read no clock
+  void setEnabled(bool enabled) {
+    enabled_ = enabled;
+  }
+
+  bool isEnabled() const {
+    return enabled_;
+  }
+
+  // Whether scopes asking for GPU timing get it. Off while the context has no
+  // timer queries.
+  void setGpuTiming(bool enabled);
+
+  bool getGpuTiming() const {
+    return gpuTiming_;
+  }
+
+  // Collects the GPU scopes whose queries have finished and reads the GL
+  // timestamp. Call at the start of every frame, with the GL context current.
+  void beginFrame();
+
+  // Microseconds since the profiler was created
+  double now() const {
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start_).count();
+  }
+
+  // Records a CPU scope of the given times, from now()
+  void addScope(const char* name, double beginUs, double endUs);
+
+  // Records the value of a counter at now()
+  void addCounter(const char* name, double value);
+
+  // Issues the query marking the start of a GPU scope and returns it for
+  // endGpuScope, or 0 if GPU timing is off or too many scopes are in flight
+  GLuint beginGpuScope();
+  void endGpuScope(GLuint beginQuery, const char* name);
+
+  int getCapacity() const {
+    return events_.size();
+  }
+
+  int getNumEvents() const {
+    return numEvents_;
+  }
+
+  // Drops the recorded events, not the GPU scopes still in flight
+  void clear() {
+    numEvents_ = 0;
+  }
+
+  // Writes the recorded events, oldest first. Throws runtime_error if the file
+  // cannot be written.
+  void writeChromeTrace(const char filename[]) const;
+
+private:
+  enum Kind { CPU_SCOPE, GPU_SCOPE, COUNTER };
+
+  struct Event {
+    const char* name;
+    double ts;             // start, or time of a counter value, in microseconds
+    double durOrValue;     // duration in microseconds, or the counter value
+    Kind kind;
+  };
+
+  struct GpuScope {
+    GLuint begin, end;     // timestamp queries
+    const char* name;
+  };
+
+  std::chrono::steady_clock::time_point start_;
+  bool enabled_, gpuTiming_;
+
+  // ring buffer, the newest event at events_[(head_ - 1) mod capacity]
+  std::vector<Event> events_;
+  int head_, numEvents_;
+
+  // in submission order, so they finish in order too
+  std::deque<GpuScope> pendingGpuScopes_;
+  std::vector<GLuint> freeQueries_;
+  int numQueries_;       // created so far, at most MAX_QUERIES
+  int numOpenGpuScopes_; // begun and not yet ended
+  double gpuToCpuUs_; // added to a GL timestamp in microseconds to get now()
+
+  void record(const char* name, double ts, double durOrValue, Kind kind);
+  GLuint getQuery();
+};
+
+// Times its own lifetime on the CPU and, if 'gpu' is set, on the GPU
+class ProfileScope : Noncopyable {
+public:
+  ProfileScope(Profiler& profiler, const char* name, bool gpu = false)
+    : profiler_(profiler), name_(name), active_(profiler.isEnabled()), gpuQuery_(0), begin_(0) {
+    if (!active_)
+      return;
+    if (gpu)
+      gpuQuery_ = profiler.beginGpuScope();
+    begin_ = profiler.now();
+  }
+
+  ~ProfileScope() {
+    if (!active_)
+      return;
+    profiler_.addScope(name_, begin_, profiler_.now());
+    if (gpuQuery_)
+      profiler_.endGpuScope(gpuQuery_, name_);
+  }
+
+private:
+  Profiler& profiler_;
+  const char* name_;
+  bool active_; // whether the profiler was enabled when the scope started
+  GLuint gpuQuery_;
+  double begin_;
+};
+
+// Whether the current context can time GPU scopes
+bool isGpuTimingSupported();
+
+#endif
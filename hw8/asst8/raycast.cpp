@@ -0,0 +1,62 @@
+#include <cmath>
+
+#include "raycast.h"
+
+using namespace std;
+
+bool intersectRayTriangle(const Cvec3& origin, const Cvec3& dir,
+                          const Cvec3& a, const Cvec3& b, const Cvec3& c,
+                          double tMax, double& t) {
+  // Moller-Trumbore: solve origin + t * dir = a + u * (b - a) + v * (c - a)
+  const Cvec3 e1 = b - a, e2 = c - a;
+  const Cvec3 p = cross(dir, e2);
+  const double det = dot(e1, p);
+  if (std::abs(det) < 1e-300)
+    return false; // parallel, or degenerate triangle
+  const double invDet = 1 / det;
+
+  const Cvec3 s = origin - a;
+  const double u = dot(s, p) * invDet;
+  if (u < 0 || u > 1)
+    return false;
+
+  const Cvec3 q = cross(s, e1);
+  const double v = dot(dir, q) * invDet;
+  if (v < 0 || u + v > 1)
+    return false;
+
+  const double hit = dot(e2, q) * invDet;
+  if (hit < 0 || hit > tMax)
+    return false;
+  t = hit;
+  return true;
+}
+
+void RayMesh::buildBvh() {
+  vector<Aabb> bounds(getNumTriangles());
+  for (int i = 0, n = bounds.size(); i < n; ++i) {
+    bounds[i].add(positions_[indices_[3 * i]]);
+    bounds[i].add(positions_[indices_[3 * i + 1]]);
+    bounds[i].add(positions_[indices_[3 * i + 2]]);
+  }
+  bvh_.build(bounds);
+  bvhValid_ = true;
+}
+
+bool RayMesh::intersectRay(const Cvec3& origin, const Cvec3& dir, double tMax, double& t) {
+  if (!bvhValid_)
+    buildBvh();
+
+  bool found = false;
+  bvh_.intersectRay(origin, dir, tMax, [&](int i, double) {
+    double hit;
+    if (intersectRayTriangle(origin, dir, positions_[indices_[3 * i]], positions_[indices_[3 * i + 1]],
+                             positions_[indices_[3 * i + 2]], tMax, hit)) {
+      tMax = hit;
+      t = hit;
+      found = true;
+    }
+    return tMax;
+  });
+  return found;
+}
@@ -0,0 +1,72 @@
+#ifndef RAYCAST_H
+#define RAYCAST_H
+
+#include <vector>
+
+#include "cvec.h"
+#include "bounds.h"
+#include "bvh.h"
+
+//--------------------------------------------------------------------------------
+// Ray queries against triangles kept on the CPU. No GL dependency.
+//
+// Rays are origin + t * dir. dir need not be normalized, and distances are
+// returned as the parameter t, so they stay comparable when the ray is moved
+// into another frame by an affine transform.
+//--------------------------------------------------------------------------------
+
+// Two sided ray/triangle test. Sets t and returns true if the ray hits the
+// triangle (a, b, c) at some t in [0, tMax].
+bool intersectRayTriangle(const Cvec3& origin, const Cvec3& dir,
+                          const Cvec3& a, const Cvec3& b, const Cvec3& c,
+                          double tMax, double& t);
+
+// Copy of the triangles of a geometry. The BVH over them is built on the first
+// query after the triangles were set, so geometries that are never picked do
+// not pay for it.
+class RayMesh {
+public:
+  RayMesh() : bvhValid_(false) {}
+
+  // Triangle list: every three vertices make a triangle
+  template<typename Vertex>
+  void setTriangles(const Vertex* vertices, int numVertices) {
+    setPositions(vertices, numVertices);
+    indices_.resize(numVertices - numVertices % 3);
+    for (int i = 0, n = indices_.size(); i < n; ++i)
+      indices_[i] = i;
+    bvhValid_ = false;
+  }
+
+  // Indexed triangle list
+  template<typename Vertex, typename Index>
+  void setTriangles(const Vertex* vertices, const Index* indices, int numVertices, int numIndices) {
+    setPositions(vertices, numVertices);
+    indices_.assign(indices, indices + numIndices - numIndices % 3);
+    bvhValid_ = false;
+  }
+
+  int getNumTriangles() const {
+    return indices_.size() / 3;
+  }
+
+  // Nearest hit in [0, tMax]
+  bool intersectRay(const Cvec3& origin, const Cvec3& dir, double tMax, double& t);
+
+private:
+  std::vector<Cvec3> positions_;
+  std::vector<int> indices_;
+  Bvh bvh_;
+  bool bvhValid_;
+
+  template<typename Vertex>
+  void setPositions(const Vertex* vertices, int numVertices) {
+    positions_.resize(numVertices);
+    for (int i = 0; i < numVertices; ++i)
+      positions_[i] = Cvec3(vertices[i].p[0], vertices[i].p[1], vertices[i].p[2]);
+  }
+
+  void buildBvh();
+};
+
+#endif
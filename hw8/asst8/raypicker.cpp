@@ -0,0 +1,138 @@
+#include <cmath>
+#include <stdexcept>
+#include <algorithm>
+
+#include "raypicker.h"
+
+using namespace std;
+
+static Cvec3 rotate(const Quat& q, const Cvec3& v) {
+  return Cvec3(q * Cvec4(v, 0));
+}
+
+// Solves m * x = b by Gaussian elimination with partial pivoting. inv() from
+// matrix4.h only handles affine matrices, and projections are not.
+static Cvec4 solve(const Matrix4& m, const Cvec4& b) {
+  double a[4][5];
+  for (int i = 0; i < 4; ++i) {
+    for (int j = 0; j < 4; ++j)
+      a[i][j] = m(i, j);
+    a[i][4] = b[i];
+  }
+  for (int c = 0; c < 4; ++c) {
+    int pivot = c;
+    for (int i = c + 1; i < 4; ++i) {
+      if (std::abs(a[i][c]) > std::abs(a[pivot][c]))
+        pivot = i;
+    }
+    if (std::abs(a[pivot][c]) < CS175_EPS2)
+      throw runtime_error("RayPicker: singular projection matrix");
+    for (int j = 0; j < 5; ++j)
+      std::swap(a[c][j], a[pivot][j]);
+    for (int i = 0; i < 4; ++i) {
+      if (i == c)
+        continue;
+      const double f = a[i][c] / a[c][c];
+      for (int j = c; j < 5; ++j)
+        a[i][j] -= f * a[c][j];
+    }
+  }
+  return Cvec4(a[0][4] / a[0][0], a[1][4] / a[1][1], a[2][4] / a[2][2], a[3][4] / a[3][3]);
+}
+
+void RayPicker::getPixelRay(const RigTForm& eyeRbt, const Matrix4& projMatrix,
+                            int x, int y, int width, int height,
+                            Cvec3& origin, Cvec3& dir) {
+  const double ndcX = 2 * (x + 0.5) / width - 1;
+  const double ndcY = 2 * (y + 0.5) / height - 1;
+
+  // unproject the pixel on the two clip planes; works for either sign
+  // convention of the depth range
+  Cvec4 nearPoint = solve(projMatrix, Cvec4(ndcX, ndcY, 1, 1));
+  Cvec4 farPoint = solve(projMatrix, Cvec4(ndcX, ndcY, -1, 1));
+  nearPoint /= nearPoint[3];
+  farPoint /= farPoint[3];
+
+  const Quat& r = eyeRbt.getRotation();
+  origin = eyeRbt.getTranslation() + rotate(r, Cvec3(nearPoint));
+  dir = rotate(r, Cvec3(farPoint - nearPoint));
+}
+
+int RayPicker::pickShape(const Cvec3& origin, const Cvec3& dir, double tMax, double& t) const {
+  int nearest = -1;
+  bvh_.intersectRay(origin, dir, tMax, [&](int k, double) {
+    // into the frame of the transform node the shape hangs from; rigid, so
+    // the ray parameter is unchanged
+    const RigTForm invWorld = inv(scene_.getWorldRbt(scene_.getShapeTransform(k)));
+    const Cvec3 o = invWorld.getTranslation() + rotate(invWorld.getRotation(), origin);
+    const Cvec3 d = rotate(invWorld.getRotation(), dir);
+
+    double hit;
+    if (scene_.getShapeNode(k)->intersectRay(o, d, tMax, hit)) {
+      tMax = hit;
+      t = hit;
+      nearest = k;
+    }
+    return tMax;
+  });
+  return nearest;
+}
+
+shared_ptr<SgRbtNode> RayPicker::getRbtNodeAtXY(const RigTForm& eyeRbt, const Matrix4& projMatrix,
+                                                int x, int y, int width, int height) const {
+  Cvec3 origin, dir;
+  getPixelRay(eyeRbt, projMatrix, x, y, width, height, origin, dir);
+
+  double t;
+  const int k = pickShape(origin, dir, 1, t);
+  if (k < 0)
+    return shared_ptr<SgRbtNode>();
+
+  const int i = findRbtNodeIndex(scene_.getShapeTransform(k));
+  return i < 0 ? shared_ptr<SgRbtNode>() : static_pointer_cast<SgRbtNode>(scene_.getSourceNode(i));
+}
+
+Matrix4 RayPicker::getRectProjection(const Matrix4& projMatrix, int x, int y, int rectWidth, int rectHeight,
+                                     int width, int height) {
+  // NDC extent of the rectangle, stretched to [-1, 1] in x and y
+  const double x0 = 2.0 * x / width - 1, x1 = 2.0 * (x + rectWidth) / width - 1;
+  const double y0 = 2.0 * y / height - 1, y1 = 2.0 * (y + rectHeight) / height - 1;
+  Matrix4 m;
+  m(0, 0) = 2 / (x1 - x0);
+  m(0, 3) = -(x1 + x0) / (x1 - x0);
+  m(1, 1) = 2 / (y1 - y0);
+  m(1, 3) = -(y1 + y0) / (y1 - y0);
+  return m * projMatrix;
+}
+
+vector<shared_ptr<SgRbtNode> > RayPicker::getRbtNodesInRect(const RigTForm& eyeRbt, const Matrix4& projMatrix,
+                                                           int x, int y, int rectWidth, int rectHeight,
+                                                           int width, int height) const {
+  vector<shared_ptr<SgRbtNode> > nodes;
+  if (rectWidth <= 0 || rectHeight <= 0)
+    return nodes;
+
+  const Frustum frustum(getRectProjection(projMatrix, x, y, rectWidth, rectHeight, width, height) *
+                        rigTFormToMatrix(inv(eyeRbt)));
+  vector<int> shapes;
+  bvh_.queryFrustum(frustum, shapes);
+
+  // many shapes share a node, so each node is taken once by its index
+  vector<char> taken(scene_.getNumNodes(), 0);
+  for (size_t k = 0; k < shapes.size(); ++k) {
+    const int i = findRbtNodeIndex(scene_.getShapeTransform(shapes[k]));
+    if (i >= 0 && !taken[i]) {
+      taken[i] = 1;
+      nodes.push_back(static_pointer_cast<SgRbtNode>(scene_.getSourceNode(i)));
+    }
+  }
+  return nodes;
+}
+
+int RayPicker::findRbtNodeIndex(int i) const {
+  for (; i >= 0; i = scene_.getParent(i)) {
+    if (asRbtNode(scene_.getSourceNodePtr(i)))
+      return i;
+  }
+  return -1;
+}
@@ -0,0 +1,71 @@
+#ifndef RAYPICKER_H
+#define RAYPICKER_H
+
+#include <memory>
+#include <vector>
+
+#include "cvec.h"
+#include "matrix4.h"
+#include "rigtform.h"
+#include "scenegraph.h"
+#include "flatscene.h"
+#include "scenebvh.h"
+
+//--------------------------------------------------------------------------------
+// Picking by casting a ray from the eye through a pixel, on the CPU
+//
+// The SceneBvh hands out the shapes whose world box the ray enters, nearest
+// first. Each one is tested exactly with SgShapeNode::intersectRay, which goes
+// through the triangle BVH of its geometry, and the search stops as soon as
+// the remaining boxes are farther than the nearest hit found. Unlike Picker,
+// nothing is drawn and nothing is read back from the GPU.
+//
+// Results are only as current as the FlatScene and SceneBvh: update both
+// before picking if frames may have changed since.
+//--------------------------------------------------------------------------------
+
+class RayPicker {
+public:
+  RayPicker(const FlatScene& scene, const SceneBvh& bvh)
+    : scene_(scene), bvh_(bvh) {}
+
+  // World space ray through the center of pixel (x, y), counted from the lower
+  // left corner as GL does. t = 0 is on the near plane and t = 1 on the far
+  // plane of 'projMatrix'.
+  static void getPixelRay(const RigTForm& eyeRbt, const Matrix4& projMatrix,
+                          int x, int y, int width, int height,
+                          Cvec3& origin, Cvec3& dir);
+
+  // Index of the FlatScene shape nearest along the ray with t in [0, tMax],
+  // or -1. Sets t to its distance.
+  int pickShape(const Cvec3& origin, const Cvec3& dir, double tMax, double& t) const;
+
+  // The SgRbtNode nearest above the shape seen at pixel (x, y), or NULL if
+  // there is none. Same result as Picker::getRbtNodeAtXY.
+  std::shared_ptr<SgRbtNode> getRbtNodeAtXY(const RigTForm& eyeRbt, const Matrix4& projMatrix,
+                                            int x, int y, int width, int height) const;
+
+  // Distinct SgRbtNodes above the shapes whose world box reaches into the
+  // part of the view frustum behind the rectWidth x rectHeight pixels at
+  // (x, y). Unlike Picker::getRbtNodesInRect, this selects through: shapes
+  // hidden behind others are included. Shapes are only tested by their box.
+  std::vector<std::shared_ptr<SgRbtNode> > getRbtNodesInRect(const RigTForm& eyeRbt, const Matrix4& projMatrix,
+                                                             int x, int y, int rectWidth, int rectHeight,
+                                                             int width, int height) const;
+
+  // Projection that maps the rectWidth x rectHeight pixels at (x, y) of a
+  // width x height viewport to the whole clip volume of 'projMatrix', as
+  // gluPickMatrix does
+  static Matrix4 getRectProjection(const Matrix4& projMatrix, int x, int y, int rectWidth, int rectHeight,
+                                   int width, int height);
+
+private:
+  const FlatScene& scene_;
+  const SceneBvh& bvh_;
+
+  // Nearest FlatScene node at or above i that was built from an SgRbtNode,
+  // or -1
+  int findRbtNodeIndex(int i) const;
+};
+
+#endif
@@ -0,0 +1,134 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "renderqueue.h"
+#include "scenegraph.h"
+#include "softrenderer.h"
+#include "asstcommon.h"
+
+using namespace std;
+
+// Opaque before blended before shape draws. Opaque ones grouped by state,
+// blended ones back to front (eye space z increases towards the eye).
+struct RenderQueue::ItemOrder {
+  const vector<Item>& items;
+
+  ItemOrder(const vector<Item>& _items) : items(_items) {}
+
+  static int getPass(const Item& item) {
+    if (!item.material)
+      return 2;
+    return item.material->getRenderStates().isEnabled(GL_BLEND) ? 1 : 0;
+  }
+
+  bool operator () (int i, int j) const {
+    const Item& a = items[i];
+    const Item& b = items[j];
+    const int pa = getPass(a), pb = getPass(b);
+    if (pa != pb)
+      return pa < pb;
+
+    switch (pa) {
+    case 0:
+      if (a.material->getProgramDesc() != b.material->getProgramDesc())
+        return a.material->getProgramDesc() < b.material->getProgramDesc();
+      if (a.material->getRenderStates() != b.material->getRenderStates())
+        return a.material->getRenderStates() < b.material->getRenderStates();
+      if (a.material != b.material)
+        return a.material < b.material;
+      if (a.geometry != b.geometry)
+        return a.geometry < b.geometry;
+      return i < j;
+    case 1:
+      if (a.MVM(2, 3) != b.MVM(2, 3))
+        return a.MVM(2, 3) < b.MVM(2, 3);
+      return i < j;
+    default:
+      return i < j;
+    }
+  }
+};
+
+void RenderQueue::sortItems() {
+  order_.resize(items_.size());
+  for (size_t i = 0; i < items_.size(); ++i)
+    order_[i] = i;
+  sort(order_.begin(), order_.end(), ItemOrder(items_));
+}
+
+int RenderQueue::getInstanceRunEnd(int k) {
+  const Item& first = items_[order_[k]];
+  if (!instancing_ || !first.material || ItemOrder::getPass(first) != 0 ||
+      !first.geometry->supportsInstancing() || !first.material->hasInstancedProgram())
+    return k + 1;
+
+  int end = k + 1;
+  while (end < int(order_.size()) &&
+         items_[order_[end]].material == first.material &&
+         items_[order_[end]].geometry == first.geometry)
+    ++end;
+  return end - k >= minInstances_ ? end : k + 1;
+}
+
+void RenderQueue::submit(Uniforms& uniforms) {
+  stats_ = Stats();
+  sortItems();
+
+  const bool canInstance = instancing_ && isInstancingSupported();
+
+  Material* bound = NULL;
+  for (int k = 0, n = order_.size(); k < n;) {
+    const Item& item = items_[order_[k]];
+
+    const int end = canInstance ? getInstanceRunEnd(k) : k + 1;
+    if (end - k > 1) {
+      instanceData_.clear();
+      for (int i = k; i < end; ++i) {
+        const Matrix4& MVM = items_[order_[i]].MVM;
+        instanceData_.push_back(InstanceMatrices(MVM, normalMatrix(MVM)));
+      }
+      if (!instanceVbo_)
+        instanceVbo_.reset(new InstanceVbo());
+      instanceVbo_->upload(&instanceData_[0], instanceData_.size());
+
+      item.material->bind(bound, &stats_, true);
+      bound = item.material;
+      bound->drawBoundInstanced(*item.geometry, uniforms, *instanceVbo_);
+      ++stats_.instancedDraws;
+      stats_.instances += end - k;
+    }
+    else {
+      sendModelViewNormalMatrix(uniforms, item.MVM, normalMatrix(item.MVM));
+      if (item.material) {
+        item.material->bind(bound, &stats_);
+        bound = item.material;
+        bound->drawBound(*item.geometry, uniforms);
+      }
+      else {
+        // binds whatever material it likes
+        item.shape->draw(uniforms);
+        bound = NULL;
+      }
+    }
+    ++stats_.draws;
+    k = end;
+  }
+
+  items_.clear();
+}
+
+void RenderQueue::submit(Uniforms& uniforms, SoftRenderer& renderer) {
+  stats_ = Stats();
+  sortItems();
+
+  for (size_t k = 0; k < order_.size(); ++k) {
+    const Item& item = items_[order_[k]];
+    if (!item.material)
+      throw runtime_error("RenderQueue: shapes without a material cannot be drawn in software");
+    sendModelViewNormalMatrix(uniforms, item.MVM, normalMatrix(item.MVM));
+    renderer.draw(*item.material, *item.geometry, uniforms);
+    ++stats_.draws;
+  }
+
+  items_.clear();
+}
@@ -0,0 +1,142 @@
+#ifndef RENDERQUEUE_H
+#define RENDERQUEUE_H
+
+#include <vector>
+#include <memory>
+
+#include "matrix4.h"
+#include "uniforms.h"
+#include "geometry.h"
+#include "material.h"
+
+class SgShapeNode;
+class SoftRenderer;
+
+//--------------------------------------------------------------------------------
+// Render queue: draws are collected during traversal and submitted sorted by
+// GL state instead of in scene graph order
+//
+// Opaque draws are sorted by program, render states, material and geometry, so
+// draws sharing a material are submitted back to back and the material is
+// bound once for all of them. Draws whose render states enable blending go
+// last, back to front. Shapes that cannot be described as a material and a
+// geometry are drawn through SgShapeNode::draw after everything else.
+//
+// With instancing enabled, a run of at least getMinInstances() opaque draws of
+// the same material and geometry is submitted as one instanced draw, provided
+// the GL context, the geometry and the material support it (see
+// Material::hasInstancedProgram).
+//
+// The queue does not own what is added to it: materials, geometries and shapes
+// must stay alive until submit() returns.
+//--------------------------------------------------------------------------------
+
+class RenderQueue {
+public:
+  struct Stats : public MaterialBindStats {
+    int draws;          // draw calls, including instanced ones
+    int instancedDraws; // instanced draw calls
+    int instances;      // queued draws covered by the instanced draw calls
+
+    Stats() : draws(0), instancedDraws(0), instances(0) {}
+  };
+
+  RenderQueue() : instancing_(true), minInstances_(2) {}
+
+  void setInstancing(bool enabled) {
+    instancing_ = enabled;
+  }
+
+  bool getInstancing() const {
+    return instancing_;
+  }
+
+  void setMinInstances(int n) {
+    minInstances_ = n;
+  }
+
+  int getMinInstances() const {
+    return minInstances_;
+  }
+
+  void add(Material& material, Geometry& geometry, const Matrix4& MVM) {
+    Item item;
+    item.material = &material;
+    item.geometry = &geometry;
+    item.shape = NULL;
+    item.MVM = MVM;
+    items_.push_back(item);
+  }
+
+  void add(SgShapeNode& shape, const Matrix4& MVM) {
+    Item item;
+    item.material = NULL;
+    item.geometry = NULL;
+    item.shape = &shape;
+    item.MVM = MVM;
+    items_.push_back(item);
+  }
+
+  int size() const {
+    return items_.size();
+  }
+
+  // Queues everything queued in 'other', in its order, after what is already
+  // here. Used to merge queues filled by several threads.
+  void append(const RenderQueue& other) {
+    items_.insert(items_.end(), other.items_.begin(), other.items_.end());
+  }
+
+  void clear() {
+    items_.clear();
+  }
+
+  // Also deletes the instance buffer, so call with the GL context current.
+  // The buffer is created again by the next instanced submit.
+  void release() {
+    clear();
+    instanceVbo_.reset();
+  }
+
+  // Sorts and draws everything queued, then empties the queue. Each draw gets
+  // 'uniforms' plus its own uModelViewMatrix and uNormalMatrix.
+  void submit(Uniforms& uniforms);
+
+  // Same as above, but draws through 'renderer' on the CPU, without
+  // instancing. Throws runtime_error for shapes queued without a material.
+  void submit(Uniforms& uniforms, SoftRenderer& renderer);
+
+  // State changes of the last submit()
+  const Stats& getStats() const {
+    return stats_;
+  }
+
+private:
+  struct Item {
+    Material* material;
+    Geometry* geometry;
+    SgShapeNode* shape;
+    Matrix4 MVM;
+  };
+
+  struct ItemOrder;
+
+  std::vector<Item> items_;
+  std::vector<int> order_;
+  Stats stats_;
+
+  bool instancing_;
+  int minInstances_;
+
+  // Fills order_ with the submission order of items_
+  void sortItems();
+
+  // created on first use, since the queue may be constructed before GL is
+  std::shared_ptr<InstanceVbo> instanceVbo_;
+  std::vector<InstanceMatrices> instanceData_;
+
+  // End of the run of draws starting at order_[k] that can be drawn instanced
+  int getInstanceRunEnd(int k);
+};
+
+#endif
@@ -81,6 +81,32 @@ RenderStates& RenderStates::disable(GLenum target) {
   throw invalid_argument("RenderStates::glEnable: unsupported target");
 }
 
+bool RenderStates::isEnabled(GLenum target) const {
+  switch (target) {
+  case GL_BLEND:
+    return (flags & kBlendBit) != 0;
+  case GL_CULL_FACE:
+    return (flags & kCullFaceBit) != 0;
+  default:
+    ;
+  }
+  throw invalid_argument("RenderStates::isEnabled: unsupported target");
+}
+
+bool RenderStates::operator < (const RenderStates& other) const {
+  const GLenum a[] = {flags, glFront, glBack, glBlendSrcFactor, glBlendDstFactor, glCullFaceMode};
+  const GLenum b[] = {other.flags, other.glFront, other.glBack, other.glBlendSrcFactor, other.glBlendDstFactor, other.glCullFaceMode};
+  for (int i = 0; i < 6; ++i) {
+    if (a[i] != b[i])
+      return a[i] < b[i];
+  }
+  return false;
+}
+
+bool RenderStates::operator == (const RenderStates& other) const {
+  return !(*this < other) && !(other < *this);
+}
+
 void RenderStates::apply() const {
   static bool firstRun = false;
   static RenderStates currentRs;
@@ -30,6 +30,25 @@ public:
   RenderStates& enable(GLenum target);
   RenderStates& disable(GLenum target);
 
+  bool isEnabled(GLenum target) const;
+
+  // Mode of GL_FRONT or GL_BACK facing polygons
+  GLenum getPolygonMode(GLenum face) const {
+    return face == GL_BACK ? glBack : glFront;
+  }
+
+  GLenum getCullFace() const {
+    return glCullFaceMode;
+  }
+
+  // Strict weak ordering, so that sorting draws by render states puts equal
+  // states next to each other
+  bool operator < (const RenderStates& other) const;
+  bool operator == (const RenderStates& other) const;
+  bool operator != (const RenderStates& other) const {
+    return !(*this == other);
+  }
+
   void apply() const;
   void captureFromGl();
 };
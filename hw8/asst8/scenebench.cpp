@@ -0,0 +1,458 @@
+////////////////////////////////////////////////////////////////////////
+//
+//   scenebench: world transform computation on large scene graphs
+//
+//   Builds a scene graph of SgRbtNodes (a complete tree with the given
+//   fanout) and compares, per frame:
+//     - the recursive visitor walk that Drawer does, which recomputes
+//       every world frame
+//     - FlatScene with every node dirty
+//     - FlatScene with a fraction of the nodes changed
+//     - FlatScene picking up changes from the scene graph through
+//       pullLocalRbts, with nothing and with a fraction changed
+//     - every node set through setRbt in creation order, as a keyframe
+//       animation does, then the walk, against FlatScene picking the
+//       frames up through pullLocalRbts
+//     - FlatScene with every node dirty, updated on a WorkStealingPool
+//     - filling a RenderQueue from a shape under every node, on the
+//       calling thread and on the pool
+//   and, for the same walk and for collecting the SgRbtNodes as
+//   dumpSgRbtNodes does, virtual dispatch through accept (with
+//   dynamic_pointer_cast for the collection) against traverse<Visitor>
+//   with node type tags. Then, for the same tree built depth-first with
+//   nodes from make_shared and from a NodeArena, the time to build and
+//   free it, and the traverse walk and the plain pointer dumpSgRbtNodes
+//   with the make_shared nodes scattered over a heap where many nodes were
+//   freed in random order. The arena allocates no faster than make_shared;
+//   it pays off in the walks, as its nodes stay in creation order however
+//   the heap was used before. Last, the time to move as many nodes as the
+//   tree has from one group to another and back with reparent, in random
+//   order, as an editor does with a large selection.
+//   Results go to stdout as JSON. No GL calls are made.
+//
+//   Usage: scenebench [-n nodes] [-b fanout] [-f frames] [-c changed%]
+//                     [-t threads]
+//
+//   -t 0, the default, gives the pool one thread per hardware thread.
+//
+//   -b 1 makes a chain as deep as there are nodes. The walks recurse, so
+//   keep -n to a few ten thousand nodes then.
+//
+////////////////////////////////////////////////////////////////////////
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <vector>
+#include <memory>
+#include <random>
+#include <algorithm>
+#include <iostream>
+
+#include "rigtform.h"
+#include "scenegraph.h"
+#include "flatscene.h"
+#include "sgutils.h"
+#include "threadpool.h"
+#include "nodearena.h"
+
+using namespace std;
+
+// Shape that only goes to the render queue, so enqueue can be timed without GL
+class QueuedShapeNode : public SgShapeNode {
+public:
+  virtual Matrix4 getAffineMatrix() {
+    return Matrix4();
+  }
+
+  virtual void draw(const Uniforms& uniforms) {}
+};
+
+// Same accumulation as Drawer, minus the drawing
+class WorldRbtVisitor : public SgNodeVisitor {
+  vector<RigTForm> rbtStack_;
+public:
+  double checksum;
+
+  WorldRbtVisitor() : rbtStack_(1, RigTForm()), checksum(0) {}
+
+  using SgNodeVisitor::visit;
+  using SgNodeVisitor::postVisit;
+
+  virtual bool visit(SgTransformNode& node) {
+    rbtStack_.push_back(rbtStack_.back() * node.getRbt());
+    checksum += rbtStack_.back().getTranslation()[0];
+    return true;
+  }
+
+  virtual bool postVisit(SgTransformNode& node) {
+    rbtStack_.pop_back();
+    return true;
+  }
+};
+
+// Collects the SgRbtNodes the way dumpSgRbtNodes did before node type tags
+class RttiRbtNodesScanner : public SgNodeVisitor {
+public:
+  vector<shared_ptr<SgRbtNode> > nodes;
+
+  virtual bool visit(SgTransformNode& node) {
+    shared_ptr<SgRbtNode> rbtNode = dynamic_pointer_cast<SgRbtNode>(node.shared_from_this());
+    if (rbtNode)
+      nodes.push_back(rbtNode);
+    return true;
+  }
+};
+
+// Creates node i of the tree where node j hangs from node (j - 1) / fanout,
+// then its subtree, so the nodes are made in depth-first order, the order
+// in which initScene and loadScene create them
+template<typename Make>
+static shared_ptr<SgRbtNode> buildSubtree(int i, const vector<RigTForm>& rbts, int fanout, Make& make) {
+  shared_ptr<SgRbtNode> node = make(rbts[i]);
+  for (long long c = (long long)i * fanout + 1; c <= (long long)i * fanout + fanout && c < (long long)rbts.size(); ++c)
+    node->addChild(buildSubtree(int(c), rbts, fanout, make));
+  return node;
+}
+
+// The tree with the given frames, its nodes made with make(rbt)
+template<typename Make>
+static shared_ptr<SgRbtNode> buildTree(const vector<RigTForm>& rbts, int fanout, Make make) {
+  return buildSubtree(0, rbts, fanout, make);
+}
+
+static RigTForm randomRbt(mt19937& rng) {
+  uniform_real_distribution<double> d(-1, 1);
+  Quat q(d(rng), d(rng), d(rng), d(rng));
+  q = q * (1 / sqrt(norm2(q)));
+  return RigTForm(Cvec3(d(rng), d(rng), d(rng)), q);
+}
+
+struct Result {
+  double msPerFrame;
+  double nodesPerFrame; // world frames recomputed per frame
+};
+
+static void printResult(const char* name, const Result& r, int numNodes, bool last) {
+  printf("    \"%s\": {\"msPerFrame\": %.6f, \"nsPerNode\": %.3f, \"nodesRecomputedPerFrame\": %.1f}%s\n",
+         name, r.msPerFrame, r.msPerFrame * 1e6 / numNodes, r.nodesPerFrame, last ? "" : ",");
+}
+
+template<typename F>
+static Result timeFrames(int frames, F frame) {
+  double nodes = 0;
+  const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  for (int f = 0; f < frames; ++f)
+    nodes += frame();
+  const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  Result r;
+  r.msPerFrame = seconds * 1000 / frames;
+  r.nodesPerFrame = nodes / frames;
+  return r;
+}
+
+int main(int argc, char* argv[]) {
+  int numNodes = 100000, fanout = 4, frames = 50, numThreads = 0;
+  double changedPercent = 1;
+
+  for (int i = 1; i < argc; ++i) {
+    const bool hasValue = i + 1 < argc;
+    if (!strcmp(argv[i], "-n") && hasValue)
+      numNodes = max(1, atoi(argv[++i]));
+    else if (!strcmp(argv[i], "-b") && hasValue)
+      fanout = max(1, atoi(argv[++i]));
+    else if (!strcmp(argv[i], "-f") && hasValue)
+      frames = max(1, atoi(argv[++i]));
+    else if (!strcmp(argv[i], "-c") && hasValue)
+      changedPercent = atof(argv[++i]);
+    else if (!strcmp(argv[i], "-t") && hasValue)
+      numThreads = atoi(argv[++i]);
+    else {
+      cerr << "Usage: " << argv[0] << " [-n nodes] [-b fanout] [-f frames] [-c changed%] [-t threads]" << endl;
+      return 1;
+    }
+  }
+
+  try {
+    mt19937 rng(175);
+
+    // node i hangs from node (i - 1) / fanout
+    vector<shared_ptr<SgTransformNode> > nodes;
+    nodes.push_back(make_shared<SgRootNode>());
+    for (int i = 1; i < numNodes; ++i) {
+      shared_ptr<SgRbtNode> node = make_shared<SgRbtNode>(randomRbt(rng));
+      nodes[(i - 1) / fanout]->addChild(node);
+      nodes.push_back(node);
+    }
+
+    const int numChanged = max(1, int(numNodes * changedPercent / 100));
+    uniform_int_distribution<int> pick(1, numNodes - 1);
+
+    // the same random frames for every variant
+    vector<int> changedNodes(numChanged);
+    vector<RigTForm> changedRbts(numChanged);
+    for (int k = 0; k < numChanged; ++k) {
+      changedNodes[k] = pick(rng);
+      changedRbts[k] = randomRbt(rng);
+    }
+
+    double checksum = 0;
+    const Result sgWalk = timeFrames(frames, [&]() {
+      WorldRbtVisitor v;
+      nodes[0]->accept(v);
+      checksum += v.checksum;
+      return double(numNodes);
+    });
+
+    const Result sgTraverse = timeFrames(frames, [&]() {
+      WorldRbtVisitor v;
+      traverse(*nodes[0], v);
+      checksum += v.checksum;
+      return double(numNodes);
+    });
+
+    size_t rttiScanned = 0, tagScanned = 0;
+    const Result scanVirtual = timeFrames(frames, [&]() {
+      RttiRbtNodesScanner scanner;
+      nodes[0]->accept(scanner);
+      rttiScanned = scanner.nodes.size();
+      return double(numNodes);
+    });
+
+    const Result scanTraverse = timeFrames(frames, [&]() {
+      vector<shared_ptr<SgRbtNode> > rbtNodes;
+      dumpSgRbtNodes(nodes[0], rbtNodes);
+      tagScanned = rbtNodes.size();
+      return double(numNodes);
+    });
+
+    // every node alternates between two frames, so every frame changes it
+    vector<RigTForm> rbtsA(numNodes), rbtsB(numNodes);
+    for (int i = 1; i < numNodes; ++i) {
+      rbtsA[i] = nodes[i]->getRbt();
+      rbtsB[i] = randomRbt(rng);
+    }
+    const auto setAllRbts = [&](int frame) {
+      const vector<RigTForm>& rbts = frame % 2 ? rbtsB : rbtsA;
+      for (int i = 1; i < numNodes; ++i)
+        static_pointer_cast<SgRbtNode>(nodes[i])->setRbt(rbts[i]);
+    };
+
+    // before the FlatScene exists, so the nodes log nothing
+    int setAllFrame = 0;
+    const Result sgSetAllWalk = timeFrames(frames, [&]() {
+      setAllRbts(++setAllFrame);
+      WorldRbtVisitor v;
+      nodes[0]->accept(v);
+      checksum += v.checksum;
+      return double(numNodes);
+    });
+
+    FlatScene flat(nodes[0]);
+    const Result flatFull = timeFrames(frames, [&]() {
+      flat.setLocalRbt(0, flat.getLocalRbt(0));
+      return double(flat.update());
+    });
+
+    const Result flatPartial = timeFrames(frames, [&]() {
+      for (int k = 0; k < numChanged; ++k)
+        flat.setLocalRbt(changedNodes[k], changedRbts[k]);
+      return double(flat.update());
+    });
+
+    // pulls only pick up changes made through the scene graph, so the direct
+    // edits above are undone first
+    for (int k = 0; k < numChanged; ++k)
+      flat.setLocalRbt(changedNodes[k], flat.getSourceNodePtr(changedNodes[k])->getRbt());
+    flat.update();
+
+    const Result pullStatic = timeFrames(frames, [&]() {
+      flat.pullLocalRbts();
+      return double(flat.update());
+    });
+
+    // changes go through the scene graph; alternate between two frames so
+    // every pull sees a difference
+    vector<RigTForm> originalRbts(numChanged);
+    for (int k = 0; k < numChanged; ++k)
+      originalRbts[k] = nodes[changedNodes[k]]->getRbt();
+    int parity = 0;
+    const Result pullPartial = timeFrames(frames, [&]() {
+      const vector<RigTForm>& rbts = (parity ^= 1) ? changedRbts : originalRbts;
+      for (int k = 0; k < numChanged; ++k)
+        static_pointer_cast<SgRbtNode>(nodes[changedNodes[k]])->setRbt(rbts[k]);
+      flat.pullLocalRbts();
+      return double(flat.update());
+    });
+
+    const Result pullAll = timeFrames(frames, [&]() {
+      setAllRbts(++setAllFrame);
+      flat.pullLocalRbts();
+      return double(flat.update());
+    });
+
+    // both representations must agree
+    flat.pullLocalRbts();
+    flat.update();
+    double flatChecksum = 0;
+    for (int i = 0; i < flat.getNumNodes(); ++i)
+      flatChecksum += flat.getWorldRbt(i).getTranslation()[0];
+    WorldRbtVisitor v, vt;
+    nodes[0]->accept(v);
+    traverse(*nodes[0], vt);
+
+    WorkStealingPool pool(numThreads);
+    const Result flatFullParallel = timeFrames(frames, [&]() {
+      flat.setLocalRbt(0, flat.getLocalRbt(0));
+      return double(flat.update(&pool));
+    });
+
+    // the same arithmetic in the same order, so the frames must be equal
+    FlatScene serialFlat(nodes[0]);
+    bool parallelMatches = true;
+    for (int i = 0; i < flat.getNumNodes(); ++i) {
+      const Cvec3 a = flat.getWorldRbt(i).getTranslation(), b = serialFlat.getWorldRbt(i).getTranslation();
+      parallelMatches = parallelMatches && a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+    }
+
+    // node allocation
+    vector<RigTForm> rbts(numNodes);
+    for (int i = 1; i < numNodes; ++i)
+      rbts[i] = nodes[i]->getRbt();
+    const Result buildHeap = timeFrames(frames, [&]() {
+      buildTree(rbts, fanout, [](const RigTForm& rbt) {
+        return make_shared<SgRbtNode>(rbt);
+      });
+      return double(numNodes);
+    });
+    const Result buildArena = timeFrames(frames, [&]() {
+      shared_ptr<NodeArena> arena(new NodeArena());
+      buildTree(rbts, fanout, [&](const RigTForm& rbt) {
+        return makeArenaShared<SgRbtNode>(arena, rbt);
+      });
+      return double(numNodes);
+    });
+
+    // the same walks over both, with the make_shared nodes in a heap where
+    // as many nodes as the tree has were created and half of them freed in
+    // random order, as in an editor that has been adding and deleting nodes:
+    // new nodes then fill the holes in no particular order
+    vector<shared_ptr<SgRbtNode> > churn(2 * numNodes);
+    for (size_t k = 0; k < churn.size(); ++k)
+      churn[k] = make_shared<SgRbtNode>();
+    shuffle(churn.begin(), churn.end(), rng);
+    churn.resize(numNodes);
+    const shared_ptr<SgTransformNode> heapTree = buildTree(rbts, fanout, [](const RigTForm& rbt) {
+      return make_shared<SgRbtNode>(rbt);
+    });
+    churn.clear();
+    shared_ptr<NodeArena> arena(new NodeArena());
+    const shared_ptr<SgTransformNode> arenaTree = buildTree(rbts, fanout, [&](const RigTForm& rbt) {
+      return makeArenaShared<SgRbtNode>(arena, rbt);
+    });
+    double heapChecksum = 0, arenaChecksum = 0;
+    const Result walkHeap = timeFrames(frames, [&]() {
+      WorldRbtVisitor v;
+      traverse(*heapTree, v);
+      heapChecksum = v.checksum;
+      return double(numNodes);
+    });
+    const Result walkArena = timeFrames(frames, [&]() {
+      WorldRbtVisitor v;
+      traverse(*arenaTree, v);
+      arenaChecksum = v.checksum;
+      return double(numNodes);
+    });
+    // next to no work per node, so mostly the cost of reaching the nodes
+    vector<SgRbtNode*> scanned;
+    const Result scanHeap = timeFrames(frames, [&]() {
+      scanned.clear();
+      dumpSgRbtNodes(*heapTree, scanned);
+      return double(numNodes);
+    });
+    const Result scanArena = timeFrames(frames, [&]() {
+      scanned.clear();
+      dumpSgRbtNodes(*arenaTree, scanned);
+      return double(numNodes);
+    });
+
+    // a shape under every node, for the render queue
+    for (int i = 0; i < numNodes; ++i)
+      nodes[i]->addChild(make_shared<QueuedShapeNode>());
+    FlatScene shapeFlat(nodes[0]);
+    const RigTForm invEyeRbt = inv(RigTForm(Cvec3(0, 0, 10)));
+    RenderQueue queue, parallelQueue;
+    const Result enqueueSerial = timeFrames(frames, [&]() {
+      queue.clear();
+      shapeFlat.enqueue(invEyeRbt, queue);
+      return double(numNodes);
+    });
+    const Result enqueueParallel = timeFrames(frames, [&]() {
+      parallelQueue.clear();
+      shapeFlat.enqueue(invEyeRbt, parallelQueue, &pool);
+      return double(numNodes);
+    });
+
+    // the selection starts out in the order it was added, and is moved in
+    // random order so removal cannot simply take the last child
+    const shared_ptr<SgTransformNode> groupA = make_shared<SgRbtNode>(), groupB = make_shared<SgRbtNode>();
+    vector<shared_ptr<SgNode> > selection(numNodes);
+    for (int i = 0; i < numNodes; ++i) {
+      selection[i] = make_shared<SgRbtNode>();
+      groupA->addChild(selection[i]);
+    }
+    const Result reparentSelection = timeFrames(frames, [&]() {
+      shuffle(selection.begin(), selection.end(), rng);
+      reparent(selection, groupB.get());
+      shuffle(selection.begin(), selection.end(), rng);
+      reparent(selection, groupA.get());
+      return double(2 * numNodes);
+    });
+    bool reparentKeepsChildren = groupA->getNumChildren() == numNodes && groupB->getNumChildren() == 0;
+    for (int i = 0; i < numNodes && reparentKeepsChildren; ++i)
+      reparentKeepsChildren = groupA->getChild(i)->getParent() == groupA.get();
+    // detaching everything leaves nothing to remove
+    reparent(selection, NULL);
+    reparentKeepsChildren = reparentKeepsChildren && groupA->getNumChildren() == 0 && !groupA->removeChild(selection[0]);
+
+    printf("{\n");
+    printf("  \"nodes\": %d, \"fanout\": %d, \"frames\": %d, \"changedNodes\": %d, \"threads\": %d,\n",
+           numNodes, fanout, frames, numChanged, pool.getNumThreads());
+    printf("  \"results\": {\n");
+    printResult("sceneGraphWalk", sgWalk, numNodes, false);
+    printResult("sceneGraphTraverse", sgTraverse, numNodes, false);
+    printResult("rbtNodeScanVirtual", scanVirtual, numNodes, false);
+    printResult("rbtNodeScanTraverse", scanTraverse, numNodes, false);
+    printResult("flatAllDirty", flatFull, numNodes, false);
+    printResult("flatPartialDirty", flatPartial, numNodes, false);
+    printResult("flatPullUnchanged", pullStatic, numNodes, false);
+    printResult("flatPullPartial", pullPartial, numNodes, false);
+    printResult("sceneGraphSetAllWalk", sgSetAllWalk, numNodes, false);
+    printResult("flatSetAllPull", pullAll, numNodes, false);
+    printResult("flatAllDirtyParallel", flatFullParallel, numNodes, false);
+    printResult("enqueueSerial", enqueueSerial, numNodes, false);
+    printResult("enqueueParallel", enqueueParallel, numNodes, false);
+    printResult("buildAndFreeMakeShared", buildHeap, numNodes, false);
+    printResult("buildAndFreeArena", buildArena, numNodes, false);
+    printResult("traverseChurnedHeap", walkHeap, numNodes, false);
+    printResult("traverseArena", walkArena, numNodes, false);
+    printResult("rbtNodeScanChurnedHeap", scanHeap, numNodes, false);
+    printResult("rbtNodeScanArena", scanArena, numNodes, false);
+    printResult("reparentSelection", reparentSelection, numNodes, true);
+    printf("  },\n");
+    printf("  \"worldFramesMatch\": %s,\n", fabs(flatChecksum - v.checksum) < 1e-6 * numNodes ? "true" : "false");
+    printf("  \"traverseMatchesAccept\": %s,\n", v.checksum == vt.checksum && rttiScanned == tagScanned ? "true" : "false");
+    printf("  \"parallelMatchesSerial\": %s,\n",
+           parallelMatches && queue.size() == parallelQueue.size() ? "true" : "false");
+    printf("  \"arenaMatchesHeap\": %s,\n", heapChecksum == arenaChecksum ? "true" : "false");
+    printf("  \"reparentKeepsChildren\": %s,\n", reparentKeepsChildren ? "true" : "false");
+    printf("  \"checksum\": %g\n", checksum);
+    printf("}\n");
+  }
+  catch (const runtime_error& e) {
+    cerr << "Exception caught: " << e.what() << endl;
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,51 @@
+#include <algorithm>
+
+#include "scenebvh.h"
+
+using namespace std;
+
+// Rebuild once refitting made queries this much more expensive than right
+// after a build
+static const double REBUILD_SAH_RATIO = 2;
+
+void SceneBvh::build(const FlatScene& scene) {
+  scene_ = &scene;
+  changedRoots_.clear();
+  bounds_.resize(scene.getNumShapes());
+  for (int k = 0, n = bounds_.size(); k < n; ++k)
+    bounds_[k] = scene.getShapeWorldBounds(k);
+  bvh_.build(bounds_);
+  builtSahCost_ = bvh_.getSahCost();
+}
+
+int SceneBvh::update() {
+  if (!scene_)
+    return 0;
+
+  changedRoots_.insert(changedRoots_.end(), scene_->getLastUpdatedRoots().begin(), scene_->getLastUpdatedRoots().end());
+  if (changedRoots_.empty())
+    return 0;
+
+  // a subtree nested in an earlier one has its shapes refitted already
+  sort(changedRoots_.begin(), changedRoots_.end());
+  changedShapes_.clear();
+  int done = 0;
+  for (size_t k = 0; k < changedRoots_.size(); ++k) {
+    const int r = changedRoots_[k];
+    if (r < done)
+      continue;
+    for (int s = scene_->getSubtreeShapesBegin(r), e = scene_->getSubtreeShapesEnd(r); s < e; ++s) {
+      bounds_[s] = scene_->getShapeWorldBounds(s);
+      changedShapes_.push_back(s);
+    }
+    done = scene_->getSubtreeEnd(r);
+  }
+  changedRoots_.clear();
+
+  bvh_.refit(bounds_, changedShapes_);
+  if (bvh_.getSahCost() > REBUILD_SAH_RATIO * builtSahCost_) {
+    bvh_.build(bounds_);
+    builtSahCost_ = bvh_.getSahCost();
+  }
+  return changedShapes_.size();
+}
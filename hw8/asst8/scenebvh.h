@@ -0,0 +1,75 @@
+#ifndef SCENEBVH_H
+#define SCENEBVH_H
+
+#include <vector>
+
+#include "bounds.h"
+#include "bvh.h"
+#include "flatscene.h"
+
+//--------------------------------------------------------------------------------
+// Bounding volume hierarchy over the world-space bounds of the shapes of a
+// FlatScene. Query results are shape indices of the FlatScene (see
+// FlatScene::getShapeNode).
+//
+// After each FlatScene::update(), update() refits the boxes of the shapes
+// below the nodes that update recomputed, so moving a few nodes, as keyframe
+// playback does, costs time proportional to the shapes that moved and the
+// depth of the tree, not to the size of the scene. Bounds changes the
+// FlatScene does not see, such as new vertices of a geometry, are reported
+// with markSubtreeChanged. Once the refitted tree has become much looser than
+// a fresh one (see Bvh::getSahCost), update() builds it again.
+//
+// The FlatScene must outlive this, and build() must be called again whenever
+// the FlatScene is.
+//--------------------------------------------------------------------------------
+
+class SceneBvh {
+public:
+  SceneBvh() : scene_(NULL), builtSahCost_(0) {}
+
+  void build(const FlatScene& scene);
+
+  // Refits the shapes below FlatScene::getLastUpdatedRoots() and below the
+  // nodes passed to markSubtreeChanged since the last call. Must be called
+  // after every FlatScene::update(), or changes are missed. Returns the number
+  // of shapes refitted.
+  int update();
+
+  // The bounds of the shapes below FlatScene node i changed
+  void markSubtreeChanged(int i) {
+    changedRoots_.push_back(i);
+  }
+
+  const Bvh& getBvh() const {
+    return bvh_;
+  }
+
+  const Aabb& getShapeWorldBounds(int k) const {
+    return bounds_[k];
+  }
+
+  void queryBox(const Aabb& box, std::vector<int>& shapes) const {
+    bvh_.queryBox(box, shapes);
+  }
+
+  // 'frustum' in world coordinates
+  void queryFrustum(const Frustum& frustum, std::vector<int>& shapes) const {
+    bvh_.queryFrustum(frustum, shapes);
+  }
+
+  // See Bvh::intersectRay. Ray in world coordinates.
+  template<typename Hit>
+  void intersectRay(const Cvec3& origin, const Cvec3& dir, double tMax, Hit hit) const {
+    bvh_.intersectRay(origin, dir, tMax, hit);
+  }
+
+private:
+  const FlatScene* scene_;
+  Bvh bvh_;
+  std::vector<Aabb> bounds_;
+  std::vector<int> changedRoots_, changedShapes_;
+  double builtSahCost_;
+};
+
+#endif
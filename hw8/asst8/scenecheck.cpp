@@ -0,0 +1,120 @@
+////////////////////////////////////////////////////////////////////////
+//
+//   scenecheck: checks of how scene graph nodes are linked and moved
+//
+//   Each check builds a small graph of SgRbtNodes and compares the
+//   parents and children that result with the expected ones:
+//     - addChild refuses a node that already has a parent, and leaves
+//       both parents as they were
+//     - reparent moves nodes from their parents to a new one, or
+//       detaches them
+//     - reparent refuses to move a node under its own subtree, before
+//       moving any of the nodes
+//     - removeChild moves the last child into the place of the removed
+//       one
+//   Makes no GL calls. Exits with 1 if any check fails.
+//
+//   Usage: scenecheck
+//
+////////////////////////////////////////////////////////////////////////
+
+#include <cstdio>
+#include <vector>
+#include <memory>
+#include <stdexcept>
+#include <iostream>
+
+#include "scenegraph.h"
+
+using namespace std;
+
+static bool throwsRuntimeError(void (*f)(const vector<shared_ptr<SgRbtNode> >&),
+                               const vector<shared_ptr<SgRbtNode> >& nodes) {
+  try {
+    f(nodes);
+  }
+  catch (const runtime_error&) {
+    return true;
+  }
+  return false;
+}
+
+static bool hasChildren(SgTransformNode& parent, const vector<shared_ptr<SgRbtNode> >& children) {
+  if (parent.getNumChildren() != int(children.size()))
+    return false;
+  for (size_t i = 0; i < children.size(); ++i) {
+    if (parent.getChild(i) != children[i] || children[i]->getParent() != &parent)
+      return false;
+  }
+  return true;
+}
+
+static vector<shared_ptr<SgRbtNode> > makeNodes(int n) {
+  vector<shared_ptr<SgRbtNode> > nodes;
+  for (int i = 0; i < n; ++i)
+    nodes.push_back(make_shared<SgRbtNode>());
+  return nodes;
+}
+
+// A node is in one tree at most, sharing it between two parents is an error
+static bool checkAddChildOfParented() {
+  const vector<shared_ptr<SgRbtNode> > n = makeNodes(3);
+  n[0]->addChild(n[2]);
+  const bool threw = throwsRuntimeError([](const vector<shared_ptr<SgRbtNode> >& n) {
+    n[1]->addChild(n[2]);
+  }, n);
+  return threw && hasChildren(*n[0], {n[2]}) && hasChildren(*n[1], {});
+}
+
+// What the refused addChild did before: the node moves to the new parent
+static bool checkReparent() {
+  const vector<shared_ptr<SgRbtNode> > n = makeNodes(4);
+  n[0]->addChild(n[2]);
+  n[0]->addChild(n[3]);
+  reparent({n[2], n[3]}, n[1].get());
+  if (!hasChildren(*n[0], {}) || !hasChildren(*n[1], {n[2], n[3]}))
+    return false;
+
+  reparent({n[3]}, NULL);
+  return hasChildren(*n[1], {n[2]}) && !n[3]->getParent();
+}
+
+static bool checkReparentIntoSubtree() {
+  const vector<shared_ptr<SgRbtNode> > n = makeNodes(4);
+  n[0]->addChild(n[1]);
+  n[1]->addChild(n[2]);
+  const bool threw = throwsRuntimeError([](const vector<shared_ptr<SgRbtNode> >& n) {
+    reparent({n[3], n[1]}, n[2].get());
+  }, n);
+  return threw && hasChildren(*n[0], {n[1]}) && hasChildren(*n[1], {n[2]}) && !n[3]->getParent();
+}
+
+static bool checkRemoveChild() {
+  const vector<shared_ptr<SgRbtNode> > n = makeNodes(4);
+  for (int i = 1; i < 4; ++i)
+    n[0]->addChild(n[i]);
+  if (!n[0]->removeChild(n[1]) || n[0]->removeChild(n[1]))
+    return false;
+  return hasChildren(*n[0], {n[3], n[2]}) && !n[1]->getParent();
+}
+
+int main() {
+  struct Check {
+    const char* name;
+    bool (*run)();
+  };
+  const Check checks[] = {
+    {"addChild of a node with a parent", checkAddChildOfParented},
+    {"reparent", checkReparent},
+    {"reparent into a moved subtree", checkReparentIntoSubtree},
+    {"removeChild", checkRemoveChild},
+  };
+
+  int failed = 0;
+  for (const Check& check : checks) {
+    const bool ok = check.run();
+    failed += !ok;
+    printf("%-34s %s\n", check.name, ok ? "ok" : "FAILED");
+  }
+  return failed ? 1 : 0;
+}
@@ -14,61 +14,140 @@ bool SgTransformNode::accept(SgNodeVisitor& visitor) {
   return visitor.postVisit(*this);
 }
 
-void SgTransformNode::addChild(shared_ptr<SgNode> child) {
-  children_.push_back(child);
+SgTransformNode::~SgTransformNode() {
+  for (int i = 0, n = children_.size(); i < n; ++i) {
+    children_[i]->parent_ = NULL;
+    children_[i]->indexInParent_ = -1;
+    children_[i]->invalidateWorldRbt();
+  }
 }
 
-void SgTransformNode::removeChild(shared_ptr<SgNode> child) {
-  children_.erase(find(children_.begin(), children_.end(), child));
+RigTForm SgTransformNode::getWorldRbt() {
+  if (!worldRbtValid_) {
+    worldRbt_ = parent_ ? parent_->getWorldRbt() * getRbt() : getRbt();
+    worldRbtValid_ = true;
+  }
+  return worldRbt_;
 }
 
-bool SgShapeNode::accept(SgNodeVisitor& visitor) {
-  if (!visitor.visit(*this))
-    return false;
-  return visitor.postVisit(*this);
+void SgTransformNode::invalidateWorldRbt() {
+  if (!worldRbtValid_)
+    return;
+  worldRbtValid_ = false;
+  for (int i = 0, n = children_.size(); i < n; ++i)
+    children_[i]->invalidateWorldRbt();
 }
 
-class RbtAccumVisitor : public SgNodeVisitor {
-protected:
-  vector<RigTForm> rbtStack_;
-  SgTransformNode& target_;
-  bool found_;
-public:
-  RbtAccumVisitor(SgTransformNode& target)
-    : target_(target)
-    , found_(false) {}
-
-  const RigTForm getAccumulatedRbt(int offsetFromStackTop = 0) {
-    if (!found_)
-      throw runtime_error("RbtAccumVisitor target never reached");
-    return rbtStack_[rbtStack_.size()-1-offsetFromStackTop];
+void SgTransformNode::logRbtChange() {
+  if (!rbtChangeLog_)
+    return;
+  if (!rbtChangeLog_->open) {
+    rbtChangeLog_.reset();
+    return;
   }
+  rbtChangeLog_->add(rbtChangeIndex_, getRbt());
+}
 
-  virtual bool visit(SgTransformNode& node) {
-    if (rbtStack_.empty())
-      rbtStack_.push_back(RigTForm());
-    else
-      rbtStack_.push_back(rbtStack_.back() * node.getRbt());
+void SgNode::invalidateBounds() {
+  if (parent_)
+    parent_->invalidateBounds();
+}
 
-    if (target_ == node) {
-      found_ = true;
-      return false;
-    }
-    return true;
+Aabb SgTransformNode::getBounds() {
+  if (!boundsValid_) {
+    bounds_ = Aabb();
+    for (int i = 0, n = children_.size(); i < n; ++i)
+      bounds_.add(children_[i]->getBoundsInParent());
+    boundsValid_ = true;
   }
+  return bounds_;
+}
+
+void SgTransformNode::invalidateBounds() {
+  if (!boundsValid_)
+    return;
+  boundsValid_ = false;
+  SgNode::invalidateBounds();
+}
+
+void SgTransformNode::addChild(shared_ptr<SgNode> child) {
+  if (child->parent_)
+    throw runtime_error("SgTransformNode::addChild: node already has a parent");
+  child->parent_ = this;
+  child->indexInParent_ = children_.size();
+  children_.push_back(child);
+  child->invalidateWorldRbt();
+  invalidateBounds();
+}
 
-  virtual bool postVisit(SgTransformNode& node) {
-    rbtStack_.pop_back();
-    return true;
+bool SgTransformNode::removeChild(SgNode& child) {
+  if (child.parent_ != this)
+    return false;
+
+  // keep the child alive until it is unlinked, children_ may hold the last reference
+  const int i = child.indexInParent_;
+  shared_ptr<SgNode> removed = move(children_[i]);
+  if (i + 1 < int(children_.size())) {
+    children_[i] = move(children_.back());
+    children_[i]->indexInParent_ = i;
+  }
+  children_.pop_back();
+
+  child.parent_ = NULL;
+  child.indexInParent_ = -1;
+  child.invalidateWorldRbt();
+  invalidateBounds();
+  return true;
+}
+
+void reparent(const vector<shared_ptr<SgNode> >& nodes, SgTransformNode* newParent) {
+  // newParent and its ancestors, sorted for lookup; none of them may be moved
+  vector<const SgNode*> path;
+  for (SgTransformNode* a = newParent; a; a = a->getParent())
+    path.push_back(a);
+  sort(path.begin(), path.end());
+
+  for (size_t k = 0; k < nodes.size(); ++k) {
+    if (!nodes[k])
+      throw runtime_error("reparent: null node");
+    if (binary_search(path.begin(), path.end(), nodes[k].get()))
+      throw runtime_error("reparent: new parent is in the subtree of a moved node");
+  }
+
+  if (newParent)
+    newParent->children_.reserve(newParent->children_.size() + nodes.size());
+  for (size_t k = 0; k < nodes.size(); ++k) {
+    SgNode& node = *nodes[k];
+    if (node.getParent())
+      node.getParent()->removeChild(node);
+    if (newParent)
+      newParent->addChild(nodes[k]);
   }
-};
+}
+
+bool SgShapeNode::accept(SgNodeVisitor& visitor) {
+  if (!visitor.visit(*this))
+    return false;
+  return visitor.postVisit(*this);
+}
 
 RigTForm getPathAccumRbt(
-  shared_ptr<SgTransformNode> source,
-  shared_ptr<SgTransformNode> destination,
+  SgTransformNode* source,
+  SgTransformNode* destination,
   int offsetFromDestination) {
 
-  RbtAccumVisitor accum(*destination);
-  source->accept(accum);
-  return accum.getAccumulatedRbt(offsetFromDestination);
+  SgTransformNode* target = destination;
+  for (int i = 0; i < offsetFromDestination && target; ++i)
+    target = target->getParent();
+
+  // source must be target itself or one of its ancestors
+  SgTransformNode* node = target;
+  while (node && node != source)
+    node = node->getParent();
+  if (!node)
+    throw runtime_error("getPathAccumRbt: destination not reached from source");
+
+  if (target == source)
+    return RigTForm();
+  return inv(source->getWorldRbt()) * target->getWorldRbt();
 }
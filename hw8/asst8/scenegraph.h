@@ -7,18 +7,77 @@
 
 #include "matrix4.h"
 #include "rigtform.h"
+#include "bounds.h"
 #include "glsupport.h" // for Noncopyable
 #include "uniforms.h"
 #include "geometry.h"
 #include "asstcommon.h"
+#include "renderqueue.h"
 
 class SgNodeVisitor;
+class SgTransformNode;
+
+// Frame changes of transform nodes, for a FlatScene built from them: each
+// entry is the index the FlatScene gave the node and the node's latest frame.
+// A node that changes again before the entries are taken only updates its
+// entry, so the log never holds more entries than there are nodes, however
+// long nobody takes them. The FlatScene closes the log when it is cleared or
+// destroyed, and nodes that still point to a closed log let go of it.
+struct SgRbtChangeLog {
+  struct Entry {
+    int index;
+    RigTForm rbt;
+  };
+
+  std::vector<Entry> entries;
+  std::vector<int> entryOf; // position in entries by node index, -1 for none
+  bool open;
+
+  SgRbtChangeLog() : open(true) {}
+
+  void add(int index, const RigTForm& rbt) {
+    if (index >= int(entryOf.size()))
+      entryOf.resize(index + 1, -1);
+    if (entryOf[index] >= 0) {
+      entries[entryOf[index]].rbt = rbt;
+      return;
+    }
+    entryOf[index] = entries.size();
+    Entry e = { index, rbt };
+    entries.push_back(e);
+  }
+
+  void clear() {
+    for (size_t k = 0; k < entries.size(); ++k)
+      entryOf[entries[k].index] = -1;
+    entries.clear();
+  }
+};
 
 class SgNode : public std::enable_shared_from_this<SgNode>, Noncopyable {
 public:
+  // What a node is, so traversals can tell without RTTI. Subclasses of
+  // SgTransformNode other than SgRootNode and SgRbtNode are TRANSFORM, and
+  // subclasses of SgRbtNode are RBT.
+  enum Type { SHAPE, TRANSFORM, ROOT, RBT };
+
   virtual bool accept(SgNodeVisitor& vistor) = 0;
   virtual ~SgNode() {}
 
+  Type getType() const {
+    return type_;
+  }
+
+  bool isTransformNode() const {
+    return type_ != SHAPE;
+  }
+
+  // The transform node this node was added to, or NULL. A node can have at
+  // most one parent. The parent owns its children, so this is a plain pointer.
+  SgTransformNode* getParent() const {
+    return parent_;
+  }
+
   // Two nodes are equal if and only if they're the same, i.e.,
   // having the same in memory address
   bool operator == (const SgNode& other) const {
@@ -29,8 +88,32 @@ public:
     return !(*this == other);
   }
 
+  // Box around everything this node draws, in the frame of its parent
+  // transform node (for a transform node, its own frame: the rbt is applied by
+  // whoever holds the node). Aabb::infinite() if unknown.
+  virtual Aabb getBounds() = 0;
+
+  // Tells the ancestors that getBounds() changed in a way the scene graph does
+  // not see, e.g. new vertices uploaded to a geometry. Frame changes made
+  // through SgRbtNode::setRbt and changes of the children are tracked already.
+  virtual void invalidateBounds();
+
 protected:
-  SgNode() {}
+  explicit SgNode(Type type) : parent_(NULL), indexInParent_(-1), type_(type) {}
+
+  // getBounds() in the frame of the parent
+  virtual Aabb getBoundsInParent() {
+    return getBounds();
+  }
+
+  // Called when the world frame of the parent changes
+  virtual void invalidateWorldRbt() {}
+
+private:
+  friend class SgTransformNode;
+  SgTransformNode* parent_;
+  int indexInParent_; // position among the children of parent_, so removal needs no search
+  const Type type_;
 };
 
 //
@@ -38,13 +121,40 @@ protected:
 // rigid body transform to represent its frame with respect to
 // the parent frame
 //
+// The world frame (the product of the frames from the root down to this node)
+// is cached and recomputed only after this node or one of its ancestors
+// changed. Subclasses whose getRbt() can change must call invalidateWorldRbt()
+// when it does, as SgRbtNode::setRbt does.
+//
+// The bounds of the subtree are cached the same way, and recomputed after a
+// node below changed its frame, its children or its bounds. Those changes
+// invalidate the cached bounds of every ancestor, so a subclass changing
+// getRbt() must also call invalidateBounds() on its parent, and logRbtChange()
+// to tell a FlatScene built from the node.
+//
 class SgTransformNode : public SgNode {
 public:
+  virtual ~SgTransformNode();
+
   virtual bool accept(SgNodeVisitor& visitor);
   virtual RigTForm getRbt() = 0;
 
+  // Frame of this node with respect to the root of its tree, in O(depth) at
+  // worst and O(1) when nothing above it changed since the last call
+  RigTForm getWorldRbt();
+
+  // Throws runtime_error if 'child' already has a parent: a node is in one
+  // tree at most, and reparent() moves it to another parent.
   void addChild(std::shared_ptr<SgNode> child);
-  void removeChild(std::shared_ptr<SgNode> child);
+
+  // Detaches 'child' in O(1): the last child takes its place, so the order
+  // of the remaining children changes. Returns false, and changes nothing, if
+  // 'child' is not a child of this node.
+  bool removeChild(SgNode& child);
+
+  bool removeChild(const std::shared_ptr<SgNode>& child) {
+    return child && removeChild(*child);
+  }
 
   int getNumChildren() const {
     return children_.size();
@@ -54,8 +164,47 @@ public:
     return children_[i];
   }
 
+  // Union of the bounds of the children, each in this node's frame
+  virtual Aabb getBounds();
+
+  // Stops at nodes whose bounds are already stale: the ancestors of a stale
+  // node are stale too
+  virtual void invalidateBounds();
+
+  // Appends later frame changes of this node to 'log' under 'index', in place
+  // of the log it wrote to before. An empty 'log' stops the reports.
+  void setRbtChangeLog(const std::shared_ptr<SgRbtChangeLog>& log, int index) {
+    rbtChangeLog_ = log;
+    rbtChangeIndex_ = index;
+  }
+
+protected:
+  explicit SgTransformNode(Type type = TRANSFORM)
+    : SgNode(type), worldRbtValid_(false), boundsValid_(false), rbtChangeIndex_(-1) {}
+
+  virtual Aabb getBoundsInParent() {
+    return transformBounds(getRbt(), getBounds());
+  }
+
+  // Marks the cached world frames of this subtree stale. A node whose cache is
+  // stale has stale descendants too, so this stops at stale nodes.
+  virtual void invalidateWorldRbt();
+
+  // Records the current getRbt() in the change log, if there is an open one
+  void logRbtChange();
+
 private:
+  template<typename Visitor>
+  friend bool traverse(SgNode& node, Visitor& visitor);
+  friend void reparent(const std::vector<std::shared_ptr<SgNode> >& nodes, SgTransformNode* newParent);
+
   std::vector<std::shared_ptr<SgNode> > children_;
+  RigTForm worldRbt_;
+  bool worldRbtValid_;
+  Aabb bounds_;
+  bool boundsValid_;
+  std::shared_ptr<SgRbtChangeLog> rbtChangeLog_;
+  int rbtChangeIndex_;
 };
 
 //
@@ -68,6 +217,36 @@ public:
 
   virtual Matrix4 getAffineMatrix() = 0;
   virtual void draw(const Uniforms& uniforms) = 0;
+
+  // Infinite unless overridden, so the shape is never culled
+  virtual Aabb getBounds() {
+    return Aabb::infinite();
+  }
+
+  // Nearest hit of the ray origin + t * dir with t in [0, tMax], given in the
+  // frame of the parent transform node. Sets t and returns true on a hit. By
+  // default the box from getBounds() is what gets hit; an infinite box is
+  // never hit.
+  virtual bool intersectRay(const Cvec3& origin, const Cvec3& dir, double tMax, double& t) {
+    const Aabb b = getBounds();
+    if (b.isEmpty() || b.isInfinite())
+      return false;
+    const double hit = Bvh::intersectRayBox(origin, Cvec3(1 / dir[0], 1 / dir[1], 1 / dir[2]), tMax, b);
+    if (hit < 0)
+      return false;
+    t = hit;
+    return true;
+  }
+
+  // Adds this shape to 'queue' with the given model view matrix (affine matrix
+  // included). By default the queue calls draw() at submit time; shapes made
+  // of a material and a geometry should add those instead so they get sorted.
+  virtual void enqueue(RenderQueue& queue, const Matrix4& MVM) {
+    queue.add(*this, MVM);
+  }
+
+protected:
+  SgShapeNode() : SgNode(SHAPE) {}
 };
 
 
@@ -83,12 +262,59 @@ public:
   virtual bool postVisit(SgShapeNode& node) { return true; }
 };
 
+// Same walk as node.accept(visitor), with the same early termination, but
+// resolved at compile time: the node kinds are told apart by their tag and
+// the callbacks of Visitor are called directly, so they can be inlined.
+//
+// Visitor needs visit and postVisit for both SgTransformNode& and
+// SgShapeNode&. A subclass of SgNodeVisitor that overrides only some of them
+// brings in the rest with 'using SgNodeVisitor::visit;' and
+// 'using SgNodeVisitor::postVisit;', and then works with both accept and
+// traverse.
+template<typename Visitor>
+bool traverse(SgNode& node, Visitor& visitor) {
+  if (!node.isTransformNode()) {
+    SgShapeNode& shape = static_cast<SgShapeNode&>(node);
+    return visitor.Visitor::visit(shape) && visitor.Visitor::postVisit(shape);
+  }
+
+  SgTransformNode& transform = static_cast<SgTransformNode&>(node);
+  if (!visitor.Visitor::visit(transform))
+    return false;
+  for (int i = 0, n = transform.children_.size(); i < n; ++i) {
+    if (!traverse(*transform.children_[i], visitor))
+      return false;
+  }
+  return visitor.Visitor::postVisit(transform);
+}
+
 
+// Accumulated frame of the nodes strictly below 'source' down to the ancestor
+// 'offsetFromDestination' levels above 'destination'. Uses the cached world
+// frames instead of traversing the graph. Throws if 'destination' is not in
+// the subtree of 'source' or the offset goes above 'source'.
 RigTForm getPathAccumRbt(
-  std::shared_ptr<SgTransformNode> source,
-  std::shared_ptr<SgTransformNode> destination,
+  SgTransformNode* source,
+  SgTransformNode* destination,
   int offsetFromDestination = 0);
 
+// Same for shared pointers to any kind of transform node, without converting
+// them to shared_ptr<SgTransformNode> temporaries
+template<typename S, typename D>
+RigTForm getPathAccumRbt(
+  const std::shared_ptr<S>& source,
+  const std::shared_ptr<D>& destination,
+  int offsetFromDestination = 0) {
+  return getPathAccumRbt(source.get(), destination.get(), offsetFromDestination);
+}
+
+// Moves each of 'nodes', in order, from its current parent (if any) to the
+// end of the children of 'newParent', or detaches them all if 'newParent' is
+// NULL. Each move is O(1), as with removeChild. Throws runtime_error, before
+// moving anything, if a node is null or 'newParent' is in the subtree of one
+// of them.
+void reparent(const std::vector<std::shared_ptr<SgNode> >& nodes, SgTransformNode* newParent);
+
 
 //----------------------------------------------------
 // Concrete scene graph node implementations follow
@@ -97,7 +323,7 @@ RigTForm getPathAccumRbt(
 // A SgRoot node is a Transform node with identity Rbt
 class SgRootNode : public SgTransformNode {
 public:
-  SgRootNode() {}
+  SgRootNode() : SgTransformNode(ROOT) {}
 
   virtual RigTForm getRbt() {
     return RigTForm();
@@ -108,7 +334,8 @@ public:
 class SgRbtNode : public SgTransformNode {
 public:
   SgRbtNode(const RigTForm& rbt = RigTForm())
-    : rbt_ (rbt) {}
+    : SgTransformNode(RBT)
+    , rbt_ (rbt) {}
 
   virtual RigTForm getRbt() {
     return rbt_;
@@ -116,12 +343,30 @@ public:
 
   void setRbt(const RigTForm& rbt) {
     rbt_ = rbt;
+    invalidateWorldRbt();
+    logRbtChange();
+    if (getParent())
+      getParent()->invalidateBounds();
   }
 
 private:
   RigTForm rbt_;
 };
 
+// Tag checked casts to SgRbtNode, cheaper than dynamic_cast. NULL if 'node' is
+// not an SgRbtNode.
+inline SgRbtNode* asRbtNode(SgNode* node) {
+  return node && node->getType() == SgNode::RBT ? static_cast<SgRbtNode*>(node) : NULL;
+}
+
+template<typename T>
+std::shared_ptr<SgRbtNode> asRbtNode(const std::shared_ptr<T>& node) {
+  return asRbtNode(node.get()) ? std::static_pointer_cast<SgRbtNode>(node) : std::shared_ptr<SgRbtNode>();
+}
+
+// Draws 'geometry' with 'material'. Changing 'geometry' or 'affineMatrix'
+// directly, or uploading new vertices to the geometry, changes the bounds:
+// call invalidateBounds() afterwards. setAffineMatrix does that already.
 class SgGeometryShapeNode : public SgShapeNode {
 public:
   std::shared_ptr<Geometry> geometry;
@@ -141,6 +386,13 @@ public:
                    Matrix4::makeZRotation(eulerAngles[2]) *
                    Matrix4::makeScale(scales)) {}
 
+  SgGeometryShapeNode(std::shared_ptr<Geometry> _geometry,
+                      std::shared_ptr<Material> _material,
+                      const Matrix4& _affineMatrix)
+    : geometry(_geometry)
+    , material(_material)
+    , affineMatrix(_affineMatrix) {}
+
   virtual Matrix4 getAffineMatrix() {
     return affineMatrix;
   }
@@ -153,6 +405,23 @@ public:
                    Matrix4::makeYRotation(eulerAngles[1]) *
                    Matrix4::makeZRotation(eulerAngles[2]) *
                    Matrix4::makeScale(scales);
+    invalidateBounds();
+  }
+
+  virtual Aabb getBounds() {
+    return transformBounds(affineMatrix, geometry->getBounds());
+  }
+
+  // Tests the triangles of the geometry if it keeps a copy (see
+  // Geometry::getRayMesh), its bounds otherwise
+  virtual bool intersectRay(const Cvec3& origin, const Cvec3& dir, double tMax, double& t) {
+    RayMesh* rayMesh = geometry->getRayMesh();
+    if (!rayMesh)
+      return SgShapeNode::intersectRay(origin, dir, tMax, t);
+    // an affine map keeps the ray parameter, so t needs no conversion
+    const Matrix4 invAffine = inv(affineMatrix);
+    const Cvec4 o = invAffine * Cvec4(origin, 1), d = invAffine * Cvec4(dir, 0);
+    return rayMesh->intersectRay(Cvec3(o), Cvec3(d), tMax, t);
   }
 
   virtual void draw(const Uniforms& uniforms) {
@@ -161,6 +430,10 @@ public:
     else
       material->draw(*geometry, uniforms);
   }
+
+  virtual void enqueue(RenderQueue& queue, const Matrix4& MVM) {
+    queue.add(g_overridingMaterial ? *g_overridingMaterial : *material, *geometry, MVM);
+  }
 };
 
 #endif
@@ -0,0 +1,489 @@
+#include <cstring>
+#include <cstdint>
+#include <climits>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+
+#include "sceneio.h"
+#include "nodearena.h"
+
+using namespace std;
+
+static const char BINARY_MAGIC[4] = {'S', 'G', 'B', 0};
+static const uint32_t VERSION = 1;
+
+enum RecordKind { ROOT_RECORD = 0, RBT_RECORD = 1, SHAPE_RECORD = 2 };
+
+// Arena space for one node with its reference count, an estimate used to
+// reserve the arena before loading
+static const size_t NODE_OVERHEAD = 64;
+
+// Smallest record of a transform (a root: kind and parent) and size of a shape
+// record, to check the counts in the header against the file size
+static const size_t MIN_TRANSFORM_RECORD_SIZE = 1 + 4;
+static const size_t SHAPE_RECORD_SIZE = 1 + 4 + 2 * 4 + 12 * 8;
+
+// The binary format is little-endian; values are reversed on other hosts
+static bool isHostLittleEndian() {
+  const uint16_t one = 1;
+  return *reinterpret_cast<const unsigned char*>(&one) == 1;
+}
+
+//------------------
+// SceneResources
+//------------------
+
+static void checkName(const string& name) {
+  if (name.empty() || name.find_first_of(" \t\r\n") != string::npos)
+    throw runtime_error("SceneResources: invalid name '" + name + "'");
+}
+
+void SceneResources::addGeometry(const string& name, const shared_ptr<Geometry>& geometry) {
+  checkName(name);
+  geometries_[name] = geometry;
+  geometryNames_[geometry.get()] = name;
+}
+
+void SceneResources::addMaterial(const string& name, const shared_ptr<Material>& material) {
+  checkName(name);
+  materials_[name] = material;
+  materialNames_[material.get()] = name;
+}
+
+shared_ptr<Geometry> SceneResources::getGeometry(const string& name) const {
+  unordered_map<string, shared_ptr<Geometry> >::const_iterator it = geometries_.find(name);
+  if (it == geometries_.end())
+    throw runtime_error("Unknown geometry '" + name + "'");
+  return it->second;
+}
+
+shared_ptr<Material> SceneResources::getMaterial(const string& name) const {
+  unordered_map<string, shared_ptr<Material> >::const_iterator it = materials_.find(name);
+  if (it == materials_.end())
+    throw runtime_error("Unknown material '" + name + "'");
+  return it->second;
+}
+
+const string& SceneResources::getGeometryName(const Geometry* geometry) const {
+  unordered_map<const Geometry*, string>::const_iterator it = geometryNames_.find(geometry);
+  if (it == geometryNames_.end())
+    throw runtime_error("saveScene: a shape uses a geometry without a name");
+  return it->second;
+}
+
+const string& SceneResources::getMaterialName(const Material* material) const {
+  unordered_map<const Material*, string>::const_iterator it = materialNames_.find(material);
+  if (it == materialNames_.end())
+    throw runtime_error("saveScene: a shape uses a material without a name");
+  return it->second;
+}
+
+//----------
+// Saving
+//----------
+
+namespace {
+
+struct Record {
+  RecordKind kind;
+  int parent;
+  RigTForm rbt;
+  const string* geometry;
+  const string* material;
+  Matrix4 affine;
+};
+
+// Lists the nodes of a scene graph in file order
+class RecordCollector : public SgNodeVisitor {
+  const SceneResources& resources_;
+  vector<int> indexStack_;
+  int numTransforms_;
+public:
+  vector<Record> records;
+
+  RecordCollector(const SceneResources& resources)
+    : resources_(resources), numTransforms_(0) {}
+
+  using SgNodeVisitor::postVisit;
+
+  virtual bool visit(SgTransformNode& node) {
+    Record r;
+    r.parent = indexStack_.empty() ? -1 : indexStack_.back();
+    r.geometry = r.material = NULL;
+    switch (node.getType()) {
+    case SgNode::ROOT:
+      r.kind = ROOT_RECORD;
+      break;
+    case SgNode::RBT:
+      r.kind = RBT_RECORD;
+      r.rbt = node.getRbt();
+      break;
+    default:
+      throw runtime_error("saveScene: only root and rbt transform nodes can be saved");
+    }
+    if (r.kind == ROOT_RECORD && r.parent >= 0)
+      throw runtime_error("saveScene: a root node can only be the root of the scene");
+    records.push_back(r);
+    indexStack_.push_back(numTransforms_++);
+    return true;
+  }
+
+  virtual bool postVisit(SgTransformNode& node) {
+    indexStack_.pop_back();
+    return true;
+  }
+
+  virtual bool visit(SgShapeNode& node) {
+    SgGeometryShapeNode* shape = dynamic_cast<SgGeometryShapeNode*>(&node);
+    if (!shape)
+      throw runtime_error("saveScene: only SgGeometryShapeNodes can be saved");
+    if (indexStack_.empty())
+      throw runtime_error("saveScene: the root of the scene must be a transform node");
+    Record r;
+    r.kind = SHAPE_RECORD;
+    r.parent = indexStack_.back();
+    r.geometry = &resources_.getGeometryName(shape->geometry.get());
+    r.material = &resources_.getMaterialName(shape->material.get());
+    r.affine = shape->affineMatrix;
+    records.push_back(r);
+    return true;
+  }
+
+  int getNumTransforms() const {
+    return numTransforms_;
+  }
+};
+
+} // namespace
+
+static void openForWrite(ofstream& f, const char filename[], ios::openmode mode) {
+  f.open(filename, mode);
+  if (!f)
+    throw runtime_error(string("Cannot write file ") + filename);
+}
+
+void saveScene(SgTransformNode& root, const SceneResources& resources, const char filename[]) {
+  RecordCollector collector(resources);
+  traverse(root, collector);
+
+  ofstream f;
+  openForWrite(f, filename, ios::out);
+  f << setprecision(17) << "scene " << VERSION << "\n";
+  for (size_t k = 0; k < collector.records.size(); ++k) {
+    const Record& r = collector.records[k];
+    switch (r.kind) {
+    case ROOT_RECORD:
+      f << "root\n";
+      break;
+    case RBT_RECORD: {
+      const Cvec3 t = r.rbt.getTranslation();
+      const Quat q = r.rbt.getRotation();
+      f << "rbt " << r.parent << "  " << t[0] << " " << t[1] << " " << t[2]
+        << "  " << q[0] << " " << q[1] << " " << q[2] << " " << q[3] << "\n";
+      break;
+    }
+    case SHAPE_RECORD:
+      f << "shape " << r.parent << " " << *r.geometry << " " << *r.material << " ";
+      for (int i = 0; i < 12; ++i)
+        f << " " << r.affine[i];
+      f << "\n";
+      break;
+    }
+  }
+  if (!f)
+    throw runtime_error(string("Error writing ") + filename);
+}
+
+template<typename T>
+static void put(string& out, const T& value) {
+  char bytes[sizeof(T)];
+  memcpy(bytes, &value, sizeof(T));
+  if (!isHostLittleEndian())
+    reverse(bytes, bytes + sizeof(T));
+  out.append(bytes, sizeof(T));
+}
+
+void saveSceneBinary(SgTransformNode& root, const SceneResources& resources, const char filename[]) {
+  RecordCollector collector(resources);
+  traverse(root, collector);
+
+  // name table
+  unordered_map<string, uint32_t> nameIndex;
+  string names;
+  const int numShapes = collector.records.size() - collector.getNumTransforms();
+  for (size_t k = 0; k < collector.records.size(); ++k) {
+    const Record& r = collector.records[k];
+    if (r.kind != SHAPE_RECORD)
+      continue;
+    const string* used[2] = {r.geometry, r.material};
+    for (int j = 0; j < 2; ++j) {
+      if (nameIndex.insert(make_pair(*used[j], uint32_t(nameIndex.size()))).second)
+        names.append(used[j]->c_str(), used[j]->size() + 1);
+    }
+  }
+
+  string out;
+  out.append(BINARY_MAGIC, sizeof(BINARY_MAGIC));
+  put(out, VERSION);
+  put(out, uint32_t(collector.getNumTransforms()));
+  put(out, uint32_t(numShapes));
+  put(out, uint32_t(nameIndex.size()));
+  put(out, uint32_t(names.size()));
+  out += names;
+
+  for (size_t k = 0; k < collector.records.size(); ++k) {
+    const Record& r = collector.records[k];
+    put(out, uint8_t(r.kind));
+    put(out, int32_t(r.parent));
+    if (r.kind == RBT_RECORD) {
+      const Cvec3 t = r.rbt.getTranslation();
+      const Quat q = r.rbt.getRotation();
+      for (int i = 0; i < 3; ++i)
+        put(out, t[i]);
+      for (int i = 0; i < 4; ++i)
+        put(out, q[i]);
+    }
+    else if (r.kind == SHAPE_RECORD) {
+      put(out, nameIndex[*r.geometry]);
+      put(out, nameIndex[*r.material]);
+      for (int i = 0; i < 12; ++i)
+        put(out, r.affine[i]);
+    }
+  }
+
+  ofstream f;
+  openForWrite(f, filename, ios::out | ios::binary);
+  f.write(out.data(), out.size());
+  if (!f)
+    throw runtime_error(string("Error writing ") + filename);
+}
+
+//-----------
+// Loading
+//-----------
+
+namespace {
+
+// Creates the nodes of a scene in file order, in one arena
+class SceneBuilder {
+  shared_ptr<NodeArena> arena_;
+  vector<SgTransformNode*> transforms_;
+  shared_ptr<SgTransformNode> root_;
+
+  SgTransformNode& getParent(int parent) {
+    if (parent < 0 || parent >= int(transforms_.size()))
+      throw runtime_error("loadScene: bad parent index");
+    return *transforms_[parent];
+  }
+
+public:
+  SceneBuilder(int numTransforms, int numShapes)
+    : arena_(new NodeArena()) {
+    transforms_.reserve(numTransforms);
+    arena_->reserve(numTransforms * (sizeof(SgRbtNode) + NODE_OVERHEAD) +
+                    numShapes * (sizeof(SgGeometryShapeNode) + NODE_OVERHEAD));
+  }
+
+  void addRoot() {
+    if (root_)
+      throw runtime_error("loadScene: a root node can only be the first node");
+    root_ = makeArenaShared<SgRootNode>(arena_);
+    transforms_.push_back(root_.get());
+  }
+
+  void addRbt(int parent, const RigTForm& rbt) {
+    shared_ptr<SgRbtNode> node = makeArenaShared<SgRbtNode>(arena_, rbt);
+    SgRbtNode* const p = node.get();
+    if (!root_ && parent == -1)
+      root_ = move(node);
+    else
+      getParent(parent).addChild(move(node));
+    transforms_.push_back(p);
+  }
+
+  void addShape(int parent, const shared_ptr<Geometry>& geometry, const shared_ptr<Material>& material,
+                const Matrix4& affine) {
+    getParent(parent).addChild(makeArenaShared<SgGeometryShapeNode>(arena_, geometry, material, affine));
+  }
+
+  shared_ptr<SgTransformNode> getRoot() const {
+    if (!root_)
+      throw runtime_error("loadScene: the scene has no nodes");
+    return root_;
+  }
+};
+
+// Bounds checked reads from the loaded file
+class Reader {
+  const char* p_;
+  const char* end_;
+public:
+  Reader(const char* begin, const char* end) : p_(begin), end_(end) {}
+
+  const char* take(size_t bytes) {
+    if (size_t(end_ - p_) < bytes)
+      throw runtime_error("loadScene: truncated file");
+    const char* p = p_;
+    p_ += bytes;
+    return p;
+  }
+
+  template<typename T>
+  T get() {
+    char bytes[sizeof(T)];
+    memcpy(bytes, take(sizeof(T)), sizeof(T));
+    if (!isHostLittleEndian())
+      reverse(bytes, bytes + sizeof(T));
+    T value;
+    memcpy(&value, bytes, sizeof(T));
+    return value;
+  }
+
+  size_t remaining() const {
+    return end_ - p_;
+  }
+
+  bool atEnd() const {
+    return p_ == end_;
+  }
+};
+
+} // namespace
+
+static shared_ptr<SgTransformNode> loadBinaryScene(const vector<char>& data, const SceneResources& resources) {
+  Reader in(data.data(), data.data() + data.size());
+  in.take(sizeof(BINARY_MAGIC));
+  if (in.get<uint32_t>() != VERSION)
+    throw runtime_error("loadScene: unsupported version");
+  const uint32_t numTransforms = in.get<uint32_t>();
+  const uint32_t numShapes = in.get<uint32_t>();
+  const uint32_t numNames = in.get<uint32_t>();
+  const uint32_t namesSize = in.get<uint32_t>();
+
+  // a name is looked up the first time a shape uses it
+  const char* names = in.take(namesSize);
+  if (namesSize > 0 && names[namesSize - 1] != 0)
+    throw runtime_error("loadScene: bad name table");
+  vector<const char*> nameStart;
+  for (uint32_t i = 0; i < namesSize; i += strlen(names + i) + 1)
+    nameStart.push_back(names + i);
+  if (nameStart.size() != numNames)
+    throw runtime_error("loadScene: bad name table");
+  vector<shared_ptr<Geometry> > geometries(numNames);
+  vector<shared_ptr<Material> > materials(numNames);
+
+  // the counts size the builder's reservations, so they must fit in the file
+  if (numTransforms > INT_MAX || numShapes > INT_MAX ||
+      uint64_t(numTransforms) * MIN_TRANSFORM_RECORD_SIZE + uint64_t(numShapes) * SHAPE_RECORD_SIZE > in.remaining())
+    throw runtime_error("loadScene: node counts do not match the file size");
+
+  SceneBuilder builder(numTransforms, numShapes);
+  for (uint32_t k = 0; k < numTransforms + numShapes; ++k) {
+    const uint8_t kind = in.get<uint8_t>();
+    const int parent = in.get<int32_t>();
+    switch (kind) {
+    case ROOT_RECORD:
+      builder.addRoot();
+      break;
+    case RBT_RECORD: {
+      double v[7];
+      for (int i = 0; i < 7; ++i)
+        v[i] = in.get<double>();
+      builder.addRbt(parent, RigTForm(Cvec3(v[0], v[1], v[2]), Quat(v[3], v[4], v[5], v[6])));
+      break;
+    }
+    case SHAPE_RECORD: {
+      const uint32_t g = in.get<uint32_t>(), m = in.get<uint32_t>();
+      if (g >= numNames || m >= numNames)
+        throw runtime_error("loadScene: bad name index");
+      if (!geometries[g])
+        geometries[g] = resources.getGeometry(nameStart[g]);
+      if (!materials[m])
+        materials[m] = resources.getMaterial(nameStart[m]);
+      Matrix4 affine;
+      for (int i = 0; i < 12; ++i)
+        affine[i] = in.get<double>();
+      builder.addShape(parent, geometries[g], materials[m], affine);
+      break;
+    }
+    default:
+      throw runtime_error("loadScene: bad node kind");
+    }
+  }
+  if (!in.atEnd())
+    throw runtime_error("loadScene: unexpected data after the last node");
+  return builder.getRoot();
+}
+
+static shared_ptr<SgTransformNode> loadTextScene(const vector<char>& data, const SceneResources& resources) {
+  istringstream in(string(data.begin(), data.end()));
+  string line, word;
+  int lineNumber = 0;
+
+  // counts are not known up front; the arena grows as needed
+  SceneBuilder builder(0, 0);
+  bool sawHeader = false;
+  while (getline(in, line)) {
+    ++lineNumber;
+    istringstream fields(line);
+    if (!(fields >> word) || word[0] == '#')
+      continue;
+
+    bool ok = true;
+    if (!sawHeader) {
+      int version = 0;
+      ok = word == "scene" && (fields >> version) && version == int(VERSION);
+      sawHeader = true;
+    }
+    else if (word == "root")
+      builder.addRoot();
+    else if (word == "rbt") {
+      int parent;
+      double v[7];
+      ok = bool(fields >> parent);
+      for (int i = 0; i < 7 && ok; ++i)
+        ok = bool(fields >> v[i]);
+      if (ok)
+        builder.addRbt(parent, RigTForm(Cvec3(v[0], v[1], v[2]), Quat(v[3], v[4], v[5], v[6])));
+    }
+    else if (word == "shape") {
+      int parent;
+      string geometry, material;
+      Matrix4 affine;
+      ok = bool(fields >> parent >> geometry >> material);
+      for (int i = 0; i < 12 && ok; ++i)
+        ok = bool(fields >> affine[i]);
+      if (ok)
+        builder.addShape(parent, resources.getGeometry(geometry), resources.getMaterial(material), affine);
+    }
+    else
+      ok = false;
+
+    if (!ok || (fields >> word)) {
+      ostringstream msg;
+      msg << "loadScene: bad line " << lineNumber;
+      throw runtime_error(msg.str());
+    }
+  }
+  return builder.getRoot();
+}
+
+shared_ptr<SgTransformNode> loadScene(const char filename[], const SceneResources& resources) {
+  ifstream f(filename, ios::binary | ios::ate);
+  if (!f)
+    throw runtime_error(string("loadScene: Cannot open file ") + filename + " for read");
+
+  // the whole file in one read
+  vector<char> data(size_t(f.tellg()));
+  f.seekg(0);
+  f.read(data.data(), data.size());
+  if (!f)
+    throw runtime_error(string("loadScene: Cannot read file ") + filename);
+
+  if (data.size() >= sizeof(BINARY_MAGIC) && memcmp(data.data(), BINARY_MAGIC, sizeof(BINARY_MAGIC)) == 0)
+    return loadBinaryScene(data, resources);
+  return loadTextScene(data, resources);
+}
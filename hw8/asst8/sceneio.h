@@ -0,0 +1,73 @@
+#ifndef SCENEIO_H
+#define SCENEIO_H
+
+#include <string>
+#include <memory>
+#include <unordered_map>
+
+#include "scenegraph.h"
+#include "material.h"
+#include "geometry.h"
+
+//--------------------------------------------------------------------------------
+// Scene files: a scene graph of SgRootNodes, SgRbtNodes and SgGeometryShapeNodes
+// saved to disk and loaded back, with geometries and materials referred to by
+// the names registered in a SceneResources
+//
+// A file lists the nodes in depth-first order, children in the order of the
+// graph. Transform nodes are numbered from 0 in file order, and every node
+// after the first names its parent by that number. The first node is the root
+// of the scene and is a root or an rbt node.
+//
+// Text format, one node per line, '#' starting a comment line:
+//
+//   scene 1
+//   root
+//   rbt <parent> <tx ty tz> <qw qx qy qz>
+//   shape <parent> <geometry> <material> <first three rows of the affine matrix>
+//
+// Binary format, little-endian, loaded with one read and one pass over the
+// data, with every node allocated from one NodeArena reserved up front:
+//
+//   header   "SGB" 0, u32 version (1), u32 transform count, u32 shape count,
+//            u32 name count, u32 size of the name table in bytes
+//   names    the geometry and material names, each ended by a 0
+//   nodes    u8 kind (0 root, 1 rbt, 2 shape), i32 parent (-1 for the first),
+//            then for rbt nodes 7 doubles (translation, rotation quaternion)
+//            and for shapes u32 geometry and material name indices and 12
+//            doubles (first three rows of the affine matrix)
+//
+// Errors, including nodes that cannot be saved and unknown names, throw
+// runtime_error.
+//--------------------------------------------------------------------------------
+
+class SceneResources {
+public:
+  // Names must not contain white space
+  void addGeometry(const std::string& name, const std::shared_ptr<Geometry>& geometry);
+  void addMaterial(const std::string& name, const std::shared_ptr<Material>& material);
+
+  std::shared_ptr<Geometry> getGeometry(const std::string& name) const;
+  std::shared_ptr<Material> getMaterial(const std::string& name) const;
+
+  const std::string& getGeometryName(const Geometry* geometry) const;
+  const std::string& getMaterialName(const Material* material) const;
+
+private:
+  std::unordered_map<std::string, std::shared_ptr<Geometry> > geometries_;
+  std::unordered_map<std::string, std::shared_ptr<Material> > materials_;
+  std::unordered_map<const Geometry*, std::string> geometryNames_;
+  std::unordered_map<const Material*, std::string> materialNames_;
+};
+
+// Writes the scene below 'root' in the text format
+void saveScene(SgTransformNode& root, const SceneResources& resources, const char filename[]);
+
+// Writes the scene below 'root' in the binary format
+void saveSceneBinary(SgTransformNode& root, const SceneResources& resources, const char filename[]);
+
+// Reads a scene in either format, told apart by the first bytes, and returns
+// its root
+std::shared_ptr<SgTransformNode> loadScene(const char filename[], const SceneResources& resources);
+
+#endif
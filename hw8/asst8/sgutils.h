@@ -13,12 +13,13 @@ struct RbtNodesScanner : public SgNodeVisitor
 
   RbtNodesScanner(SgRbtNodes &nodes) : nodes_(nodes) {}
 
+  using SgNodeVisitor::visit;
+
   virtual bool visit(SgTransformNode &node)
   {
     using namespace std;
-    shared_ptr<SgRbtNode> rbtPtr = dynamic_pointer_cast<SgRbtNode>(node.shared_from_this());
-    if (rbtPtr)
-      nodes_.push_back(rbtPtr);
+    if (node.getType() == SgNode::RBT)
+      nodes_.push_back(static_pointer_cast<SgRbtNode>(node.shared_from_this()));
     return true;
   }
 };
@@ -26,7 +27,31 @@ struct RbtNodesScanner : public SgNodeVisitor
 inline void dumpSgRbtNodes(std::shared_ptr<SgNode> root, std::vector<std::shared_ptr<SgRbtNode>> &rbtNodes)
 {
   RbtNodesScanner scanner(rbtNodes);
-  root->accept(scanner);
+  traverse(*root, scanner);
+}
+
+// Same as RbtNodesScanner, but collects plain pointers: no reference counting,
+// for callers that only use the nodes while the graph holds them
+struct RbtNodePtrsScanner : public SgNodeVisitor
+{
+  std::vector<SgRbtNode *> &nodes_;
+
+  RbtNodePtrsScanner(std::vector<SgRbtNode *> &nodes) : nodes_(nodes) {}
+
+  using SgNodeVisitor::visit;
+
+  virtual bool visit(SgTransformNode &node)
+  {
+    if (node.getType() == SgNode::RBT)
+      nodes_.push_back(static_cast<SgRbtNode *>(&node));
+    return true;
+  }
+};
+
+inline void dumpSgRbtNodes(SgNode &root, std::vector<SgRbtNode *> &rbtNodes)
+{
+  RbtNodePtrsScanner scanner(rbtNodes);
+  traverse(root, scanner);
 }
 
 #endif
\ No newline at end of file
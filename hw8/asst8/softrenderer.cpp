@@ -0,0 +1,1417 @@
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <stdexcept>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "asstcommon.h"
+#include "softrenderer.h"
+
+using namespace std;
+
+// Vertices further out than this many half viewports from the center are
+// clipped, so screen coordinates stay small enough to snap exactly
+static const float GUARD_BAND = 4;
+
+// Subpixel precision of the snapped vertex positions
+static const float SUBPIXELS = 256;
+
+// Outcode bits: outside the view volume in bits 0-5, outside the clipping
+// volume, the view volume grown by the guard band in x and y, in bits 6-11
+enum { NUM_PLANES = 6, VIEW_PLANES = 0x3f };
+
+// Varyings of the ported vertex shaders
+enum {
+  BASIC_NORMAL = 0, BASIC_POSITION = 3, NUM_BASIC_VARYINGS = 6,
+  NORMAL_TEXCOORD = 0, NORMAL_TANGENT = 2, NORMAL_BINORMAL = 5, NORMAL_NORMAL = 8, NORMAL_POSITION = 11,
+  NUM_NORMAL_VARYINGS = 14
+};
+
+// Triangles set up together by setupTriangles, in one array per field
+enum { SETUP_BATCH = 64 };
+enum {
+  SETUP_X0, SETUP_Y0, SETUP_X1, SETUP_Y1, SETUP_X2, SETUP_Y2,
+  SETUP_AREA, SETUP_A0, SETUP_B0, SETUP_A1, SETUP_B1, SETUP_A2, SETUP_B2,
+  SETUP_MIN_X, SETUP_MIN_Y, SETUP_MAX_X, SETUP_MAX_Y, NUM_SETUP_FIELDS
+};
+
+// The values of a group of LANES pixels, worked on together. With AVX2 they
+// are one register of eight floats, with SSE2, which every x86-64 CPU has,
+// one of four, and each operation is one instruction; elsewhere they are
+// loops over an array of four, which the compiler is free to vectorize.
+#if defined(__AVX2__)
+
+enum { LANES = 8 };
+
+// Per value true or false, from comparing two FloatNs
+struct MaskN {
+  __m256 m;
+
+  explicit MaskN(__m256 m) : m(m) {}
+
+  MaskN operator&(const MaskN& b) const {
+    return MaskN(_mm256_and_ps(m, b.m));
+  }
+
+  bool any() const {
+    return _mm256_movemask_ps(m) != 0;
+  }
+};
+
+struct FloatN {
+  __m256 v;
+
+  FloatN() {}
+  explicit FloatN(__m256 v) : v(v) {}
+  FloatN(float x) : v(_mm256_set1_ps(x)) {}
+
+  static FloatN load(const float* p) {
+    return FloatN(_mm256_loadu_ps(p));
+  }
+
+  void store(float* p) const {
+    _mm256_storeu_ps(p, v);
+  }
+
+  FloatN& operator+=(const FloatN& b) {
+    v = _mm256_add_ps(v, b.v);
+    return *this;
+  }
+
+  // friends rather than members, so that either operand may be a float
+  friend FloatN operator+(const FloatN& a, const FloatN& b) { return FloatN(_mm256_add_ps(a.v, b.v)); }
+  friend FloatN operator-(const FloatN& a, const FloatN& b) { return FloatN(_mm256_sub_ps(a.v, b.v)); }
+  friend FloatN operator*(const FloatN& a, const FloatN& b) { return FloatN(_mm256_mul_ps(a.v, b.v)); }
+  friend FloatN operator/(const FloatN& a, const FloatN& b) { return FloatN(_mm256_div_ps(a.v, b.v)); }
+  friend MaskN operator<(const FloatN& a, const FloatN& b) { return MaskN(_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)); }
+  friend MaskN operator>(const FloatN& a, const FloatN& b) { return MaskN(_mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ)); }
+  friend MaskN operator>=(const FloatN& a, const FloatN& b) { return MaskN(_mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ)); }
+  friend MaskN operator<=(const FloatN& a, const FloatN& b) { return MaskN(_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ)); }
+};
+
+// The second operand where either is NaN, as minps and maxps do
+static inline FloatN vmin(const FloatN& a, const FloatN& b) { return FloatN(_mm256_min_ps(a.v, b.v)); }
+static inline FloatN vmax(const FloatN& a, const FloatN& b) { return FloatN(_mm256_max_ps(a.v, b.v)); }
+static inline FloatN vsqrt(const FloatN& a) { return FloatN(_mm256_sqrt_ps(a.v)); }
+
+static inline FloatN select(const MaskN& m, const FloatN& a, const FloatN& b) {
+  return FloatN(_mm256_blendv_ps(b.v, a.v, m.m));
+}
+
+struct IntN {
+  __m256i v;
+
+  IntN() {}
+  explicit IntN(__m256i v) : v(v) {}
+  IntN(int x) : v(_mm256_set1_epi32(x)) {}
+
+  static IntN load(const int* p) {
+    return IntN(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)));
+  }
+
+  void store(int* p) const {
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), v);
+  }
+};
+
+static inline IntN select(const MaskN& m, const IntN& a, const IntN& b) {
+  return IntN(_mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(b.v), _mm256_castsi256_ps(a.v), m.m)));
+}
+
+// Rounds toward zero, as a cast to int does
+static inline IntN truncate(const FloatN& a) {
+  return IntN(_mm256_cvttps_epi32(a.v));
+}
+
+static inline FloatN toFloat(const IntN& a) {
+  return FloatN(_mm256_cvtepi32_ps(a.v));
+}
+
+// 1 / sqrt(x), from the estimate of rsqrtps refined by a Newton step to
+// about 22 bits, several times faster than a square root and a division
+static inline FloatN vrsqrt(const FloatN& x) {
+  const FloatN y(_mm256_rsqrt_ps(x.v));
+  return y * (1.5f - 0.5f * x * y * y);
+}
+
+// The pairs of adjacent RGBA texels from texel index[0], ..., index[LANES - 1]
+// on, 8 bits per channel, as r | g << 8 | b << 16 | a << 24: the first and
+// second of each pair
+static inline void loadTexelPairs(const unsigned char* texels, const int* index, IntN& first, IntN& second) {
+  const __m256i i = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(index));
+  const int* t = reinterpret_cast<const int*>(texels);
+  first.v = _mm256_i32gather_epi32(t, i, 4);
+  second.v = _mm256_i32gather_epi32(t + 1, i, 4);
+}
+
+// The channels of texels as loadTexelPairs returns them, from 0 to 255
+static inline void unpackTexels(const IntN& texels, FloatN& r, FloatN& g, FloatN& b) {
+  const __m256i mask = _mm256_set1_epi32(0xff);
+  r.v = _mm256_cvtepi32_ps(_mm256_and_si256(texels.v, mask));
+  g.v = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(texels.v, 8), mask));
+  b.v = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(texels.v, 16), mask));
+}
+
+// Channels from 0 to 255 of pixels, each pixel an int whose bytes in memory
+// are its red, green and blue and a 0
+static inline IntN packColors(const IntN& r, const IntN& g, const IntN& b) {
+  return IntN(_mm256_or_si256(r.v, _mm256_or_si256(_mm256_slli_epi32(g.v, 8), _mm256_slli_epi32(b.v, 16))));
+}
+
+// 0, 1, ..., LANES - 1: the offsets of the pixels of a group from its first one
+static inline FloatN laneOffsets() {
+  return FloatN(_mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7));
+}
+
+#elif defined(__SSE2__)
+
+enum { LANES = 4 };
+
+struct MaskN {
+  __m128 m;
+
+  explicit MaskN(__m128 m) : m(m) {}
+
+  MaskN operator&(const MaskN& b) const {
+    return MaskN(_mm_and_ps(m, b.m));
+  }
+
+  bool any() const {
+    return _mm_movemask_ps(m) != 0;
+  }
+};
+
+struct FloatN {
+  __m128 v;
+
+  FloatN() {}
+  explicit FloatN(__m128 v) : v(v) {}
+  FloatN(float x) : v(_mm_set1_ps(x)) {}
+
+  static FloatN load(const float* p) {
+    return FloatN(_mm_loadu_ps(p));
+  }
+
+  void store(float* p) const {
+    _mm_storeu_ps(p, v);
+  }
+
+  FloatN& operator+=(const FloatN& b) {
+    v = _mm_add_ps(v, b.v);
+    return *this;
+  }
+
+  friend FloatN operator+(const FloatN& a, const FloatN& b) { return FloatN(_mm_add_ps(a.v, b.v)); }
+  friend FloatN operator-(const FloatN& a, const FloatN& b) { return FloatN(_mm_sub_ps(a.v, b.v)); }
+  friend FloatN operator*(const FloatN& a, const FloatN& b) { return FloatN(_mm_mul_ps(a.v, b.v)); }
+  friend FloatN operator/(const FloatN& a, const FloatN& b) { return FloatN(_mm_div_ps(a.v, b.v)); }
+  friend MaskN operator<(const FloatN& a, const FloatN& b) { return MaskN(_mm_cmplt_ps(a.v, b.v)); }
+  friend MaskN operator>(const FloatN& a, const FloatN& b) { return MaskN(_mm_cmpgt_ps(a.v, b.v)); }
+  friend MaskN operator>=(const FloatN& a, const FloatN& b) { return MaskN(_mm_cmpge_ps(a.v, b.v)); }
+  friend MaskN operator<=(const FloatN& a, const FloatN& b) { return MaskN(_mm_cmple_ps(a.v, b.v)); }
+};
+
+static inline FloatN vmin(const FloatN& a, const FloatN& b) { return FloatN(_mm_min_ps(a.v, b.v)); }
+static inline FloatN vmax(const FloatN& a, const FloatN& b) { return FloatN(_mm_max_ps(a.v, b.v)); }
+static inline FloatN vsqrt(const FloatN& a) { return FloatN(_mm_sqrt_ps(a.v)); }
+
+static inline FloatN select(const MaskN& m, const FloatN& a, const FloatN& b) {
+  return FloatN(_mm_or_ps(_mm_and_ps(m.m, a.v), _mm_andnot_ps(m.m, b.v)));
+}
+
+struct IntN {
+  __m128i v;
+
+  IntN() {}
+  explicit IntN(__m128i v) : v(v) {}
+  IntN(int x) : v(_mm_set1_epi32(x)) {}
+
+  static IntN load(const int* p) {
+    return IntN(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+  }
+
+  void store(int* p) const {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v);
+  }
+};
+
+static inline IntN select(const MaskN& m, const IntN& a, const IntN& b) {
+  const __m128i mi = _mm_castps_si128(m.m);
+  return IntN(_mm_or_si128(_mm_and_si128(mi, a.v), _mm_andnot_si128(mi, b.v)));
+}
+
+static inline IntN truncate(const FloatN& a) {
+  return IntN(_mm_cvttps_epi32(a.v));
+}
+
+static inline FloatN toFloat(const IntN& a) {
+  return FloatN(_mm_cvtepi32_ps(a.v));
+}
+
+static inline FloatN vrsqrt(const FloatN& x) {
+  const FloatN y(_mm_rsqrt_ps(x.v));
+  return y * (1.5f - 0.5f * x * y * y);
+}
+
+// SSE2 has no gather, but loads a pair as one 64 bit value
+static inline void loadTexelPairs(const unsigned char* texels, const int* index, IntN& first, IntN& second) {
+  const __m128i p0 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(texels + 4 * index[0]));
+  const __m128i p1 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(texels + 4 * index[1]));
+  const __m128i p2 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(texels + 4 * index[2]));
+  const __m128i p3 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(texels + 4 * index[3]));
+  const __m128i p01 = _mm_unpacklo_epi32(p0, p1), p23 = _mm_unpacklo_epi32(p2, p3);
+  first.v = _mm_unpacklo_epi64(p01, p23);
+  second.v = _mm_unpackhi_epi64(p01, p23);
+}
+
+static inline void unpackTexels(const IntN& texels, FloatN& r, FloatN& g, FloatN& b) {
+  const __m128i mask = _mm_set1_epi32(0xff);
+  r.v = _mm_cvtepi32_ps(_mm_and_si128(texels.v, mask));
+  g.v = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(texels.v, 8), mask));
+  b.v = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(texels.v, 16), mask));
+}
+
+static inline IntN packColors(const IntN& r, const IntN& g, const IntN& b) {
+  return IntN(_mm_or_si128(r.v, _mm_or_si128(_mm_slli_epi32(g.v, 8), _mm_slli_epi32(b.v, 16))));
+}
+
+static inline FloatN laneOffsets() {
+  return FloatN(_mm_setr_ps(0, 1, 2, 3));
+}
+
+#else
+
+enum { LANES = 4 };
+
+struct MaskN {
+  bool m[LANES];
+
+  MaskN operator&(const MaskN& b) const {
+    MaskN r;
+    for (int i = 0; i < LANES; ++i)
+      r.m[i] = m[i] && b.m[i];
+    return r;
+  }
+
+  bool any() const {
+    return find(m, m + LANES, true) != m + LANES;
+  }
+};
+
+struct FloatN {
+  float v[LANES];
+
+  FloatN() {}
+  FloatN(float x) {
+    fill(v, v + LANES, x);
+  }
+
+  static FloatN load(const float* p) {
+    FloatN r;
+    copy(p, p + LANES, r.v);
+    return r;
+  }
+
+  void store(float* p) const {
+    copy(v, v + LANES, p);
+  }
+
+  template<typename Op>
+  FloatN map(const FloatN& b, Op op) const {
+    FloatN r;
+    for (int i = 0; i < LANES; ++i)
+      r.v[i] = op(v[i], b.v[i]);
+    return r;
+  }
+
+  template<typename Op>
+  MaskN compare(const FloatN& b, Op op) const {
+    MaskN r;
+    for (int i = 0; i < LANES; ++i)
+      r.m[i] = op(v[i], b.v[i]);
+    return r;
+  }
+
+  FloatN& operator+=(const FloatN& b) {
+    return *this = *this + b;
+  }
+
+  friend FloatN operator+(const FloatN& a, const FloatN& b) { return a.map(b, [](float x, float y) { return x + y; }); }
+  friend FloatN operator-(const FloatN& a, const FloatN& b) { return a.map(b, [](float x, float y) { return x - y; }); }
+  friend FloatN operator*(const FloatN& a, const FloatN& b) { return a.map(b, [](float x, float y) { return x * y; }); }
+  friend FloatN operator/(const FloatN& a, const FloatN& b) { return a.map(b, [](float x, float y) { return x / y; }); }
+  friend MaskN operator<(const FloatN& a, const FloatN& b) { return a.compare(b, [](float x, float y) { return x < y; }); }
+  friend MaskN operator>(const FloatN& a, const FloatN& b) { return a.compare(b, [](float x, float y) { return x > y; }); }
+  friend MaskN operator>=(const FloatN& a, const FloatN& b) { return a.compare(b, [](float x, float y) { return x >= y; }); }
+  friend MaskN operator<=(const FloatN& a, const FloatN& b) { return a.compare(b, [](float x, float y) { return x <= y; }); }
+};
+
+static inline FloatN vmin(const FloatN& a, const FloatN& b) {
+  return a.map(b, [](float x, float y) { return x < y ? x : y; });
+}
+
+static inline FloatN vmax(const FloatN& a, const FloatN& b) {
+  return a.map(b, [](float x, float y) { return x > y ? x : y; });
+}
+
+static inline FloatN vsqrt(const FloatN& a) {
+  return a.map(a, [](float x, float) { return sqrt(x); });
+}
+
+static inline FloatN select(const MaskN& m, const FloatN& a, const FloatN& b) {
+  FloatN r;
+  for (int i = 0; i < LANES; ++i)
+    r.v[i] = m.m[i] ? a.v[i] : b.v[i];
+  return r;
+}
+
+struct IntN {
+  int v[LANES];
+
+  IntN() {}
+  IntN(int x) {
+    fill(v, v + LANES, x);
+  }
+
+  static IntN load(const int* p) {
+    IntN r;
+    copy(p, p + LANES, r.v);
+    return r;
+  }
+
+  void store(int* p) const {
+    copy(v, v + LANES, p);
+  }
+};
+
+static inline IntN select(const MaskN& m, const IntN& a, const IntN& b) {
+  IntN r;
+  for (int i = 0; i < LANES; ++i)
+    r.v[i] = m.m[i] ? a.v[i] : b.v[i];
+  return r;
+}
+
+static inline IntN truncate(const FloatN& a) {
+  IntN r;
+  for (int i = 0; i < LANES; ++i)
+    r.v[i] = int(a.v[i]);
+  return r;
+}
+
+static inline FloatN toFloat(const IntN& a) {
+  FloatN r;
+  for (int i = 0; i < LANES; ++i)
+    r.v[i] = float(a.v[i]);
+  return r;
+}
+
+static inline FloatN vrsqrt(const FloatN& x) {
+  return 1.0f / vsqrt(x);
+}
+
+static inline void loadTexelPairs(const unsigned char* texels, const int* index, IntN& first, IntN& second) {
+  for (int i = 0; i < LANES; ++i) {
+    const unsigned char* p = texels + 4 * index[i];
+    first.v[i] = p[0] | p[1] << 8 | p[2] << 16 | p[3] << 24;
+    second.v[i] = p[4] | p[5] << 8 | p[6] << 16 | p[7] << 24;
+  }
+}
+
+static inline void unpackTexels(const IntN& texels, FloatN& r, FloatN& g, FloatN& b) {
+  for (int i = 0; i < LANES; ++i) {
+    r.v[i] = float(texels.v[i] & 0xff);
+    g.v[i] = float(texels.v[i] >> 8 & 0xff);
+    b.v[i] = float(texels.v[i] >> 16 & 0xff);
+  }
+}
+
+static inline IntN packColors(const IntN& r, const IntN& g, const IntN& b) {
+  IntN packed;
+  for (int i = 0; i < LANES; ++i) {
+    const unsigned char bytes[4] = { (unsigned char)r.v[i], (unsigned char)g.v[i], (unsigned char)b.v[i], 0 };
+    memcpy(&packed.v[i], bytes, 4);
+  }
+  return packed;
+}
+
+static inline FloatN laneOffsets() {
+  FloatN r;
+  for (int i = 0; i < LANES; ++i)
+    r.v[i] = float(i);
+  return r;
+}
+
+#endif
+
+// groups of pixels from a multiple of LANES stay inside their tile
+static_assert(SoftRenderer::TILE_SIZE % LANES == 0, "tiles must be whole groups of pixels wide");
+
+static inline FloatN operator-(const FloatN& a) {
+  return FloatN(0.0f) - a;
+}
+
+static float srgbToLinear(float c) {
+  return c <= 0.04045f ? c / 12.92f : pow((c + 0.055f) / 1.055f, 2.4f);
+}
+
+static float linearToSrgb(float c) {
+  return c <= 0.0031308f ? c * 12.92f : 1.055f * pow(c, 1 / 2.4f) - 0.055f;
+}
+
+// Color channel as GL writes it to an 8 bit buffer
+static inline unsigned char toUnorm8(float c, bool srgb) {
+  c = min(max(c, 0.0f), 1.0f);
+  return (unsigned char)((srgb ? linearToSrgb(c) : c) * 255 + 0.5f);
+}
+
+// "./shaders/diffuse-gl3.fshader" -> "diffuse"
+static string getShaderName(const string& filename) {
+  size_t begin = filename.rfind('/');
+  begin = begin == string::npos ? 0 : begin + 1;
+  return filename.substr(begin, filename.find('-', begin) - begin);
+}
+
+// x, y, z = M (x, y, z, w) for the column major 4x4 matrix M
+static void transform(const float m[16], float w, float* x, float* y, float* z, int n) {
+  for (int i = 0; i < n; ++i) {
+    const float a = x[i], b = y[i], c = z[i];
+    x[i] = m[0] * a + m[4] * b + m[8] * c + m[12] * w;
+    y[i] = m[1] * a + m[5] * b + m[9] * c + m[13] * w;
+    z[i] = m[2] * a + m[6] * b + m[10] * c + m[14] * w;
+  }
+}
+
+// out = row r of M times (x, y, z, w), for the column major 4x4 matrix M
+static void transformRow(const float m[16], int r, float w, const float* x, const float* y, const float* z,
+                         float* out, int n) {
+  const float a = m[r], b = m[4 + r], c = m[8 + r], d = m[12 + r] * w;
+  for (int i = 0; i < n; ++i)
+    out[i] = a * x[i] + b * y[i] + c * z[i] + d;
+}
+
+// Rounds to the nearest 1/SUBPIXELS, halves away from zero
+static float snap(float x) {
+  return float(int(x * SUBPIXELS + copysign(0.5f, x))) / SUBPIXELS;
+}
+
+static float getClipDistance(int plane, float x, float y, float z, float w) {
+  const float gw = GUARD_BAND * w;
+  switch (plane) {
+  case 0:
+    return x + gw;
+  case 1:
+    return gw - x;
+  case 2:
+    return y + gw;
+  case 3:
+    return gw - y;
+  case 4:
+    return z + w;
+  default:
+    return w - z;
+  }
+}
+
+// Copies the attribute called 'name' of every vertex into the arrays out[0],
+// ..., out[size - 1], one per component
+static void readAttrib(const CpuVertexArray& vertices, const char* name, int size, vector<float>* out) {
+  const VertexFormat& format = vertices.getVertexFormat();
+  const int index = format.getAttribIndexForName(name);
+  if (index < 0)
+    throw runtime_error(string("Vertex attribute ") + name + ": used in the shader codes, but not supplied.");
+  const VertexFormat::AttribDesc& ad = format.getAttrib(index);
+  if (ad.type != GL_FLOAT || ad.size < size)
+    throw runtime_error(string("Vertex attribute ") + name + ": not supplied as enough floats.");
+
+  const int n = vertices.getNumVertices(), stride = format.getVertexSize();
+  const char* data = vertices.getVertexData() + ad.offset;
+  for (int c = 0; c < size; ++c)
+    out[c].resize(n);
+  for (int i = 0; i < n; ++i) {
+    const float* v = reinterpret_cast<const float*>(data + stride * i);
+    for (int c = 0; c < size; ++c)
+      out[c][i] = v[c];
+  }
+}
+
+// floor, without the call to libm that it is without SSE4.1
+static inline int floorToInt(float x) {
+  const int i = int(x);
+  return i - (x < i);
+}
+
+// log2 of x > 0 to within 2e-4, from its exponent and a polynomial in its
+// mantissa, accurate enough to pick and blend mipmap levels
+static inline float fastLog2(float x) {
+  unsigned int bits;
+  memcpy(&bits, &x, sizeof bits);
+  const int exponent = int(bits >> 23) - 127;
+  bits = (bits & 0x7fffff) | 0x3f800000;
+  float m;
+  memcpy(&m, &bits, sizeof m);
+  const float t = m - 1; // in [0, 1)
+  return exponent + t * (1.4385468f + t * (-0.67808149f + t * (0.32363037f - 0.084285093f * t)));
+}
+
+// Linear value of each sRGB encoded 8 bit value, times 255
+static const float* getSrgbDecodeTable() {
+  static const vector<float> table = []() {
+    vector<float> t(256);
+    for (int c = 0; c < 256; ++c)
+      t[c] = srgbToLinear(c / 255.0f) * 255;
+    return t;
+  }();
+  return &table[0];
+}
+
+// x^32 by squaring, the shininess of the normal shader and half the one of
+// the specular shader
+static inline FloatN pow32(FloatN x) {
+  x = x * x;
+  x = x * x;
+  x = x * x;
+  x = x * x;
+  return x * x;
+}
+
+// GLSL's normalize. Unlike Cvec's, it does not assert on a zero vector, which
+// a shader may well normalize.
+static inline void normalize3(FloatN& x, FloatN& y, FloatN& z) {
+  const FloatN s = vrsqrt(x * x + y * y + z * z);
+  x = x * s;
+  y = y * s;
+  z = z * s;
+}
+
+// Writes the first n pixels of a group, RGB with 8 bits per channel, as GL
+// writes the colors to an 8 bit buffer
+static inline void storeColors(const FloatN& r, const FloatN& g, const FloatN& b, bool srgb, int n,
+                               unsigned char* color) {
+  IntN c[3];
+  const FloatN rgb[3] = { r, g, b };
+  for (int k = 0; k < 3; ++k) {
+    FloatN x = vmax(vmin(rgb[k], 1.0f), 0.0f);
+    if (srgb) {
+      float c[LANES];
+      x.store(c);
+      for (int i = 0; i < LANES; ++i)
+        c[i] = linearToSrgb(c[i]);
+      x = FloatN::load(c);
+    }
+    c[k] = truncate(x * 255.0f + 0.5f);
+  }
+  int pixels[LANES];
+  packColors(c[0], c[1], c[2]).store(pixels);
+  // four bytes at a time, the fourth overwritten by the next pixel, but not
+  // past the last one, whose next may be another tile's
+  for (int i = 0; i < n - 1; ++i)
+    memcpy(color + 3 * i, &pixels[i], 4);
+  memcpy(color + 3 * (n - 1), &pixels[n - 1], 3);
+}
+
+// Pixels of a tile row covered by one triangle, shaded LANES at a time
+struct SoftRenderer::Span {
+  int n;
+  float dx0, dy;        // of the first pixel, from the first vertex of the triangle
+  unsigned char* color; // RGB of the first pixel in the color buffer
+};
+
+SoftRenderer::SoftRenderer(int width, int height)
+  : width_(width), height_(height)
+  , tilesX_((width + TILE_SIZE - 1) / TILE_SIZE), tilesY_((height + TILE_SIZE - 1) / TILE_SIZE)
+  , clearColor_(0, 0, 0), clearPending_(false)
+  , color_(3 * width * height), depth_(width * height)
+  , bins_(tilesX_ * tilesY_) {
+  if (width <= 0 || height <= 0)
+    throw runtime_error("SoftRenderer: the size must be positive");
+}
+
+const Uniforms::Value& SoftRenderer::findUniform(const Material& material, const Uniforms& extra,
+                                                 const char* name, GLenum type) {
+  const Uniforms::Value* u = material.getUniforms().get(name);
+  if (!u)
+    u = extra.get(name);
+  if (!u)
+    throw runtime_error(string("Uniform variable ") + name + ": used in the shader codes, but not supplied.");
+  if (u->type != type)
+    throw runtime_error(string("Uniform variable ") + name + ": supplied value and declared variable do not match in type.");
+  return *u;
+}
+
+Cvec3f SoftRenderer::getVec3(const Material& material, const Uniforms& extra, const char* name) {
+  const float* v = findUniform(material, extra, name, GL_FLOAT_VEC3).getFloats();
+  return Cvec3f(v[0], v[1], v[2]);
+}
+
+Matrix4 SoftRenderer::getMatrix(const Material& material, const Uniforms& extra, const char* name) {
+  const float* m = findUniform(material, extra, name, GL_FLOAT_MAT4).getFloats();
+  Matrix4 r;
+  for (int row = 0; row < 4; ++row) {
+    for (int col = 0; col < 4; ++col)
+      r(row, col) = m[4 * col + row];
+  }
+  return r;
+}
+
+const SoftRenderer::MipmappedTexture* SoftRenderer::getTexture(const shared_ptr<Texture>& texture) {
+  map<const Texture*, MipmappedTexture>::iterator i = textures_.find(texture.get());
+  if (i != textures_.end())
+    return &i->second;
+
+  const ImageTexture* image = dynamic_cast<const ImageTexture*>(texture.get());
+  if (!image)
+    throw runtime_error("SoftRenderer: only ImageTextures can be sampled");
+
+  MipmappedTexture& t = textures_[texture.get()];
+  t.texture = texture;
+  t.srgb = image->isSrgb();
+  t.levels.resize(1);
+  MipmappedTexture::Level* level = &t.levels[0];
+  level->width = image->getWidth();
+  level->height = image->getHeight();
+  level->rgba.resize(4 * (level->width + 1) * level->height);
+  const vector<PackedPixel>& pixels = image->getPixels();
+  for (int y = 0; y < level->height; ++y) {
+    for (int x = 0; x < level->width; ++x) {
+      const PackedPixel& p = pixels[y * level->width + x];
+      unsigned char* texel = level->getTexel(x, y);
+      texel[0] = p.r;
+      texel[1] = p.g;
+      texel[2] = p.b;
+      texel[3] = 255;
+    }
+  }
+
+  // box filtered mipmaps down to 1x1, as glGenerateMipmap makes them, sRGB
+  // ones averaged in linear space
+  const float* decode = getSrgbDecodeTable();
+  for (;;) {
+    for (int y = 0; y < level->height; ++y)
+      copy(level->getTexel(level->width - 1, y), level->getTexel(level->width, y), level->getTexel(level->width, y));
+    if (level->width == 1 && level->height == 1)
+      break;
+
+    MipmappedTexture::Level next;
+    next.width = max(1, level->width / 2);
+    next.height = max(1, level->height / 2);
+    next.rgba.resize(4 * (next.width + 1) * next.height);
+    for (int y = 0; y < next.height; ++y) {
+      const int y0 = min(2 * y, level->height - 1), y1 = min(2 * y + 1, level->height - 1);
+      for (int x = 0; x < next.width; ++x) {
+        const int x0 = min(2 * x, level->width - 1), x1 = min(2 * x + 1, level->width - 1);
+        const unsigned char* texels[4] = {
+          level->getTexel(x0, y0), level->getTexel(x1, y0), level->getTexel(x0, y1), level->getTexel(x1, y1)
+        };
+        unsigned char* texel = next.getTexel(x, y);
+        for (int k = 0; k < 4; ++k) {
+          if (t.srgb && k < 3) {
+            const float sum = decode[texels[0][k]] + decode[texels[1][k]] + decode[texels[2][k]] + decode[texels[3][k]];
+            texel[k] = (unsigned char)(linearToSrgb(sum / (4 * 255)) * 255 + 0.5f);
+          }
+          else
+            texel[k] = (texels[0][k] + texels[1][k] + texels[2][k] + texels[3][k] + 2) / 4;
+        }
+      }
+    }
+    t.levels.push_back(next);
+    level = &t.levels.back();
+  }
+  return &t;
+}
+
+void SoftRenderer::draw(const Material& material, Geometry& geometry, const Uniforms& extraUniforms) {
+  const string vs = getShaderName(material.getVertexShaderFilename());
+  const string fs = getShaderName(material.getFragmentShaderFilename());
+  DrawState state;
+  if (vs == "basic" && fs == "diffuse")
+    state.shader = DIFFUSE;
+  else if (vs == "basic" && fs == "specular")
+    state.shader = SPECULAR;
+  else if (vs == "basic" && fs == "solid")
+    state.shader = SOLID;
+  else if (vs == "normal" && fs == "normal")
+    state.shader = NORMAL;
+  else {
+    throw runtime_error("SoftRenderer: no software version of " + material.getVertexShaderFilename() +
+                        " with " + material.getFragmentShaderFilename());
+  }
+
+  const RenderStates& rs = material.getRenderStates();
+  const bool cullFront = rs.isEnabled(GL_CULL_FACE) && rs.getCullFace() != GL_BACK;
+  const bool cullBack = rs.isEnabled(GL_CULL_FACE) && rs.getCullFace() != GL_FRONT;
+  if (rs.isEnabled(GL_BLEND))
+    throw runtime_error("SoftRenderer: blending is not supported");
+  if ((!cullFront && rs.getPolygonMode(GL_FRONT) != GL_FILL) || (!cullBack && rs.getPolygonMode(GL_BACK) != GL_FILL))
+    throw runtime_error("SoftRenderer: only GL_FILL polygons are supported");
+
+  const CpuVertexArray* vertices = geometry.getCpuVertexArray();
+  if (!vertices)
+    throw runtime_error("SoftRenderer: the geometry keeps no CPU copy of its vertices");
+
+  // uniforms, in the order GL would complain about them
+  const Matrix4 projection = getMatrix(material, extraUniforms, "uProjMatrix");
+  const Matrix4 modelView = getMatrix(material, extraUniforms, "uModelViewMatrix");
+  const Matrix4 normalMatrix = getMatrix(material, extraUniforms, "uNormalMatrix");
+  state.colorTexture = state.normalTexture = NULL;
+  if (state.shader == NORMAL) {
+    state.colorTexture = getTexture(findUniform(material, extraUniforms, "uTexColor", GL_SAMPLER_2D).getTextures()[0]);
+    if (g_Gl2Compatible) // the GL3 fragment shader does not read the normal map yet
+      state.normalTexture = getTexture(findUniform(material, extraUniforms, "uTexNormal", GL_SAMPLER_2D).getTextures()[0]);
+  }
+  else
+    state.color = getVec3(material, extraUniforms, "uColor");
+  if (state.shader != SOLID) {
+    state.light = getVec3(material, extraUniforms, "uLight");
+    state.light2 = getVec3(material, extraUniforms, "uLight2");
+  }
+  state.numVaryings = state.shader == NORMAL ? NUM_NORMAL_VARYINGS : NUM_BASIC_VARYINGS;
+
+  float proj[16], mvm[16], nmvm[16];
+  projection.writeToColumnMajorMatrix(proj);
+  modelView.writeToColumnMajorMatrix(mvm);
+  normalMatrix.writeToColumnMajorMatrix(nmvm);
+
+  // vertex shader, on all vertices, one varying component per array
+  const int numVertices = vertices->getNumVertices();
+  if (numVertices == 0)
+    return;
+  numVaryings_ = state.numVaryings;
+  varyings_.resize(max<int>(varyings_.size(), state.numVaryings));
+  vector<float>* v = &varyings_[0];
+  if (state.shader == NORMAL) {
+    readAttrib(*vertices, "aTexCoord", 2, v + NORMAL_TEXCOORD);
+    readAttrib(*vertices, "aTangent", 3, v + NORMAL_TANGENT);
+    readAttrib(*vertices, "aBinormal", 3, v + NORMAL_BINORMAL);
+    readAttrib(*vertices, "aNormal", 3, v + NORMAL_NORMAL);
+    readAttrib(*vertices, "aPosition", 3, v + NORMAL_POSITION);
+    for (int k = NORMAL_TANGENT; k < NORMAL_POSITION; k += 3)
+      transform(nmvm, 0, &v[k][0], &v[k + 1][0], &v[k + 2][0], numVertices);
+  }
+  else {
+    readAttrib(*vertices, "aNormal", 3, v + BASIC_NORMAL);
+    readAttrib(*vertices, "aPosition", 3, v + BASIC_POSITION);
+    transform(nmvm, 0, &v[BASIC_NORMAL][0], &v[BASIC_NORMAL + 1][0], &v[BASIC_NORMAL + 2][0], numVertices);
+  }
+  const int position = state.shader == NORMAL ? NORMAL_POSITION : BASIC_POSITION;
+  float *ex = &v[position][0], *ey = &v[position + 1][0], *ez = &v[position + 2][0];
+  transform(mvm, 1, ex, ey, ez, numVertices);
+  for (int c = 0; c < 4; ++c) {
+    clip_[c].resize(numVertices);
+    transformRow(proj, c, 1, ex, ey, ez, &clip_[c][0], numVertices);
+  }
+  const float *cx = &clip_[0][0], *cy = &clip_[1][0], *cz = &clip_[2][0], *cw = &clip_[3][0];
+
+  outcodes_.resize(numVertices);
+  int* outcodes = &outcodes_[0];
+  for (int i = 0; i < numVertices; ++i) {
+    const float x = cx[i], y = cy[i], z = cz[i], w = cw[i], gw = GUARD_BAND * w;
+    outcodes[i] = (x < -w) | (x > w) << 1 | (y < -w) << 2 | (y > w) << 3 | (z < -w) << 4 | (z > w) << 5 |
+                  (x < -gw) << 6 | (x > gw) << 7 | (y < -gw) << 8 | (y > gw) << 9 | (z < -w) << 10 | (z > w) << 11;
+  }
+
+  // primitive assembly and clipping
+  setupVertices_.clear();
+  const vector<int>& indices = vertices->getIndices();
+  for (int t = 0, n = vertices->getNumTriangles(); t < n; ++t) {
+    int tri[3];
+    for (int k = 0; k < 3; ++k)
+      tri[k] = indices.empty() ? 3 * t + k : indices[3 * t + k];
+    const int c0 = outcodes[tri[0]], c1 = outcodes[tri[1]], c2 = outcodes[tri[2]];
+    if (c0 & c1 & c2 & VIEW_PLANES)
+      ++pendingStats_.trianglesCulled;
+    else if ((c0 | c1 | c2) >> NUM_PLANES) {
+      ++pendingStats_.trianglesClipped;
+      clipTriangle(tri, (c0 | c1 | c2) >> NUM_PLANES);
+    }
+    else
+      setupVertices_.insert(setupVertices_.end(), tri, tri + 3);
+  }
+
+  // viewport transform of the vertices, including the ones made by clipping,
+  // one output per loop so that each vectorizes
+  const int numClipVertices = clip_[0].size();
+  for (int c = 0; c < 4; ++c)
+    screen_[c].resize(numClipVertices);
+  cx = &clip_[0][0], cy = &clip_[1][0], cz = &clip_[2][0], cw = &clip_[3][0];
+  float *sx = &screen_[0][0], *sy = &screen_[1][0], *sz = &screen_[2][0], *siw = &screen_[3][0];
+  const float halfWidth = 0.5f * width_, halfHeight = 0.5f * height_;
+  for (int i = 0; i < numClipVertices; ++i)
+    siw[i] = 1 / cw[i];
+  for (int i = 0; i < numClipVertices; ++i)
+    sx[i] = snap((cx[i] * siw[i] + 1) * halfWidth);
+  for (int i = 0; i < numClipVertices; ++i)
+    sy[i] = snap((cy[i] * siw[i] + 1) * halfHeight);
+  for (int i = 0; i < numClipVertices; ++i)
+    sz[i] = 0.5f * cz[i] * siw[i] + 0.5f;
+
+  drawStates_.push_back(state);
+  setupTriangles(drawStates_.size() - 1, cullFront, cullBack);
+  ++pendingStats_.draws;
+}
+
+int SoftRenderer::addClipVertex(int a, int b, float da, float db) {
+  // the same vertex for both triangles sharing the edge
+  if (a > b) {
+    swap(a, b);
+    swap(da, db);
+  }
+  const float t = da / (da - db);
+  const int index = clip_[0].size();
+  for (int c = 0; c < 4; ++c) {
+    const float value = clip_[c][a] + t * (clip_[c][b] - clip_[c][a]);
+    clip_[c].push_back(value);
+  }
+  for (int k = 0; k < numVaryings_; ++k) {
+    const float value = varyings_[k][a] + t * (varyings_[k][b] - varyings_[k][a]);
+    varyings_[k].push_back(value);
+  }
+  return index;
+}
+
+void SoftRenderer::clipTriangle(const int v[3], int clipCodes) {
+  // Sutherland-Hodgman, each plane adds at most one vertex
+  int polygon[3 + NUM_PLANES], n = 3;
+  copy(v, v + 3, polygon);
+  for (int plane = 0; plane < NUM_PLANES && n >= 3; ++plane) {
+    if (!(clipCodes & (1 << plane)))
+      continue;
+    int clipped[3 + NUM_PLANES], m = 0;
+    for (int i = 0; i < n; ++i) {
+      const int a = polygon[i], b = polygon[(i + 1) % n];
+      const float da = getClipDistance(plane, clip_[0][a], clip_[1][a], clip_[2][a], clip_[3][a]);
+      const float db = getClipDistance(plane, clip_[0][b], clip_[1][b], clip_[2][b], clip_[3][b]);
+      if (da >= 0)
+        clipped[m++] = a;
+      if ((da >= 0) != (db >= 0))
+        clipped[m++] = addClipVertex(a, b, da, db);
+    }
+    copy(clipped, clipped + m, polygon);
+    n = m;
+  }
+
+  if (n < 3)
+    ++pendingStats_.trianglesCulled;
+  for (int i = 1; i + 1 < n; ++i) {
+    setupVertices_.push_back(polygon[0]);
+    setupVertices_.push_back(polygon[i]);
+    setupVertices_.push_back(polygon[i + 1]);
+  }
+}
+
+void SoftRenderer::setupTriangles(int drawState, bool cullFront, bool cullBack) {
+  const int numTriangles = setupVertices_.size() / 3;
+  const float *sx = &screen_[0][0], *sy = &screen_[1][0], *sz = &screen_[2][0], *siw = &screen_[3][0];
+  const int numVaryings = drawStates_[drawState].numVaryings;
+
+  for (int first = 0; first < numTriangles; first += SETUP_BATCH) {
+    const int n = min<int>(SETUP_BATCH, numTriangles - first);
+    const int* tv = &setupVertices_[3 * first];
+    float s[NUM_SETUP_FIELDS][SETUP_BATCH];
+    for (int i = 0; i < n; ++i) {
+      s[SETUP_X0][i] = sx[tv[3 * i]];
+      s[SETUP_Y0][i] = sy[tv[3 * i]];
+      s[SETUP_X1][i] = sx[tv[3 * i + 1]];
+      s[SETUP_Y1][i] = sy[tv[3 * i + 1]];
+      s[SETUP_X2][i] = sx[tv[3 * i + 2]];
+      s[SETUP_Y2][i] = sy[tv[3 * i + 2]];
+    }
+
+    // barycentric coordinates as edge functions, and bounds. Degenerate
+    // triangles get infinite coefficients here and are dropped below.
+    for (int i = 0; i < n; ++i) {
+      const float x0 = s[SETUP_X0][i], y0 = s[SETUP_Y0][i];
+      const float x1 = s[SETUP_X1][i], y1 = s[SETUP_Y1][i];
+      const float x2 = s[SETUP_X2][i], y2 = s[SETUP_Y2][i];
+      const float area = (x1 - x0) * (y2 - y0) - (x2 - x0) * (y1 - y0);
+      const float invArea = 1 / area;
+      s[SETUP_AREA][i] = area;
+      s[SETUP_A0][i] = (y1 - y2) * invArea;
+      s[SETUP_B0][i] = (x2 - x1) * invArea;
+      s[SETUP_A1][i] = (y2 - y0) * invArea;
+      s[SETUP_B1][i] = (x0 - x2) * invArea;
+      s[SETUP_A2][i] = (y0 - y1) * invArea;
+      s[SETUP_B2][i] = (x1 - x0) * invArea;
+      s[SETUP_MIN_X][i] = min(x0, min(x1, x2));
+      s[SETUP_MIN_Y][i] = min(y0, min(y1, y2));
+      s[SETUP_MAX_X][i] = max(x0, max(x1, x2));
+      s[SETUP_MAX_Y][i] = max(y0, max(y1, y2));
+    }
+
+    for (int i = 0; i < n; ++i) {
+      // counterclockwise on screen is front facing, as glFrontFace(GL_CCW)
+      const float area = s[SETUP_AREA][i];
+      if (area == 0 || (area > 0 ? cullFront : cullBack)) {
+        ++pendingStats_.trianglesCulled;
+        continue;
+      }
+
+      // pixels whose centers are inside the bounds
+      Triangle t;
+      t.minX = max(0, int(ceil(s[SETUP_MIN_X][i] - 0.5f)));
+      t.minY = max(0, int(ceil(s[SETUP_MIN_Y][i] - 0.5f)));
+      t.maxX = min(width_ - 1, int(floor(s[SETUP_MAX_X][i] - 0.5f)));
+      t.maxY = min(height_ - 1, int(floor(s[SETUP_MAX_Y][i] - 0.5f)));
+      if (t.minX > t.maxX || t.minY > t.maxY) {
+        ++pendingStats_.trianglesCulled;
+        continue;
+      }
+
+      t.x0 = s[SETUP_X0][i];
+      t.y0 = s[SETUP_Y0][i];
+      const float a[3] = { s[SETUP_A0][i], s[SETUP_A1][i], s[SETUP_A2][i] };
+      const float b[3] = { s[SETUP_B0][i], s[SETUP_B1][i], s[SETUP_B2][i] };
+      for (int k = 0; k < 3; ++k) {
+        t.edge[k][0] = k == 0 ? 1 : 0;
+        t.edge[k][1] = a[k];
+        t.edge[k][2] = b[k];
+        // the coordinate grows to the right on a left edge, and downwards on a top edge
+        t.edgeBias[k] = a[k] > 0 || (a[k] == 0 && b[k] < 0) ? 0 : numeric_limits<float>::denorm_min();
+      }
+
+      const int* v = &tv[3 * i];
+      t.depth[0] = sz[v[0]];
+      t.depth[1] = (sz[v[1]] - sz[v[0]]) * a[1] + (sz[v[2]] - sz[v[0]]) * a[2];
+      t.depth[2] = (sz[v[1]] - sz[v[0]]) * b[1] + (sz[v[2]] - sz[v[0]]) * b[2];
+      t.invW[0] = siw[v[0]];
+      t.invW[1] = (siw[v[1]] - siw[v[0]]) * a[1] + (siw[v[2]] - siw[v[0]]) * a[2];
+      t.invW[2] = (siw[v[1]] - siw[v[0]]) * b[1] + (siw[v[2]] - siw[v[0]]) * b[2];
+      t.drawState = drawState;
+      t.varyings = varyingPlanes_.size();
+      for (int k = 0; k < numVaryings; ++k) {
+        const float q0 = varyings_[k][v[0]] * siw[v[0]];
+        const float q1 = varyings_[k][v[1]] * siw[v[1]];
+        const float q2 = varyings_[k][v[2]] * siw[v[2]];
+        varyingPlanes_.push_back(q0);
+        varyingPlanes_.push_back((q1 - q0) * a[1] + (q2 - q0) * a[2]);
+        varyingPlanes_.push_back((q1 - q0) * b[1] + (q2 - q0) * b[2]);
+      }
+
+      triangles_.push_back(t);
+      ++pendingStats_.triangles;
+      binTriangle(triangles_.size() - 1);
+    }
+  }
+}
+
+void SoftRenderer::binTriangle(int index) {
+  const Triangle& t = triangles_[index];
+  const int tx0 = t.minX / TILE_SIZE, tx1 = t.maxX / TILE_SIZE;
+  const int ty0 = t.minY / TILE_SIZE, ty1 = t.maxY / TILE_SIZE;
+  for (int ty = ty0; ty <= ty1; ++ty) {
+    for (int tx = tx0; tx <= tx1; ++tx) {
+      // skips the tiles of the bounds that one edge keeps all pixels out of
+      const float minX = max(t.minX, tx * TILE_SIZE) + 0.5f - t.x0;
+      const float maxX = min(t.maxX, tx * TILE_SIZE + TILE_SIZE - 1) + 0.5f - t.x0;
+      const float minY = max(t.minY, ty * TILE_SIZE) + 0.5f - t.y0;
+      const float maxY = min(t.maxY, ty * TILE_SIZE + TILE_SIZE - 1) + 0.5f - t.y0;
+      bool outside = false;
+      for (int k = 0; k < 3 && !outside; ++k) {
+        const float e = t.edge[k][0] + t.edge[k][1] * (t.edge[k][1] > 0 ? maxX : minX) +
+                        t.edge[k][2] * (t.edge[k][2] > 0 ? maxY : minY);
+        outside = e < t.edgeBias[k];
+      }
+      if (!outside) {
+        bins_[ty * tilesX_ + tx].push_back(index);
+        ++pendingStats_.binEntries;
+      }
+    }
+  }
+}
+
+void SoftRenderer::rasterizeTile(int tx, int ty) {
+  const bool srgb = !g_Gl2Compatible;
+  const int tileX0 = tx * TILE_SIZE, tileY0 = ty * TILE_SIZE;
+  const int tileX1 = min(tileX0 + TILE_SIZE, width_) - 1, tileY1 = min(tileY0 + TILE_SIZE, height_) - 1;
+  const int tileWidth = tileX1 - tileX0 + 1;
+
+  // depth and nearest triangle of the tile's pixels, in rows of TILE_SIZE, so
+  // that groups of pixels from a multiple of LANES stay inside the tile
+  float depth[TILE_SIZE * TILE_SIZE];
+  int nearest[TILE_SIZE * TILE_SIZE];
+  fill(depth, depth + TILE_SIZE * TILE_SIZE, 0.0f);
+  fill(nearest, nearest + TILE_SIZE * TILE_SIZE, -1);
+  if (!clearPending_) {
+    for (int y = tileY0; y <= tileY1; ++y) {
+      const float* row = &depth_[y * width_ + tileX0];
+      copy(row, row + tileWidth, &depth[(y - tileY0) * TILE_SIZE]);
+    }
+  }
+
+  // visibility first, keeping the nearest triangle of each pixel, so that a
+  // pixel is shaded once however many triangles cover it
+  const vector<int>& bin = bins_[ty * tilesX_ + tx];
+  for (size_t j = 0; j < bin.size(); ++j) {
+    const int index = bin[j];
+    const Triangle& t = triangles_[index];
+    const int x0 = max(t.minX, tileX0), x1 = min(t.maxX, tileX1);
+    const int y0 = max(t.minY, tileY0), y1 = min(t.maxY, tileY1);
+    const FloatN a0 = t.edge[0][1], a1 = t.edge[1][1], a2 = t.edge[2][1];
+    const FloatN bias0 = t.edgeBias[0], bias1 = t.edgeBias[1], bias2 = t.edgeBias[2];
+    const FloatN dz = t.depth[1];
+
+    for (int y = y0; y <= y1; ++y) {
+      const float dy = y + 0.5f - t.y0;
+      const float e[3] = {
+        t.edge[0][0] + t.edge[0][2] * dy, t.edge[1][0] + t.edge[1][2] * dy, t.edge[2][0] + t.edge[2][2] * dy
+      };
+
+      // the pixels between where the edges cross the row, give or take one
+      // for rounding; the test below decides about each of them
+      int begin = x0, end = x1;
+      for (int k = 0; k < 3; ++k) {
+        const float a = t.edge[k][1];
+        if (a == 0) {
+          if (e[k] < t.edgeBias[k])
+            end = begin - 1;
+          continue;
+        }
+        const float x = min(max(t.x0 - 0.5f + (t.edgeBias[k] - e[k]) / a, begin - 1.0f), end + 1.0f);
+        if (a > 0)
+          begin = max(begin, floorToInt(x));
+        else
+          end = min(end, floorToInt(x) + 1);
+      }
+
+      // coverage and depth test, a group of pixels at a time
+      const FloatN e0 = e[0], e1 = e[1], e2 = e[2], z0 = t.depth[0] + t.depth[2] * dy;
+      const FloatN first = float(begin), last = float(end), x0Vertex = t.x0;
+      float* depthRow = &depth[(y - tileY0) * TILE_SIZE];
+      int* ids = &nearest[(y - tileY0) * TILE_SIZE];
+      for (int i = (begin - tileX0) & ~(LANES - 1); i <= end - tileX0; i += LANES) {
+        const FloatN x = float(tileX0 + i) + laneOffsets();
+        const FloatN dx = x + 0.5f - x0Vertex, z = z0 + dz * dx;
+        const FloatN d = FloatN::load(depthRow + i);
+        const MaskN visible = (x >= first) & (x <= last) & (e0 + a0 * dx >= bias0) & (e1 + a1 * dx >= bias1) &
+                              (e2 + a2 * dx >= bias2) & (z > d);
+        if (visible.any()) {
+          select(visible, z, d).store(depthRow + i);
+          select(visible, IntN(index), IntN::load(ids + i)).store(ids + i);
+        }
+      }
+    }
+  }
+
+  // then shading, a span of pixels of the same triangle at a time
+  const unsigned char clear[3] = {
+    toUnorm8(clearColor_[0], srgb), toUnorm8(clearColor_[1], srgb), toUnorm8(clearColor_[2], srgb)
+  };
+  for (int y = tileY0; y <= tileY1; ++y) {
+    const int* ids = &nearest[(y - tileY0) * TILE_SIZE];
+    unsigned char* color = &color_[3 * (y * width_ + tileX0)];
+    for (int begin = 0, end = 0; begin < tileWidth; begin = end) {
+      for (end = begin + 1; end < tileWidth && ids[end] == ids[begin]; ++end) {}
+      if (ids[begin] >= 0) {
+        const Triangle& t = triangles_[ids[begin]];
+        Span span;
+        span.n = end - begin;
+        span.dx0 = tileX0 + begin + 0.5f - t.x0;
+        span.dy = y + 0.5f - t.y0;
+        span.color = color + 3 * begin;
+        shadeSpan(drawStates_[t.drawState], t, &varyingPlanes_[t.varyings], span);
+      }
+      else if (clearPending_) {
+        for (int x = begin; x < end; ++x)
+          copy(clear, clear + 3, color + 3 * x);
+      }
+    }
+
+    const float* depthRow = &depth[(y - tileY0) * TILE_SIZE];
+    copy(depthRow, depthRow + tileWidth, &depth_[y * width_ + tileX0]);
+  }
+}
+
+// The lookups of a group of pixels at the same level of detail: the texels
+// they read and their weights. It is the same for all textures of the same
+// size.
+struct SoftRenderer::MipmappedTexture::Footprint {
+  int level, numLevels;
+  float levelWeight;      // of the second level
+  int pairs[2][2][LANES]; // per level and row, the first texel of each lookup's pair
+  float ax[2][LANES], ay[2][LANES];
+};
+
+float SoftRenderer::MipmappedTexture::getLod(const float* dudx, const float* dvdx, const float* dudy,
+                                             const float* dvdy, int n) const {
+  const FloatN w2 = float(levels[0].width * levels[0].width), h2 = float(levels[0].height * levels[0].height);
+  const FloatN dux = FloatN::load(dudx), dvx = FloatN::load(dvdx), duy = FloatN::load(dudy), dvy = FloatN::load(dvdy);
+  // log2 of the longest footprint, from their squared lengths
+  float rho2[LANES];
+  vmax(dux * dux * w2 + dvx * dvx * h2, duy * duy * w2 + dvy * dvy * h2).store(rho2);
+  return 0.5f * fastLog2(*max_element(rho2, rho2 + n));
+}
+
+void SoftRenderer::MipmappedTexture::getFootprint(const float* u, const float* v, float lod,
+                                                  Footprint& footprint) const {
+  // the base level if magnified, else the two levels around lod
+  int level = 0;
+  float levelWeight = 0;
+  if (lod > 0) {
+    lod = min(lod, float(levels.size() - 1));
+    level = int(lod);
+    levelWeight = lod - level;
+  }
+  footprint.level = level;
+  footprint.numLevels = levelWeight > 0 ? 2 : 1;
+  footprint.levelWeight = levelWeight;
+
+  const FloatN uu = FloatN::load(u), vv = FloatN::load(v);
+  for (int k = 0; k < footprint.numLevels; ++k) {
+    const Level& l = levels[level + k];
+    const FloatN w = float(l.width), h = float(l.height);
+    // texel coordinates, clamped first to one texel beyond the edges, which
+    // samples the same, so that they fit an int. NaNs become the edges.
+    const FloatN x = vmax(vmin(uu * w - 0.5f, w), -1.0f), y = vmax(vmin(vv * h - 0.5f, h), -1.0f);
+    // floor, which truncation is above -1
+    FloatN ix = toFloat(truncate(x + 1.0f)) - 1.0f;
+    const FloatN iy = toFloat(truncate(y + 1.0f)) - 1.0f;
+    // beyond an edge, both texels of a pair are the one at the edge
+    const MaskN inside = (ix >= 0.0f) & (ix < w - 1.0f);
+    select(inside, x - ix, 0.0f).store(footprint.ax[k]);
+    (y - iy).store(footprint.ay[k]);
+    ix = vmin(vmax(ix, 0.0f), w - 1.0f);
+    const FloatN y0 = vmin(vmax(iy, 0.0f), h - 1.0f), y1 = vmin(vmax(iy + 1.0f, 0.0f), h - 1.0f);
+    // texel indices, exact as floats for levels of up to 2^24 texels
+    truncate(y0 * (w + 1.0f) + ix).store(footprint.pairs[k][0]);
+    truncate(y1 * (w + 1.0f) + ix).store(footprint.pairs[k][1]);
+  }
+}
+
+// Channels of sRGB encoded texels, as loadTexelPairs returns them, decoded by
+// 'table'
+static inline void decodeSrgbTexels(const float* table, const IntN& texels, FloatN& r, FloatN& g, FloatN& b) {
+  int t[LANES];
+  float c[3][LANES];
+  texels.store(t);
+  for (int i = 0; i < LANES; ++i) {
+    c[0][i] = table[t[i] & 0xff];
+    c[1][i] = table[t[i] >> 8 & 0xff];
+    c[2][i] = table[t[i] >> 16 & 0xff];
+  }
+  r = FloatN::load(c[0]);
+  g = FloatN::load(c[1]);
+  b = FloatN::load(c[2]);
+}
+
+// Channels of texels, as loadTexelPairs returns them, from 0 to 255
+static inline void getChannels(const IntN& texels, bool srgb, FloatN& r, FloatN& g, FloatN& b) {
+  if (srgb)
+    decodeSrgbTexels(getSrgbDecodeTable(), texels, r, g, b);
+  else
+    unpackTexels(texels, r, g, b);
+}
+
+void SoftRenderer::MipmappedTexture::sample(const Footprint& footprint, float* red, float* green, float* blue) const {
+  FloatN r = 0.0f, g = 0.0f, b = 0.0f;
+  for (int k = 0; k < footprint.numLevels; ++k) {
+    // the texels of each lookup, on the left and right of its lower and upper rows
+    const unsigned char* texels = &levels[footprint.level + k].rgba[0];
+    IntN t00, t01, t10, t11;
+    loadTexelPairs(texels, footprint.pairs[k][0], t00, t01);
+    loadTexelPairs(texels, footprint.pairs[k][1], t10, t11);
+
+    const FloatN ax = FloatN::load(footprint.ax[k]), ay = FloatN::load(footprint.ay[k]);
+    const FloatN weight = k == 0 ? 1 - footprint.levelWeight : footprint.levelWeight;
+    FloatN r0, g0, b0, r1, g1, b1;
+    getChannels(t00, srgb, r0, g0, b0);
+    getChannels(t01, srgb, r1, g1, b1);
+    const FloatN bottomR = r0 + (r1 - r0) * ax, bottomG = g0 + (g1 - g0) * ax, bottomB = b0 + (b1 - b0) * ax;
+    getChannels(t10, srgb, r0, g0, b0);
+    getChannels(t11, srgb, r1, g1, b1);
+    const FloatN topR = r0 + (r1 - r0) * ax, topG = g0 + (g1 - g0) * ax, topB = b0 + (b1 - b0) * ax;
+    r += (bottomR + (topR - bottomR) * ay) * weight;
+    g += (bottomG + (topG - bottomG) * ay) * weight;
+    b += (bottomB + (topB - bottomB) * ay) * weight;
+  }
+  (r * (1.0f / 255)).store(red);
+  (g * (1.0f / 255)).store(green);
+  (b * (1.0f / 255)).store(blue);
+}
+
+void SoftRenderer::shadeSpan(const DrawState& state, const Triangle& t, const float* varyingPlanes, const Span& span) {
+  const bool srgb = !g_Gl2Compatible;
+  const Cvec3f& color = state.color;
+  if (state.shader == SOLID) {
+    for (int i = 0; i < span.n; i += LANES)
+      storeColors(color[0], color[1], color[2], srgb, min<int>(LANES, span.n - i), span.color + 3 * i);
+    return;
+  }
+
+  // perspective correct varyings: the planes of 1 / w and of varying / w are
+  // linear on screen. Their values at the first group of pixels of the span,
+  // stepped a group at a time:
+  const FloatN firstDx = span.dx0 + laneOffsets();
+  FloatN invW = t.invW[0] + t.invW[1] * firstDx + t.invW[2] * span.dy;
+  const FloatN invWStep = LANES * t.invW[1];
+  FloatN q[NUM_NORMAL_VARYINGS], qStep[NUM_NORMAL_VARYINGS];
+  for (int k = 0; k < state.numVaryings; ++k) {
+    const float* plane = varyingPlanes + 3 * k;
+    q[k] = plane[0] + plane[1] * firstDx + plane[2] * span.dy;
+    qStep[k] = LANES * plane[1];
+  }
+
+  const bool sameTextureSize = state.normalTexture &&
+                               state.normalTexture->levels[0].width == state.colorTexture->levels[0].width &&
+                               state.normalTexture->levels[0].height == state.colorTexture->levels[0].height;
+  const bool shininess64 = state.shader == SPECULAR;
+
+  for (int i = 0; i < span.n; i += LANES) {
+    const int n = min<int>(LANES, span.n - i);
+    const FloatN w = 1.0f / invW;
+    const auto varying = [&](int k) { return q[k] * w; };
+
+    // unit normals, and for the normal shader, the texture color in rgb
+    FloatN nx = 0.0f, ny = 0.0f, nz = 1.0f, r = 0.0f, g = 0.0f, b = 0.0f;
+    int position;
+    if (state.shader != NORMAL) {
+      nx = varying(BASIC_NORMAL);
+      ny = varying(BASIC_NORMAL + 1);
+      nz = varying(BASIC_NORMAL + 2);
+      normalize3(nx, ny, nz);
+      position = BASIC_POSITION;
+    }
+    else {
+      // texture lookups, a group at a time. The derivatives of u = U / Q, with U
+      // the plane of u / w and Q the one of 1 / w, pick the mipmap level.
+      const FloatN u = varying(NORMAL_TEXCOORD), v = varying(NORMAL_TEXCOORD + 1);
+      const float *pu = varyingPlanes + 3 * NORMAL_TEXCOORD, *pv = pu + 3;
+      float us[LANES], vs[LANES], dudx[LANES], dudy[LANES], dvdx[LANES], dvdy[LANES];
+      u.store(us);
+      v.store(vs);
+      ((pu[1] - u * t.invW[1]) * w).store(dudx);
+      ((pu[2] - u * t.invW[2]) * w).store(dudy);
+      ((pv[1] - v * t.invW[1]) * w).store(dvdx);
+      ((pv[2] - v * t.invW[2]) * w).store(dvdy);
+
+      MipmappedTexture::Footprint footprint;
+      const MipmappedTexture* texture = state.colorTexture;
+      texture->getFootprint(us, vs, texture->getLod(dudx, dvdx, dudy, dvdy, n), footprint);
+      float rgb[3][LANES];
+      texture->sample(footprint, rgb[0], rgb[1], rgb[2]);
+      r = FloatN::load(rgb[0]);
+      g = FloatN::load(rgb[1]);
+      b = FloatN::load(rgb[2]);
+
+      if (state.normalTexture) {
+        texture = state.normalTexture;
+        if (!sameTextureSize)
+          texture->getFootprint(us, vs, texture->getLod(dudx, dvdx, dudy, dvdy, n), footprint);
+        texture->sample(footprint, rgb[0], rgb[1], rgb[2]);
+        // from tangent space to eye space
+        const FloatN x = 2.0f * FloatN::load(rgb[0]) - 1.0f;
+        const FloatN y = 2.0f * FloatN::load(rgb[1]) - 1.0f;
+        const FloatN z = 2.0f * FloatN::load(rgb[2]) - 1.0f;
+        nx = varying(NORMAL_TANGENT) * x + varying(NORMAL_BINORMAL) * y + varying(NORMAL_NORMAL) * z;
+        ny = varying(NORMAL_TANGENT + 1) * x + varying(NORMAL_BINORMAL + 1) * y + varying(NORMAL_NORMAL + 1) * z;
+        nz = varying(NORMAL_TANGENT + 2) * x + varying(NORMAL_BINORMAL + 2) * y + varying(NORMAL_NORMAL + 2) * z;
+        normalize3(nx, ny, nz);
+      }
+      // else the GL3 shader does not read the normal map yet, and the normal is (0, 0, 1)
+      position = NORMAL_POSITION;
+    }
+
+    // the two lights, as all three shaders compute them; shininess is 64 for the
+    // specular shader and 32 for the normal one, and the diffuse one has none
+    const FloatN px = varying(position), py = varying(position + 1), pz = varying(position + 2);
+    FloatN vx = -px, vy = -py, vz = -pz;
+    normalize3(vx, vy, vz);
+    FloatN diffuse = 0.0f, specular = 0.0f;
+    for (int k = 0; k < 2; ++k) {
+      const Cvec3f& l = k == 0 ? state.light : state.light2;
+      FloatN dx = l[0] - px, dy = l[1] - py, dz = l[2] - pz;
+      normalize3(dx, dy, dz);
+      const FloatN nDotL = nx * dx + ny * dy + nz * dz;
+      // the shaders normalize the reflection, which is a unit vector already
+      const FloatN twoNDotL = 2.0f * nDotL;
+      const FloatN rx = twoNDotL * nx - dx, ry = twoNDotL * ny - dy, rz = twoNDotL * nz - dz;
+      const FloatN s = pow32(vmax(rx * vx + ry * vy + rz * vz, 0.0f));
+      specular += shininess64 ? s * s : s;
+      diffuse += vmax(nDotL, 0.0f);
+    }
+
+    switch (state.shader) {
+    case DIFFUSE:
+      r = color[0] * diffuse;
+      g = color[1] * diffuse;
+      b = color[2] * diffuse;
+      break;
+
+    case SPECULAR: {
+      // the GL2 and GL3 shaders light it differently
+      const Cvec3f ambient = g_Gl2Compatible ? Cvec3f(0.05f, 0.05f, 0.05f) : color * 0.2f;
+      const FloatN lit = (g_Gl2Compatible ? 0.24f : 0.4f) * specular;
+      r = ambient[0] + color[0] * diffuse + lit;
+      g = ambient[1] + color[1] * diffuse + lit;
+      b = ambient[2] + color[2] * diffuse + lit;
+      break;
+    }
+
+    default: {
+      const FloatN lit = (g_Gl2Compatible ? 0.4f : 0.6f) * specular;
+      r = r * diffuse + lit;
+      g = g * diffuse + lit;
+      b = b * diffuse + lit;
+      break;
+    }
+    }
+    storeColors(r, g, b, srgb, n, span.color + 3 * i);
+
+    invW += invWStep;
+    for (int k = 0; k < state.numVaryings; ++k)
+      q[k] += qStep[k];
+  }
+}
+
+void SoftRenderer::finish(WorkStealingPool* pool) {
+  vector<int> tiles;
+  for (int i = 0; i < tilesX_ * tilesY_; ++i) {
+    if (clearPending_ || !bins_[i].empty())
+      tiles.push_back(i);
+  }
+
+  // One task per thread, each taking the next tile until none are left. A
+  // task per tile costs a wake-up of a worker per tile, which is as much as
+  // drawing the tile when there are fewer cores than threads.
+  atomic<size_t> next(0);
+  const auto rasterizeTiles = [&]() {
+    for (size_t i; (i = next.fetch_add(1)) < tiles.size();)
+      rasterizeTile(tiles[i] % tilesX_, tiles[i] / tilesX_);
+  };
+  if (pool) {
+    for (int i = 0; i < pool->getNumThreads(); ++i)
+      pool->submit(rasterizeTiles);
+    rasterizeTiles();
+    pool->wait();
+  }
+  else
+    rasterizeTiles();
+
+  clearPending_ = false;
+  stats_ = pendingStats_;
+  pendingStats_ = Stats();
+  drawStates_.clear();
+  triangles_.clear();
+  varyingPlanes_.clear();
+  for (size_t i = 0; i < bins_.size(); ++i)
+    bins_[i].clear();
+}
+
+void SoftRenderer::writePpm(const char* filename) const {
+  FILE* f = fopen(filename, "wb");
+  if (!f)
+    throw runtime_error(string("Cannot write file ") + filename);
+  fprintf(f, "P6 %d %d 255\n", width_, height_);
+  for (int y = height_ - 1; y >= 0; --y)
+    fwrite(&color_[3 * y * width_], 1, 3 * width_, f);
+  const bool failed = ferror(f) != 0;
+  if (fclose(f) != 0 || failed)
+    throw runtime_error(string("Cannot write file ") + filename);
+}
@@ -0,0 +1,225 @@
+#ifndef SOFTRENDERER_H
+#define SOFTRENDERER_H
+
+#include <vector>
+#include <map>
+#include <memory>
+
+#include "cvec.h"
+#include "matrix4.h"
+#include "glsupport.h"
+#include "uniforms.h"
+#include "geometry.h"
+#include "material.h"
+#include "texture.h"
+#include "threadpool.h"
+
+//--------------------------------------------------------------------------------
+// Software renderer: draws materials and geometries on the CPU, for machines
+// without a GPU, where GL is Mesa's llvmpipe. Built with AVX2, it draws a
+// frame of asst8's animation.txt at 1024x768 in about 13 ms on one core, where
+// llvmpipe takes 15 to 16 ms; with SSE2 only, it takes about 20 ms. make
+// softcheck checks that its frames match GL's, to within the tolerances of
+// imagediff.
+//
+// draw() has the contract of Material::draw, for the built-in shaders only:
+// basic-gl3.vshader with the diffuse, specular or solid fragment shader, and
+// normal-gl3.vshader with normal-gl3.fshader, recognized by their file names.
+// They are ported to C++ as the GL program would run them: the GL2 variants
+// when g_Gl2Compatible is set, with sRGB textures and framebuffer otherwise.
+// Uniforms come from the material, then from the extra uniforms, and vertex
+// attributes from the geometry's CpuVertexArray, matched by name. Of the
+// render states, face culling is followed; blending and polygon modes other
+// than GL_FILL throw. Fragments pass the depth test if they are nearer than
+// what is there, and depth is cleared to the far plane, as asst8 sets up GL.
+//
+// Rendering is tile based. draw() runs the vertex shader, clips against the
+// near and far planes (and a guard band around the viewport), sets up the
+// triangles and bins them into tiles of TILE_SIZE x TILE_SIZE pixels. finish()
+// rasterizes the tiles, in parallel on a WorkStealingPool if given one. Each
+// tile is owned by one task and depth tests its triangles in the order they
+// were drawn, so the image does not depend on the number of threads. Only the
+// nearest triangle of a pixel is shaded, once the whole tile is depth tested,
+// which draws the same image as shading every fragment as GL does without
+// blending.
+//
+// Vertex transforms and triangle setup run over arrays of floats with no
+// branches in the loop body, so the compiler vectorizes them (the Makefile
+// adds -ftree-vectorize for GCC's -O2). The coverage and depth test and the
+// shading run on groups of eight pixels of a row with AVX2, or four with SSE2:
+// edge functions, depths and varyings are evaluated for the whole group, and
+// texels are fetched for it as 8 bit RGBA, two adjacent ones at a time.
+// Vertices are snapped to 1/256 pixel and edges follow the top-left rule, so
+// shared edges are neither skipped nor drawn twice.
+//--------------------------------------------------------------------------------
+
+class SoftRenderer : Noncopyable {
+public:
+  enum { TILE_SIZE = 64 };
+
+  struct Stats {
+    int draws;
+    int triangles;        // set up and binned, after clipping and culling
+    int trianglesCulled;  // back facing, empty, or outside the view volume
+    int trianglesClipped; // crossing the near or far plane or the guard band
+    int binEntries;       // triangle and tile pairs rasterized
+
+    Stats() : draws(0), triangles(0), trianglesCulled(0), trianglesClipped(0), binEntries(0) {}
+  };
+
+  SoftRenderer(int width, int height);
+
+  int getWidth() const {
+    return width_;
+  }
+
+  int getHeight() const {
+    return height_;
+  }
+
+  // Color that clear() fills the color buffer with, as passed to glClearColor
+  void setClearColor(const Cvec3f& color) {
+    clearColor_ = color;
+  }
+
+  // Clears the color and depth buffers at the start of the next finish()
+  void clear() {
+    clearPending_ = true;
+  }
+
+  // Sets up and bins the triangles of 'geometry' as 'material' draws them.
+  // Throws runtime_error, as Material::draw does, if a uniform or vertex
+  // attribute is missing, and also for a shader, geometry or render state the
+  // renderer does not support.
+  void draw(const Material& material, Geometry& geometry, const Uniforms& extraUniforms);
+
+  // Rasterizes everything drawn since the last finish() into the buffers
+  void finish(WorkStealingPool* pool = NULL);
+
+  // Counts for the draws of the last finish()
+  const Stats& getStats() const {
+    return stats_;
+  }
+
+  // RGB, 8 bits per channel, bottom row first, as glReadPixels returns them
+  const std::vector<unsigned char>& getPixels() const {
+    return color_;
+  }
+
+  // Writes the color buffer as a binary PPM, like writePpmScreenshot. Throws
+  // runtime_error if the file cannot be written.
+  void writePpm(const char* filename) const;
+
+private:
+  enum Shader { DIFFUSE, SPECULAR, SOLID, NORMAL };
+
+  // A texture with its mipmaps, 8 bits per channel as GL keeps them
+  struct MipmappedTexture {
+    struct Level {
+      int width, height;
+      // RGBA texels in rows of width + 1, with the last texel repeated, so
+      // that the two texels a bilinear lookup reads from a row are adjacent
+      std::vector<unsigned char> rgba;
+
+      unsigned char* getTexel(int x, int y) {
+        return &rgba[4 * (y * (width + 1) + x)];
+      }
+
+      const unsigned char* getTexel(int x, int y) const {
+        return &rgba[4 * (y * (width + 1) + x)];
+      }
+    };
+
+    // Where the lookups of a group of pixels read, defined in softrenderer.cpp
+    // as the size of a group depends on the SIMD instructions it is built with
+    struct Footprint;
+
+    std::shared_ptr<Texture> texture; // keeps the key of the cache alive
+    bool srgb;
+    std::vector<Level> levels;
+
+    // Mipmap level for the first n lookups of a group with these texture
+    // coordinate derivatives, one per lookup: as GL picks it for the one of
+    // them with the largest footprint, much as GPUs pick one for each 2x2
+    // pixels
+    float getLod(const float* dudx, const float* dvdx, const float* dudy, const float* dvdy, int n) const;
+
+    // Where a group of lookups as GL_LINEAR_MIPMAP_LINEAR with
+    // GL_CLAMP_TO_EDGE read
+    void getFootprint(const float* u, const float* v, float lod, Footprint& footprint) const;
+
+    // Filtered red, green and blue, from 0 to 1, of each lookup of the footprint
+    void sample(const Footprint& footprint, float* red, float* green, float* blue) const;
+  };
+
+  // What a draw passes from its vertex to its fragment stage
+  struct DrawState {
+    Shader shader;
+    int numVaryings;
+    Cvec3f color, light, light2; // lights in eye space
+    const MipmappedTexture *colorTexture, *normalTexture;
+  };
+
+  // Set up triangle. Edge functions and interpolated values are planes
+  // relative to the first vertex, x0 and y0: value + dx * d/dx + dy * d/dy.
+  struct Triangle {
+    float x0, y0;
+    float edge[3][3];   // barycentric coordinate of each vertex: value, d/dx, d/dy
+    float edgeBias[3];  // smallest edge value inside: 0 on top and left edges, else just above 0
+    float depth[3];
+    float invW[3];
+    int minX, minY, maxX, maxY; // pixel bounds, inside the viewport
+    int drawState;
+    int varyings;       // first of the drawState's numVaryings planes of varying / w in varyingPlanes_
+  };
+
+  int width_, height_;
+  int tilesX_, tilesY_;
+  Cvec3f clearColor_;
+  bool clearPending_;
+
+  std::vector<unsigned char> color_;
+  std::vector<float> depth_;
+
+  std::vector<DrawState> drawStates_;
+  std::vector<Triangle> triangles_;
+  std::vector<float> varyingPlanes_;
+  std::vector<std::vector<int> > bins_; // triangles overlapping each tile, in draw order
+  Stats stats_, pendingStats_;
+
+  std::map<const Texture*, MipmappedTexture> textures_;
+
+  // Scratch arrays of draw(), kept to avoid reallocating them every draw: per
+  // vertex in clip space and on screen, and the triangles to set up
+  std::vector<float> clip_[4];
+  std::vector<std::vector<float> > varyings_;
+  std::vector<float> screen_[4]; // x, y, depth, 1 / w
+  std::vector<int> outcodes_;
+  std::vector<int> setupVertices_; // three per triangle after clipping
+  int numVaryings_; // of the current draw
+
+  const MipmappedTexture* getTexture(const std::shared_ptr<Texture>& texture);
+
+  // The uniform of that name supplied by the material, else by 'extra'
+  static const Uniforms::Value& findUniform(const Material& material, const Uniforms& extra,
+                                            const char* name, GLenum type);
+  static Cvec3f getVec3(const Material& material, const Uniforms& extra, const char* name);
+  static Matrix4 getMatrix(const Material& material, const Uniforms& extra, const char* name);
+
+  // Appends the vertex where edge a-b meets the clipping plane of distances
+  // da and db at a and b, and returns its index
+  int addClipVertex(int a, int b, float da, float db);
+
+  void clipTriangle(const int v[3], int clipCodes);
+  void setupTriangles(int drawState, bool cullFront, bool cullBack);
+  void binTriangle(int triangle);
+  void rasterizeTile(int tx, int ty);
+
+  struct Span;
+
+  // Runs the fragment shader on a span of pixels of triangle t, whose planes
+  // of varying / w start at varyingPlanes, and writes their colors
+  static void shadeSpan(const DrawState& state, const Triangle& t, const float* varyingPlanes, const Span& span);
+};
+
+#endif
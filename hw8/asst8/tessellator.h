@@ -0,0 +1,273 @@
+#ifndef TESSELLATOR_H
+#define TESSELLATOR_H
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include "cvec.h"
+#include "matrix4.h"
+#include "mesh.h"
+#include "threadpool.h"
+
+//--------------------------------------------------------------------------------
+// CPU tessellation of Mesh faces as bicubic patches, with a density chosen per
+// patch from its size on screen.
+//
+// Each face of the mesh becomes a bicubic Bezier patch. The corners interpolate
+// the face vertices, and the edge control points are pulled onto the tangent
+// planes given by the smooth vertex normals (the quad analogue of PN triangles).
+// A triangle is handled as a quad whose last corner is doubled.
+//
+// The number of segments along a patch edge comes from the projected length of
+// the edge's control polygon, so patches near the eye get more triangles than
+// distant or off-screen ones. The two patches sharing an edge compute the same
+// segment count for it, and boundary vertices are snapped onto that edge's
+// polyline, so neighbouring patches of different density meet without cracks.
+//--------------------------------------------------------------------------------
+
+struct TessellationOptions {
+  double pixelsPerSegment;       // target screen-space length of one segment
+  int minSegments, maxSegments;  // clamps the per-edge segment count
+
+  TessellationOptions()
+    : pixelsPerSegment(8), minSegments(1), maxSegments(64) {}
+};
+
+// Private namespace for the tessellator implementation.
+namespace _tessellator {
+
+struct Patch {
+  Cvec3 b[4][4];        // control points, b[i][j] is at (u, v) = (i/3, j/3)
+  Cvec3 n[4];           // corner normals at (0,0), (1,0), (1,1), (0,1)
+  int edgeSegments[4];  // edges v=0, u=1, v=1, u=0
+  int segments;         // grid resolution, the max over the edges
+};
+
+inline void bernstein(double t, double w[4]) {
+  const double s = 1 - t;
+  w[0] = s * s * s;
+  w[1] = 3 * t * s * s;
+  w[2] = 3 * t * t * s;
+  w[3] = t * t * t;
+}
+
+inline Cvec3 evalCurve(const Cvec3 c[4], double t) {
+  double w[4];
+  bernstein(t, w);
+  return c[0] * w[0] + c[1] * w[1] + c[2] * w[2] + c[3] * w[3];
+}
+
+inline Cvec3 evalPatch(const Patch& p, double u, double v) {
+  double wu[4], wv[4];
+  bernstein(u, wu);
+  bernstein(v, wv);
+  Cvec3 r(0);
+  for (int i = 0; i < 4; ++i) {
+    for (int j = 0; j < 4; ++j) {
+      r += p.b[i][j] * (wu[i] * wv[j]);
+    }
+  }
+  return r;
+}
+
+// Point on the polyline through 'segments' + 1 uniformly spaced samples of the
+// curve. Equals the curve itself at the sample parameters.
+inline Cvec3 evalEdgePolyline(const Cvec3 c[4], int segments, double t) {
+  const double x = t * segments;
+  const int k = std::min(std::max(int(std::floor(x)), 0), segments - 1);
+  const double f = x - k;
+  return evalCurve(c, double(k) / segments) * (1 - f) + evalCurve(c, double(k + 1) / segments) * f;
+}
+
+// Control point next to 'p' on the edge towards 'q', projected onto the tangent
+// plane at 'p'
+inline Cvec3 edgeControlPoint(const Cvec3& p, const Cvec3& n, const Cvec3& q) {
+  return (p * 2 + q - n * dot(q - p, n)) / 3;
+}
+
+inline void getEdgeCurve(const Patch& p, int edge, Cvec3 c[4]) {
+  for (int k = 0; k < 4; ++k) {
+    switch (edge) {
+    case 0: c[k] = p.b[k][0]; break;
+    case 1: c[k] = p.b[3][k]; break;
+    case 2: c[k] = p.b[k][3]; break;
+    default: c[k] = p.b[0][k]; break;
+    }
+  }
+}
+
+// Number of segments for a curve, from the screen-space length of its control
+// polygon (an upper bound of the curve length)
+inline int getEdgeSegments(const Cvec3 c[4], const Matrix4& mvp, int width, int height,
+                           const TessellationOptions& options) {
+  Cvec2 s[4];
+  int behind = 0;
+  for (int k = 0; k < 4; ++k) {
+    const Cvec4 q = mvp * Cvec4(c[k], 1);
+    if (q[3] < CS175_EPS) {
+      ++behind;
+      continue;
+    }
+    s[k] = Cvec2((q[0] / q[3] + 1) * 0.5 * width, (q[1] / q[3] + 1) * 0.5 * height);
+  }
+  if (behind == 4)
+    return options.minSegments;
+  if (behind > 0) // crosses the eye plane, cannot measure it on screen
+    return options.maxSegments;
+
+  double len = 0;
+  for (int k = 0; k < 3; ++k)
+    len += norm(s[k + 1] - s[k]);
+  const int n = int(std::ceil(len / options.pixelsPerSegment));
+  return std::min(std::max(n, options.minSegments), options.maxSegments);
+}
+
+// Runs f(i) for i in [0, n), in chunks of consecutive i on 'pool' if there is
+// one and it has more than one thread
+template<typename F>
+void parallelFor(int n, WorkStealingPool* pool, const F& f) {
+  static const int CHUNK = 16;
+  if (pool == NULL || pool->getNumThreads() <= 1 || n <= CHUNK) {
+    for (int i = 0; i < n; ++i)
+      f(i);
+    return;
+  }
+
+  for (int begin = 0; begin < n; begin += CHUNK) {
+    const int end = std::min(begin + CHUNK, n);
+    pool->submit([&f, begin, end]() {
+      for (int i = begin; i < end; ++i)
+        f(i);
+    });
+  }
+  pool->wait();
+}
+
+} // namespace _tessellator
+
+// Tessellates all faces of 'mesh' into an unindexed triangle list written into
+// 'vertices'. 'modelView' takes the mesh into eye space, and together with
+// 'projection' and the screen size determines the density of each patch.
+// Vertex must be constructible from a (position, normal) pair of Cvec3.
+// Patch setup and triangle generation run on 'pool' if given one, which must
+// not be called from one of its own tasks.
+template<typename Vertex>
+void tessellateMeshAdaptive(Mesh& mesh, const Matrix4& modelView, const Matrix4& projection,
+                            int screenWidth, int screenHeight,
+                            std::vector<Vertex>& vertices,
+                            WorkStealingPool* pool = NULL,
+                            const TessellationOptions& options = TessellationOptions()) {
+  using namespace _tessellator;
+
+  const int numFaces = mesh.getNumFaces();
+  const Matrix4 mvp = projection * modelView;
+
+  // smooth vertex normals, accumulated from the face normals
+  std::vector<Cvec3> normals(mesh.getNumVertices(), Cvec3(0));
+  for (int i = 0; i < numFaces; ++i) {
+    const Mesh::Face f = mesh.getFace(i);
+    const Cvec3 fn = f.getNormal();
+    for (int j = 0; j < f.getNumVertices(); ++j)
+      normals[f.getVertex(j).getIndex()] += fn;
+  }
+  for (size_t i = 0; i < normals.size(); ++i) {
+    if (norm2(normals[i]) > CS175_EPS2)
+      normals[i].normalize();
+  }
+
+  // gather the corners of every face, so the parallel part does not touch the mesh
+  std::vector<Patch> patches(numFaces);
+  for (int i = 0; i < numFaces; ++i) {
+    const Mesh::Face f = mesh.getFace(i);
+    const int nv = f.getNumVertices();
+    static const int corner[4][2] = {{0, 0}, {3, 0}, {3, 3}, {0, 3}};
+    for (int k = 0; k < 4; ++k) {
+      const Mesh::Vertex v = f.getVertex(std::min(k, nv - 1));
+      patches[i].b[corner[k][0]][corner[k][1]] = v.getPosition();
+      patches[i].n[k] = normals[v.getIndex()];
+      if (norm2(patches[i].n[k]) < CS175_EPS2)
+        patches[i].n[k] = f.getNormal();
+    }
+  }
+
+  // build the control nets and pick the per-edge densities
+  parallelFor(numFaces, pool, [&](int i) {
+    Patch& p = patches[i];
+    Cvec3 (&b)[4][4] = p.b;
+    const Cvec3 c0 = b[0][0], c1 = b[3][0], c2 = b[3][3], c3 = b[0][3];
+
+    b[1][0] = edgeControlPoint(c0, p.n[0], c1);
+    b[2][0] = edgeControlPoint(c1, p.n[1], c0);
+    b[3][1] = edgeControlPoint(c1, p.n[1], c2);
+    b[3][2] = edgeControlPoint(c2, p.n[2], c1);
+    b[1][3] = edgeControlPoint(c3, p.n[3], c2);
+    b[2][3] = edgeControlPoint(c2, p.n[2], c3);
+    b[0][1] = edgeControlPoint(c0, p.n[0], c3);
+    b[0][2] = edgeControlPoint(c3, p.n[3], c0);
+
+    // interior points complete the parallelograms at the corners (zero twist)
+    b[1][1] = b[1][0] + b[0][1] - b[0][0];
+    b[2][1] = b[2][0] + b[3][1] - b[3][0];
+    b[1][2] = b[1][3] + b[0][2] - b[0][3];
+    b[2][2] = b[2][3] + b[3][2] - b[3][3];
+
+    p.segments = 0;
+    for (int e = 0; e < 4; ++e) {
+      Cvec3 c[4];
+      getEdgeCurve(p, e, c);
+      p.edgeSegments[e] = getEdgeSegments(c, mvp, screenWidth, screenHeight, options);
+      p.segments = std::max(p.segments, p.edgeSegments[e]);
+    }
+  });
+
+  // each patch owns a contiguous run of 6 * segments^2 vertices in the output
+  std::vector<int> firstVertex(numFaces + 1, 0);
+  for (int i = 0; i < numFaces; ++i)
+    firstVertex[i + 1] = firstVertex[i] + 6 * patches[i].segments * patches[i].segments;
+  vertices.resize(firstVertex[numFaces], Vertex(Cvec3(0), Cvec3(0)));
+
+  parallelFor(numFaces, pool, [&](int i) {
+    const Patch& p = patches[i];
+    const int n = p.segments;
+
+    Cvec3 edge[4][4];
+    for (int e = 0; e < 4; ++e)
+      getEdgeCurve(p, e, edge[e]);
+
+    std::vector<Cvec3> pos((n + 1) * (n + 1)), nrm((n + 1) * (n + 1));
+    for (int gi = 0; gi <= n; ++gi) {
+      for (int gj = 0; gj <= n; ++gj) {
+        const double u = double(gi) / n, v = double(gj) / n;
+        Cvec3& x = pos[gi * (n + 1) + gj];
+        if (gj == 0)
+          x = evalEdgePolyline(edge[0], p.edgeSegments[0], u);
+        else if (gi == n)
+          x = evalEdgePolyline(edge[1], p.edgeSegments[1], v);
+        else if (gj == n)
+          x = evalEdgePolyline(edge[2], p.edgeSegments[2], u);
+        else if (gi == 0)
+          x = evalEdgePolyline(edge[3], p.edgeSegments[3], v);
+        else
+          x = evalPatch(p, u, v);
+
+        Cvec3 nm = p.n[0] * ((1 - u) * (1 - v)) + p.n[1] * (u * (1 - v)) + p.n[2] * (u * v) + p.n[3] * ((1 - u) * v);
+        if (norm2(nm) > CS175_EPS2)
+          nm.normalize();
+        nrm[gi * (n + 1) + gj] = nm;
+      }
+    }
+
+    typename std::vector<Vertex>::iterator out = vertices.begin() + firstVertex[i];
+    for (int gi = 0; gi < n; ++gi) {
+      for (int gj = 0; gj < n; ++gj) {
+        const int a = gi * (n + 1) + gj, b = a + (n + 1), c = b + 1, d = a + 1;
+        const int tri[6] = {a, b, c, c, d, a};
+        for (int k = 0; k < 6; ++k)
+          *out++ = Vertex(pos[tri[k]], nrm[tri[k]]);
+      }
+    }
+  });
+}
+
+#endif
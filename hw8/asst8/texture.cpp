@@ -7,17 +7,17 @@
 
 using namespace std;
 
-ImageTexture::ImageTexture(const char* ppmFileName, bool srgb) {
-  int width, height;
-  vector<PackedPixel> pixData;
-  ppmRead(ppmFileName, width, height, pixData);
+ImageTexture::ImageTexture(const char* ppmFileName, bool srgb)
+  : srgb_(srgb && !g_Gl2Compatible) {
+  vector<PackedPixel> pixels;
+  ppmRead(ppmFileName, width_, height_, pixels);
 
   glBindTexture(GL_TEXTURE_2D, tex);
   if (g_Gl2Compatible)
     glTexParameteri(GL_TEXTURE_2D, GL_GENERATE_MIPMAP, GL_TRUE);
 
-  glTexImage2D(GL_TEXTURE_2D, 0, (!srgb) || g_Gl2Compatible ? GL_RGB : GL_SRGB, width, height,
-               0, GL_RGB, GL_UNSIGNED_BYTE, &pixData[0]);
+  glTexImage2D(GL_TEXTURE_2D, 0, srgb_ ? GL_SRGB : GL_RGB, width_, height_,
+               0, GL_RGB, GL_UNSIGNED_BYTE, &pixels[0]);
 
   if (!g_Gl2Compatible)
     glGenerateMipmap(GL_TEXTURE_2D);
@@ -29,3 +29,22 @@ ImageTexture::ImageTexture(const char* ppmFileName, bool srgb) {
 
   checkGlErrors();
 }
+
+const vector<PackedPixel>& ImageTexture::getPixels() const {
+  if (pixels_.empty()) {
+    // leaves the texture binding and pack alignment as they were
+    GLint boundTexture, packAlignment;
+    glGetIntegerv(GL_TEXTURE_BINDING_2D, &boundTexture);
+    glGetIntegerv(GL_PACK_ALIGNMENT, &packAlignment);
+
+    pixels_.resize(width_ * height_);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGB, GL_UNSIGNED_BYTE, &pixels_[0]);
+
+    glPixelStorei(GL_PACK_ALIGNMENT, packAlignment);
+    glBindTexture(GL_TEXTURE_2D, boundTexture);
+    checkGlErrors();
+  }
+  return pixels_;
+}
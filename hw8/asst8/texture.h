@@ -1,7 +1,10 @@
 #ifndef TEXTURE_H
 #define TEXTURE_H
 
+#include <vector>
+
 #include "glsupport.h"
+#include "ppm.h"
 
 class Texture {
 public:
@@ -21,6 +24,9 @@ public:
 
 class ImageTexture : public Texture {
   GlTexture tex;
+  int width_, height_;
+  bool srgb_;
+  mutable std::vector<PackedPixel> pixels_; // read back for the software renderer, see getPixels
 
 public:
   // Loades a PPM image files with three channels, and create
@@ -28,6 +34,23 @@ public:
   // to be in SRGB color space
   ImageTexture(const char* ppmFileName, bool srgb); // implemented in texture.cpp
 
+  int getWidth() const {
+    return width_;
+  }
+
+  int getHeight() const {
+    return height_;
+  }
+
+  // Whether GL decodes the texels from sRGB, which it does not in GL2 mode
+  bool isSrgb() const {
+    return srgb_;
+  }
+
+  // The image as uploaded, bottom row first. Read back from the texture on
+  // the first call, so the GL context must be current.
+  const std::vector<PackedPixel>& getPixels() const; // implemented in texture.cpp
+
   virtual GLenum getSamplerType() const {
     return GL_SAMPLER_2D;
   }
@@ -0,0 +1,193 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <algorithm>
+
+//--------------------------------------------------------------------------------
+// Work-stealing thread pool
+//
+// Every worker owns a task queue. A worker runs tasks from the back of its own
+// queue and, once that is empty, steals from the front of the other queues, so
+// a few expensive tasks do not leave the remaining workers idle. Tasks submitted
+// from a worker go to that worker's queue; tasks submitted from outside are
+// spread over the queues round-robin.
+//
+// wait() blocks until every submitted task has finished, and the calling thread
+// runs tasks itself while it waits. If a task throws, the first exception is
+// rethrown by wait(). wait() must not be called from inside a task.
+//
+// The pool has no GL dependency.
+//--------------------------------------------------------------------------------
+
+class WorkStealingPool {
+public:
+  typedef std::function<void()> Task;
+
+  // numThreads <= 0 means one worker per hardware thread
+  explicit WorkStealingPool(int numThreads = 0)
+    : pending_(0), queued_(0), nextQueue_(0), stop_(false) {
+    if (numThreads <= 0)
+      numThreads = std::max(1u, std::thread::hardware_concurrency());
+
+    // one queue per worker, plus one for the thread calling wait()
+    for (int i = 0; i <= numThreads; ++i)
+      queues_.push_back(std::unique_ptr<Queue>(new Queue()));
+    for (int i = 0; i < numThreads; ++i)
+      threads_.push_back(std::thread(&WorkStealingPool::workerLoop, this, i + 1));
+  }
+
+  ~WorkStealingPool() {
+    {
+      std::lock_guard<std::mutex> lock(sleepMutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (size_t i = 0; i < threads_.size(); ++i)
+      threads_[i].join();
+  }
+
+  int getNumThreads() const {
+    return int(threads_.size());
+  }
+
+  void submit(Task task) {
+    int q = currentQueue();
+    if (q < 0)
+      q = int(nextQueue_.fetch_add(1) % queues_.size());
+
+    ++pending_;
+    {
+      std::lock_guard<std::mutex> lock(queues_[q]->mutex);
+      queues_[q]->tasks.push_back(std::move(task));
+    }
+    {
+      // counted under the sleep mutex so a worker about to sleep cannot miss it
+      std::lock_guard<std::mutex> lock(sleepMutex_);
+      ++queued_;
+    }
+    wake_.notify_one();
+  }
+
+  void wait() {
+    const int previous = currentQueue();
+    currentQueue() = 0;
+
+    Task task;
+    while (pending_.load() > 0) {
+      if (popTask(0, task)) {
+        runTask(task);
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(sleepMutex_);
+      done_.wait(lock, [this]() { return pending_.load() == 0 || queued_ > 0; });
+    }
+    currentQueue() = previous;
+
+    std::exception_ptr error;
+    {
+      std::lock_guard<std::mutex> lock(errorMutex_);
+      std::swap(error, error_);
+    }
+    if (error)
+      std::rethrow_exception(error);
+  }
+
+private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  WorkStealingPool(const WorkStealingPool&);
+  WorkStealingPool& operator = (const WorkStealingPool&);
+
+  // Index of the queue owned by the current thread, or -1 for outside threads
+  static int& currentQueue() {
+    static thread_local int q = -1;
+    return q;
+  }
+
+  // Takes a task from the back of queue 'self', or else steals one from the
+  // front of another queue
+  bool popTask(int self, Task& task) {
+    {
+      Queue& own = *queues_[self];
+      std::lock_guard<std::mutex> lock(own.mutex);
+      if (!own.tasks.empty()) {
+        task = std::move(own.tasks.back());
+        own.tasks.pop_back();
+        --queued_;
+        return true;
+      }
+    }
+    const int n = int(queues_.size());
+    for (int k = 1; k < n; ++k) {
+      Queue& victim = *queues_[(self + k) % n];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.tasks.empty()) {
+        task = std::move(victim.tasks.front());
+        victim.tasks.pop_front();
+        --queued_;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void runTask(Task& task) {
+    try {
+      task();
+    }
+    catch (...) {
+      std::lock_guard<std::mutex> lock(errorMutex_);
+      if (!error_)
+        error_ = std::current_exception();
+    }
+    task = Task();
+
+    if (--pending_ == 0) {
+      std::lock_guard<std::mutex> lock(sleepMutex_);
+      done_.notify_all();
+    }
+  }
+
+  void workerLoop(int self) {
+    currentQueue() = self;
+    Task task;
+    for (;;) {
+      if (popTask(self, task)) {
+        runTask(task);
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(sleepMutex_);
+      wake_.wait(lock, [this]() { return stop_ || queued_ > 0; });
+      if (stop_ && queued_ == 0)
+        return;
+    }
+  }
+
+  std::vector<std::unique_ptr<Queue> > queues_;
+  std::vector<std::thread> threads_;
+
+  std::atomic<int> pending_;  // submitted and not yet finished
+  std::atomic<int> queued_;   // sitting in a queue, not yet started
+  std::atomic<unsigned> nextQueue_;
+  bool stop_;
+
+  std::mutex sleepMutex_;
+  std::condition_variable wake_, done_;
+
+  std::mutex errorMutex_;
+  std::exception_ptr error_;
+};
+
+#endif
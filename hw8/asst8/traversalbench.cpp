@@ -0,0 +1,242 @@
+////////////////////////////////////////////////////////////////////////
+//
+//   traversalbench: cost per node of the scene graph traversals that
+//   picking and keyframing run
+//
+//   Builds a tree of SgRbtNodes with the given fanout and one shape under
+//   every transform node, and times each traversal before and after
+//   it stopped handling shared pointers per node:
+//     - building the pick ID table: a stack of shared_from_this() and a
+//       dynamic_pointer_cast up the stack per shape into a std::map,
+//       against the plain pointer stack and vector Picker uses now
+//     - collecting the SgRbtNodes: dynamic_pointer_cast of
+//       shared_from_this() per node through accept, against
+//       dumpSgRbtNodes into shared and into plain pointers
+//     - pasting a keyframe: a copy of the frame and a dynamic_pointer_cast
+//       per node, against Paster
+//   Results go to stdout as JSON. No GL calls are made.
+//
+//   Usage: traversalbench [-n nodes] [-b fanout] [-f frames]
+//
+////////////////////////////////////////////////////////////////////////
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <memory>
+#include <iostream>
+
+#include "rigtform.h"
+#include "scenegraph.h"
+#include "sgutils.h"
+#include "keyframes.h"
+
+using namespace std;
+
+// Shape that draws nothing, so the traversals can be timed without GL
+class NullShapeNode : public SgShapeNode {
+public:
+  virtual Matrix4 getAffineMatrix() {
+    return Matrix4();
+  }
+
+  virtual void draw(const Uniforms& uniforms) {}
+};
+
+//---------------------------------------------------
+// The traversals as they were, kept here to compare
+//---------------------------------------------------
+
+class SharedPickIdVisitor : public SgNodeVisitor {
+  vector<shared_ptr<SgNode> > nodeStack_;
+  int idCounter_;
+public:
+  map<int, shared_ptr<SgRbtNode> > idToRbtNode;
+
+  SharedPickIdVisitor() : idCounter_(0) {}
+
+  virtual bool visit(SgTransformNode& node) {
+    nodeStack_.push_back(node.shared_from_this());
+    return true;
+  }
+
+  virtual bool postVisit(SgTransformNode& node) {
+    nodeStack_.pop_back();
+    return true;
+  }
+
+  virtual bool visit(SgShapeNode& node) {
+    idCounter_++;
+    for (int i = nodeStack_.size() - 1; i >= 0; --i) {
+      shared_ptr<SgRbtNode> asRbtNode = dynamic_pointer_cast<SgRbtNode>(nodeStack_[i]);
+      if (asRbtNode) {
+        idToRbtNode[idCounter_] = asRbtNode;
+        break;
+      }
+    }
+    return true;
+  }
+};
+
+class SharedRbtNodesScanner : public SgNodeVisitor {
+public:
+  vector<shared_ptr<SgRbtNode> > nodes;
+
+  virtual bool visit(SgTransformNode& node) {
+    shared_ptr<SgRbtNode> rbtNode = dynamic_pointer_cast<SgRbtNode>(node.shared_from_this());
+    if (rbtNode)
+      nodes.push_back(rbtNode);
+    return true;
+  }
+};
+
+class SharedPaster : public SgNodeVisitor {
+  vector<RigTForm> frame_;
+  int counter_;
+public:
+  SharedPaster(vector<RigTForm>& frame) : frame_(frame), counter_(0) {}
+
+  virtual bool visit(SgTransformNode& node) {
+    shared_ptr<SgRbtNode> rbtNode = dynamic_pointer_cast<SgRbtNode>(node.shared_from_this());
+    if (rbtNode)
+      rbtNode->setRbt(frame_[counter_++]);
+    return true;
+  }
+};
+
+//------------------------------------------------
+// The pick ID table the way Picker builds it now
+//------------------------------------------------
+
+class PickIdVisitor : public SgNodeVisitor {
+  vector<SgRbtNode*> rbtNodeStack_;
+public:
+  vector<SgRbtNode*> idToRbtNode;
+
+  PickIdVisitor() : rbtNodeStack_(1), idToRbtNode(1) {}
+
+  virtual bool visit(SgTransformNode& node) {
+    rbtNodeStack_.push_back(node.getType() == SgNode::RBT ? static_cast<SgRbtNode*>(&node) : rbtNodeStack_.back());
+    return true;
+  }
+
+  virtual bool postVisit(SgTransformNode& node) {
+    rbtNodeStack_.pop_back();
+    return true;
+  }
+
+  virtual bool visit(SgShapeNode& node) {
+    idToRbtNode.push_back(rbtNodeStack_.back());
+    return true;
+  }
+
+  virtual bool postVisit(SgShapeNode& node) {
+    return true;
+  }
+};
+
+template<typename F>
+static double nsPerNode(int frames, int numNodes, F frame) {
+  const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  for (int f = 0; f < frames; ++f)
+    frame();
+  const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  return seconds * 1e9 / frames / numNodes;
+}
+
+int main(int argc, char* argv[]) {
+  int numNodes = 100000, fanout = 4, frames = 20;
+
+  for (int i = 1; i < argc; ++i) {
+    const bool hasValue = i + 1 < argc;
+    if (!strcmp(argv[i], "-n") && hasValue)
+      numNodes = max(2, atoi(argv[++i]));
+    else if (!strcmp(argv[i], "-b") && hasValue)
+      fanout = max(1, atoi(argv[++i]));
+    else if (!strcmp(argv[i], "-f") && hasValue)
+      frames = max(1, atoi(argv[++i]));
+    else {
+      cerr << "Usage: " << argv[0] << " [-n nodes] [-b fanout] [-f frames]" << endl;
+      return 1;
+    }
+  }
+
+  try {
+    // half the nodes are transform nodes, each with one shape below it;
+    // transform node i hangs from transform node (i - 1) / fanout
+    const int numTransforms = numNodes / 2;
+    vector<shared_ptr<SgTransformNode> > transforms;
+    transforms.push_back(make_shared<SgRootNode>());
+    for (int i = 1; i < numTransforms; ++i) {
+      shared_ptr<SgRbtNode> node = make_shared<SgRbtNode>(RigTForm(Cvec3(i, 0, 0)));
+      transforms[(i - 1) / fanout]->addChild(node);
+      transforms.push_back(node);
+    }
+    for (int i = 0; i < numTransforms; ++i)
+      transforms[i]->addChild(make_shared<NullShapeNode>());
+    SgNode& root = *transforms[0];
+
+    size_t sharedIds = 0, ids = 0;
+    const double pickShared = nsPerNode(frames, numNodes, [&]() {
+      SharedPickIdVisitor v;
+      root.accept(v);
+      sharedIds = v.idToRbtNode.size();
+    });
+    const double pickPlain = nsPerNode(frames, numNodes, [&]() {
+      PickIdVisitor v;
+      traverse(root, v);
+      ids = v.idToRbtNode.size() - count(v.idToRbtNode.begin(), v.idToRbtNode.end(), (SgRbtNode*)NULL);
+    });
+
+    size_t scannedShared = 0, scannedTagged = 0, scannedPlain = 0;
+    const double scanShared = nsPerNode(frames, numNodes, [&]() {
+      SharedRbtNodesScanner v;
+      root.accept(v);
+      scannedShared = v.nodes.size();
+    });
+    const double scanTagged = nsPerNode(frames, numNodes, [&]() {
+      vector<shared_ptr<SgRbtNode> > nodes;
+      dumpSgRbtNodes(transforms[0], nodes);
+      scannedTagged = nodes.size();
+    });
+    const double scanPlain = nsPerNode(frames, numNodes, [&]() {
+      vector<SgRbtNode*> nodes;
+      dumpSgRbtNodes(root, nodes);
+      scannedPlain = nodes.size();
+    });
+
+    Frame frame;
+    frame.capture_scene(transforms[0]);
+    vector<RigTForm> rbts(numTransforms - 1);
+    for (int i = 1; i < numTransforms; ++i)
+      rbts[i - 1] = transforms[i]->getRbt();
+    const double pasteShared = nsPerNode(frames, numNodes, [&]() {
+      SharedPaster v(rbts);
+      root.accept(v);
+    });
+    const double pastePlain = nsPerNode(frames, numNodes, [&]() {
+      frame.paste_to_scene(transforms[0]);
+    });
+
+    const bool match = sharedIds == ids && scannedShared == scannedTagged && scannedShared == scannedPlain;
+    printf("{\n");
+    printf("  \"nodes\": %d, \"fanout\": %d, \"frames\": %d,\n", numNodes, fanout, frames);
+    printf("  \"nsPerNode\": {\n");
+    printf("    \"pickIdTableShared\": %.3f, \"pickIdTablePlain\": %.3f,\n", pickShared, pickPlain);
+    printf("    \"rbtNodeScanShared\": %.3f, \"rbtNodeScanTagged\": %.3f, \"rbtNodeScanPlain\": %.3f,\n",
+           scanShared, scanTagged, scanPlain);
+    printf("    \"pasteShared\": %.3f, \"pastePlain\": %.3f\n", pasteShared, pastePlain);
+    printf("  },\n");
+    printf("  \"resultsMatch\": %s\n", match ? "true" : "false");
+    printf("}\n");
+  }
+  catch (const runtime_error& e) {
+    cerr << "Exception caught: " << e.what() << endl;
+    return -1;
+  }
+  return 0;
+}
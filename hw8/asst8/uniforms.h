@@ -55,6 +55,15 @@ inline void genericGlUniformMatrix4v(GLint location, int size, const Cvec<float,
   ::glUniformMatrix4fv(location, size, GL_FALSE, &m[0][0]);
 }
 
+template<typename T, int n>
+inline const float *getFloatData(const Cvec<T, n> *v) {
+  return NULL;
+}
+template<int n>
+inline const float *getFloatData(const Cvec<float, n> *v) {
+  return &v[0][0];
+}
+
 template<typename T, int n>
 inline GLenum getTypeForCvec();   // should replace with STATIC_ASSERT
 
@@ -188,6 +197,7 @@ protected:
   // Ghastly implementation details follow. Viewer be warned.
 
   friend class Material;
+  friend class SoftRenderer;
   class ValueHolder;
   class Value;
 
@@ -251,6 +261,10 @@ public:
     virtual void apply(GLint location, GLsizei count, const GLint *boundTexUnits) const = 0;
     virtual const std::shared_ptr<Texture> * getTextures() const { return NULL; };
 
+    // The values as they are sent to GL, if they are floats: matrices column
+    // major, one after the other. NULL for ints and textures.
+    virtual const float * getFloats() const { return NULL; }
+
 protected:
     Value(GLenum aType, GLint aSize) : type(aType), size(aSize) {}
   };
@@ -285,6 +299,10 @@ public:
       assert(count <= size);
       _helper::genericGlUniformv(location, count, &vs_[0]);
     }
+
+    virtual const float *getFloats() const {
+      return _helper::getFloatData(&vs_[0]);
+    }
   };
 
   class Matrix4sValue : public Value {
@@ -310,6 +328,10 @@ public:
       assert(count <= size);
       _helper::genericGlUniformMatrix4v(location, count, &ms_[0]);
     }
+
+    virtual const float *getFloats() const {
+      return &ms_[0][0];
+    }
   };
 
   class TexturesValue : public Value {
@@ -0,0 +1,150 @@
+////////////////////////////////////////////////////////////////////////
+//
+//   vbocheck: headless check of StreamingVbo's upload paths
+//
+//   For each upload path the GL context supports, streams a sequence of
+//   uploads of changing size through one StreamingVbo: enough to wrap
+//   around the ring of regions several times and to grow the store
+//   once. Right after each upload, the region is copied on the GPU with
+//   glCopyBufferSubData, which reads it as a draw would and is guarded
+//   by the same fences. The copies are read back at the end and compared
+//   with what was written, so a region overwritten before the GPU was
+//   done with it, or an upload that missed its region, is a mismatch.
+//   The last upload is also read back with download().
+//
+//   Creates its context through EGL, so it runs without a display, e.g.
+//   on Mesa's llvmpipe. Exits with 1 if any path fails.
+//
+//   Usage: vbocheck [-n uploads]
+//
+////////////////////////////////////////////////////////////////////////
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <iostream>
+
+#include "glsupport.h"
+#include "geometry.h"
+#include "offscreen.h"
+
+using namespace std;
+
+static const int MAX_VERTICES = 4096;
+
+// Distinct for every upload and vertex, so a stale or misplaced region shows
+static VertexPN makeVertex(int upload, int i) {
+  return VertexPN(float(upload), float(i), float(upload * MAX_VERTICES + i), 1, 2, 3);
+}
+
+// Small uploads at first, which wrap around the initial store, then uploads
+// that do not fit it any more
+static int getUploadLength(int upload, int numUploads) {
+  if (upload < numUploads / 2)
+    return 1000 + 100 * (upload % 3);
+  return MAX_VERTICES - 50 * (upload % 4);
+}
+
+static const char* getModeName(StreamingVbo::Mode mode) {
+  switch (mode) {
+  case StreamingVbo::PERSISTENT_MAPPED:
+    return "persistent map";
+  case StreamingVbo::MAPPED_RANGE:
+    return "map buffer range";
+  default:
+    return "buffer sub data";
+  }
+}
+
+// Returns the number of uploads whose copy does not match what was written
+static int checkMode(StreamingVbo::Mode mode, int numUploads) {
+  const int stride = sizeof(VertexPN);
+  StreamingVbo vbo(VertexPN::FORMAT, 3, mode);
+  GlBufferObject copies;
+  glBindBuffer(GL_COPY_WRITE_BUFFER, copies);
+  glBufferData(GL_COPY_WRITE_BUFFER, numUploads * MAX_VERTICES * stride, NULL, GL_STATIC_READ);
+
+  vector<VertexPN> vertices(MAX_VERTICES);
+  int reused = 0, grown = 0;
+  for (int k = 0; k < numUploads; ++k) {
+    const int length = getUploadLength(k, numUploads);
+    for (int i = 0; i < length; ++i)
+      vertices[i] = makeVertex(k, i);
+
+    const int capacityBefore = vbo.capacity();
+    vbo.upload(&vertices[0], length);
+    if (k > 0 && vbo.capacity() != capacityBefore)
+      ++grown;
+    else if (k > 0 && vbo.getByteOffset() == 0)
+      ++reused;
+
+    glBindBuffer(GL_COPY_READ_BUFFER, vbo);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                        vbo.getByteOffset(), k * MAX_VERTICES * stride, length * stride);
+  }
+
+  int mismatches = 0;
+  vector<VertexPN> copied(MAX_VERTICES);
+  for (int k = 0; k < numUploads; ++k) {
+    const int length = getUploadLength(k, numUploads);
+    glGetBufferSubData(GL_COPY_WRITE_BUFFER, k * MAX_VERTICES * stride, length * stride, &copied[0]);
+    for (int i = 0; i < length; ++i) {
+      const VertexPN expected = makeVertex(k, i);
+      if (memcmp(&copied[i], &expected, stride) != 0) {
+        ++mismatches;
+        break;
+      }
+    }
+  }
+  vector<VertexPN> downloaded;
+  vbo.download(downloaded);
+  const int lastLength = getUploadLength(numUploads - 1, numUploads);
+  if (int(downloaded.size()) != lastLength ||
+      memcmp(&downloaded[0], &vertices[0], lastLength * stride) != 0)
+    ++mismatches;
+  checkGlErrors();
+
+  printf("%-16s %d uploads, ring wrapped %d times, store grown %d times: %s\n",
+         getModeName(vbo.getMode()), numUploads, reused, grown, mismatches ? "FAILED" : "ok");
+  return mismatches;
+}
+
+int main(int argc, char* argv[]) {
+  int numUploads = 24;
+
+  for (int i = 1; i < argc; ++i) {
+    const bool hasValue = i + 1 < argc;
+    if (!strcmp(argv[i], "-n") && hasValue)
+      numUploads = max(4, atoi(argv[++i]));
+    else {
+      cerr << "Usage: " << argv[0] << " [-n uploads]" << endl;
+      return 1;
+    }
+  }
+
+  try {
+    OffscreenContext context;
+    glewInit();
+    if (!GLEW_VERSION_3_1 && !GLEW_ARB_copy_buffer)
+      throw runtime_error("vbocheck: the GL context cannot copy between buffers");
+
+    const StreamingVbo::Mode modes[] = {
+      StreamingVbo::PERSISTENT_MAPPED, StreamingVbo::MAPPED_RANGE, StreamingVbo::BUFFER_SUB_DATA
+    };
+    int failed = 0;
+    for (int i = 0; i < 3; ++i) {
+      if (StreamingVbo::isSupported(modes[i]))
+        failed += checkMode(modes[i], numUploads) > 0;
+      else
+        printf("%-16s not supported by the context, skipped\n", getModeName(modes[i]));
+    }
+    return failed ? 1 : 0;
+  }
+  catch (const runtime_error& e) {
+    cerr << "Exception caught: " << e.what() << endl;
+    return 1;
+  }
+}